@@ -2927,8 +2927,8 @@ void glslopt_glcpp_free (void * ptr , yyscan_t yyscanner)
 
 
 void
-glslopt_glcpp_lex_set_source_string(glcpp_parser_t *parser, const char *shader)
+glslopt_glcpp_lex_set_source_string(glcpp_parser_t *parser, const char *shader, size_t length)
 {
-	glslopt_glcpp__scan_string(shader,parser->scanner);
+	glslopt_glcpp__scan_bytes(shader,length,parser->scanner);
 }
 
@@ -1892,7 +1892,9 @@ yyreduce:
 		macro = glslopt_hash_table_find (parser->defines, (yyvsp[-1].str));
 		if (macro) {
 			glslopt_hash_table_remove (parser->defines, (yyvsp[-1].str));
-			glslopt_ralloc_free (macro);
+			/* Predefined macros from a prelude are not ours to free. */
+			if (glslopt_ralloc_parent (macro) == parser)
+				glslopt_ralloc_free (macro);
 		}
 		glslopt_ralloc_free ((yyvsp[-1].str));
 	}
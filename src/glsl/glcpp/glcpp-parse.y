@@ -297,7 +297,9 @@ control_line_success:
 		macro = hash_table_find (parser->defines, $4);
 		if (macro) {
 			hash_table_remove (parser->defines, $4);
-			ralloc_free (macro);
+			/* Predefined macros from a prelude are not ours to free. */
+			if (ralloc_parent (macro) == parser)
+				ralloc_free (macro);
 		}
 		ralloc_free ($4);
 	}
@@ -219,9 +219,22 @@ glslopt_glcpp_parser_destroy (glcpp_parser_t *parser);
 void
 glslopt_glcpp_parser_resolve_implicit_version(glcpp_parser_t *parser);
 
+bool
+glslopt_glcpp_needs_preprocessing(const char *shader, size_t length);
+
+struct glcpp_macro_set;
+
+unsigned
+glslopt_glcpp_macro_set_count(const struct glcpp_macro_set *set);
+
+struct glcpp_macro_set *
+glslopt_glcpp_macro_set_union(void *ralloc_ctx, const struct glcpp_macro_set *a,
+			      const struct glcpp_macro_set *b);
+
 int
-glslopt_glcpp_preprocess(void *ralloc_ctx, const char **shader, char **info_log,
-	   const struct gl_extensions *extensions, struct gl_context *g_ctx);
+glslopt_glcpp_preprocess(void *ralloc_ctx, const char **shader, size_t *shader_length,
+	   char **info_log, const struct gl_extensions *extensions, struct gl_context *g_ctx,
+	   const struct glcpp_macro_set *predefined, struct glcpp_macro_set **defined);
 
 /* Functions for writing to the info log */
 
@@ -237,7 +250,7 @@ int
 glslopt_glcpp_lex_init_extra (glcpp_parser_t *parser, yyscan_t* scanner);
 
 void
-glslopt_glcpp_lex_set_source_string(glcpp_parser_t *parser, const char *shader);
+glslopt_glcpp_lex_set_source_string(glcpp_parser_t *parser, const char *shader, size_t length);
 
 int
 glslopt_glcpp_lex (YYSTYPE *lvalp, YYLTYPE *llocp, yyscan_t scanner);
@@ -80,44 +80,79 @@ glslopt_glcpp_warning (YYLTYPE *locp, glcpp_parser_t *parser, const char *fmt, .
  *	"\n"
  *	"\r"
  *
- * And the longest such sequence will be skipped.
+ * And the longest such sequence will be skipped. Never reads at or past end.
  */
 static const char *
-skip_newline (const char *str)
+skip_newline (const char *str, const char *end)
 {
 	const char *ret = str;
 
 	if (ret == NULL)
 		return ret;
 
-	if (*ret == '\0')
+	if (ret >= end)
 		return ret;
 
 	if (*ret == '\r') {
 		ret++;
-		if (*ret && *ret == '\n')
+		if (ret < end && *ret == '\n')
 			ret++;
 	} else if (*ret == '\n') {
 		ret++;
-		if (*ret && *ret == '\r')
+		if (ret < end && *ret == '\r')
 			ret++;
 	}
 
 	return ret;
 }
 
+/* Return the first newline character ('\r' or '\n') in [str, end), or NULL. */
+static const char *
+find_newline (const char *str, const char *end)
+{
+	const char *cr = memchr(str, '\r', end - str);
+	const char *lf = memchr(str, '\n', cr ? cr - str : end - str);
+	return lf ? lf : cr;
+}
+
+/* Return the first backslash that is followed by a newline in [str, end),
+ * or NULL.
+ */
+static const char *
+find_line_continuation (const char *str, const char *end)
+{
+	const char *backslash;
+
+	while ((backslash = memchr(str, '\\', end - str)) != NULL) {
+		if (backslash + 1 < end &&
+		    (backslash[1] == '\r' || backslash[1] == '\n'))
+			return backslash;
+		str = backslash + 1;
+	}
+	return NULL;
+}
+
 /* Remove any line continuation characters in the shader, (whether in
  * preprocessing directives or in GLSL code).
+ *
+ * The shader is given by pointer and length and does not need to be NUL
+ * terminated. When it has no line continuations it is returned as is,
+ * without copying; otherwise a cleaned copy is returned and *length updated.
  */
-static char *
-remove_line_continuations(glcpp_parser_t *ctx, const char *shader)
+static const char *
+remove_line_continuations(glcpp_parser_t *ctx, const char *shader, size_t *length)
 {
-	char *clean = glslopt_ralloc_strdup(ctx, "");
+	char *clean;
 	const char *backslash, *newline, *search_start;
-        const char *cr, *lf;
-        char newline_separator[3];
+	const char *cr, *lf;
+	const char *end = shader + *length;
+	char newline_separator[3];
 	int collapsed_newlines = 0;
 
+	if (find_line_continuation(shader, end) == NULL)
+		return shader;
+
+	clean = glslopt_ralloc_strdup(ctx, "");
 	search_start = shader;
 
 	/* Determine what flavor of newlines this shader is using. GLSL
@@ -138,8 +173,8 @@ remove_line_continuations(glcpp_parser_t *ctx, const char *shader)
 	 * examining the first encountered newline terminator, and using the
 	 * same terminator for any newlines we insert.
 	 */
-	cr = strchr(search_start, '\r');
-	lf = strchr(search_start, '\n');
+	cr = memchr(search_start, '\r', end - search_start);
+	lf = memchr(search_start, '\n', end - search_start);
 
 	newline_separator[0] = '\n';
 	newline_separator[1] = '\0';
@@ -158,7 +193,7 @@ remove_line_continuations(glcpp_parser_t *ctx, const char *shader)
 	}
 
 	while (true) {
-		backslash = strchr(search_start, '\\');
+		backslash = memchr(search_start, '\\', end - search_start);
 
 		/* If we have previously collapsed any line-continuations,
 		 * then we want to insert additional newlines at the next
@@ -166,14 +201,7 @@ remove_line_continuations(glcpp_parser_t *ctx, const char *shader)
 		 * line numbers.
 		 */
 		if (collapsed_newlines) {
-			cr = strchr (search_start, '\r');
-			lf = strchr (search_start, '\n');
-			if (cr && lf)
-				newline = cr < lf ? cr : lf;
-			else if (cr)
-				newline = cr;
-			else
-				newline = lf;
+			newline = find_newline (search_start, end);
 			if (newline &&
 			    (backslash == NULL || newline < backslash))
 			{
@@ -183,46 +211,193 @@ remove_line_continuations(glcpp_parser_t *ctx, const char *shader)
 					glslopt_ralloc_strcat(&clean, newline_separator);
 					collapsed_newlines--;
 				}
-				shader = skip_newline (newline);
+				shader = skip_newline (newline, end);
 				search_start = shader;
 			}
 		}
 
-		search_start = backslash + 1;
-
 		if (backslash == NULL)
 			break;
 
+		search_start = backslash + 1;
+
 		/* At each line continuation, (backslash followed by a
 		 * newline), copy all preceding text to the output, then
 		 * advance the shader pointer to the character after the
 		 * newline.
 		 */
-		if (backslash[1] == '\r' || backslash[1] == '\n')
+		if (backslash + 1 < end &&
+		    (backslash[1] == '\r' || backslash[1] == '\n'))
 		{
 			collapsed_newlines++;
 			glslopt_ralloc_strncat(&clean, shader, backslash - shader);
-			shader = skip_newline (backslash + 1);
+			shader = skip_newline (backslash + 1, end);
 			search_start = shader;
 		}
 	}
 
-	glslopt_ralloc_strcat(&clean, shader);
+	glslopt_ralloc_strncat(&clean, shader, end - shader);
 
+	*length = strlen(clean);
 	return clean;
 }
 
+/* Word-at-a-time helpers for glcpp_needs_preprocessing: a byte of
+ * has_zero_byte(x) is nonzero only if the corresponding byte of x is zero
+ * (with possible false positives only above a real zero byte).
+ */
+#define BYTES_ONES (~(uintptr_t)0 / 0xFF)
+#define BYTES_HIGHS (BYTES_ONES * 0x80)
+#define has_zero_byte(x) (((x) - BYTES_ONES) & ~(x) & BYTES_HIGHS)
+#define has_byte(x, c) has_zero_byte((x) ^ (BYTES_ONES * (unsigned char)(c)))
+
+static bool
+is_identifier_char(char c)
+{
+	return isalnum((unsigned char)c) || c == '_';
+}
+
+/* Inspect a potentially interesting character at str[i]. Returns true if
+ * the preprocessor has work to do there.
+ */
+static bool
+needs_preprocessing_at(const char *str, size_t i, size_t length)
+{
+	switch (str[i]) {
+	case '#': /* any directive */
+		return true;
+	case '\\': /* line continuation */
+		return i + 1 < length && (str[i+1] == '\n' || str[i+1] == '\r');
+	case '/': /* comments; the GLSL lexer does not handle those */
+		return i + 1 < length && (str[i+1] == '/' || str[i+1] == '*');
+	case '_': /* __LINE__, __FILE__, __VERSION__ */
+		return i + 1 < length && str[i+1] == '_' &&
+		       (i == 0 || !is_identifier_char(str[i-1]));
+	case 'G': /* GL_ES, GL_FRAGMENT_PRECISION_HIGH and extension macros */
+		return i + 2 < length && str[i+1] == 'L' && str[i+2] == '_' &&
+		       (i == 0 || !is_identifier_char(str[i-1]));
+	default:
+		return false;
+	}
+}
+
+/* Fast conservative check whether preprocessing the shader could change it:
+ * returns false only if it has no directives, comments, line continuations
+ * or references to predefined macros, i.e. glcpp would be an identity
+ * transform. Scans a machine word at a time and only looks closer at words
+ * that contain one of the interesting characters.
+ */
+bool
+glslopt_glcpp_needs_preprocessing(const char *shader, size_t length)
+{
+	size_t i = 0;
+
+	while (i < length) {
+		if ((((uintptr_t)(shader + i)) & (sizeof(uintptr_t) - 1)) == 0 &&
+		    i + sizeof(uintptr_t) <= length) {
+			uintptr_t word;
+			memcpy(&word, shader + i, sizeof(word));
+			if (!(has_byte(word, '#') | has_byte(word, '\\') |
+			      has_byte(word, '/') | has_byte(word, '_') |
+			      has_byte(word, 'G'))) {
+				i += sizeof(uintptr_t);
+				continue;
+			}
+		}
+		if (needs_preprocessing_at(shader, i, length))
+			return true;
+		++i;
+	}
+	return false;
+}
+
+#undef has_byte
+#undef has_zero_byte
+#undef BYTES_HIGHS
+#undef BYTES_ONES
+
+/* Macros defined by one preprocessor run; they can be predefined for later
+ * runs (used for shader preludes).
+ */
+struct glcpp_macro_set {
+	macro_t **macros;
+	unsigned count;
+};
+
+static void
+collect_macro(const void *key, void *data, void *closure)
+{
+	struct glcpp_macro_set *set = (struct glcpp_macro_set *) closure;
+	macro_t *macro = (macro_t *) data;
+
+	/* Built-in macros are defined by each run itself. */
+	if (strncmp(macro->identifier, "__", 2) == 0 ||
+	    strncmp(macro->identifier, "GL_", 3) == 0)
+		return;
+
+	set->macros = reralloc(set, set->macros, macro_t *, set->count + 1);
+	set->macros[set->count++] = macro;
+	glslopt_ralloc_steal(set, macro);
+
+	/* Replacement tokens are owned by the parser, which goes away. */
+	if (macro->replacements) {
+		token_node_t *node;
+		for (node = macro->replacements->head; node; node = node->next)
+			glslopt_ralloc_steal(macro, node->token);
+	}
+}
+
+unsigned
+glslopt_glcpp_macro_set_count(const struct glcpp_macro_set *set)
+{
+	return set ? set->count : 0;
+}
+
+/* Set referencing the macros of both a and b (either may be NULL); macros of
+ * b take precedence. The macros themselves stay owned by their sets.
+ */
+struct glcpp_macro_set *
+glslopt_glcpp_macro_set_union(void *ralloc_ctx, const struct glcpp_macro_set *a,
+			      const struct glcpp_macro_set *b)
+{
+	struct glcpp_macro_set *set = rzalloc(ralloc_ctx, struct glcpp_macro_set);
+	unsigned count_a = glslopt_glcpp_macro_set_count(a);
+	unsigned count_b = glslopt_glcpp_macro_set_count(b);
+
+	set->count = count_a + count_b;
+	set->macros = ralloc_array(set, macro_t *, set->count);
+	if (count_a)
+		memcpy(set->macros, a->macros, count_a * sizeof(macro_t *));
+	if (count_b)
+		memcpy(set->macros + count_a, b->macros, count_b * sizeof(macro_t *));
+	return set;
+}
+
+/* Preprocess a shader of given length (not necessarily NUL terminated).
+ *
+ * Macros in predefined (may be NULL) are visible as if defined before the
+ * shader. If defined is not NULL, it receives the set of macros defined at
+ * the end of preprocessing, allocated in ralloc_ctx.
+ */
 int
-glslopt_glcpp_preprocess(void *ralloc_ctx, const char **shader, char **info_log,
-	   const struct gl_extensions *extensions, struct gl_context *gl_ctx)
+glslopt_glcpp_preprocess(void *ralloc_ctx, const char **shader, size_t *shader_length,
+	   char **info_log, const struct gl_extensions *extensions, struct gl_context *gl_ctx,
+	   const struct glcpp_macro_set *predefined, struct glcpp_macro_set **defined)
 {
 	int errors;
+	unsigned i;
 	glcpp_parser_t *parser = glslopt_glcpp_parser_create (extensions, gl_ctx->API);
 
+	if (predefined) {
+		for (i = 0; i < predefined->count; i++)
+			glslopt_hash_table_insert(parser->defines, predefined->macros[i],
+					  predefined->macros[i]->identifier);
+	}
+
 	if (! gl_ctx->Const.DisableGLSLLineContinuations)
-		*shader = remove_line_continuations(parser, *shader);
+		*shader = remove_line_continuations(parser, *shader, shader_length);
 
-	glslopt_glcpp_lex_set_source_string (parser, *shader);
+	glslopt_glcpp_lex_set_source_string (parser, *shader, *shader_length);
 
 	glslopt_glcpp_parser_parse (parser);
 
@@ -235,6 +410,12 @@ glslopt_glcpp_preprocess(void *ralloc_ctx, const char **shader, char **info_log,
 
 	glslopt_ralloc_steal(ralloc_ctx, parser->output);
 	*shader = parser->output;
+	*shader_length = parser->output_length;
+
+	if (defined) {
+		*defined = rzalloc(ralloc_ctx, struct glcpp_macro_set);
+		glslopt_hash_table_call_foreach(parser->defines, collect_macro, *defined);
+	}
 
 	errors = parser->error;
 	glslopt_glcpp_parser_destroy (parser);
@@ -4102,10 +4102,11 @@ classify_identifier(struct _mesa_glsl_parse_state *state, const char *name)
 }
 
 void
-_mesa_glsl_lexer_ctor(struct _mesa_glsl_parse_state *state, const char *string)
+_mesa_glsl_lexer_ctor(struct _mesa_glsl_parse_state *state, const char *string,
+                      size_t length)
 {
    _mesa_glsl_lexer_lex_init_extra(state,& state->scanner);
-   _mesa_glsl_lexer__scan_string(string,state->scanner);
+   _mesa_glsl_lexer__scan_bytes(string,(int)length,state->scanner);
 }
 
 void
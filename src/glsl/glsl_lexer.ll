@@ -583,10 +583,11 @@ classify_identifier(struct _mesa_glsl_parse_state *state, const char *name)
 }
 
 void
-_mesa_glsl_lexer_ctor(struct _mesa_glsl_parse_state *state, const char *string)
+_mesa_glsl_lexer_ctor(struct _mesa_glsl_parse_state *state, const char *string,
+                      size_t length)
 {
    yylex_init_extra(state, & state->scanner);
-   yy_scan_string(string, state->scanner);
+   yy_scan_bytes(string, (int)length, state->scanner);
 }
 
 void
@@ -6,11 +6,21 @@
 #include "ir_print_metal_visitor.h"
 #include "ir_print_glsl_visitor.h"
 #include "ir_print_visitor.h"
+#include "ir_fingerprint.h"
+#include "ir_serialize.h"
 #include "ir_stats.h"
+#include "ir_liveness.h"
 #include "loop_analysis.h"
 #include "program.h"
 #include "linker.h"
+#include "link_varyings.h"
 #include "standalone_scaffolding.h"
+#include <errno.h>
+#ifdef _MSC_VER
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
 
 
 extern "C" struct gl_shader *
@@ -83,10 +93,60 @@ initialize_mesa_context(struct gl_context *ctx, glslopt_target api)
 }
 
 
+// Common shader code compiled once per stage; see glslopt_set_prelude.
+struct glslopt_prelude {
+	glslopt_prelude ()
+		: mem_ctx(NULL)
+		, state(NULL)
+		, shader(NULL)
+		, macros(NULL)
+		, log(NULL)
+	{
+	}
+	void* mem_ctx; // owns everything below
+	_mesa_glsl_parse_state* state;
+	struct gl_shader* shader; // NULL unless successfully compiled
+	struct glcpp_macro_set* macros;
+	const char* log;
+};
+
+// Optimized output, shared by all shaders of a context with the same IR fingerprint.
+struct glslopt_shared_output {
+	unsigned char fingerprint[kIrFingerprintSize];
+	char* output;
+	size_t size;
+	int uniformsSize;
+	unsigned refCount;
+	struct hash_table* table;
+};
+
+static unsigned fingerprint_hash (const void* key)
+{
+	unsigned hash;
+	memcpy (&hash, key, sizeof(hash));
+	return hash;
+}
+
+static int fingerprint_compare (const void* key1, const void* key2)
+{
+	return memcmp (key1, key2, kIrFingerprintSize);
+}
+
+static void release_shared_output (glslopt_shared_output* shared)
+{
+	if (!shared || --shared->refCount)
+		return;
+	glslopt_hash_table_remove (shared->table, shared->fingerprint);
+	glslopt_ralloc_free (shared);
+}
+
 struct glslopt_ctx {
 	glslopt_ctx (glslopt_target target) {
 		this->target = target;
+		preprocessorBypassCount = 0;
+		maxHoistedVaryings = 0;
 		mem_ctx = glslopt_ralloc_context (NULL);
+		sharedOutputs = glslopt_hash_table_ctor (0, fingerprint_hash, fingerprint_compare);
 		initialize_mesa_context (&mesa_ctx, target);
 
 		_mesa_glsl_builtin_functions_init_or_ref();
@@ -94,11 +154,16 @@ struct glslopt_ctx {
 	~glslopt_ctx() {
 		_mesa_glsl_builtin_functions_decref();
 
+		glslopt_hash_table_dtor (sharedOutputs);
 		glslopt_ralloc_free (mem_ctx);
 	}
 	struct gl_context mesa_ctx;
 	void* mem_ctx;
 	glslopt_target target;
+	unsigned preprocessorBypassCount;
+	unsigned maxHoistedVaryings;
+	glslopt_prelude preludes[MESA_SHADER_STAGES];
+	struct hash_table* sharedOutputs; // fingerprint -> glslopt_shared_output
 };
 
 glslopt_ctx* glslopt_initialize (glslopt_target target)
@@ -117,6 +182,133 @@ void glslopt_set_max_unroll_iterations (glslopt_ctx* ctx, unsigned iterations)
 		ctx->mesa_ctx.Const.ShaderCompilerOptions[i].MaxUnrollIterations = iterations;
 }
 
+void glslopt_set_unroll_factor (glslopt_ctx* ctx, unsigned factor)
+{
+	for (int i = 0; i < MESA_SHADER_STAGES; ++i)
+		ctx->mesa_ctx.Const.ShaderCompilerOptions[i].MaxUnrollFactor = factor;
+}
+
+void glslopt_set_max_hoisted_varyings (glslopt_ctx* ctx, unsigned varyings)
+{
+	ctx->maxHoistedVaryings = varyings;
+}
+
+unsigned glslopt_get_preprocessor_bypass_count (glslopt_ctx* ctx)
+{
+	return ctx->preprocessorBypassCount;
+}
+
+static bool get_shader_stage (glslopt_shader_type type, GLenum* outType, gl_shader_stage* outStage)
+{
+	switch (type) {
+	case kGlslOptShaderVertex: *outType = GL_VERTEX_SHADER; *outStage = MESA_SHADER_VERTEX; return true;
+	case kGlslOptShaderFragment: *outType = GL_FRAGMENT_SHADER; *outStage = MESA_SHADER_FRAGMENT; return true;
+	case kGlslOptShaderCompute: *outType = GL_COMPUTE_SHADER; *outStage = MESA_SHADER_COMPUTE; return true;
+	}
+	return false;
+}
+
+bool glslopt_set_prelude (glslopt_ctx* ctx, glslopt_shader_type type, const char* preludeSource)
+{
+	GLenum glType;
+	gl_shader_stage stage;
+	if (!get_shader_stage (type, &glType, &stage))
+		return false;
+
+	glslopt_prelude& prelude = ctx->preludes[stage];
+	glslopt_ralloc_free (prelude.mem_ctx);
+	prelude = glslopt_prelude();
+	if (!preludeSource)
+		return true;
+
+	prelude.mem_ctx = glslopt_ralloc_context (ctx->mem_ctx);
+	gl_shader* shader = rzalloc (prelude.mem_ctx, gl_shader);
+	shader->Type = glType;
+	shader->Stage = stage;
+
+	_mesa_glsl_parse_state* state = new (shader) _mesa_glsl_parse_state (&ctx->mesa_ctx, stage, shader);
+	if (ctx->target == kGlslTargetMetal)
+		state->metal_target = true;
+	state->error = 0;
+
+	size_t length = strlen(preludeSource);
+	state->error = !!glslopt_glcpp_preprocess (state, &preludeSource, &length, &state->info_log, state->extensions, &ctx->mesa_ctx, NULL, &prelude.macros);
+	if (!state->error)
+	{
+		_mesa_glsl_lexer_ctor (state, preludeSource, length);
+		_mesa_glsl_parse (state);
+		_mesa_glsl_lexer_dtor (state);
+	}
+
+	shader->ir = new (shader) exec_list();
+	if (!state->error && !state->translation_unit.is_empty())
+		_mesa_ast_to_hir (shader->ir, state);
+
+	prelude.log = state->info_log;
+	if (state->error)
+		return false;
+
+	shader->symbols = state->symbols;
+	shader->uses_builtin_functions = state->uses_builtin_functions;
+	prelude.state = state;
+	prelude.shader = shader;
+	return true;
+}
+
+const char* glslopt_get_prelude_log (glslopt_ctx* ctx, glslopt_shader_type type)
+{
+	GLenum glType;
+	gl_shader_stage stage;
+	if (!get_shader_stage (type, &glType, &stage) || !ctx->preludes[stage].log)
+		return "";
+	return ctx->preludes[stage].log;
+}
+
+// The parser needs to know prelude struct names to tell types from identifiers.
+static void import_prelude_types (const glslopt_prelude& prelude, _mesa_glsl_parse_state* state)
+{
+	foreach_in_list(ir_instruction, node, prelude.shader->ir)
+	{
+		if (node->ir_type == ir_type_typedecl)
+		{
+			ir_typedecl_statement* decl = (ir_typedecl_statement*)node;
+			state->symbols->add_type (decl->type_decl->name, decl->type_decl);
+		}
+	}
+}
+
+// Make prelude declarations visible to a parsed shader that is about to be
+// converted to HIR: structs, precision statements, global variables and function
+// prototypes. Function bodies stay in the prelude and get linked in only when
+// called. (The parser starts HIR conversion with a fresh symbol table, so this
+// can't be done before parsing.)
+static void import_prelude (const glslopt_prelude& prelude, exec_list* ir, _mesa_glsl_parse_state* state)
+{
+	import_prelude_types (prelude, state);
+	foreach_in_list(ir_instruction, node, prelude.shader->ir)
+	{
+		if (node->ir_type == ir_type_typedecl)
+		{
+			ir->push_tail (node->clone (state, NULL));
+		}
+		else if (node->ir_type == ir_type_precision)
+		{
+			ir->push_tail (node->clone (state, NULL));
+		}
+		else if (ir_variable* var = node->as_variable())
+		{
+			// built-in variables get declared by the shader itself
+			if (strncmp (var->name, "gl_", 3) == 0)
+				continue;
+			ir_variable* clone = var->clone (state, NULL);
+			ir->push_tail (clone);
+			state->symbols->add_variable (clone);
+		}
+	}
+	import_prototypes (prelude.shader->ir, ir, state->symbols, state);
+	state->had_float_precision |= prelude.state->had_float_precision;
+}
+
 struct glslopt_shader_var
 {
 	const char* name;
@@ -145,14 +337,25 @@ struct glslopt_shader
 	glslopt_shader ()
 		: rawOutput(0)
 		, optimizedOutput(0)
+		, optimizedOutputSize(0)
 		, status(false)
 		, uniformCount(0)
 		, uniformsSize(0)
 		, inputCount(0)
 		, textureCount(0)
+		, removedVaryingCount(0)
+		, uniformExpressionCount(0)
 		, statsMath(0)
 		, statsTex(0)
 		, statsFlow(0)
+		, refCount(1)
+		, hasFingerprint(false)
+		, sharedOutput(0)
+		, savedIR(0)
+		, savedIRSize(0)
+		, retainedIR(0)
+		, retainedIRSize(0)
+		, options(0)
 	{
 		infoLog = "Shader not compiled yet";
 		
@@ -168,6 +371,7 @@ struct glslopt_shader
 		whole_program->NumShaders++;
 		
 		whole_program->LinkStatus = true;		
+		memset (&cost, 0, sizeof(cost));
 	}
 	
 	~glslopt_shader()
@@ -180,7 +384,10 @@ struct glslopt_shader
 		glslopt_ralloc_free(whole_program->InfoLog);
 		glslopt_ralloc_free(whole_program);
 		glslopt_ralloc_free(rawOutput);
-		glslopt_ralloc_free(optimizedOutput);
+		if (sharedOutput)
+			release_shared_output(sharedOutput);
+		else
+			glslopt_ralloc_free(optimizedOutput);
 	}
 	
 	struct gl_shader_program* whole_program;
@@ -192,15 +399,31 @@ struct glslopt_shader
 	glslopt_shader_var uniforms[kMaxShaderUniforms];
 	glslopt_shader_var inputs[kMaxShaderInputs];
 	glslopt_shader_var textures[kMaxShaderInputs];
+	glslopt_shader_var removedVaryings[kMaxShaderInputs]; // by glslopt_optimize_program
+	glslopt_shader_var uniformExpressions[kMaxShaderInputs]; // with kGlslOptionExtractUniformExpressions
+	const char* uniformExpressionSources[kMaxShaderInputs];
 	int uniformCount, uniformsSize;
 	int inputCount;
 	int textureCount;
+	int removedVaryingCount;
+	int uniformExpressionCount;
 	int statsMath, statsTex, statsFlow;
+	shader_cost cost;
 
 	char*	rawOutput;
 	char*	optimizedOutput;
+	size_t	optimizedOutputSize;
 	const char*	infoLog;
 	bool	status;
+	unsigned	refCount; // > 1 when shared between variants
+	unsigned char	fingerprint[kIrFingerprintSize];
+	bool	hasFingerprint;
+	glslopt_shared_output*	sharedOutput; // owns optimizedOutput when set
+	unsigned char*	savedIR; // with kGlslOptionSaveIR
+	size_t	savedIRSize;
+	unsigned char*	retainedIR; // optimized IR, with kGlslOptionRetainIR
+	size_t	retainedIRSize;
+	unsigned	options;
 };
 
 static inline void debug_print_ir (const char* name, exec_list* ir, _mesa_glsl_parse_state* state, void* memctx)
@@ -482,6 +705,7 @@ static void do_optimization_passes(exec_list* ir, bool linked, _mesa_glsl_parse_
 		if (linked)
 		{
 			progress2 = do_vectorize(ir); progress |= progress2; if (progress2) debug_print_ir ("After vectorize", ir, state, mem_ctx);
+			progress2 = do_slp_vectorize(ir); progress |= progress2; if (progress2) debug_print_ir ("After SLP vectorize", ir, state, mem_ctx);
 		}
 		if (linked) {
 			progress2 = do_dead_code(ir,false); progress |= progress2; if (progress2) debug_print_ir ("After dead code", ir, state, mem_ctx);
@@ -498,9 +722,10 @@ static void do_optimization_passes(exec_list* ir, bool linked, _mesa_glsl_parse_
 			progress2 = do_constant_variable_unlinked(ir); progress |= progress2; if (progress2) debug_print_ir ("After const variable unlinked", ir, state, mem_ctx);
 		}
 		progress2 = do_constant_folding(ir); progress |= progress2; if (progress2) debug_print_ir ("After const folding", ir, state, mem_ctx);
-		progress2 = do_minmax_prune(ir); progress |= progress2; if (progress2) debug_print_ir ("After minmax prune", ir, state, mem_ctx);
+		progress2 = do_minmax_prune(ir, state->normalized_textures); progress |= progress2; if (progress2) debug_print_ir ("After minmax prune", ir, state, mem_ctx);
 		progress2 = do_cse(ir); progress |= progress2; if (progress2) debug_print_ir ("After CSE", ir, state, mem_ctx);
-		progress2 = do_rebalance_tree(ir); progress |= progress2; if (progress2) debug_print_ir ("After rebalance tree", ir, state, mem_ctx);
+		progress2 = do_merge_texture_fetches(ir); progress |= progress2; if (progress2) debug_print_ir ("After texture fetch merging", ir, state, mem_ctx);
+		progress2 = do_rebalance_tree(ir, state->fast_math); progress |= progress2; if (progress2) debug_print_ir ("After rebalance tree", ir, state, mem_ctx);
 		progress2 = do_algebraic(ir, state->ctx->Const.NativeIntegers, &state->ctx->Const.ShaderCompilerOptions[state->stage]); progress |= progress2; if (progress2) debug_print_ir ("After algebraic", ir, state, mem_ctx);
 		progress2 = do_lower_jumps(ir); progress |= progress2; if (progress2) debug_print_ir ("After lower jumps", ir, state, mem_ctx);
 		progress2 = do_vec_index_to_swizzle(ir); progress |= progress2; if (progress2) debug_print_ir ("After vec index to swizzle", ir, state, mem_ctx);
@@ -517,7 +742,19 @@ static void do_optimization_passes(exec_list* ir, bool linked, _mesa_glsl_parse_
 			loop_state *ls = analyze_loop_variables(ir);
 			if (ls->loop_found) {
 				progress2 = set_loop_controls(ir, ls); progress |= progress2; if (progress2) debug_print_ir ("After set loop", ir, state, mem_ctx);
-				progress2 = unroll_loops(ir, ls, &state->ctx->Const.ShaderCompilerOptions[state->stage]); progress |= progress2; if (progress2) debug_print_ir ("After unroll", ir, state, mem_ctx);
+				bool loops_changed = progress2;
+				progress2 = unswitch_loops(ir, ls, &state->ctx->Const.ShaderCompilerOptions[state->stage]); progress |= progress2; if (progress2) debug_print_ir ("After unswitch", ir, state, mem_ctx);
+				// the copies get analyzed and unrolled on their own next time round
+				bool unswitched = progress2;
+				loops_changed |= unswitched;
+				if (!unswitched) {
+					progress2 = unroll_loops(ir, ls, &state->ctx->Const.ShaderCompilerOptions[state->stage]); progress |= progress2; if (progress2) debug_print_ir ("After unroll", ir, state, mem_ctx);
+					loops_changed |= progress2;
+				}
+				// the analysis is out of date once loops got changed above
+				if (!loops_changed) {
+					progress2 = hoist_loop_invariants(ir, ls); progress |= progress2; if (progress2) debug_print_ir ("After loop invariants", ir, state, mem_ctx);
+				}
 			}
 			delete ls;
 		}
@@ -623,11 +860,70 @@ static void find_shader_variables(glslopt_shader* sh, exec_list* ir)
 }
 
 
-glslopt_shader* glslopt_optimize (glslopt_ctx* ctx, glslopt_shader_type type, const char* shaderSource, unsigned options)
+static bool write_fd (int fd, const char* data, size_t size)
+{
+	while (size > 0)
+	{
+#ifdef _MSC_VER
+		int res = _write (fd, data, (unsigned)size);
+#else
+		ssize_t res = write (fd, data, size);
+		if (res < 0 && errno == EINTR)
+			continue;
+#endif
+		if (res <= 0)
+			return false;
+		data += res;
+		size -= (size_t)res;
+	}
+	return true;
+}
+
+// Forwards printer output to the user supplied glslopt_sink.
+class glslopt_output_sink : public string_sink
+{
+public:
+	glslopt_output_sink (const glslopt_sink* desc)
+		: desc(desc)
+		, size(0)
+		, failed(false)
+	{
+	}
+
+	virtual bool write (const char* data, size_t len)
+	{
+		size += len;
+		if (failed)
+			return false;
+		switch (desc->type)
+		{
+		case kGlslSinkCallback:
+			failed = !desc->callback || !desc->callback (data, len, desc->userData);
+			break;
+		case kGlslSinkFileDescriptor:
+			failed = !write_fd (desc->fd, data, len);
+			break;
+		case kGlslSinkSizeOnly:
+			break;
+		}
+		return !failed;
+	}
+
+	const glslopt_sink* desc;
+	size_t size;
+	bool failed;
+};
+
+
+// Creates a shader object and its parse state. On unknown shader types the
+// shader is returned with an error and *outState is NULL.
+static glslopt_shader* new_shader (glslopt_ctx* ctx, glslopt_shader_type type, _mesa_glsl_parse_state** outState, PrintGlslMode* outPrintMode)
 {
 	glslopt_shader* shader = new (ctx->mem_ctx) glslopt_shader ();
+	*outState = NULL;
 
-	PrintGlslMode printMode = kPrintGlslVertex;
+	PrintGlslMode& printMode = *outPrintMode;
+	printMode = kPrintGlslVertex;
 	switch (type) {
 	case kGlslOptShaderVertex:
 			shader->shader->Type = GL_VERTEX_SHADER;
@@ -657,25 +953,244 @@ glslopt_shader* glslopt_optimize (glslopt_ctx* ctx, glslopt_shader_type type, co
 	if (ctx->target == kGlslTargetMetal)
 		state->metal_target = true;
 	state->error = 0;
+	*outState = state;
+	return shader;
+}
+
+// Preprocesses the source in place, with the given macros predefined (normally
+// those of the prelude). Returns false, with the shader failed, on errors.
+static bool preprocess_shader (glslopt_ctx* ctx, glslopt_shader* shader, _mesa_glsl_parse_state* state, const char** shaderSource, size_t* shaderLength, unsigned options, const glcpp_macro_set* macros)
+{
+	// Preprocessing is an identity transform for sources without directives,
+	// comments, line continuations or predefined macros; skip it for those.
+	if (!(options & kGlslOptionSkipPreprocessor) && glslopt_glcpp_macro_set_count (macros) == 0 && !glslopt_glcpp_needs_preprocessing (*shaderSource, *shaderLength))
+	{
+		options |= kGlslOptionSkipPreprocessor;
+		++ctx->preprocessorBypassCount;
+	}
 
 	if (!(options & kGlslOptionSkipPreprocessor))
 	{
-		state->error = !!glslopt_glcpp_preprocess (state, &shaderSource, &state->info_log, state->extensions, &ctx->mesa_ctx);
+		state->error = !!glslopt_glcpp_preprocess (state, shaderSource, shaderLength, &state->info_log, state->extensions, &ctx->mesa_ctx, macros, NULL);
 		if (state->error)
 		{
 			shader->status = !state->error;
 			shader->infoLog = state->info_log;
-			return shader;
+			return false;
+		}
+	}
+	return true;
+}
+
+// Returns the context's output for the fingerprint; a new entry has NULL output
+// for the caller to fill in.
+static glslopt_shared_output* get_shared_output (glslopt_ctx* ctx, const unsigned char* fingerprint)
+{
+	glslopt_shared_output* shared = (glslopt_shared_output*)glslopt_hash_table_find (ctx->sharedOutputs, fingerprint);
+	if (shared)
+		return shared;
+	shared = rzalloc (ctx->mem_ctx, glslopt_shared_output);
+	memcpy (shared->fingerprint, fingerprint, kIrFingerprintSize);
+	shared->table = ctx->sharedOutputs;
+	glslopt_hash_table_insert (ctx->sharedOutputs, shared, shared->fingerprint);
+	return shared;
+}
+
+static void use_shared_output (glslopt_ctx* ctx, glslopt_shader* shader, glslopt_shared_output* shared)
+{
+	++shared->refCount;
+	shader->sharedOutput = shared;
+	shader->optimizedOutput = shared->output;
+	shader->optimizedOutputSize = shared->size;
+	if (ctx->target == kGlslTargetMetal)
+		shader->uniformsSize = shared->uniformsSize;
+}
+
+// Replaces expressions of uniforms only by new uniforms, and records how to compute them.
+static void extract_uniform_expressions (glslopt_shader* shader, _mesa_glsl_parse_state* state, exec_list* ir, bool linked)
+{
+	const int space = glslopt_shader::kMaxShaderInputs - shader->uniformExpressionCount;
+	if (space <= 0)
+		return;
+
+	const char* prefix = state->stage == MESA_SHADER_VERTEX ? "xlat_vs_uniform" : state->stage == MESA_SHADER_FRAGMENT ? "xlat_fs_uniform" : "xlat_cs_uniform";
+	exec_list extracted;
+	if (!do_extract_uniform_expressions(ir, prefix, space, &extracted))
+		return;
+
+	// expressions are reported as GLSL, which has no saturate
+	if (state->metal_target)
+		lower_instructions(&extracted, SAT_TO_CLAMP);
+
+	foreach_in_list(ir_assignment, assign, &extracted)
+	{
+		ir_variable* var = assign->lhs->variable_referenced();
+		glslopt_shader_var& v = shader->uniformExpressions[shader->uniformExpressionCount];
+		v.name = glslopt_ralloc_strdup(shader, var->name);
+		glsl_type_to_optimizer_desc(var->type, (glsl_precision)var->data.precision, &v);
+		v.location = -1;
+		shader->uniformExpressionSources[shader->uniformExpressionCount] = _mesa_print_ir_glsl_expression(assign->rhs, state, shader);
+		++shader->uniformExpressionCount;
+	}
+
+	// drop what was only there to compute the expressions
+	do_optimization_passes(ir, linked, state, shader);
+}
+
+// Runs the optimization passes on front end output (linked unless kGlslOptionNotFullShader).
+static void optimize_ir (glslopt_shader* shader, _mesa_glsl_parse_state* state, exec_list* ir, unsigned options)
+{
+	// Do optimization post-link
+	if (!state->error && !ir->is_empty())
+	{		
+		const bool linked = !(options & kGlslOptionNotFullShader);
+		state->normalized_textures = (options & kGlslOptionNormalizedTextures) != 0;
+		state->fast_math = (options & kGlslOptionFastMath) != 0;
+		do_optimization_passes(ir, linked, state, shader);
+		if (options & kGlslOptionExtractUniformExpressions)
+			extract_uniform_expressions(shader, state, ir, linked);
+		// desktop GLSL ignores precision
+		if ((options & kGlslOptionInferPrecision) && (state->es_shader || state->metal_target))
+			do_infer_precision(ir);
+		validate_ir_tree(ir);
+	}	
+}
+
+static bool target_has_fma (glslopt_ctx* ctx, _mesa_glsl_parse_state* state)
+{
+	if (ctx->target == kGlslTargetMetal)
+		return true;
+	return state->ARB_gpu_shader5_enable || state->is_version (400, 0);
+}
+
+// Cost model of each target, for glslopt_shader_get_extended_stats.
+static const shader_cost_model kCostModels[] = {
+	// kGlslTargetOpenGL: desktop GPUs run all math at full precision
+	{ 1.0f, 4.0f, 5.0f, 4.0f, 1.5f, 1.25f, 2.0f, 1.0f },
+	// kGlslTargetOpenGLES20: older mobile GPUs; half precision is cheaper,
+	// texture lookups and branches are expensive
+	{ 0.5f, 4.0f, 5.0f, 6.0f, 1.5f, 1.5f, 2.0f, 2.0f },
+	// kGlslTargetOpenGLES30
+	{ 0.5f, 4.0f, 5.0f, 4.0f, 1.5f, 1.25f, 2.0f, 1.0f },
+	// kGlslTargetMetal
+	{ 0.5f, 4.0f, 5.0f, 4.0f, 1.5f, 1.25f, 2.0f, 1.0f },
+};
+
+// Prints optimized IR and fills in the rest of the shader; frees ir and state.
+// targetCosts (may be NULL) receives the cost under the model of each target.
+static void print_optimized (glslopt_ctx* ctx, glslopt_shader* shader, _mesa_glsl_parse_state* state, PrintGlslMode printMode, exec_list* ir, unsigned options, const glslopt_sink* sink, shader_cost* targetCosts = NULL)
+{
+	// Fused only now, as the optimization passes know more about plain
+	// multiplies and adds
+	if (!state->error && (options & kGlslOptionFastMath) && target_has_fma (ctx, state))
+		do_fuse_multiply_add (ir);
+
+	// Scheduled last, as the optimization passes don't keep assignments in
+	// any particular order
+	int unscheduledRegisters = -1;
+	if (!state->error && (options & kGlslOptionScheduleForPressure))
+	{
+		liveness_analysis liveness (ir);
+		unscheduledRegisters = liveness.max_registers;
+		do_schedule_for_pressure (ir);
+	}
+
+	if (!state->error)
+	{
+		calculate_ir_fingerprint (ir, state, shader->fingerprint);
+		shader->hasFingerprint = true;
+	}
+
+	shader->options = options;
+	if (!state->error && (options & kGlslOptionRetainIR))
+		shader->retainedIR = serialize_ir (shader, ir, state, &shader->retainedIRSize);
+
+	// Final optimized output
+	bool sinkFailed = false;
+	if (!state->error && sink)
+	{
+		glslopt_output_sink out (sink);
+		char* tmpctx = glslopt_ralloc_strdup(shader, "");
+		if (ctx->target == kGlslTargetMetal)
+			_mesa_print_ir_metal(ir, state, tmpctx, printMode, &shader->uniformsSize, &out);
+		else
+			_mesa_print_ir_glsl(ir, state, tmpctx, printMode, &out);
+		glslopt_ralloc_free(tmpctx);
+		shader->optimizedOutputSize = out.size;
+		sinkFailed = out.failed;
+	}
+	else if (!state->error)
+	{
+		// Same fingerprint as an existing shader: reuse its output instead of printing
+		glslopt_shared_output* shared = get_shared_output (ctx, shader->fingerprint);
+		if (!shared->output)
+		{
+			if (ctx->target == kGlslTargetMetal)
+				shared->output = _mesa_print_ir_metal(ir, state, glslopt_ralloc_strdup(shared, ""), printMode, &shared->uniformsSize);
+			else
+				shared->output = _mesa_print_ir_glsl(ir, state, glslopt_ralloc_strdup(shared, ""), printMode);
+			shared->size = strlen(shared->output);
 		}
+		use_shared_output (ctx, shader, shared);
 	}
 
-	_mesa_glsl_lexer_ctor (state, shaderSource);
+	shader->status = !state->error && !sinkFailed;
+	shader->infoLog = sinkFailed ? "Failed to write optimized output to sink" : state->info_log;
+
+	find_shader_variables (shader, ir);
+	if (!state->error)
+	{
+		calculate_shader_stats (ir, &shader->statsMath, &shader->statsTex, &shader->statsFlow);
+		calculate_shader_cost (ir, kCostModels[ctx->target], &shader->cost);
+		if (unscheduledRegisters >= 0)
+			shader->cost.liveRegistersUnscheduled = unscheduledRegisters;
+		for (unsigned i = 0; targetCosts && i < Elements(kCostModels); ++i)
+		{
+			calculate_shader_cost (ir, kCostModels[i], &targetCosts[i]);
+			if (unscheduledRegisters >= 0)
+				targetCosts[i].liveRegistersUnscheduled = unscheduledRegisters;
+		}
+	}
+
+	glslopt_ralloc_free (ir);
+	glslopt_ralloc_free (state);
+}
+
+// Optimizes front end output (linked unless kGlslOptionNotFullShader), prints it
+// and fills in reflection data; frees the IR and parse state.
+static void optimize_and_print (glslopt_ctx* ctx, glslopt_shader* shader, _mesa_glsl_parse_state* state, PrintGlslMode printMode, exec_list* ir, unsigned options, const glslopt_sink* sink)
+{
+	optimize_ir (shader, state, ir, options);
+	print_optimized (ctx, shader, state, printMode, ir, options, sink);
+}
+
+// Compiles and links preprocessed source. Returns the IR to optimize (owned by
+// *outLinked when that gets set), or NULL with the shader failed on link errors.
+static exec_list* run_front_end (glslopt_ctx* ctx, glslopt_shader* shader, _mesa_glsl_parse_state* state, PrintGlslMode printMode, const char* shaderSource, size_t shaderLength, unsigned options, gl_shader** outLinked)
+{
+	const glslopt_prelude& prelude = ctx->preludes[shader->shader->Stage];
+
+	if (prelude.shader)
+		import_prelude_types (prelude, state);
+
+	_mesa_glsl_lexer_ctor (state, shaderSource, shaderLength);
 	_mesa_glsl_parse (state);
 	_mesa_glsl_lexer_dtor (state);
 
+	if (!state->error && prelude.shader && (state->language_version != prelude.state->language_version || state->es_shader != prelude.state->es_shader))
+	{
+		glslopt_ralloc_asprintf_append (&state->info_log, "error: shader version %u%s does not match prelude version %u%s\n",
+			state->language_version, state->es_shader ? " es" : "",
+			prelude.state->language_version, prelude.state->es_shader ? " es" : "");
+		state->error = true;
+	}
+
 	exec_list* ir = new (shader) exec_list();
 	shader->shader->ir = ir;
 
+	if (!state->error && prelude.shader)
+		import_prelude (prelude, ir, state);
+
 	if (!state->error && !state->translation_unit.is_empty())
 		_mesa_ast_to_hir (ir, state);
 
@@ -692,62 +1207,718 @@ glslopt_shader* glslopt_optimize (glslopt_ctx* ctx, glslopt_shader_type type, co
 	shader->shader->symbols = state->symbols;
 	shader->shader->uses_builtin_functions = state->uses_builtin_functions;
 	
-	struct gl_shader* linked_shader = NULL;
-
+	*outLinked = NULL;
 	if (!state->error && !ir->is_empty() && !(options & kGlslOptionNotFullShader))
 	{
-		linked_shader = link_intrastage_shaders(shader,
+		// The prelude is linked in as a second compilation unit, but is not owned
+		// by the program. Our shader goes first, so that the linker never needs
+		// to modify prelude declarations.
+		struct gl_shader* link_shaders[2] = { shader->shader, prelude.shader };
+		struct gl_shader* linked_shader = link_intrastage_shaders(shader,
 												&ctx->mesa_ctx,
 												shader->whole_program,
-												shader->whole_program->Shaders,
-												shader->whole_program->NumShaders);
+												link_shaders,
+												prelude.shader ? 2 : 1);
 		if (!linked_shader)
 		{
 			shader->status = false;
 			shader->infoLog = shader->whole_program->InfoLog;
-			return shader;
+			return NULL;
 		}
+		*outLinked = linked_shader;
 		ir = linked_shader->ir;
 		
 		debug_print_ir ("==== After link ====", ir, state, shader);
 	}
-	
-	// Do optimization post-link
-	if (!state->error && !ir->is_empty())
-	{		
-		const bool linked = !(options & kGlslOptionNotFullShader);
-		do_optimization_passes(ir, linked, state, shader);
-		validate_ir_tree(ir);
-	}	
-	
-	// Final optimized output
-	if (!state->error)
-	{
-		if (ctx->target == kGlslTargetMetal)
-			shader->optimizedOutput = _mesa_print_ir_metal(ir, state, glslopt_ralloc_strdup(shader, ""), printMode, &shader->uniformsSize);
-		else
-			shader->optimizedOutput = _mesa_print_ir_glsl(ir, state, glslopt_ralloc_strdup(shader, ""), printMode);
-	}
 
-	shader->status = !state->error;
-	shader->infoLog = state->info_log;
+	if (!state->error && (options & kGlslOptionSaveIR))
+		shader->savedIR = serialize_ir (shader, ir, state, &shader->savedIRSize);
 
-	find_shader_variables (shader, ir);
-	if (!state->error)
-		calculate_shader_stats (ir, &shader->statsMath, &shader->statsTex, &shader->statsFlow);
+	return ir;
+}
 
-	glslopt_ralloc_free (ir);
-	glslopt_ralloc_free (state);
+// Compiles, links and optimizes preprocessed source into the shader.
+static void compile_shader (glslopt_ctx* ctx, glslopt_shader* shader, _mesa_glsl_parse_state* state, PrintGlslMode printMode, const char* shaderSource, size_t shaderLength, unsigned options, const glslopt_sink* sink)
+{
+	struct gl_shader* linked_shader;
+	exec_list* ir = run_front_end (ctx, shader, state, printMode, shaderSource, shaderLength, options, &linked_shader);
+	if (!ir)
+		return;
+
+	optimize_and_print (ctx, shader, state, printMode, ir, options, sink);
 
 	if (linked_shader)
 		glslopt_ralloc_free(linked_shader);
+}
 
+static glslopt_shader* optimize_shader (glslopt_ctx* ctx, glslopt_shader_type type, const char* shaderSource, size_t shaderLength, unsigned options, const glslopt_sink* sink)
+{
+	_mesa_glsl_parse_state* state;
+	PrintGlslMode printMode;
+	glslopt_shader* shader = new_shader (ctx, type, &state, &printMode);
+	if (state && preprocess_shader (ctx, shader, state, &shaderSource, &shaderLength, options, ctx->preludes[shader->shader->Stage].macros))
+		compile_shader (ctx, shader, state, printMode, shaderSource, shaderLength, options, sink);
 	return shader;
 }
 
+glslopt_shader* glslopt_optimize (glslopt_ctx* ctx, glslopt_shader_type type, const char* shaderSource, unsigned options)
+{
+	return optimize_shader (ctx, type, shaderSource, strlen(shaderSource), options, NULL);
+}
+
+glslopt_shader* glslopt_optimize_to_sink (glslopt_ctx* ctx, glslopt_shader_type type, const char* shaderSource, unsigned options, const glslopt_sink* sink)
+{
+	return optimize_shader (ctx, type, shaderSource, strlen(shaderSource), options, sink);
+}
+
+glslopt_shader* glslopt_optimize_buffer (glslopt_ctx* ctx, glslopt_shader_type type, const char* shaderSource, size_t shaderLength, unsigned options, const glslopt_sink* sink)
+{
+	return optimize_shader (ctx, type, shaderSource, shaderLength, options, sink);
+}
+
+// Creates a shader from serialized IR; on failure *outIR is NULL and the shader
+// is failed.
+static glslopt_shader* new_shader_from_ir (glslopt_ctx* ctx, const void* ir, size_t irSize, _mesa_glsl_parse_state** outState, PrintGlslMode* outPrintMode, exec_list** outIR)
+{
+	unsigned stage = MESA_SHADER_STAGES;
+	get_serialized_ir_stage (ir, irSize, &stage);
+	glslopt_shader_type type = (glslopt_shader_type)-1;
+	switch (stage) {
+	case MESA_SHADER_VERTEX: type = kGlslOptShaderVertex; break;
+	case MESA_SHADER_FRAGMENT: type = kGlslOptShaderFragment; break;
+	case MESA_SHADER_COMPUTE: type = kGlslOptShaderCompute; break;
+	}
+
+	*outIR = NULL;
+	_mesa_glsl_parse_state* state;
+	glslopt_shader* shader = new_shader (ctx, type, &state, outPrintMode);
+	if (!state)
+	{
+		shader->infoLog = "Invalid serialized IR";
+		return shader;
+	}
+
+	exec_list* list = new (shader) exec_list();
+	shader->shader->ir = list;
+	if (!deserialize_ir (list, ir, irSize, state, list))
+	{
+		shader->status = false;
+		shader->infoLog = "Invalid serialized IR";
+		glslopt_ralloc_free (list);
+		glslopt_ralloc_free (state);
+		return shader;
+	}
+	validate_ir_tree(list);
+
+	*outState = state;
+	*outIR = list;
+	return shader;
+}
+
+glslopt_shader* glslopt_optimize_ir (glslopt_ctx* ctx, const void* ir, size_t irSize, unsigned options)
+{
+	_mesa_glsl_parse_state* state;
+	PrintGlslMode printMode;
+	exec_list* list;
+	glslopt_shader* shader = new_shader_from_ir (ctx, ir, irSize, &state, &printMode, &list);
+	if (!list)
+		return shader;
+
+	if (ctx->target == kGlslTargetMetal)
+		shader->rawOutput = _mesa_print_ir_metal(list, state, glslopt_ralloc_strdup(shader, ""), printMode, &shader->uniformsSize);
+	else
+		shader->rawOutput = _mesa_print_ir_glsl(list, state, glslopt_ralloc_strdup(shader, ""), printMode);
+
+	if (options & kGlslOptionSaveIR)
+		shader->savedIR = serialize_ir (shader, list, state, &shader->savedIRSize);
+
+	optimize_and_print (ctx, shader, state, printMode, list, options, NULL);
+	return shader;
+}
+
+// Number of values in a constant of the type, as passed to glslopt_specialize.
+static unsigned specialization_value_count (const glsl_type* type)
+{
+	if (type->is_array())
+		return type->length * specialization_value_count (type->fields.array);
+	return type->components();
+}
+
+static ir_constant* make_specialization_constant (void* mem_ctx, const glsl_type* type, glsl_precision precision, const float* values)
+{
+	if (type->is_array())
+	{
+		exec_list elements;
+		const unsigned stride = specialization_value_count (type->fields.array);
+		for (unsigned i = 0; i < type->length; ++i)
+		{
+			ir_constant* element = make_specialization_constant (mem_ctx, type->fields.array, precision, values + i * stride);
+			if (!element)
+				return NULL;
+			elements.push_tail (element);
+		}
+		return new (mem_ctx) ir_constant (type, &elements);
+	}
+	if (!type->is_scalar() && !type->is_vector() && !type->is_matrix())
+		return NULL;
+
+	ir_constant_data data;
+	memset (&data, 0, sizeof(data));
+	for (unsigned i = 0; i < type->components(); ++i)
+	{
+		switch (type->base_type)
+		{
+		case GLSL_TYPE_FLOAT: data.f[i] = values[i]; break;
+		case GLSL_TYPE_INT: data.i[i] = (int)values[i]; break;
+		case GLSL_TYPE_UINT: data.u[i] = (unsigned)values[i]; break;
+		case GLSL_TYPE_BOOL: data.b[i] = values[i] != 0.0f; break;
+		default: return NULL;
+		}
+	}
+	return new (mem_ctx) ir_constant (type, &data, precision);
+}
+
+glslopt_shader* glslopt_specialize (glslopt_ctx* ctx, glslopt_shader* original, const glslopt_uniform_binding* bindings, unsigned bindingCount)
+{
+	if (!original->retainedIR)
+	{
+		glslopt_shader* shader = new (ctx->mem_ctx) glslopt_shader ();
+		shader->infoLog = "Shader has no retained IR to specialize (compile it with kGlslOptionRetainIR)";
+		return shader;
+	}
+
+	_mesa_glsl_parse_state* state;
+	PrintGlslMode printMode;
+	exec_list* ir;
+	glslopt_shader* shader = new_shader_from_ir (ctx, original->retainedIR, original->retainedIRSize, &state, &printMode, &ir);
+	if (!ir)
+		return shader;
+	shader->rawOutput = glslopt_ralloc_strdup (shader, original->rawOutput);
+
+	// Uniforms the original got for uniform expressions are in the retained IR
+	for (int i = 0; i < original->uniformExpressionCount; ++i)
+	{
+		shader->uniformExpressions[i] = original->uniformExpressions[i];
+		shader->uniformExpressions[i].name = glslopt_ralloc_strdup (shader, original->uniformExpressions[i].name);
+		shader->uniformExpressionSources[i] = glslopt_ralloc_strdup (shader, original->uniformExpressionSources[i]);
+	}
+	shader->uniformExpressionCount = original->uniformExpressionCount;
+
+	// Bound uniforms become constants; folding them in and the optimizations
+	// that follow from it are up to the usual passes.
+	for (unsigned i = 0; i < bindingCount && !state->error; ++i)
+	{
+		ir_variable* var = NULL;
+		foreach_in_list(ir_instruction, node, ir)
+		{
+			ir_variable* v = node->as_variable();
+			if (v && v->data.mode == ir_var_uniform && !strcmp (v->name, bindings[i].name))
+			{
+				var = v;
+				break;
+			}
+		}
+		if (!var)
+		{
+			glslopt_ralloc_asprintf_append (&state->info_log, "error: no uniform '%s' to specialize\n", bindings[i].name);
+			state->error = true;
+			break;
+		}
+		ir_constant* value = make_specialization_constant (var, var->type, (glsl_precision)var->data.precision, bindings[i].values);
+		if (!value)
+		{
+			glslopt_ralloc_asprintf_append (&state->info_log, "error: uniform '%s' has a type that can't be specialized\n", bindings[i].name);
+			state->error = true;
+			break;
+		}
+		var->data.mode = ir_var_auto;
+		var->data.read_only = true;
+		var->data.has_initializer = true;
+		var->constant_value = value;
+		var->constant_initializer = value->clone (var, NULL);
+	}
+
+	optimize_and_print (ctx, shader, state, printMode, ir, original->options, NULL);
+	return shader;
+}
+
+// Whether optimizing the same IR in both contexts gives the same result.
+static bool same_optimizer_settings (glslopt_ctx* a, glslopt_ctx* b, gl_shader_stage stage)
+{
+	return (a->target == kGlslTargetMetal) == (b->target == kGlslTargetMetal)
+		&& a->mesa_ctx.Const.NativeIntegers == b->mesa_ctx.Const.NativeIntegers
+		&& !memcmp (&a->mesa_ctx.Const.ShaderCompilerOptions[stage], &b->mesa_ctx.Const.ShaderCompilerOptions[stage], sizeof(a->mesa_ctx.Const.ShaderCompilerOptions[stage]));
+}
+
+// Gives shader the optimization results of src, which was optimized from the same IR.
+static void copy_optimized_shader (glslopt_ctx* ctx, glslopt_shader* shader, const glslopt_shader* src)
+{
+	memcpy (shader->fingerprint, src->fingerprint, kIrFingerprintSize);
+	shader->hasFingerprint = src->hasFingerprint;
+	glslopt_shared_output* shared = get_shared_output (ctx, shader->fingerprint);
+	if (!shared->output)
+	{
+		shared->output = glslopt_ralloc_strdup (shared, src->optimizedOutput);
+		shared->size = src->optimizedOutputSize;
+		shared->uniformsSize = src->uniformsSize;
+	}
+	use_shared_output (ctx, shader, shared);
+	shader->uniformsSize = src->uniformsSize;
+
+	shader->uniformCount = src->uniformCount;
+	shader->inputCount = src->inputCount;
+	shader->textureCount = src->textureCount;
+	memcpy (shader->uniforms, src->uniforms, src->uniformCount * sizeof(src->uniforms[0]));
+	memcpy (shader->inputs, src->inputs, src->inputCount * sizeof(src->inputs[0]));
+	memcpy (shader->textures, src->textures, src->textureCount * sizeof(src->textures[0]));
+	for (int i = 0; i < shader->uniformCount; ++i)
+		shader->uniforms[i].name = glslopt_ralloc_strdup (shader, src->uniforms[i].name);
+	for (int i = 0; i < shader->inputCount; ++i)
+		shader->inputs[i].name = glslopt_ralloc_strdup (shader, src->inputs[i].name);
+	for (int i = 0; i < shader->textureCount; ++i)
+		shader->textures[i].name = glslopt_ralloc_strdup (shader, src->textures[i].name);
+
+	shader->statsMath = src->statsMath;
+	shader->statsTex = src->statsTex;
+	shader->statsFlow = src->statsFlow;
+}
+
+void glslopt_optimize_targets (glslopt_ctx* const* contexts, unsigned count, glslopt_shader_type type, const char* shaderSource, unsigned options, glslopt_shader** outShaders)
+{
+	void* mem_ctx = glslopt_ralloc_context (NULL);
+	const size_t sourceLength = strlen (shaderSource);
+
+	// Front end output of each target, to find targets that would do the same optimization work
+	unsigned char** frontEndIR = rzalloc_array (mem_ctx, unsigned char*, count);
+	size_t* frontEndIRSize = rzalloc_array (mem_ctx, size_t, count);
+	// Targets weigh costs differently, so each result gets costed for all of them
+	const unsigned modelCount = Elements(kCostModels);
+	shader_cost* targetCosts = rzalloc_array (mem_ctx, shader_cost, count * modelCount);
+
+	for (unsigned i = 0; i < count; ++i)
+	{
+		glslopt_ctx* ctx = contexts[i];
+		_mesa_glsl_parse_state* state;
+		PrintGlslMode printMode;
+		glslopt_shader* shader = outShaders[i] = new_shader (ctx, type, &state, &printMode);
+		if (!state)
+			continue;
+
+		const char* source = shaderSource;
+		size_t length = sourceLength;
+		if (!preprocess_shader (ctx, shader, state, &source, &length, options, ctx->preludes[shader->shader->Stage].macros))
+			continue;
+
+		struct gl_shader* linked_shader;
+		exec_list* ir = run_front_end (ctx, shader, state, printMode, source, length, options, &linked_shader);
+		if (!ir)
+			continue;
+
+		int same = -1;
+		if (!state->error)
+		{
+			frontEndIR[i] = serialize_ir (mem_ctx, ir, state, &frontEndIRSize[i]);
+			for (unsigned j = 0; j < i && same < 0; ++j)
+			{
+				if (frontEndIR[j] && outShaders[j]->status && frontEndIRSize[j] == frontEndIRSize[i] &&
+					same_optimizer_settings (contexts[j], ctx, shader->shader->Stage) &&
+					!memcmp (frontEndIR[j], frontEndIR[i], frontEndIRSize[i]))
+					same = j;
+			}
+		}
+
+		if (same >= 0)
+		{
+			copy_optimized_shader (ctx, shader, outShaders[same]);
+			shader->cost = targetCosts[same * modelCount + ctx->target];
+			memcpy (&targetCosts[i * modelCount], &targetCosts[same * modelCount], modelCount * sizeof(targetCosts[0]));
+			shader->status = true;
+			shader->infoLog = state->info_log;
+			glslopt_ralloc_free (ir);
+			glslopt_ralloc_free (state);
+		}
+		else
+		{
+			optimize_ir (shader, state, ir, options);
+			print_optimized (ctx, shader, state, printMode, ir, options, NULL, &targetCosts[i * modelCount]);
+		}
+
+		if (linked_shader)
+			glslopt_ralloc_free (linked_shader);
+	}
+
+	glslopt_ralloc_free (mem_ctx);
+}
+
+// A stage of a program being optimized, between the front end and printing.
+struct glslopt_program_stage
+{
+	glslopt_shader* shader;
+	_mesa_glsl_parse_state* state;
+	PrintGlslMode printMode;
+	exec_list* ir;
+	gl_shader* linked;
+};
+
+// Another optimization round after moving code between the stages.
+static void reoptimize_program (glslopt_program_stage& vs, glslopt_program_stage& fs, unsigned options)
+{
+	optimize_ir (fs.shader, fs.state, fs.ir, options);
+	remove_unused_varyings (vs.shader, vs.linked, fs.linked);
+	optimize_ir (vs.shader, vs.state, vs.ir, options);
+}
+
+void glslopt_optimize_program (glslopt_ctx* ctx, const char* vertexSource, const char* fragmentSource, unsigned options, glslopt_shader** outVertex, glslopt_shader** outFragment)
+{
+	const glslopt_shader_type types[2] = { kGlslOptShaderVertex, kGlslOptShaderFragment };
+	const char* sources[2] = { vertexSource, fragmentSource };
+	glslopt_program_stage stages[2];
+	for (int i = 0; i < 2; ++i)
+	{
+		glslopt_program_stage& stage = stages[i];
+		stage.ir = NULL;
+		stage.linked = NULL;
+		stage.shader = new_shader (ctx, types[i], &stage.state, &stage.printMode);
+		const char* source = sources[i];
+		size_t length = strlen (source);
+		if (stage.state && preprocess_shader (ctx, stage.shader, stage.state, &source, &length, options, ctx->preludes[stage.shader->shader->Stage].macros))
+			stage.ir = run_front_end (ctx, stage.shader, stage.state, stage.printMode, source, length, options, &stage.linked);
+	}
+	glslopt_program_stage& vs = stages[0];
+	glslopt_program_stage& fs = stages[1];
+	*outVertex = vs.shader;
+	*outFragment = fs.shader;
+
+	// When one stage fails on its own, the other is optimized as by itself
+	bool together = vs.linked && fs.linked && !vs.state->error && !fs.state->error;
+	if (together)
+	{
+		gl_shader_program* prog = fs.shader->whole_program;
+		cross_validate_outputs_to_inputs (prog, vs.linked, fs.linked);
+		if (!prog->LinkStatus)
+		{
+			for (int i = 0; i < 2; ++i)
+			{
+				glslopt_ralloc_strcat (&stages[i].state->info_log, prog->InfoLog);
+				stages[i].state->error = true;
+			}
+			together = false;
+		}
+	}
+
+	// User-defined varyings, to report the ones that end up removed
+	ir_variable* varyings[glslopt_shader::kMaxShaderInputs];
+	int varyingCount = 0;
+	if (together)
+	{
+		foreach_in_list(ir_instruction, node, vs.ir)
+		{
+			ir_variable* var = node->as_variable();
+			if (var && var->data.mode == ir_var_shader_out && !is_gl_identifier(var->name) && varyingCount < glslopt_shader::kMaxShaderInputs)
+				varyings[varyingCount++] = var;
+		}
+	}
+
+	// The fragment shader goes first, so that only what it still reads after
+	// optimization is kept in the vertex shader. Vertex outputs that turn out
+	// to be the same for all vertices are then computed in the fragment shader
+	// instead, and affine fragment computations in the vertex shader; each
+	// takes another round.
+	if (fs.ir)
+		optimize_ir (fs.shader, fs.state, fs.ir, options);
+	if (together && !fs.state->error)
+		remove_unused_varyings (vs.shader, vs.linked, fs.linked);
+	if (vs.ir)
+		optimize_ir (vs.shader, vs.state, vs.ir, options);
+	if (together && !vs.state->error && !fs.state->error && propagate_uniform_varyings (vs.shader, vs.linked, fs.linked, fs.state))
+		reoptimize_program (vs, fs, options);
+	if (together && !vs.state->error && !fs.state->error && do_hoist_affine_varyings (vs.linked, fs.linked, fs.state->es_shader, ctx->maxHoistedVaryings))
+		reoptimize_program (vs, fs, options);
+
+	for (int i = 0; i < varyingCount; ++i)
+	{
+		if (varyings[i]->data.mode == ir_var_shader_out)
+			continue;
+		for (int j = 0; j < 2; ++j)
+		{
+			glslopt_shader* sh = stages[j].shader;
+			glslopt_shader_var& v = sh->removedVaryings[sh->removedVaryingCount++];
+			v.name = glslopt_ralloc_strdup(sh, varyings[i]->name);
+			glsl_type_to_optimizer_desc(varyings[i]->type, (glsl_precision)varyings[i]->data.precision, &v);
+			v.location = -1;
+		}
+	}
+
+	for (int i = 0; i < 2; ++i)
+	{
+		glslopt_program_stage& stage = stages[i];
+		if (stage.ir)
+			print_optimized (ctx, stage.shader, stage.state, stage.printMode, stage.ir, options, NULL);
+		if (stage.linked)
+			glslopt_ralloc_free (stage.linked);
+	}
+}
+
+static inline bool is_identifier_start (char c)
+{
+	return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_';
+}
+
+static inline bool is_identifier_char (char c)
+{
+	return is_identifier_start (c) || (c >= '0' && c <= '9');
+}
+
+// Finds the next identifier in [p, end); numbers (including suffixes and
+// exponents) are skipped over. Returns NULL when there are no more.
+static const char* next_identifier (const char*& p, const char* end, size_t* outLength)
+{
+	while (p < end)
+	{
+		if (is_identifier_start (*p))
+		{
+			const char* start = p;
+			while (p < end && is_identifier_char (*p))
+				++p;
+			*outLength = p - start;
+			return start;
+		}
+		if (*p >= '0' && *p <= '9')
+		{
+			while (p < end && (is_identifier_char (*p) || *p == '.'))
+				++p;
+			continue;
+		}
+		++p;
+	}
+	return NULL;
+}
+
+// One NAME or NAME=VALUE entry of a variant define set.
+struct variant_define
+{
+	const char* name;
+	const char* value;
+	size_t nameLength;
+	size_t valueLength;
+	unsigned order;
+	bool relevant;
+};
+
+static int compare_variant_defines (const void* a, const void* b)
+{
+	const variant_define* da = (const variant_define*)a;
+	const variant_define* db = (const variant_define*)b;
+	size_t len = da->nameLength < db->nameLength ? da->nameLength : db->nameLength;
+	int res = memcmp (da->name, db->name, len);
+	if (res == 0 && da->nameLength != db->nameLength)
+		res = da->nameLength < db->nameLength ? -1 : 1;
+	if (res == 0)
+		res = da->order < db->order ? -1 : 1;
+	return res;
+}
+
+// Splits a whitespace separated define set into entries.
+static variant_define* parse_variant_defines (void* mem_ctx, const char* defines, unsigned* outCount)
+{
+	variant_define* entries = NULL;
+	unsigned count = 0;
+	const char* p = defines ? defines : "";
+	while (*p)
+	{
+		while (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')
+			++p;
+		if (!*p)
+			break;
+		const char* start = p;
+		while (*p && *p != ' ' && *p != '\t' && *p != '\n' && *p != '\r')
+			++p;
+
+		entries = reralloc (mem_ctx, entries, variant_define, count + 1);
+		variant_define& e = entries[count];
+		e.name = start;
+		e.nameLength = p - start;
+		e.value = "1";
+		e.valueLength = 1;
+		e.order = count;
+		e.relevant = false;
+		if (const char* eq = (const char*)memchr (start, '=', p - start))
+		{
+			e.nameLength = eq - start;
+			e.value = eq + 1;
+			e.valueLength = p - e.value;
+		}
+		++count;
+	}
+	*outCount = count;
+	return entries;
+}
+
+// Canonical form of the relevant part of a define set: sorted NAME=VALUE lines,
+// later entries overriding earlier ones with the same name. Entries referenced
+// from values of relevant entries become relevant themselves.
+static char* variant_define_key (void* mem_ctx, variant_define* entries, unsigned count, string_to_uint_map* identifiers)
+{
+	for (unsigned i = 0; i < count; ++i)
+	{
+		variant_define& e = entries[i];
+		unsigned dummy;
+		if (!identifiers)
+			e.relevant = true;
+		else
+		{
+			char* name = glslopt_ralloc_strndup (mem_ctx, e.name, e.nameLength);
+			e.relevant = identifiers->get (dummy, name);
+			glslopt_ralloc_free (name);
+		}
+	}
+	for (bool changed = true; changed; )
+	{
+		changed = false;
+		for (unsigned i = 0; i < count; ++i)
+		{
+			if (!entries[i].relevant)
+				continue;
+			const char* p = entries[i].value;
+			const char* end = p + entries[i].valueLength;
+			size_t len;
+			while (const char* ident = next_identifier (p, end, &len))
+			{
+				for (unsigned j = 0; j < count; ++j)
+				{
+					if (!entries[j].relevant && entries[j].nameLength == len && memcmp (entries[j].name, ident, len) == 0)
+						entries[j].relevant = changed = true;
+				}
+			}
+		}
+	}
+
+	qsort (entries, count, sizeof(entries[0]), compare_variant_defines);
+	char* key = glslopt_ralloc_strdup (mem_ctx, "");
+	for (unsigned i = 0; i < count; ++i)
+	{
+		const variant_define& e = entries[i];
+		if (!e.relevant)
+			continue;
+		if (i + 1 < count && entries[i+1].nameLength == e.nameLength && memcmp (entries[i+1].name, e.name, e.nameLength) == 0)
+			continue;
+		glslopt_ralloc_asprintf_append (&key, "%.*s=%.*s\n", (int)e.nameLength, e.name, (int)e.valueLength, e.value);
+	}
+	return key;
+}
+
+void glslopt_optimize_variants (glslopt_ctx* ctx, glslopt_shader_type type, const char* shaderSource, const char* const* defineSets, unsigned variantCount, unsigned options, glslopt_shader** outShaders)
+{
+	void* mem_ctx = glslopt_ralloc_context (NULL);
+	const size_t shaderLength = strlen (shaderSource);
+
+	GLenum glType;
+	gl_shader_stage stage;
+	const glcpp_macro_set* preludeMacros = get_shader_stage (type, &glType, &stage) ? ctx->preludes[stage].macros : NULL;
+
+	// Defines whose names never appear in the source can't change its
+	// preprocessed form, so variants differing only in those share everything.
+	// Token pasting can form new names, and prelude macros might refer to any
+	// define; then every define counts.
+	string_to_uint_map* identifiers = NULL;
+	bool pasting = false;
+	for (size_t i = 0; i + 1 < shaderLength && !pasting; ++i)
+		pasting = shaderSource[i] == '#' && shaderSource[i+1] == '#';
+	if (!pasting && glslopt_glcpp_macro_set_count (preludeMacros) == 0)
+	{
+		identifiers = new string_to_uint_map();
+		const char* p = shaderSource;
+		size_t len;
+		while (const char* ident = next_identifier (p, shaderSource + shaderLength, &len))
+		{
+			char* name = glslopt_ralloc_strndup (mem_ctx, ident, len);
+			identifiers->put (0, name);
+			glslopt_ralloc_free (name);
+		}
+	}
+
+	// Variants with the same relevant defines are preprocessed once; variants
+	// with the same preprocessed source are compiled once.
+	string_to_uint_map keyToShader, sourceToShader;
+	glslopt_shader** uniqueShaders = ralloc_array (mem_ctx, glslopt_shader*, variantCount);
+	unsigned uniqueCount = 0;
+
+	for (unsigned v = 0; v < variantCount; ++v)
+	{
+		unsigned defineCount;
+		variant_define* defines = parse_variant_defines (mem_ctx, defineSets[v], &defineCount);
+		char* key = variant_define_key (mem_ctx, defines, defineCount, identifiers);
+
+		unsigned index;
+		if (keyToShader.get (index, key))
+		{
+			outShaders[v] = uniqueShaders[index];
+			++outShaders[v]->refCount;
+			continue;
+		}
+
+		_mesa_glsl_parse_state* state;
+		PrintGlslMode printMode;
+		glslopt_shader* shader = new_shader (ctx, type, &state, &printMode);
+		const char* source = shaderSource;
+		size_t length = shaderLength;
+		bool preprocessed = false;
+		if (state)
+		{
+			// Turn the key back into #define lines, and let glcpp make macros of them.
+			char* defineSource = glslopt_ralloc_strdup (mem_ctx, "");
+			for (const char* line = key; *line; )
+			{
+				const char* eol = strchr (line, '\n');
+				const char* eq = (const char*)memchr (line, '=', eol - line);
+				glslopt_ralloc_asprintf_append (&defineSource, "#define %.*s %.*s\n", (int)(eq - line), line, (int)(eol - eq - 1), eq + 1);
+				line = eol + 1;
+			}
+			const char* defineText = defineSource;
+			size_t defineLength = strlen (defineSource);
+			glcpp_macro_set* variantMacros = NULL;
+			state->error = !!glslopt_glcpp_preprocess (state, &defineText, &defineLength, &state->info_log, state->extensions, &ctx->mesa_ctx, NULL, &variantMacros);
+			if (state->error)
+			{
+				shader->status = false;
+				shader->infoLog = state->info_log;
+			}
+			else
+			{
+				glcpp_macro_set* macros = glslopt_glcpp_macro_set_union (state, preludeMacros, variantMacros);
+				preprocessed = preprocess_shader (ctx, shader, state, &source, &length, options, macros);
+			}
+		}
+
+		if (preprocessed)
+		{
+			char* text = glslopt_ralloc_strndup (mem_ctx, source, length);
+			if (sourceToShader.get (index, text))
+			{
+				glslopt_shader_delete (shader);
+				shader = uniqueShaders[index];
+				++shader->refCount;
+			}
+			else
+			{
+				sourceToShader.put (uniqueCount, text);
+				compile_shader (ctx, shader, state, printMode, source, length, options, NULL);
+			}
+		}
+
+		keyToShader.put (uniqueCount, key);
+		uniqueShaders[uniqueCount++] = shader;
+		outShaders[v] = shader;
+	}
+
+	delete identifiers;
+	glslopt_ralloc_free (mem_ctx);
+}
+
 void glslopt_shader_delete (glslopt_shader* shader)
 {
-	delete shader;
+	if (shader && --shader->refCount == 0)
+		delete shader;
 }
 
 bool glslopt_get_status (glslopt_shader* shader)
@@ -760,6 +1931,24 @@ const char* glslopt_get_output (glslopt_shader* shader)
 	return shader->optimizedOutput;
 }
 
+size_t glslopt_get_output_size (glslopt_shader* shader)
+{
+	return shader->optimizedOutputSize;
+}
+
+static_assert (kIrFingerprintSize == kGlslOptFingerprintSize, "fingerprint size mismatch");
+
+const unsigned char* glslopt_shader_get_fingerprint (glslopt_shader* shader)
+{
+	return shader->hasFingerprint ? shader->fingerprint : NULL;
+}
+
+const void* glslopt_get_saved_ir (glslopt_shader* shader, size_t* outSize)
+{
+	*outSize = shader->savedIRSize;
+	return shader->savedIR;
+}
+
 const char* glslopt_get_raw_output (glslopt_shader* shader)
 {
 	return shader->rawOutput;
@@ -802,6 +1991,39 @@ void glslopt_shader_get_input_desc (glslopt_shader* shader, int index, const cha
 	*outLocation = v.location;
 }
 
+int glslopt_shader_get_removed_varying_count (glslopt_shader* shader)
+{
+	return shader->removedVaryingCount;
+}
+
+void glslopt_shader_get_removed_varying_desc (glslopt_shader* shader, int index, const char** outName, glslopt_basic_type* outType, glslopt_precision* outPrec, int* outVecSize, int* outMatSize, int* outArraySize, int* outLocation)
+{
+	const glslopt_shader_var& v = shader->removedVaryings[index];
+	*outName = v.name;
+	*outType = v.type;
+	*outPrec = v.prec;
+	*outVecSize = v.vectorSize;
+	*outMatSize = v.matrixSize;
+	*outArraySize = v.arraySize;
+	*outLocation = v.location;
+}
+
+int glslopt_shader_get_uniform_expression_count (glslopt_shader* shader)
+{
+	return shader->uniformExpressionCount;
+}
+
+void glslopt_shader_get_uniform_expression_desc (glslopt_shader* shader, int index, const char** outName, glslopt_basic_type* outType, glslopt_precision* outPrec, int* outVecSize, int* outMatSize, const char** outExpression)
+{
+	const glslopt_shader_var& v = shader->uniformExpressions[index];
+	*outName = v.name;
+	*outType = v.type;
+	*outPrec = v.prec;
+	*outVecSize = v.vectorSize;
+	*outMatSize = v.matrixSize;
+	*outExpression = shader->uniformExpressionSources[index];
+}
+
 void glslopt_shader_get_uniform_desc (glslopt_shader* shader, int index, const char** outName, glslopt_basic_type* outType, glslopt_precision* outPrec, int* outVecSize, int* outMatSize, int* outArraySize, int* outLocation)
 {
 	const glslopt_shader_var& v = shader->uniforms[index];
@@ -832,3 +2054,19 @@ void glslopt_shader_get_stats (glslopt_shader* shader, int* approxMath, int* app
 	*approxTex = shader->statsTex;
 	*approxFlow = shader->statsFlow;
 }
+
+void glslopt_shader_get_extended_stats (glslopt_shader* shader, glslopt_shader_stats* outStats)
+{
+	outStats->approxMath = shader->statsMath;
+	outStats->approxTex = shader->statsTex;
+	outStats->approxFlow = shader->statsFlow;
+	outStats->aluCost = shader->cost.alu;
+	outStats->textureCost = shader->cost.tex;
+	outStats->flowCost = shader->cost.flow;
+	outStats->textureLookups = shader->cost.textureLookups;
+	outStats->unknownLoops = shader->cost.unknownLoops;
+	outStats->fusedMultiplyAdds = shader->cost.fma;
+	outStats->dependentTextureReads = shader->cost.dependentTextureReads;
+	outStats->liveRegisters = shader->cost.liveRegisters;
+	outStats->liveRegistersUnscheduled = shader->cost.liveRegistersUnscheduled;
+}
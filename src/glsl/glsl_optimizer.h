@@ -21,6 +21,8 @@
  glslopt_cleanup (ctx);
 */
 
+#include <stddef.h>
+
 struct glslopt_shader;
 struct glslopt_ctx;
 
@@ -32,8 +34,15 @@ enum glslopt_shader_type {
 
 // Options flags for glsl_optimize
 enum glslopt_options {
-	kGlslOptionSkipPreprocessor = (1<<0), // Skip preprocessing shader source. Saves some time if you know you don't need it.
+	kGlslOptionSkipPreprocessor = (1<<0), // Skip preprocessing shader source. Saves some time if you know you don't need it. Done automatically for sources that don't need it.
 	kGlslOptionNotFullShader = (1<<1), // Passed shader is not the full shader source. This makes some optimizations weaker.
+	kGlslOptionSaveIR = (1<<2), // Keep a binary copy of the IR before optimization; see glslopt_get_saved_ir.
+	kGlslOptionRetainIR = (1<<3), // Keep a binary copy of the optimized IR, for glslopt_specialize.
+	kGlslOptionExtractUniformExpressions = (1<<4), // Replace expressions of uniforms only by new uniforms; see glslopt_shader_get_uniform_expression_desc.
+	kGlslOptionNormalizedTextures = (1<<5), // All textures hold normalized (UNORM) values, so samples are in [0,1]; lets clamps of them go.
+	kGlslOptionFastMath = (1<<6), // Allow float math to round differently: sums and products get reordered so constants fold and uniform parts can be extracted, and multiply-adds get fused into fma on targets that have it (Metal, GL_ARB_gpu_shader5).
+	kGlslOptionInferPrecision = (1<<7), // GLSL ES and Metal: declare locals mediump/lowp (half in Metal) where everything they hold, or every variable they are copied to, has that precision anyway. Normalized vectors count as mediump.
+	kGlslOptionScheduleForPressure = (1<<8), // Reorder assignments so that fewer registers are live at once; see glslopt_shader_stats::liveRegisters.
 };
 
 // Optimizer target language
@@ -68,19 +77,147 @@ glslopt_ctx* glslopt_initialize (glslopt_target target);
 void glslopt_cleanup (glslopt_ctx* ctx);
 
 void glslopt_set_max_unroll_iterations (glslopt_ctx* ctx, unsigned iterations);
+// Loops with a known iteration count that are too large to unroll fully get
+// their body repeated up to this many times per iteration instead, as long as
+// the code stays within the full unrolling size limit. Left over iterations run
+// in front of the loop. 0 or 1 (the default) turns partial unrolling off.
+void glslopt_set_unroll_factor (glslopt_ctx* ctx, unsigned factor);
+// Most varyings glslopt_optimize_program may add to hoist fragment shader code
+// into the vertex shader; 0 (the default) turns hoisting off.
+void glslopt_set_max_hoisted_varyings (glslopt_ctx* ctx, unsigned varyings);
+
+// Prelude: common code (macros, structs, uniforms, utility functions) that every
+// shader of the given type starts with. It is compiled once, and subsequent
+// glslopt_optimize calls for that type see its macros and declarations as if its
+// text preceded the shader source, without preprocessing or parsing it again.
+// Prelude functions are linked in only when called; this needs a full shader (no
+// kGlslOptionNotFullShader), with the same #version as the prelude.
+// Pass NULL source to remove the prelude. Returns false on compile errors.
+bool glslopt_set_prelude (glslopt_ctx* ctx, glslopt_shader_type type, const char* preludeSource);
+const char* glslopt_get_prelude_log (glslopt_ctx* ctx, glslopt_shader_type type);
+
+// Number of compiles on this context that skipped the preprocessor automatically,
+// because the source had nothing for it to do.
+unsigned glslopt_get_preprocessor_bypass_count (glslopt_ctx* ctx);
 
 glslopt_shader* glslopt_optimize (glslopt_ctx* ctx, glslopt_shader_type type, const char* shaderSource, unsigned options);
+
+// Streaming output: optimized output is handed to a sink in chunks while it is
+// printed, instead of being kept in the shader object. glslopt_get_output returns
+// NULL for such shaders; glslopt_get_output_size returns the total size.
+// Raw (unoptimized) output and reflection data are still available as usual.
+enum glslopt_sink_type {
+	kGlslSinkCallback = 0, // pass chunks to callback; it returns false to stop further output
+	kGlslSinkFileDescriptor, // write chunks to file descriptor fd
+	kGlslSinkSizeOnly, // don't write anything, only compute the output size
+};
+typedef bool (*glslopt_sink_callback) (const char* data, size_t size, void* userData);
+struct glslopt_sink {
+	glslopt_sink_type type;
+	glslopt_sink_callback callback;
+	void* userData;
+	int fd;
+};
+
+glslopt_shader* glslopt_optimize_to_sink (glslopt_ctx* ctx, glslopt_shader_type type, const char* shaderSource, unsigned options, const glslopt_sink* sink);
+size_t glslopt_get_output_size (glslopt_shader* shader);
+
+// Same as above, but the source is given by pointer and length and does not need
+// to be NUL terminated (e.g. a memory mapped file). It is not copied unless some
+// transformation (like line continuation removal) actually changes it. Pass NULL
+// sink to keep the output in the shader object like glslopt_optimize does.
+glslopt_shader* glslopt_optimize_buffer (glslopt_ctx* ctx, glslopt_shader_type type, const char* shaderSource, size_t shaderLength, unsigned options, const glslopt_sink* sink);
+
+// Variants: optimize one source under several sets of preprocessor defines.
+// defineSets[i] lists whitespace separated NAME or NAME=VALUE entries (like -D
+// compiler flags; NAME alone defines it as 1), and outShaders[i] receives the
+// result for it. Work is shared where possible: defines the source never
+// mentions are ignored, and variants with the same preprocessed source are
+// compiled once and get the same shader object. Call glslopt_shader_delete once
+// for each returned entry.
+void glslopt_optimize_variants (glslopt_ctx* ctx, glslopt_shader_type type, const char* shaderSource, const char* const* defineSets, unsigned variantCount, unsigned options, glslopt_shader** outShaders);
+
+// Saved IR: with kGlslOptionSaveIR, the shader keeps a compact binary copy of its
+// IR as it was right before optimization (i.e. after parsing and linking), along
+// with the parse state it depends on. It can be stored away, and later optimized
+// again (e.g. with another context or other options) without going through the
+// front end. glslopt_get_saved_ir returns NULL if there is none (not requested,
+// or compile failed). The data is owned by the shader.
+const void* glslopt_get_saved_ir (glslopt_shader* shader, size_t* outSize);
+// Optimizes saved IR, as glslopt_optimize would have optimized the source it
+// came from. Shader type comes from the IR; raw output is printed from the saved
+// (linked) IR. Fails with a log message on malformed or incompatible data.
+glslopt_shader* glslopt_optimize_ir (glslopt_ctx* ctx, const void* ir, size_t irSize, unsigned options);
+
+// Multiple targets: optimize one source for several contexts (usually with
+// different targets), as glslopt_optimize would in each of them; outShaders[i]
+// receives the result for contexts[i], and belongs to it. The front end runs
+// per context, since its output depends on the target (built-in variables,
+// available extensions); targets for which it produces the same IR share the
+// optimization work, as with e.g. GLES2 and GLES3 contexts and a #version 100
+// shader.
+void glslopt_optimize_targets (glslopt_ctx* const* contexts, unsigned count, glslopt_shader_type type, const char* shaderSource, unsigned options, glslopt_shader** outShaders);
+
+// Programs: optimize a vertex and a fragment shader together. On top of what
+// glslopt_optimize does for each, the stages get checked against each other, and
+// vertex outputs the fragment shader doesn't read are removed along with the
+// code computing them (built-in outputs are kept). Outputs that are constant,
+// or only depend on constants and uniforms, are computed in the fragment shader
+// instead and removed as well; for GLSL ES 1.00 that is only done when it needs
+// no highp uniforms the fragment shader doesn't have. Both shaders are returned,
+// and have to be deleted; when the stages don't match, both fail with the same
+// log. Has no cross-stage effect with kGlslOptionNotFullShader.
+// With glslopt_set_max_hoisted_varyings, affine functions of varyings in the
+// fragment shader (like uv * scale + offset, with uniform scale and offset) are
+// computed per vertex instead, and passed in new varyings; the expressions that
+// save the most fragment shader work go first.
+void glslopt_optimize_program (glslopt_ctx* ctx, const char* vertexSource, const char* fragmentSource, unsigned options, glslopt_shader** outVertex, glslopt_shader** outFragment);
+
+// Specialization: optimize a shader again with some of its uniforms replaced by
+// constants (e.g. quality toggles or light counts), so that branches and loops
+// depending on them fold away. The shader has to be compiled with
+// kGlslOptionRetainIR; specialization starts from its optimized IR, which is a
+// lot cheaper than compiling modified source. Bound uniforms are no longer
+// uniforms of the result. values holds one float per component (all elements
+// of an array, matrices column by column), converted for int and bool uniforms.
+// Fails with a log message for unknown uniforms and struct types.
+struct glslopt_uniform_binding {
+	const char* name;
+	const float* values;
+};
+glslopt_shader* glslopt_specialize (glslopt_ctx* ctx, glslopt_shader* shader, const glslopt_uniform_binding* bindings, unsigned bindingCount);
+
 bool glslopt_get_status (glslopt_shader* shader);
 const char* glslopt_get_output (glslopt_shader* shader);
 const char* glslopt_get_raw_output (glslopt_shader* shader);
 const char* glslopt_get_log (glslopt_shader* shader);
 void glslopt_shader_delete (glslopt_shader* shader);
 
+// Fingerprint of the optimized program: kGlslOptFingerprintSize bytes, the same
+// for shaders that optimize to identical IR (up to naming of compiler
+// temporaries), and so to identical output. Shaders of one context with the same
+// fingerprint share a single output buffer. NULL for shaders that failed to compile.
+enum { kGlslOptFingerprintSize = 16 };
+const unsigned char* glslopt_shader_get_fingerprint (glslopt_shader* shader);
+
 int glslopt_shader_get_input_count (glslopt_shader* shader);
 void glslopt_shader_get_input_desc (glslopt_shader* shader, int index, const char** outName, glslopt_basic_type* outType, glslopt_precision* outPrec, int* outVecSize, int* outMatSize, int* outArraySize, int* outLocation);
 int glslopt_shader_get_uniform_count (glslopt_shader* shader);
 int glslopt_shader_get_uniform_total_size (glslopt_shader* shader);
 void glslopt_shader_get_uniform_desc (glslopt_shader* shader, int index, const char** outName, glslopt_basic_type* outType, glslopt_precision* outPrec, int* outVecSize, int* outMatSize, int* outArraySize, int* outLocation);
+// Varyings removed from between the stages by glslopt_optimize_program; the
+// same on both shaders of the program. Location is always -1.
+int glslopt_shader_get_removed_varying_count (glslopt_shader* shader);
+void glslopt_shader_get_removed_varying_desc (glslopt_shader* shader, int index, const char** outName, glslopt_basic_type* outType, glslopt_precision* outPrec, int* outVecSize, int* outMatSize, int* outArraySize, int* outLocation);
+// Uniform expressions: with kGlslOptionExtractUniformExpressions, expressions
+// that only depend on uniforms and constants (like normalize(lightDir)) are
+// replaced by new uniforms, for the application to compute once per draw call
+// instead of per vertex or pixel. The new uniforms are named xlat_vs_uniformN or
+// xlat_fs_uniformN and are listed among the uniforms; outExpression is the GLSL
+// expression that computes each from the original uniforms (which are no longer
+// in the shader when nothing else reads them).
+int glslopt_shader_get_uniform_expression_count (glslopt_shader* shader);
+void glslopt_shader_get_uniform_expression_desc (glslopt_shader* shader, int index, const char** outName, glslopt_basic_type* outType, glslopt_precision* outPrec, int* outVecSize, int* outMatSize, const char** outExpression);
 int glslopt_shader_get_texture_count (glslopt_shader* shader);
 void glslopt_shader_get_texture_desc (glslopt_shader* shader, int index, const char** outName, glslopt_basic_type* outType, glslopt_precision* outPrec, int* outVecSize, int* outMatSize, int* outArraySize, int* outLocation);
 
@@ -88,5 +225,24 @@ void glslopt_shader_get_texture_desc (glslopt_shader* shader, int index, const c
 // Number of math, texture and flow control instructions.
 void glslopt_shader_get_stats (glslopt_shader* shader, int* approxMath, int* approxTex, int* approxFlow);
 
+// Estimated cost of one run of the shader (per vertex or pixel), from a cost
+// model of the context's target that weights each operation by its kind, vector
+// width and precision, and each texture lookup by its sampler type. Code in
+// loops counts once per iteration; both sides of a branch count. Costs are in
+// units of one full precision add.
+struct glslopt_shader_stats {
+	int approxMath, approxTex, approxFlow; // same as glslopt_shader_get_stats
+	float aluCost;
+	float textureCost;
+	float flowCost; // branches and loop iterations
+	float textureLookups; // number of lookups per run
+	bool unknownLoops; // some loops have no fixed iteration count; they count as 8
+	int fusedMultiplyAdds; // fma operations in the code, from kGlslOptionFastMath
+	int dependentTextureReads; // lookups whose coordinates come from other lookups, so they have to wait for those
+	int liveRegisters; // most vec4 registers that local variables take at once
+	int liveRegistersUnscheduled; // the same before kGlslOptionScheduleForPressure reordered assignments
+};
+void glslopt_shader_get_extended_stats (glslopt_shader* shader, glslopt_shader_stats* outStats);
+
 
 #endif /* GLSL_OPTIMIZER_H */
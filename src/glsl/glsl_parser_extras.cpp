@@ -79,6 +79,8 @@ _mesa_glsl_parse_state::_mesa_glsl_parse_state(struct gl_context *_ctx,
                             ctx->Const.ForceGLSLVersion : 110;
    this->es_shader = false;
    this->metal_target = false;
+   this->normalized_textures = false;
+   this->fast_math = false;
    this->had_version_string = false;
    this->had_float_precision = false;
    this->ARB_texture_rectangle_enable = true;
@@ -692,6 +694,34 @@ _mesa_glsl_process_extension(const char *name, YYLTYPE *name_locp,
 }
 
 
+const char *
+_mesa_glsl_get_extension_state(const _mesa_glsl_parse_state *state,
+			       unsigned index, bool *enabled, bool *warn)
+{
+   if (index >= Elements(_mesa_glsl_supported_extensions))
+      return NULL;
+
+   const _mesa_glsl_extension *extension = &_mesa_glsl_supported_extensions[index];
+   *enabled = state->*(extension->enable_flag);
+   *warn = state->*(extension->warn_flag);
+   return extension->name;
+}
+
+
+bool
+_mesa_glsl_set_extension_state(_mesa_glsl_parse_state *state, const char *name,
+			       bool enabled, bool warn)
+{
+   const _mesa_glsl_extension *extension = find_extension(name);
+   if (!extension)
+      return false;
+
+   extension->set_flags(state, !enabled ? extension_disable
+                               : warn ? extension_warn : extension_enable);
+   return true;
+}
+
+
 /**
  * Recurses through <type> and <expr> if <expr> is an aggregate initializer
  * and sets <expr>'s <constructor_type> field to <type>. Gives later functions
@@ -1452,15 +1482,17 @@ glslopt__mesa_glsl_compile_shader(struct gl_context *ctx, struct gl_shader *shad
    struct _mesa_glsl_parse_state *state =
       new(shader) _mesa_glsl_parse_state(ctx, shader->Stage, shader);
    const char *source = shader->Source;
+   size_t source_length = strlen(source);
 
    if (ctx->Const.GenerateTemporaryNames)
       ir_variable::temporaries_allocate_names = true;
 
-   state->error = !!glslopt_glcpp_preprocess(state, &source, &state->info_log,
-                             &ctx->Extensions, ctx);
+   state->error = !!glslopt_glcpp_preprocess(state, &source, &source_length,
+                             &state->info_log, &ctx->Extensions, ctx,
+                             NULL, NULL);
 
    if (!state->error) {
-     _mesa_glsl_lexer_ctor(state, source);
+     _mesa_glsl_lexer_ctor(state, source, source_length);
      _mesa_glsl_parse(state);
      _mesa_glsl_lexer_dtor(state);
    }
@@ -219,6 +219,8 @@ struct _mesa_glsl_parse_state {
 
    bool es_shader;
    bool metal_target;
+   bool normalized_textures;
+   bool fast_math;
    unsigned language_version;
    bool had_version_string;
    bool had_float_precision;
@@ -547,8 +549,9 @@ extern void _mesa_glsl_warning(const YYLTYPE *locp,
 			       _mesa_glsl_parse_state *state,
 			       const char *fmt, ...);
 
+/* The source does not need to be NUL terminated. */
 extern void _mesa_glsl_lexer_ctor(struct _mesa_glsl_parse_state *state,
-				  const char *string);
+				  const char *string, size_t length);
 
 extern void _mesa_glsl_lexer_dtor(struct _mesa_glsl_parse_state *state);
 
@@ -570,6 +573,28 @@ extern bool _mesa_glsl_process_extension(const char *name, YYLTYPE *name_locp,
 					 YYLTYPE *behavior_locp,
 					 _mesa_glsl_parse_state *state);
 
+/**
+ * Get the state of the extension at \c index in the table of supported
+ * extensions (used to save it along with serialized IR).
+ *
+ * \return
+ * The name of the extension, or \c NULL if \c index is past the end.
+ */
+extern const char *_mesa_glsl_get_extension_state(const _mesa_glsl_parse_state *state,
+						  unsigned index,
+						  bool *enabled, bool *warn);
+
+/**
+ * Set the state of the named extension, as if by an #extension directive,
+ * regardless of whether the context supports it.
+ *
+ * \return
+ * \c false if there is no such extension.
+ */
+extern bool _mesa_glsl_set_extension_state(_mesa_glsl_parse_state *state,
+					   const char *name,
+					   bool enabled, bool warn);
+
 #endif /* __cplusplus */
 
 
@@ -587,8 +612,28 @@ extern "C" {
 extern const char *
 glslopt__mesa_shader_stage_to_string(unsigned stage);
 
-extern int glslopt_glcpp_preprocess(void *ctx, const char **shader, char **info_log,
-                      const struct gl_extensions *extensions, struct gl_context *gl_ctx);
+/* Returns false if preprocessing the source would not change it. */
+extern bool glslopt_glcpp_needs_preprocessing(const char *shader, size_t length);
+
+struct glcpp_macro_set;
+
+extern unsigned glslopt_glcpp_macro_set_count(const struct glcpp_macro_set *set);
+
+/* Macros of both sets, those of b taking precedence. */
+extern struct glcpp_macro_set *glslopt_glcpp_macro_set_union(void *ctx,
+                      const struct glcpp_macro_set *a,
+                      const struct glcpp_macro_set *b);
+
+/* Takes a source of given length (not necessarily NUL terminated); on return
+ * *shader and *shader_length describe the preprocessed output.
+ * predefined macros may be NULL; if defined is not NULL, it receives the
+ * user macros defined at the end of the source.
+ */
+extern int glslopt_glcpp_preprocess(void *ctx, const char **shader, size_t *shader_length,
+                      char **info_log, const struct gl_extensions *extensions,
+                      struct gl_context *gl_ctx,
+                      const struct glcpp_macro_set *predefined,
+                      struct glcpp_macro_set **defined);
 
 extern void glslopt__mesa_destroy_shader_compiler(void);
 extern void glslopt__mesa_destroy_shader_compiler_caches(void);
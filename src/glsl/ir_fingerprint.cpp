@@ -0,0 +1,355 @@
+#include "ir_fingerprint.h"
+#include "glsl_types.h"
+#include "glsl_parser_extras.h"
+#include "ir_print_glsl_visitor.h"
+#include "program/hash_table.h"
+
+// Two independent 64 bit FNV-1a style lanes make up the 128 bit fingerprint.
+class ir_fingerprint_hasher {
+public:
+	ir_fingerprint_hasher()
+		: lane0(0xcbf29ce484222325ull)
+		, lane1(0x84222325cbf29ce4ull)
+		, var_count(0)
+	{
+		vars = glslopt_hash_table_ctor(0, glslopt_hash_table_pointer_hash, glslopt_hash_table_pointer_compare);
+	}
+	~ir_fingerprint_hasher()
+	{
+		glslopt_hash_table_dtor(vars);
+	}
+
+	void add_bytes(const void* data, size_t size)
+	{
+		const unsigned char* p = (const unsigned char*)data;
+		for (size_t i = 0; i < size; ++i)
+		{
+			lane0 = (lane0 ^ p[i]) * 0x100000001b3ull;
+			lane1 = (lane1 ^ p[i]) * 0x9e3779b97f4a7c15ull;
+			lane1 ^= lane1 >> 29;
+		}
+	}
+	void add_int(int v)
+	{
+		add_bytes(&v, sizeof(v));
+	}
+	void add_string(const char* s)
+	{
+		if (!s)
+			s = "";
+		add_bytes(s, strlen(s) + 1);
+	}
+
+	void add_type(const glsl_type* type);
+	void add_variable_ref(ir_variable* var);
+	void add_variable(ir_variable* var);
+	void add_constant(ir_constant* c);
+	void add_rvalue(ir_rvalue* ir);
+	void add(ir_instruction* ir);
+	void add_list(exec_list* list);
+
+	void finish(unsigned char out[kIrFingerprintSize])
+	{
+		for (unsigned i = 0; i < 8; ++i)
+		{
+			out[i] = (unsigned char)(lane0 >> (i * 8));
+			out[i + 8] = (unsigned char)(lane1 >> (i * 8));
+		}
+	}
+
+private:
+	unsigned long long lane0, lane1;
+	struct hash_table* vars;
+	unsigned var_count;
+};
+
+
+void ir_fingerprint_hasher::add_type(const glsl_type* type)
+{
+	if (!type)
+	{
+		add_int(-1);
+		return;
+	}
+	add_int(type->base_type);
+	add_int(type->vector_elements);
+	add_int(type->matrix_columns);
+	add_int(type->length);
+	add_string(type->name);
+	if (type->base_type == GLSL_TYPE_ARRAY)
+		add_type(type->fields.array);
+	else if (type->base_type == GLSL_TYPE_STRUCT || type->base_type == GLSL_TYPE_INTERFACE)
+	{
+		for (unsigned i = 0; i < type->length; ++i)
+		{
+			const glsl_struct_field& field = type->fields.structure[i];
+			add_string(field.name);
+			add_int(field.precision);
+			add_type(field.type);
+		}
+	}
+}
+
+
+// The first reference to a variable (usually its declaration) describes it;
+// later ones only refer to its order of appearance.
+void ir_fingerprint_hasher::add_variable_ref(ir_variable* var)
+{
+	uintptr_t id = (uintptr_t)glslopt_hash_table_find(vars, var);
+	if (id)
+	{
+		add_int((int)id);
+		return;
+	}
+	id = ++var_count;
+	glslopt_hash_table_insert(vars, (void*)id, var);
+	add_int(0);
+	add_int(var->data.mode);
+	add_int(var->data.precision);
+	add_type(var->type);
+	// temporaries get renamed when printed; everything else keeps its name
+	if (var->data.mode != ir_var_temporary)
+		add_string(var->name);
+}
+
+
+void ir_fingerprint_hasher::add_variable(ir_variable* var)
+{
+	add_variable_ref(var);
+	add_int(var->data.read_only);
+	add_int(var->data.centroid);
+	add_int(var->data.invariant);
+	add_int(var->data.interpolation);
+	add_int(var->data.origin_upper_left);
+	add_int(var->data.pixel_center_integer);
+	add_int(var->data.explicit_location);
+	add_int(var->data.location);
+	add_int(var->data.used);
+	add_int(var->data.assigned);
+	add_rvalue(var->constant_value);
+}
+
+
+void ir_fingerprint_hasher::add_constant(ir_constant* c)
+{
+	add_type(c->type);
+	add_int(c->get_precision());
+	if (c->type->base_type == GLSL_TYPE_ARRAY)
+	{
+		for (unsigned i = 0; i < c->type->length; ++i)
+			add_constant(c->array_elements[i]);
+	}
+	else if (c->type->base_type == GLSL_TYPE_STRUCT)
+	{
+		foreach_in_list(ir_constant, field, &c->components)
+			add_constant(field);
+	}
+	else
+	{
+		const unsigned n = c->type->components();
+		for (unsigned i = 0; i < n; ++i)
+		{
+			switch (c->type->base_type)
+			{
+			case GLSL_TYPE_BOOL: add_int(c->value.b[i]); break;
+			default: add_bytes(&c->value.u[i], sizeof(c->value.u[i])); break;
+			}
+		}
+	}
+}
+
+
+void ir_fingerprint_hasher::add_rvalue(ir_rvalue* ir)
+{
+	if (!ir)
+	{
+		add_int(-1);
+		return;
+	}
+	add(ir);
+}
+
+
+void ir_fingerprint_hasher::add_list(exec_list* list)
+{
+	add_int(-2);
+	foreach_in_list(ir_instruction, ir, list)
+		add(ir);
+	add_int(-3);
+}
+
+
+void ir_fingerprint_hasher::add(ir_instruction* ir)
+{
+	add_int(ir->ir_type);
+	switch (ir->ir_type)
+	{
+	case ir_type_dereference_array:
+	{
+		ir_dereference_array* deref = (ir_dereference_array*)ir;
+		add_int(deref->get_precision());
+		add_rvalue(deref->array);
+		add_rvalue(deref->array_index);
+		break;
+	}
+	case ir_type_dereference_record:
+	{
+		ir_dereference_record* deref = (ir_dereference_record*)ir;
+		add_int(deref->get_precision());
+		add_rvalue(deref->record);
+		add_string(deref->field);
+		break;
+	}
+	case ir_type_dereference_variable:
+	{
+		ir_dereference_variable* deref = (ir_dereference_variable*)ir;
+		add_int(deref->get_precision());
+		add_variable_ref(deref->var);
+		break;
+	}
+	case ir_type_constant:
+		add_constant((ir_constant*)ir);
+		break;
+	case ir_type_expression:
+	{
+		ir_expression* expr = (ir_expression*)ir;
+		add_int(expr->operation);
+		add_int(expr->get_precision());
+		add_type(expr->type);
+		const unsigned n = expr->get_num_operands();
+		for (unsigned i = 0; i < n; ++i)
+			add_rvalue(expr->operands[i]);
+		break;
+	}
+	case ir_type_swizzle:
+	{
+		ir_swizzle* swz = (ir_swizzle*)ir;
+		add_int(swz->get_precision());
+		add_int(swz->mask.num_components);
+		add_int(swz->mask.x | (swz->mask.y << 2) | (swz->mask.z << 4) | (swz->mask.w << 6));
+		add_rvalue(swz->val);
+		break;
+	}
+	case ir_type_texture:
+	{
+		ir_texture* tex = (ir_texture*)ir;
+		add_int(tex->op);
+		add_int(tex->get_precision());
+		add_type(tex->type);
+		add_rvalue(tex->sampler);
+		add_rvalue(tex->coordinate);
+		add_rvalue(tex->offset);
+		switch (tex->op)
+		{
+		case ir_tex:
+		case ir_lod:
+		case ir_query_levels:
+			break;
+		case ir_txb: add_rvalue(tex->lod_info.bias); break;
+		case ir_txl:
+		case ir_txf:
+		case ir_txs: add_rvalue(tex->lod_info.lod); break;
+		case ir_txf_ms: add_rvalue(tex->lod_info.sample_index); break;
+		case ir_tg4: add_rvalue(tex->lod_info.component); break;
+		case ir_txd:
+			add_rvalue(tex->lod_info.grad.dPdx);
+			add_rvalue(tex->lod_info.grad.dPdy);
+			break;
+		}
+		break;
+	}
+	case ir_type_variable:
+		add_variable((ir_variable*)ir);
+		break;
+	case ir_type_assignment:
+	{
+		ir_assignment* ass = (ir_assignment*)ir;
+		add_int(ass->write_mask);
+		add_rvalue(ass->lhs);
+		add_rvalue(ass->rhs);
+		add_rvalue(ass->condition);
+		break;
+	}
+	case ir_type_call:
+	{
+		ir_call* call = (ir_call*)ir;
+		add_string(call->callee_name());
+		foreach_in_list(ir_variable, param, &call->callee->parameters)
+			add_type(param->type);
+		add_rvalue(call->return_deref);
+		add_list(&call->actual_parameters);
+		break;
+	}
+	case ir_type_function:
+	{
+		ir_function* func = (ir_function*)ir;
+		add_string(func->name);
+		add_list(&func->signatures);
+		break;
+	}
+	case ir_type_function_signature:
+	{
+		ir_function_signature* sig = (ir_function_signature*)ir;
+		add_type(sig->return_type);
+		add_int(sig->precision);
+		add_int(sig->is_defined);
+		add_list(&sig->parameters);
+		add_list(&sig->body);
+		break;
+	}
+	case ir_type_if:
+	{
+		ir_if* iff = (ir_if*)ir;
+		add_rvalue(iff->condition);
+		add_list(&iff->then_instructions);
+		add_list(&iff->else_instructions);
+		break;
+	}
+	case ir_type_loop:
+		add_list(&((ir_loop*)ir)->body_instructions);
+		break;
+	case ir_type_loop_jump:
+		add_int(((ir_loop_jump*)ir)->mode);
+		break;
+	case ir_type_return:
+		add_rvalue(((ir_return*)ir)->value);
+		break;
+	case ir_type_precision:
+		add_string(((ir_precision_statement*)ir)->precision_statement);
+		break;
+	case ir_type_typedecl:
+		add_type(((ir_typedecl_statement*)ir)->type_decl);
+		break;
+	case ir_type_discard:
+		add_rvalue(((ir_discard*)ir)->condition);
+		break;
+	case ir_type_emit_vertex:
+		add_rvalue(((ir_emit_vertex*)ir)->stream);
+		break;
+	case ir_type_end_primitive:
+		add_rvalue(((ir_end_primitive*)ir)->stream);
+		break;
+	default:
+		break;
+	}
+}
+
+
+void calculate_ir_fingerprint(exec_list* instructions, _mesa_glsl_parse_state* state, unsigned char outFingerprint[kIrFingerprintSize])
+{
+	ir_fingerprint_hasher h;
+
+	// state the printers look at
+	h.add_int(state->stage);
+	h.add_int(state->language_version);
+	h.add_int(state->es_shader);
+	h.add_int(state->metal_target);
+	h.add_int(state->had_version_string);
+	h.add_int(state->had_float_precision);
+#define HASH_EXTENSION(name, condition) h.add_int(state->name##_enable);
+	GLSL_PRINTED_EXTENSIONS(HASH_EXTENSION)
+#undef HASH_EXTENSION
+
+	h.add_list(instructions);
+	h.finish(outFingerprint);
+}
@@ -0,0 +1,12 @@
+#pragma once
+
+#include "ir.h"
+
+struct _mesa_glsl_parse_state;
+
+static const unsigned kIrFingerprintSize = 16;
+
+// Structural hash of a shader's IR, plus the bits of parse state that affect how
+// it gets printed. Compiler temporaries are identified by order of appearance
+// rather than name, so programs that only differ in those hash the same.
+void calculate_ir_fingerprint(exec_list* instructions, _mesa_glsl_parse_state* state, unsigned char outFingerprint[kIrFingerprintSize]);
@@ -0,0 +1,327 @@
+/**
+ * \file ir_liveness.cpp
+ *
+ * Live variable analysis.
+ *
+ * The IR has no goto, so instead of building a control flow graph this
+ * walks the code backwards: both branches of an if start out with what is
+ * live after it, a break with what is live after its loop, and a continue
+ * with what is live at the top of the loop.  Loops go round until that
+ * stops growing.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include "ir_liveness.h"
+#include "ir_hierarchical_visitor.h"
+#include "glsl_types.h"
+#include "program/hash_table.h"
+
+struct liveness_analysis::loop_context {
+   const unsigned *break_live;
+   const unsigned *continue_live;
+};
+
+namespace {
+
+bool
+is_local(const ir_variable *var)
+{
+   return var->data.mode == ir_var_auto || var->data.mode == ir_var_temporary;
+}
+
+
+/** Numbers the local variables, for the sets to be bitsets. */
+class variable_numberer : public ir_hierarchical_visitor {
+public:
+   variable_numberer(hash_table *indices, void *mem_ctx)
+      : indices(indices), mem_ctx(mem_ctx), variables(NULL), num_variables(0)
+   {
+   }
+
+   virtual ir_visitor_status visit(ir_variable *ir)
+   {
+      if (!is_local(ir) || glslopt_hash_table_find(this->indices, ir))
+         return visit_continue;
+
+      this->variables = reralloc(this->mem_ctx, this->variables,
+                                 ir_variable *, this->num_variables + 1);
+      this->variables[this->num_variables++] = ir;
+      glslopt_hash_table_insert(this->indices,
+                                (void *) (uintptr_t) this->num_variables, ir);
+      return visit_continue;
+   }
+
+   hash_table *indices;
+   void *mem_ctx;
+   ir_variable **variables;
+   unsigned num_variables;
+};
+
+
+void
+set_live(hash_table *indices, unsigned *set, ir_variable *var, bool live)
+{
+   const uintptr_t index = (uintptr_t) glslopt_hash_table_find(indices, var);
+   if (index == 0)
+      return;
+
+   if (live)
+      set[(index - 1) / 32] |= 1u << ((index - 1) % 32);
+   else
+      set[(index - 1) / 32] &= ~(1u << ((index - 1) % 32));
+}
+
+
+class read_visitor : public ir_hierarchical_visitor {
+public:
+   read_visitor(hash_table *indices, unsigned *live)
+      : indices(indices), live(live)
+   {
+   }
+
+   virtual ir_visitor_status visit(ir_dereference_variable *ir)
+   {
+      set_live(this->indices, this->live, ir->var, true);
+      return visit_continue;
+   }
+
+   hash_table *indices;
+   unsigned *live;
+};
+
+} /* unnamed namespace */
+
+
+unsigned
+variable_registers(const ir_variable *var)
+{
+   if (!is_local(var))
+      return 0;
+
+   const glsl_type *type = var->type;
+   unsigned elements = 1;
+   while (type->is_array()) {
+      elements *= MAX2(type->length, 1u);
+      type = type->fields.array;
+   }
+   if (type->is_record())
+      return elements * ((type->component_slots() + 3) / 4);
+   return elements * MAX2(type->matrix_columns, 1u);
+}
+
+
+liveness_analysis::liveness_analysis(exec_list *instructions)
+   : max_registers(0)
+{
+   this->mem_ctx = glslopt_ralloc_context(NULL);
+   this->indices = glslopt_hash_table_ctor(0, glslopt_hash_table_pointer_hash,
+                                           glslopt_hash_table_pointer_compare);
+   this->live_after = glslopt_hash_table_ctor(0,
+                                              glslopt_hash_table_pointer_hash,
+                                              glslopt_hash_table_pointer_compare);
+
+   variable_numberer numberer(this->indices, this->mem_ctx);
+   numberer.run(instructions);
+   this->variables = numberer.variables;
+   this->num_variables = numberer.num_variables;
+   this->num_words = (this->num_variables + 31) / 32;
+
+   unsigned *const live = new_set();
+   analyze_list(instructions, live, NULL);
+}
+
+
+liveness_analysis::~liveness_analysis()
+{
+   glslopt_hash_table_dtor(this->live_after);
+   glslopt_hash_table_dtor(this->indices);
+   glslopt_ralloc_free(this->mem_ctx);
+}
+
+
+bool
+liveness_analysis::is_live_after(ir_instruction *ir, ir_variable *var)
+{
+   const unsigned *const live =
+      (const unsigned *) glslopt_hash_table_find(this->live_after, ir);
+   return live != NULL && has_bit(live, var);
+}
+
+
+unsigned *
+liveness_analysis::new_set()
+{
+   return rzalloc_array(this->mem_ctx, unsigned, this->num_words + 1);
+}
+
+
+unsigned *
+liveness_analysis::copy_set(const unsigned *set)
+{
+   unsigned *const copy = ralloc_array(this->mem_ctx, unsigned,
+                                       this->num_words + 1);
+   memcpy(copy, set, (this->num_words + 1) * sizeof(unsigned));
+   return copy;
+}
+
+
+bool
+liveness_analysis::has_bit(const unsigned *set, ir_variable *var)
+{
+   const uintptr_t index =
+      (uintptr_t) glslopt_hash_table_find(this->indices, var);
+   return index != 0 && (set[(index - 1) / 32] & (1u << ((index - 1) % 32)));
+}
+
+
+void
+liveness_analysis::add_reads(unsigned *live, ir_instruction *ir)
+{
+   if (ir == NULL)
+      return;
+
+   read_visitor v(this->indices, live);
+   ir->accept(&v);
+}
+
+
+/** An assignment to an array element or field reads the indices. */
+void
+liveness_analysis::add_lhs_reads(unsigned *live, ir_dereference *lhs)
+{
+   for (;;) {
+      ir_dereference_array *const array = lhs->as_dereference_array();
+      if (array != NULL) {
+         add_reads(live, array->array_index);
+         lhs = array->array->as_dereference();
+         continue;
+      }
+      ir_dereference_record *const record = lhs->as_dereference_record();
+      if (record != NULL) {
+         lhs = record->record->as_dereference();
+         continue;
+      }
+      return;
+   }
+}
+
+
+void
+liveness_analysis::measure(const unsigned *live, ir_variable *written)
+{
+   unsigned registers = 0;
+   for (unsigned i = 0; i < this->num_variables; i++) {
+      if ((live[i / 32] & (1u << (i % 32))) || this->variables[i] == written)
+         registers += variable_registers(this->variables[i]);
+   }
+   this->max_registers = MAX2(this->max_registers, registers);
+}
+
+
+/** Turns the set live after a list into the one live before it. */
+void
+liveness_analysis::analyze_list(exec_list *list, unsigned *live,
+                                loop_context *loop)
+{
+   foreach_in_list_reverse(ir_instruction, ir, list) {
+      glslopt_hash_table_replace(this->live_after, copy_set(live), ir);
+      analyze(ir, live, loop);
+   }
+}
+
+
+void
+liveness_analysis::analyze(ir_instruction *ir, unsigned *live,
+                           loop_context *loop)
+{
+   switch (ir->ir_type) {
+   case ir_type_assignment: {
+      ir_assignment *const assign = (ir_assignment *) ir;
+      ir_variable *const var = assign->lhs->variable_referenced();
+      measure(live, var);
+      if (assign->condition == NULL && assign->whole_variable_written())
+         set_live(this->indices, live, var, false);
+      add_lhs_reads(live, assign->lhs);
+      add_reads(live, assign->rhs);
+      add_reads(live, assign->condition);
+      measure(live, NULL);
+      break;
+   }
+
+   case ir_type_if: {
+      ir_if *const branch = (ir_if *) ir;
+      unsigned *const else_live = copy_set(live);
+      analyze_list(&branch->then_instructions, live, loop);
+      analyze_list(&branch->else_instructions, else_live, loop);
+      for (unsigned i = 0; i <= this->num_words; i++)
+         live[i] |= else_live[i];
+      add_reads(live, branch->condition);
+      break;
+   }
+
+   case ir_type_loop: {
+      ir_loop *const body = (ir_loop *) ir;
+      unsigned *const head = new_set();
+      unsigned *const after = copy_set(live);
+      loop_context inner = { after, head };
+
+      /* Live sets only grow, so this ends. */
+      bool changed;
+      do {
+         memcpy(live, head, (this->num_words + 1) * sizeof(unsigned));
+         analyze_list(&body->body_instructions, live, &inner);
+         changed = false;
+         for (unsigned i = 0; i <= this->num_words; i++) {
+            changed |= (live[i] & ~head[i]) != 0;
+            head[i] |= live[i];
+         }
+      } while (changed);
+      memcpy(live, head, (this->num_words + 1) * sizeof(unsigned));
+      break;
+   }
+
+   case ir_type_loop_jump: {
+      ir_loop_jump *const jump = (ir_loop_jump *) ir;
+      if (loop == NULL)
+         break;
+      memcpy(live, jump->is_break() ? loop->break_live : loop->continue_live,
+             (this->num_words + 1) * sizeof(unsigned));
+      break;
+   }
+
+   case ir_type_return:
+      memset(live, 0, (this->num_words + 1) * sizeof(unsigned));
+      add_reads(live, ((ir_return *) ir)->value);
+      break;
+
+   case ir_type_discard: {
+      ir_discard *const discard = (ir_discard *) ir;
+      if (discard->condition == NULL)
+         memset(live, 0, (this->num_words + 1) * sizeof(unsigned));
+      add_reads(live, discard->condition);
+      break;
+   }
+
+   case ir_type_call: {
+      ir_call *const call = (ir_call *) ir;
+      measure(live, NULL);
+      foreach_in_list(ir_rvalue, param, &call->actual_parameters)
+         add_reads(live, param);
+      measure(live, NULL);
+      break;
+   }
+
+   case ir_type_function:
+      foreach_in_list(ir_function_signature, sig,
+                      &((ir_function *) ir)->signatures) {
+         unsigned *const body_live = new_set();
+         analyze_list(&sig->body, body_live, NULL);
+      }
+      break;
+
+   default:
+      add_reads(live, ir);
+      break;
+   }
+}
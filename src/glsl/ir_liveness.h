@@ -0,0 +1,60 @@
+/**
+ * \file ir_liveness.h
+ *
+ * Which local variables are live where, and how many registers that takes.
+ */
+
+#pragma once
+
+#include "ir.h"
+
+struct hash_table;
+
+/**
+ * Registers a variable takes up, in units of vec4: one per vector or matrix
+ * column, for each array element.  Uniforms, inputs and outputs don't live
+ * in temporary registers and take none.
+ */
+unsigned variable_registers(const ir_variable *var);
+
+/**
+ * Backward live variable analysis over structured code.  A variable is live
+ * from the assignments to it up to the last read of what they wrote; only a
+ * whole, unconditional assignment ends a live range, so arrays and variables
+ * written one component at a time stay live in between.
+ */
+class liveness_analysis {
+public:
+   liveness_analysis(exec_list *instructions);
+   ~liveness_analysis();
+
+   /** Whether var is still read after a statement ran. */
+   bool is_live_after(ir_instruction *ir, ir_variable *var);
+
+   /**
+    * Most registers the live variables take at once, at any statement.  A
+    * statement needs the register it writes to, even if nothing reads it.
+    */
+   unsigned max_registers;
+
+   /** Only used while analyzing. */
+   struct loop_context;
+
+private:
+   unsigned *new_set();
+   unsigned *copy_set(const unsigned *set);
+   void add_reads(unsigned *live, ir_instruction *ir);
+   void add_lhs_reads(unsigned *live, ir_dereference *lhs);
+   bool has_bit(const unsigned *set, ir_variable *var);
+   void measure(const unsigned *live, ir_variable *written);
+
+   void analyze_list(exec_list *list, unsigned *live, loop_context *loop);
+   void analyze(ir_instruction *ir, unsigned *live, loop_context *loop);
+
+   struct hash_table *indices;
+   struct hash_table *live_after;
+   ir_variable **variables;
+   unsigned num_variables;
+   unsigned num_words;
+   void *mem_ctx;
+};
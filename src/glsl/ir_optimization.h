@@ -72,7 +72,7 @@ bool do_common_optimization(exec_list *ir, bool linked,
                             const struct gl_shader_compiler_options *options,
                             bool native_integers);
 
-bool do_rebalance_tree(exec_list *instructions);
+bool do_rebalance_tree(exec_list *instructions, bool reassociate = false);
 bool do_algebraic(exec_list *instructions, bool native_integers,
                   const struct gl_shader_compiler_options *options);
 bool do_constant_folding(exec_list *instructions);
@@ -87,10 +87,16 @@ void do_dead_builtin_varyings(struct gl_context *ctx,
                               unsigned num_tfeedback_decls,
                               class tfeedback_decl *tfeedback_decls);
 bool do_dead_code(exec_list *instructions, bool uniform_locations_assigned);
+unsigned do_hoist_affine_varyings(gl_shader *producer, gl_shader *consumer,
+                                  bool es_precision, unsigned max_varyings);
 bool do_dead_code_local(exec_list *instructions);
 bool do_dead_code_unlinked(exec_list *instructions);
 bool do_dead_functions(exec_list *instructions);
 bool opt_flip_matrices(exec_list *instructions);
+unsigned do_extract_uniform_expressions(exec_list *instructions,
+                                        const char *prefix,
+                                        unsigned max_count,
+                                        exec_list *extracted);
 bool do_function_inlining(exec_list *instructions);
 bool do_lower_jumps(exec_list *instructions, bool pull_out_jumps = true, bool lower_sub_return = true, bool lower_main_return = false, bool lower_continue = false, bool lower_break = false);
 bool do_if_simplification(exec_list *instructions);
@@ -98,11 +104,16 @@ bool opt_flatten_nested_if_blocks(exec_list *instructions);
 bool do_discard_simplification(exec_list *instructions);
 bool lower_if_to_cond_assign(exec_list *instructions, unsigned max_depth = 0);
 bool do_mat_op_to_vec(exec_list *instructions);
-bool do_minmax_prune(exec_list *instructions);
+bool do_minmax_prune(exec_list *instructions, bool normalized_textures = false);
 bool do_noop_swizzle(exec_list *instructions);
 bool do_structure_splitting(exec_list *instructions);
 bool do_swizzle_swizzle(exec_list *instructions);
 bool do_vectorize(exec_list *instructions);
+bool do_slp_vectorize(exec_list *instructions);
+bool do_fuse_multiply_add(exec_list *instructions);
+bool do_infer_precision(exec_list *instructions);
+bool do_merge_texture_fetches(exec_list *instructions);
+bool do_schedule_for_pressure(exec_list *instructions);
 bool do_tree_grafting(exec_list *instructions);
 bool do_vec_index_to_cond_assign(exec_list *instructions);
 bool do_vec_index_to_swizzle(exec_list *instructions);
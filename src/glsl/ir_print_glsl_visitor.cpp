@@ -23,6 +23,7 @@
 
 #include "ir_print_glsl_visitor.h"
 #include "ir_visitor.h"
+#include "ir_hierarchical_visitor.h"
 #include "glsl_types.h"
 #include "glsl_parser_extras.h"
 #include "ir_unused_structs.h"
@@ -212,10 +213,27 @@ void print_texlod_workarounds(int usage_bitfield, int usage_proj_bitfield, strin
 }
 
 
+// Finds out whether any fma() is left to print.
+class fma_finder : public ir_hierarchical_visitor {
+public:
+	fma_finder() : found(false) {}
+
+	virtual ir_visitor_status visit_enter(ir_expression* ir)
+	{
+		if (ir->operation != ir_triop_fma)
+			return visit_continue;
+		found = true;
+		return visit_stop;
+	}
+
+	bool found;
+};
+
+
 char*
 _mesa_print_ir_glsl(exec_list *instructions,
 	    struct _mesa_glsl_parse_state *state,
-		char* buffer, PrintGlslMode mode)
+		char* buffer, PrintGlslMode mode, string_sink* sink)
 {
 	string_buffer str(buffer);
 	string_buffer body(buffer);
@@ -229,33 +247,14 @@ _mesa_print_ir_glsl(exec_list *instructions,
 				str.asprintf_append (" es");
 			str.asprintf_append ("\n");
 		}
-		if (state->ARB_shader_texture_lod_enable)
-			str.asprintf_append ("#extension GL_ARB_shader_texture_lod : enable\n");
-		if (state->ARB_draw_instanced_enable)
-			str.asprintf_append ("#extension GL_ARB_draw_instanced : enable\n");
-		if (state->EXT_gpu_shader4_enable)
-			str.asprintf_append ("#extension GL_EXT_gpu_shader4 : enable\n");
-		if (state->EXT_shader_texture_lod_enable)
-			str.asprintf_append ("#extension GL_EXT_shader_texture_lod : enable\n");
-		if (state->OES_standard_derivatives_enable)
-			str.asprintf_append ("#extension GL_OES_standard_derivatives : enable\n");
-		if (state->EXT_shadow_samplers_enable)
-			str.asprintf_append ("#extension GL_EXT_shadow_samplers : enable\n");
-		if (state->EXT_frag_depth_enable)
-			str.asprintf_append ("#extension GL_EXT_frag_depth : enable\n");
-		if (state->es_shader && state->language_version < 300)
-		{
-			if (state->EXT_draw_buffers_enable)
-				str.asprintf_append ("#extension GL_EXT_draw_buffers : enable\n");
-			if (state->EXT_draw_instanced_enable)
-				str.asprintf_append ("#extension GL_EXT_draw_instanced : enable\n");
-		}
-		if (state->EXT_shader_framebuffer_fetch_enable)
-			str.asprintf_append ("#extension GL_EXT_shader_framebuffer_fetch : enable\n");
-		if (state->ARB_shader_bit_encoding_enable)
-			str.asprintf_append("#extension GL_ARB_shader_bit_encoding : enable\n");
-		if (state->EXT_texture_array_enable)
-			str.asprintf_append ("#extension GL_EXT_texture_array : enable\n");
+		fma_finder fma;
+		fma.run(instructions);
+		const bool uses_fma = fma.found;
+#define PRINT_EXTENSION(name, condition) \
+		if (state->name##_enable && (condition)) \
+			str.asprintf_append ("#extension GL_" #name " : enable\n");
+		GLSL_PRINTED_EXTENSIONS(PRINT_EXTENSION)
+#undef PRINT_EXTENSION
 	}
 	
 	// remove unused struct declarations
@@ -269,6 +268,15 @@ _mesa_print_ir_glsl(exec_list *instructions,
 	if (ls->loop_found)
 		set_loop_controls(instructions, ls);
 
+	// When streaming, the header is complete at this point; send it out and
+	// stream the body right after it instead of concatenating the two.
+	if (sink)
+	{
+		str.set_sink(sink);
+		str.flush();
+		body.set_sink(sink);
+	}
+
 	foreach_in_list(ir_instruction, ir, instructions)
 	{
 		if (ir->ir_type == ir_type_variable) {
@@ -295,13 +303,31 @@ _mesa_print_ir_glsl(exec_list *instructions,
 	print_texlod_workarounds(uses_texlod_impl, uses_texlodproj_impl, str);
 #endif // 0
 	
+	if (sink)
+	{
+		body.flush();
+		return NULL;
+	}
+
 	// Add the optimized glsl code
-	str.asprintf_append("%s", body.c_str());
+	str.append(body);
 
 	return glslopt_ralloc_strdup(buffer, str.c_str());
 }
 
 
+char*
+_mesa_print_ir_glsl_expression(ir_rvalue *ir,
+	const struct _mesa_glsl_parse_state *state, void* mem_ctx)
+{
+	string_buffer str(mem_ctx);
+	global_print_tracker gtracker;
+	ir_print_glsl_visitor v (str, &gtracker, kPrintGlslNone, false, state);
+	ir->accept(&v);
+	return glslopt_ralloc_strdup(mem_ctx, str.c_str());
+}
+
+
 void ir_print_glsl_visitor::indent(void)
 {
 	if (previous_skipped)
@@ -34,21 +34,63 @@ enum PrintGlslMode {
 	kPrintGlslFragment,
 };
 
+class string_sink;
+
+// Prints a single rvalue as a GLSL expression, without precision qualifiers.
+extern char* _mesa_print_ir_glsl_expression(ir_rvalue *ir,
+			const struct _mesa_glsl_parse_state *state, void* mem_ctx);
+
+// When sink is not NULL, output is written to it in chunks and NULL is returned.
 extern char* _mesa_print_ir_glsl(exec_list *instructions,
 			struct _mesa_glsl_parse_state *state,
-			char* buf, PrintGlslMode mode);
+			char* buf, PrintGlslMode mode, string_sink* sink = NULL);
 
+// Extensions _mesa_print_ir_glsl enables in the output, in printing order, as
+// EXT(name, condition): GL_<name> is enabled when the source enabled it
+// (state-><name>_enable) and the condition holds; uses_fma tells whether the
+// output calls fma().  Anything that caches printed output has to tell apart
+// all of the _enable flags listed here.
+#define GLSL_PRINTED_EXTENSIONS(EXT) \
+	EXT(ARB_shader_texture_lod, true) \
+	EXT(ARB_draw_instanced, true) \
+	EXT(EXT_gpu_shader4, true) \
+	EXT(ARB_gpu_shader5, uses_fma) \
+	EXT(EXT_shader_texture_lod, true) \
+	EXT(OES_standard_derivatives, true) \
+	EXT(EXT_shadow_samplers, true) \
+	EXT(EXT_frag_depth, true) \
+	EXT(EXT_draw_buffers, state->es_shader && state->language_version < 300) \
+	EXT(EXT_draw_instanced, state->es_shader && state->language_version < 300) \
+	EXT(EXT_shader_framebuffer_fetch, true) \
+	EXT(ARB_shader_bit_encoding, true) \
+	EXT(EXT_texture_array, true)
+
+
+// Consumer of printed output, fed in chunks by string_buffer.
+// write() returns false if the data could not be consumed; further output is dropped then.
+class string_sink
+{
+public:
+	virtual ~string_sink() {}
+	virtual bool write(const char* data, size_t size) = 0;
+};
 
 
 class string_buffer
 {
 public:
+	// Accumulated text is handed to the sink (if any) once it grows past this size.
+	static const size_t kSinkChunkSize = 16 * 1024;
+
 	string_buffer(void* mem_ctx)
 	{
 		m_Capacity = 512;
 		m_Ptr = (char*)glslopt_ralloc_size(mem_ctx, m_Capacity);
 		m_Size = 0;
 		m_Ptr[0] = 0;
+		m_Sink = NULL;
+		m_SinkFailed = false;
+		m_Flushed = 0;
 	}
 	
 	~string_buffer()
@@ -56,9 +98,43 @@ public:
 		glslopt_ralloc_free(m_Ptr);
 	}
 	
-	bool empty() const { return m_Size == 0; }
+	bool empty() const { return m_Size == 0 && m_Flushed == 0; }
 	
+	// Only the part not yet flushed to the sink.
 	const char* c_str() const { return m_Ptr; }
+
+	// Total number of characters printed, including the ones already flushed.
+	size_t size() const { return m_Flushed + m_Size; }
+
+	void set_sink(string_sink* sink) { m_Sink = sink; }
+	bool sink_failed() const { return m_SinkFailed; }
+
+	void flush()
+	{
+		if (!m_Sink || m_Size == 0)
+			return;
+		if (!m_SinkFailed && !m_Sink->write(m_Ptr, m_Size))
+			m_SinkFailed = true;
+		m_Flushed += m_Size;
+		m_Size = 0;
+		m_Ptr[0] = 0;
+	}
+
+	void append(const char* str, size_t len)
+	{
+		assert (m_Ptr != NULL);
+		reserve(m_Size + len + 1);
+		memcpy(m_Ptr + m_Size, str, len);
+		m_Size += len;
+		m_Ptr[m_Size] = 0;
+		if (m_Sink && m_Size >= kSinkChunkSize)
+			flush();
+	}
+
+	void append(const string_buffer& other)
+	{
+		append(other.m_Ptr, other.m_Size);
+	}
 	
 	void asprintf_append(const char *fmt, ...) PRINTFLIKE(2, 3)
 	{
@@ -79,23 +155,31 @@ public:
 		assert (m_Ptr != NULL);
 		
 		size_t new_length = glslopt_printf_length(fmt, args);
-		size_t needed_length = m_Size + new_length + 1;
-		
-		if (m_Capacity < needed_length)
-		{
-			m_Capacity = MAX2 (m_Capacity + m_Capacity/2, needed_length);
-			m_Ptr = (char*)glslopt_reralloc_size(glslopt_ralloc_parent(m_Ptr), m_Ptr, m_Capacity);
-		}
+		reserve(m_Size + new_length + 1);
 		
 		vsnprintf(m_Ptr + m_Size, new_length+1, fmt, args);
 		m_Size += new_length;
 		assert (m_Capacity >= m_Size);
+		if (m_Sink && m_Size >= kSinkChunkSize)
+			flush();
 	}
 	
 private:
+	void reserve(size_t needed_length)
+	{
+		if (m_Capacity < needed_length)
+		{
+			m_Capacity = MAX2 (m_Capacity + m_Capacity/2, needed_length);
+			m_Ptr = (char*)glslopt_reralloc_size(glslopt_ralloc_parent(m_Ptr), m_Ptr, m_Capacity);
+		}
+	}
+
 	char* m_Ptr;
 	size_t m_Size;
 	size_t m_Capacity;
+	string_sink* m_Sink;
+	size_t m_Flushed;
+	bool m_SinkFailed;
 };
 
 
@@ -205,7 +205,7 @@ public:
 char*
 _mesa_print_ir_metal(exec_list *instructions,
 	    struct _mesa_glsl_parse_state *state,
-		char* buffer, PrintGlslMode mode, int* outUniformsSize)
+		char* buffer, PrintGlslMode mode, int* outUniformsSize, string_sink* sink)
 {
 	metal_print_context ctx(buffer);
 
@@ -337,13 +337,28 @@ _mesa_print_ir_metal(exec_list *instructions,
 	}
 
 
-	ctx.prefixStr.asprintf_append("%s", ctx.inputStr.c_str());
-	ctx.prefixStr.asprintf_append("%s", ctx.outputStr.c_str());
-	ctx.prefixStr.asprintf_append("%s", ctx.uniformStr.c_str());
-	ctx.prefixStr.asprintf_append("%s", ctx.str.c_str());
-
 	*outUniformsSize = ctx.uniformLocationCounter;
 
+	// Struct sections are only complete after the whole body is printed, so
+	// streaming can't start earlier; but at least don't concatenate them.
+	if (sink)
+	{
+		string_buffer* sections[] = { &ctx.prefixStr, &ctx.inputStr, &ctx.outputStr, &ctx.uniformStr, &ctx.str };
+		for (unsigned i = 0; i < sizeof(sections)/sizeof(sections[0]); ++i)
+		{
+			sections[i]->set_sink(sink);
+			sections[i]->flush();
+			if (sections[i]->sink_failed())
+				break;
+		}
+		return NULL;
+	}
+
+	ctx.prefixStr.append(ctx.inputStr);
+	ctx.prefixStr.append(ctx.outputStr);
+	ctx.prefixStr.append(ctx.uniformStr);
+	ctx.prefixStr.append(ctx.str);
+
 	return glslopt_ralloc_strdup(buffer, ctx.prefixStr.c_str());
 }
 
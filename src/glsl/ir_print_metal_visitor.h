@@ -31,6 +31,6 @@
 
 extern char* _mesa_print_ir_metal(exec_list *instructions,
 			struct _mesa_glsl_parse_state *state,
-			char* buf, PrintGlslMode mode, int* outUniformsSize);
+			char* buf, PrintGlslMode mode, int* outUniformsSize, string_sink* sink = NULL);
 
 #endif /* IR_PRINT_GLSL_VISITOR_H */
@@ -0,0 +1,1211 @@
+#include "ir_serialize.h"
+#include "glsl_types.h"
+#include "glsl_parser_extras.h"
+#include "program/hash_table.h"
+
+// Layout: header (magic, format version), parse state, then the top level
+// instruction list. Integers are stored as LEB128 varints;
+// references to types, variables and signatures are 0 for NULL, 1 for "new,
+// definition follows", and index+2 for one seen before.
+
+static const unsigned char kIrMagic[4] = { 'G', 'L', 'I', 'R' };
+static const unsigned kIrFormatVersion = 1;
+
+enum {
+	kRefNull = 0,
+	kRefNew = 1,
+	kRefFirst = 2,
+};
+
+enum {
+	kTypeBuiltin = 0,
+	kTypeArray,
+	kTypeRecord,
+	kTypeInterface,
+};
+
+static const unsigned kNullNode = 0xFF;
+
+// Unsigned fields of ir_variable::data, stored one by one: its bitfields have no
+// portable layout, and its padding would make the bytes differ between runs.
+// The extension warning only matters while converting source to IR, and state
+// slots are stored on their own.
+#define IR_VARIABLE_DATA_FIELDS(F) \
+	F(read_only) F(centroid) F(sample) F(invariant) F(precise) F(used) F(assigned) \
+	F(how_declared) F(mode) F(interpolation) F(precision) F(origin_upper_left) \
+	F(pixel_center_integer) F(explicit_location) F(explicit_index) F(explicit_binding) \
+	F(has_initializer) F(is_unmatched_generic_inout) F(location_frac) F(matrix_layout) \
+	F(from_named_ifc_block_nonarray) F(from_named_ifc_block_array) \
+	F(must_be_shader_input) F(index) F(image_read_only) F(image_write_only) \
+	F(image_coherent) F(image_volatile) F(image_restrict) F(image_format) F(stream) \
+	F(atomic.offset) F(max_array_access)
+
+
+static const glsl_type* find_builtin_type(const char* name)
+{
+#define DECL_TYPE(NAME, ...) if (!strcmp(name, #NAME)) return glsl_type::NAME##_type;
+#define STRUCT_TYPE(NAME)
+#include "builtin_type_macros.h"
+#undef DECL_TYPE
+#undef STRUCT_TYPE
+	return NULL;
+}
+
+
+// Built-in signatures keep a non-NULL availability predicate, since that is what
+// marks them as built-in; they were available when the IR got serialized.
+static bool serialized_builtin_available(const _mesa_glsl_parse_state*)
+{
+	return true;
+}
+
+
+// --------------------------------------------------------------------------
+// Writing
+
+
+class ir_serializer {
+public:
+	ir_serializer(void* mem_ctx)
+		: mem_ctx(mem_ctx)
+		, data(NULL)
+		, size(0)
+		, capacity(0)
+		, type_count(0)
+		, var_count(0)
+		, sig_count(0)
+	{
+		types = glslopt_hash_table_ctor(0, glslopt_hash_table_pointer_hash, glslopt_hash_table_pointer_compare);
+		vars = glslopt_hash_table_ctor(0, glslopt_hash_table_pointer_hash, glslopt_hash_table_pointer_compare);
+		sigs = glslopt_hash_table_ctor(0, glslopt_hash_table_pointer_hash, glslopt_hash_table_pointer_compare);
+	}
+	~ir_serializer()
+	{
+		glslopt_hash_table_dtor(types);
+		glslopt_hash_table_dtor(vars);
+		glslopt_hash_table_dtor(sigs);
+	}
+
+	void write_bytes(const void* src, size_t n)
+	{
+		if (size + n > capacity)
+		{
+			capacity = MAX2(capacity * 2, size + n + 256);
+			data = reralloc(mem_ctx, data, unsigned char, capacity);
+		}
+		memcpy(data + size, src, n);
+		size += n;
+	}
+	void write_uint(unsigned v)
+	{
+		unsigned char buf[5];
+		unsigned n = 0;
+		do
+		{
+			buf[n] = v & 0x7F;
+			v >>= 7;
+			if (v)
+				buf[n] |= 0x80;
+			++n;
+		} while (v);
+		write_bytes(buf, n);
+	}
+	void write_int(int v)
+	{
+		write_uint(((unsigned)v << 1) ^ (unsigned)(v >> 31));
+	}
+	void write_string(const char* s)
+	{
+		if (!s)
+		{
+			write_uint(0);
+			return;
+		}
+		const size_t len = strlen(s);
+		write_uint((unsigned)len + 1);
+		write_bytes(s, len);
+	}
+
+	void write_type(const glsl_type* type);
+	void write_variable(ir_variable* var);
+	void write_signature(ir_function_signature* sig);
+	void write_constant(ir_constant* c);
+	void write_rvalue(ir_rvalue* ir);
+	void write_instruction(ir_instruction* ir);
+	void write_list(exec_list* list);
+
+	void* mem_ctx;
+	unsigned char* data;
+	size_t size, capacity;
+
+private:
+	// Writes a reference; returns true if the object is new and its definition has to follow.
+	bool write_ref(struct hash_table* table, unsigned* count, const void* ptr)
+	{
+		if (!ptr)
+		{
+			write_uint(kRefNull);
+			return false;
+		}
+		uintptr_t id = (uintptr_t)glslopt_hash_table_find(table, ptr);
+		if (id)
+		{
+			write_uint((unsigned)id - 1 + kRefFirst);
+			return false;
+		}
+		id = ++*count;
+		glslopt_hash_table_insert(table, (void*)id, ptr);
+		write_uint(kRefNew);
+		return true;
+	}
+
+	struct hash_table* types;
+	struct hash_table* vars;
+	struct hash_table* sigs;
+	unsigned type_count, var_count, sig_count;
+};
+
+
+void ir_serializer::write_type(const glsl_type* type)
+{
+	// types are numbered after their definition, i.e. after the types it refers to
+	if (!type)
+	{
+		write_uint(kRefNull);
+		return;
+	}
+	if (uintptr_t id = (uintptr_t)glslopt_hash_table_find(types, type))
+	{
+		write_uint((unsigned)id - 1 + kRefFirst);
+		return;
+	}
+	write_uint(kRefNew);
+
+	switch (type->base_type)
+	{
+	case GLSL_TYPE_ARRAY:
+		write_uint(kTypeArray);
+		write_type(type->fields.array);
+		write_uint(type->length);
+		break;
+	case GLSL_TYPE_STRUCT:
+	case GLSL_TYPE_INTERFACE:
+		write_uint(type->base_type == GLSL_TYPE_STRUCT ? kTypeRecord : kTypeInterface);
+		write_string(type->name);
+		if (type->base_type == GLSL_TYPE_INTERFACE)
+			write_uint(type->interface_packing);
+		write_uint(type->length);
+		for (unsigned i = 0; i < type->length; ++i)
+		{
+			const glsl_struct_field& field = type->fields.structure[i];
+			write_string(field.name);
+			write_type(field.type);
+			write_uint(field.precision);
+			write_int(field.location);
+			write_uint(field.interpolation);
+			write_uint(field.centroid);
+			write_uint(field.sample);
+			write_uint(field.matrix_layout);
+			write_int(field.stream);
+		}
+		break;
+	default:
+		write_uint(kTypeBuiltin);
+		write_string(type->name);
+		break;
+	}
+	glslopt_hash_table_insert(types, (void*)(uintptr_t)++type_count, type);
+}
+
+
+void ir_serializer::write_variable(ir_variable* var)
+{
+	if (!write_ref(vars, &var_count, var))
+		return;
+
+	write_string(var->is_name_ralloced() ? var->name : NULL);
+	write_type(var->type);
+#define WRITE_FIELD(f) write_uint(var->data.f);
+	IR_VARIABLE_DATA_FIELDS(WRITE_FIELD)
+#undef WRITE_FIELD
+	write_uint(var->data.depth_layout);
+	write_int(var->data.binding);
+	write_int(var->data.location);
+	write_rvalue(var->constant_value);
+	write_rvalue(var->constant_initializer);
+	write_type(var->get_interface_type());
+	if (var->is_interface_instance())
+	{
+		const unsigned* access = var->get_max_ifc_array_access();
+		for (unsigned i = 0; i < var->get_interface_type()->length; ++i)
+			write_uint(access ? access[i] : 0);
+	}
+	else
+	{
+		const ir_state_slot* slots = var->get_state_slots();
+		write_uint(var->get_num_state_slots());
+		for (unsigned i = 0; i < var->get_num_state_slots(); ++i)
+		{
+			for (unsigned j = 0; j < Elements(slots[i].tokens); ++j)
+				write_int(slots[i].tokens[j]);
+			write_int(slots[i].swizzle);
+		}
+	}
+}
+
+
+void ir_serializer::write_signature(ir_function_signature* sig)
+{
+	if (!write_ref(sigs, &sig_count, sig))
+		return;
+
+	write_string(sig->function_name());
+	write_type(sig->return_type);
+	write_uint(sig->precision);
+	write_uint(sig->is_defined);
+	write_uint(sig->is_intrinsic);
+	write_uint(sig->is_builtin());
+	write_list(&sig->parameters);
+}
+
+
+void ir_serializer::write_constant(ir_constant* c)
+{
+	write_type(c->type);
+	if (c->type->is_array())
+	{
+		for (unsigned i = 0; i < c->type->length; ++i)
+			write_rvalue(c->array_elements[i]);
+	}
+	else if (c->type->is_record())
+	{
+		foreach_in_list(ir_constant, field, &c->components)
+			write_rvalue(field);
+	}
+	else
+	{
+		const unsigned n = c->type->components();
+		for (unsigned i = 0; i < n; ++i)
+		{
+			if (c->type->base_type == GLSL_TYPE_BOOL)
+				write_uint(c->value.b[i]);
+			else
+				write_bytes(&c->value.u[i], sizeof(c->value.u[i]));
+		}
+	}
+}
+
+
+void ir_serializer::write_rvalue(ir_rvalue* ir)
+{
+	if (!ir)
+	{
+		write_uint(kNullNode);
+		return;
+	}
+	write_instruction(ir);
+}
+
+
+void ir_serializer::write_list(exec_list* list)
+{
+	unsigned count = 0;
+	foreach_in_list(ir_instruction, ir, list)
+		++count;
+	write_uint(count);
+	foreach_in_list(ir_instruction, ir, list)
+		write_instruction(ir);
+}
+
+
+void ir_serializer::write_instruction(ir_instruction* ir)
+{
+	write_uint(ir->ir_type);
+	if (ir_rvalue* rv = ir->as_rvalue())
+		write_uint(rv->get_precision());
+
+	switch (ir->ir_type)
+	{
+	case ir_type_dereference_array:
+	{
+		ir_dereference_array* deref = (ir_dereference_array*)ir;
+		write_rvalue(deref->array);
+		write_rvalue(deref->array_index);
+		break;
+	}
+	case ir_type_dereference_record:
+	{
+		ir_dereference_record* deref = (ir_dereference_record*)ir;
+		write_rvalue(deref->record);
+		write_string(deref->field);
+		break;
+	}
+	case ir_type_dereference_variable:
+		write_variable(((ir_dereference_variable*)ir)->var);
+		break;
+	case ir_type_constant:
+		write_constant((ir_constant*)ir);
+		break;
+	case ir_type_expression:
+	{
+		ir_expression* expr = (ir_expression*)ir;
+		write_uint(expr->operation);
+		write_type(expr->type);
+		const unsigned n = expr->get_num_operands();
+		write_uint(n);
+		for (unsigned i = 0; i < n; ++i)
+			write_rvalue(expr->operands[i]);
+		break;
+	}
+	case ir_type_swizzle:
+	{
+		ir_swizzle* swz = (ir_swizzle*)ir;
+		write_rvalue(swz->val);
+		write_uint(swz->mask.num_components);
+		write_uint(swz->mask.x | (swz->mask.y << 2) | (swz->mask.z << 4) | (swz->mask.w << 6));
+		write_uint(swz->mask.has_duplicates);
+		break;
+	}
+	case ir_type_texture:
+	{
+		ir_texture* tex = (ir_texture*)ir;
+		write_uint(tex->op);
+		write_type(tex->type);
+		write_rvalue(tex->sampler);
+		write_rvalue(tex->coordinate);
+		write_rvalue(tex->offset);
+		switch (tex->op)
+		{
+		case ir_tex:
+		case ir_lod:
+		case ir_query_levels:
+			break;
+		case ir_txb: write_rvalue(tex->lod_info.bias); break;
+		case ir_txl:
+		case ir_txf:
+		case ir_txs: write_rvalue(tex->lod_info.lod); break;
+		case ir_txf_ms: write_rvalue(tex->lod_info.sample_index); break;
+		case ir_tg4: write_rvalue(tex->lod_info.component); break;
+		case ir_txd:
+			write_rvalue(tex->lod_info.grad.dPdx);
+			write_rvalue(tex->lod_info.grad.dPdy);
+			break;
+		}
+		break;
+	}
+	case ir_type_variable:
+		write_variable((ir_variable*)ir);
+		break;
+	case ir_type_assignment:
+	{
+		ir_assignment* ass = (ir_assignment*)ir;
+		write_uint(ass->write_mask);
+		write_rvalue(ass->lhs);
+		write_rvalue(ass->rhs);
+		write_rvalue(ass->condition);
+		break;
+	}
+	case ir_type_call:
+	{
+		ir_call* call = (ir_call*)ir;
+		write_signature(call->callee);
+		write_rvalue(call->return_deref);
+		write_list(&call->actual_parameters);
+		break;
+	}
+	case ir_type_function:
+	{
+		ir_function* func = (ir_function*)ir;
+		write_string(func->name);
+		write_uint(func->signatures.length());
+		foreach_in_list(ir_function_signature, sig, &func->signatures)
+		{
+			write_signature(sig);
+			write_list(&sig->body);
+		}
+		break;
+	}
+	case ir_type_if:
+	{
+		ir_if* iff = (ir_if*)ir;
+		write_rvalue(iff->condition);
+		write_list(&iff->then_instructions);
+		write_list(&iff->else_instructions);
+		break;
+	}
+	case ir_type_loop:
+		write_list(&((ir_loop*)ir)->body_instructions);
+		break;
+	case ir_type_loop_jump:
+		write_uint(((ir_loop_jump*)ir)->mode);
+		break;
+	case ir_type_return:
+		write_rvalue(((ir_return*)ir)->value);
+		break;
+	case ir_type_precision:
+		write_string(((ir_precision_statement*)ir)->precision_statement);
+		break;
+	case ir_type_typedecl:
+		write_type(((ir_typedecl_statement*)ir)->type_decl);
+		break;
+	case ir_type_discard:
+		write_rvalue(((ir_discard*)ir)->condition);
+		break;
+	case ir_type_emit_vertex:
+		write_rvalue(((ir_emit_vertex*)ir)->stream);
+		break;
+	case ir_type_end_primitive:
+		write_rvalue(((ir_end_primitive*)ir)->stream);
+		break;
+	default:
+		assert(!"unexpected IR node when serializing");
+		break;
+	}
+}
+
+
+unsigned char* serialize_ir(void* mem_ctx, exec_list* instructions, const _mesa_glsl_parse_state* state, size_t* outSize)
+{
+	ir_serializer s(mem_ctx);
+
+	s.write_bytes(kIrMagic, sizeof(kIrMagic));
+	s.write_uint(kIrFormatVersion);
+
+	s.write_uint(state->stage);
+	s.write_uint(state->language_version);
+	s.write_uint(state->es_shader);
+	s.write_uint(state->had_version_string);
+	s.write_uint(state->had_float_precision);
+	const char* name;
+	bool enabled, warn;
+	unsigned enabledCount = 0;
+	for (unsigned i = 0; (name = _mesa_glsl_get_extension_state(state, i, &enabled, &warn)) != NULL; ++i)
+		enabledCount += enabled;
+	s.write_uint(enabledCount);
+	for (unsigned i = 0; (name = _mesa_glsl_get_extension_state(state, i, &enabled, &warn)) != NULL; ++i)
+	{
+		if (!enabled)
+			continue;
+		s.write_string(name);
+		s.write_uint(warn);
+	}
+
+	s.write_list(instructions);
+
+	*outSize = s.size;
+	return s.data;
+}
+
+
+// --------------------------------------------------------------------------
+// Reading
+//
+// All reads are bounds checked; after the first failure they return zeroes, and
+// nodes don't get created anymore, so the caller only has to look at the result.
+
+
+class ir_deserializer {
+public:
+	ir_deserializer(void* mem_ctx, const void* data, size_t size)
+		: mem_ctx(mem_ctx)
+		, cur((const unsigned char*)data)
+		, end((const unsigned char*)data + size)
+		, failed(false)
+		, types(NULL), vars(NULL), sigs(NULL)
+		, type_count(0), var_count(0), sig_count(0)
+		, type_capacity(0), var_capacity(0), sig_capacity(0)
+	{
+	}
+
+	bool read_bytes(void* dst, size_t n)
+	{
+		if (failed || (size_t)(end - cur) < n)
+		{
+			failed = true;
+			memset(dst, 0, n);
+			return false;
+		}
+		memcpy(dst, cur, n);
+		cur += n;
+		return true;
+	}
+	unsigned read_uint()
+	{
+		unsigned v = 0;
+		for (unsigned shift = 0; shift < 35; shift += 7)
+		{
+			unsigned char b;
+			if (!read_bytes(&b, 1))
+				return 0;
+			v |= (unsigned)(b & 0x7F) << shift;
+			if (!(b & 0x80))
+				return v;
+		}
+		failed = true;
+		return 0;
+	}
+	unsigned read_uint(unsigned limit)
+	{
+		unsigned v = read_uint();
+		if (v > limit)
+		{
+			failed = true;
+			return 0;
+		}
+		return v;
+	}
+	int read_int()
+	{
+		unsigned v = read_uint();
+		return (int)(v >> 1) ^ -(int)(v & 1);
+	}
+	// Returns a NUL terminated copy in mem_ctx, or NULL.
+	const char* read_string()
+	{
+		unsigned len = read_uint();
+		if (len == 0 || failed)
+			return NULL;
+		--len;
+		if ((size_t)(end - cur) < len)
+		{
+			failed = true;
+			return NULL;
+		}
+		char* s = ralloc_array(mem_ctx, char, len + 1);
+		memcpy(s, cur, len);
+		s[len] = 0;
+		cur += len;
+		return s;
+	}
+
+	const glsl_type* read_type();
+	ir_variable* read_variable();
+	ir_function_signature* read_signature();
+	ir_constant* read_constant(glsl_precision precision);
+	ir_rvalue* read_rvalue();
+	ir_dereference* read_dereference();
+	ir_instruction* read_instruction();
+	void read_list(exec_list* list, bool rvalues);
+
+	void* mem_ctx;
+	const unsigned char* cur;
+	const unsigned char* end;
+	bool failed;
+
+private:
+	// Reads a reference: returns the known object, or NULL with *isNew set when the
+	// definition follows (the caller then adds it with add_ref).
+	template <typename T>
+	T* read_ref(T** table, unsigned count, bool* isNew)
+	{
+		*isNew = false;
+		unsigned ref = read_uint();
+		if (failed || ref == kRefNull)
+			return NULL;
+		if (ref == kRefNew)
+		{
+			*isNew = true;
+			return NULL;
+		}
+		if (ref - kRefFirst >= count)
+		{
+			failed = true;
+			return NULL;
+		}
+		return table[ref - kRefFirst];
+	}
+	template <typename T>
+	void add_ref(T*** table, unsigned* count, unsigned* capacity, T* ptr)
+	{
+		if (*count == *capacity)
+		{
+			*capacity = MAX2(*capacity * 2, 16u);
+			*table = reralloc(mem_ctx, *table, T*, *capacity);
+		}
+		(*table)[(*count)++] = ptr;
+	}
+
+	const glsl_type** types;
+	ir_variable** vars;
+	ir_function_signature** sigs;
+	unsigned type_count, var_count, sig_count;
+	unsigned type_capacity, var_capacity, sig_capacity;
+};
+
+
+const glsl_type* ir_deserializer::read_type()
+{
+	bool isNew;
+	const glsl_type* type = read_ref(types, type_count, &isNew);
+	if (!isNew)
+		return type;
+
+	const unsigned tag = read_uint();
+	switch (tag)
+	{
+	case kTypeBuiltin:
+	{
+		const char* name = read_string();
+		if (name)
+			type = find_builtin_type(name);
+		break;
+	}
+	case kTypeArray:
+	{
+		const glsl_type* element = read_type();
+		const unsigned length = read_uint();
+		if (element && !failed)
+			type = glsl_type::get_array_instance(element, length);
+		break;
+	}
+	case kTypeRecord:
+	case kTypeInterface:
+	{
+		const bool isInterface = tag == kTypeInterface;
+		const char* name = read_string();
+		const unsigned packing = isInterface ? read_uint(GLSL_INTERFACE_PACKING_PACKED) : 0;
+		const unsigned length = read_uint((unsigned)(end - cur));
+		if (failed)
+			break;
+		glsl_struct_field* fields = ralloc_array(mem_ctx, glsl_struct_field, length);
+		for (unsigned i = 0; i < length; ++i)
+		{
+			fields[i].name = read_string();
+			fields[i].type = read_type();
+			fields[i].precision = (glsl_precision)read_uint(glsl_precision_undefined);
+			fields[i].location = read_int();
+			fields[i].interpolation = read_uint();
+			fields[i].centroid = read_uint();
+			fields[i].sample = read_uint();
+			fields[i].matrix_layout = read_uint();
+			fields[i].stream = read_int();
+			if (!fields[i].name || !fields[i].type)
+				failed = true;
+			if (failed)
+				return NULL;
+		}
+		if (!name)
+			failed = true;
+		else if (isInterface)
+			type = glsl_type::get_interface_instance(fields, length, (glsl_interface_packing)packing, name);
+		else
+			type = glsl_type::get_record_instance(fields, length, name);
+		break;
+	}
+	default:
+		failed = true;
+		break;
+	}
+
+	if (!type)
+	{
+		failed = true;
+		return NULL;
+	}
+	add_ref(&types, &type_count, &type_capacity, type);
+	return type;
+}
+
+
+ir_variable* ir_deserializer::read_variable()
+{
+	bool isNew;
+	ir_variable* var = read_ref(vars, var_count, &isNew);
+	if (!isNew)
+		return var;
+
+	const char* name = read_string();
+	const glsl_type* type = read_type();
+	ir_variable::ir_variable_data data;
+	memset(&data, 0, sizeof(data));
+#define READ_FIELD(f) data.f = read_uint();
+	IR_VARIABLE_DATA_FIELDS(READ_FIELD)
+#undef READ_FIELD
+	data.depth_layout = (ir_depth_layout)read_uint();
+	data.binding = read_int();
+	data.location = read_int();
+	if (failed || !type)
+	{
+		failed = true;
+		return NULL;
+	}
+	if (!name && data.mode != ir_var_temporary && data.mode != ir_var_function_in && data.mode != ir_var_function_out && data.mode != ir_var_function_inout)
+	{
+		failed = true;
+		return NULL;
+	}
+
+	// registered before the constants, which can't refer back to it anyway
+	var = new(mem_ctx) ir_variable(type, name, (ir_variable_mode)data.mode, (glsl_precision)data.precision);
+	add_ref(&vars, &var_count, &var_capacity, var);
+	var->data = data;
+
+	ir_rvalue* value = read_rvalue();
+	ir_rvalue* initializer = read_rvalue();
+	var->constant_value = value ? value->as_constant() : NULL;
+	var->constant_initializer = initializer ? initializer->as_constant() : NULL;
+	if ((value && !var->constant_value) || (initializer && !var->constant_initializer))
+		failed = true;
+
+	const glsl_type* ifcType = read_type();
+	if (failed)
+		return NULL;
+	if (ifcType != var->get_interface_type())
+	{
+		if (!ifcType)
+		{
+			failed = true;
+			return NULL;
+		}
+		if (var->get_interface_type())
+			var->change_interface_type(ifcType);
+		else
+			var->init_interface_type(ifcType);
+	}
+	if (var->is_interface_instance())
+	{
+		unsigned* access = var->get_max_ifc_array_access();
+		for (unsigned i = 0; i < ifcType->length; ++i)
+		{
+			const unsigned v = read_uint();
+			if (access)
+				access[i] = v;
+		}
+	}
+	else if (const unsigned slotCount = read_uint((unsigned)(end - cur)))
+	{
+		ir_state_slot* slots = var->allocate_state_slots(slotCount);
+		for (unsigned i = 0; i < slotCount; ++i)
+		{
+			for (unsigned j = 0; j < Elements(slots[i].tokens); ++j)
+				slots[i].tokens[j] = read_int();
+			slots[i].swizzle = read_int();
+		}
+	}
+	return failed ? NULL : var;
+}
+
+
+ir_function_signature* ir_deserializer::read_signature()
+{
+	bool isNew;
+	ir_function_signature* sig = read_ref(sigs, sig_count, &isNew);
+	if (!isNew)
+		return sig;
+
+	const char* name = read_string();
+	const glsl_type* returnType = read_type();
+	const glsl_precision precision = (glsl_precision)read_uint(glsl_precision_undefined);
+	const bool isDefined = read_uint() != 0;
+	const bool isIntrinsic = read_uint() != 0;
+	const bool isBuiltin = read_uint() != 0;
+	if (failed || !name || !returnType)
+	{
+		failed = true;
+		return NULL;
+	}
+
+	sig = new(mem_ctx) ir_function_signature(returnType, precision, isBuiltin ? serialized_builtin_available : NULL);
+	sig->is_defined = isDefined;
+	sig->is_intrinsic = isIntrinsic;
+	// Until the ir_function that owns it comes up (if ever), the signature
+	// lives in a function of its own, so that it always has a name.
+	ir_function* func = new(mem_ctx) ir_function(name);
+	func->add_signature(sig);
+	add_ref(&sigs, &sig_count, &sig_capacity, sig);
+
+	read_list(&sig->parameters, false);
+	foreach_in_list(ir_instruction, param, &sig->parameters)
+	{
+		if (param->ir_type != ir_type_variable)
+			failed = true;
+	}
+	return failed ? NULL : sig;
+}
+
+
+ir_constant* ir_deserializer::read_constant(glsl_precision precision)
+{
+	const glsl_type* type = read_type();
+	if (failed)
+		return NULL;
+
+	if (type->is_array() || type->is_record())
+	{
+		exec_list values;
+		const unsigned count = type->length;
+		for (unsigned i = 0; i < count; ++i)
+		{
+			ir_rvalue* value = read_rvalue();
+			if (!value || !value->as_constant())
+			{
+				failed = true;
+				return NULL;
+			}
+			values.push_tail(value);
+		}
+		ir_constant* c = new(mem_ctx) ir_constant(type, &values);
+		c->set_precision(precision);
+		return c;
+	}
+
+	if (!type->is_scalar() && !type->is_vector() && !type->is_matrix())
+	{
+		failed = true;
+		return NULL;
+	}
+	ir_constant_data data;
+	memset(&data, 0, sizeof(data));
+	const unsigned n = type->components();
+	for (unsigned i = 0; i < n; ++i)
+	{
+		if (type->base_type == GLSL_TYPE_BOOL)
+			data.b[i] = read_uint() != 0;
+		else
+			read_bytes(&data.u[i], sizeof(data.u[i]));
+	}
+	if (failed)
+		return NULL;
+	return new(mem_ctx) ir_constant(type, &data, precision);
+}
+
+
+ir_rvalue* ir_deserializer::read_rvalue()
+{
+	ir_instruction* ir = read_instruction();
+	if (!ir)
+		return NULL;
+	ir_rvalue* rv = ir->as_rvalue();
+	if (!rv)
+		failed = true;
+	return rv;
+}
+
+
+ir_dereference* ir_deserializer::read_dereference()
+{
+	ir_rvalue* rv = read_rvalue();
+	if (!rv)
+		return NULL;
+	ir_dereference* deref = rv->as_dereference();
+	if (!deref)
+		failed = true;
+	return deref;
+}
+
+
+void ir_deserializer::read_list(exec_list* list, bool rvalues)
+{
+	const unsigned count = read_uint((unsigned)(end - cur));
+	for (unsigned i = 0; i < count && !failed; ++i)
+	{
+		ir_instruction* ir = rvalues ? read_rvalue() : read_instruction();
+		if (!ir)
+		{
+			failed = true;
+			return;
+		}
+		list->push_tail(ir);
+	}
+}
+
+
+ir_instruction* ir_deserializer::read_instruction()
+{
+	const unsigned irType = read_uint();
+	if (failed || irType == kNullNode)
+		return NULL;
+	if (irType >= ir_type_max || irType == ir_type_function_signature)
+	{
+		failed = true;
+		return NULL;
+	}
+
+	glsl_precision precision = glsl_precision_undefined;
+	if (irType <= ir_type_texture)
+		precision = (glsl_precision)read_uint(glsl_precision_undefined);
+
+	ir_instruction* result = NULL;
+	switch (irType)
+	{
+	case ir_type_dereference_array:
+	{
+		ir_rvalue* array = read_rvalue();
+		ir_rvalue* index = read_rvalue();
+		if (array && index && !failed)
+			result = new(mem_ctx) ir_dereference_array(array, index);
+		break;
+	}
+	case ir_type_dereference_record:
+	{
+		ir_rvalue* record = read_rvalue();
+		const char* field = read_string();
+		if (record && field && !failed)
+			result = new(mem_ctx) ir_dereference_record(record, field);
+		break;
+	}
+	case ir_type_dereference_variable:
+	{
+		ir_variable* var = read_variable();
+		if (var && !failed)
+			result = new(mem_ctx) ir_dereference_variable(var);
+		break;
+	}
+	case ir_type_constant:
+		result = read_constant(precision);
+		break;
+	case ir_type_expression:
+	{
+		const unsigned op = read_uint(ir_last_opcode);
+		const glsl_type* type = read_type();
+		const unsigned n = read_uint(4);
+		ir_rvalue* operands[4] = { NULL, NULL, NULL, NULL };
+		for (unsigned i = 0; i < n; ++i)
+		{
+			operands[i] = read_rvalue();
+			if (!operands[i])
+				failed = true;
+		}
+		if (type && !failed)
+			result = new(mem_ctx) ir_expression(op, type, operands[0], operands[1], operands[2], operands[3]);
+		break;
+	}
+	case ir_type_swizzle:
+	{
+		ir_rvalue* val = read_rvalue();
+		ir_swizzle_mask mask;
+		mask.num_components = read_uint(4);
+		const unsigned components = read_uint(0xFF);
+		mask.x = components & 3;
+		mask.y = (components >> 2) & 3;
+		mask.z = (components >> 4) & 3;
+		mask.w = (components >> 6) & 3;
+		mask.has_duplicates = read_uint(1);
+		if (val && !failed)
+			result = new(mem_ctx) ir_swizzle(val, mask);
+		break;
+	}
+	case ir_type_texture:
+	{
+		const unsigned op = read_uint(ir_query_levels);
+		const glsl_type* type = read_type();
+		ir_dereference* sampler = read_dereference();
+		ir_rvalue* coordinate = read_rvalue();
+		ir_rvalue* offset = read_rvalue();
+		if (failed || !type || !sampler)
+			break;
+		ir_texture* tex = new(mem_ctx) ir_texture((ir_texture_opcode)op);
+		tex->set_sampler(sampler, type);
+		tex->coordinate = coordinate;
+		tex->offset = offset;
+		switch (tex->op)
+		{
+		case ir_tex:
+		case ir_lod:
+		case ir_query_levels:
+			break;
+		case ir_txb: tex->lod_info.bias = read_rvalue(); break;
+		case ir_txl:
+		case ir_txf:
+		case ir_txs: tex->lod_info.lod = read_rvalue(); break;
+		case ir_txf_ms: tex->lod_info.sample_index = read_rvalue(); break;
+		case ir_tg4: tex->lod_info.component = read_rvalue(); break;
+		case ir_txd:
+			tex->lod_info.grad.dPdx = read_rvalue();
+			tex->lod_info.grad.dPdy = read_rvalue();
+			break;
+		}
+		result = tex;
+		break;
+	}
+	case ir_type_variable:
+		result = read_variable();
+		// a declaration can't also be a reference to an earlier one
+		if (result && result->next)
+			failed = true;
+		break;
+	case ir_type_assignment:
+	{
+		const unsigned writeMask = read_uint(0xF);
+		ir_dereference* lhs = read_dereference();
+		ir_rvalue* rhs = read_rvalue();
+		ir_rvalue* condition = read_rvalue();
+		if (failed || !lhs || !rhs)
+			break;
+		if ((lhs->type->is_scalar() || lhs->type->is_vector()) && (unsigned)glslopt__mesa_bitcount(writeMask) != rhs->type->vector_elements)
+			break;
+		result = new(mem_ctx) ir_assignment(lhs, rhs, condition, writeMask);
+		break;
+	}
+	case ir_type_call:
+	{
+		ir_function_signature* callee = read_signature();
+		ir_rvalue* ret = read_rvalue();
+		exec_list params;
+		read_list(&params, true);
+		if (failed || !callee || (ret && ret->ir_type != ir_type_dereference_variable))
+			break;
+		result = new(mem_ctx) ir_call(callee, (ir_dereference_variable*)ret, &params);
+		break;
+	}
+	case ir_type_function:
+	{
+		const char* name = read_string();
+		const unsigned count = read_uint((unsigned)(end - cur));
+		if (failed || !name)
+			break;
+		ir_function* func = new(mem_ctx) ir_function(name);
+		for (unsigned i = 0; i < count && !failed; ++i)
+		{
+			ir_function_signature* sig = read_signature();
+			if (!sig || !sig->body.is_empty())
+			{
+				failed = true;
+				break;
+			}
+			sig->remove();
+			func->add_signature(sig);
+			read_list(&sig->body, false);
+		}
+		result = func;
+		break;
+	}
+	case ir_type_if:
+	{
+		ir_rvalue* condition = read_rvalue();
+		if (failed || !condition)
+			break;
+		ir_if* iff = new(mem_ctx) ir_if(condition);
+		read_list(&iff->then_instructions, false);
+		read_list(&iff->else_instructions, false);
+		result = iff;
+		break;
+	}
+	case ir_type_loop:
+	{
+		ir_loop* loop = new(mem_ctx) ir_loop();
+		read_list(&loop->body_instructions, false);
+		result = loop;
+		break;
+	}
+	case ir_type_loop_jump:
+	{
+		const unsigned mode = read_uint(ir_loop_jump::jump_continue);
+		if (!failed)
+			result = new(mem_ctx) ir_loop_jump((ir_loop_jump::jump_mode)mode);
+		break;
+	}
+	case ir_type_return:
+	{
+		ir_rvalue* value = read_rvalue();
+		if (!failed)
+			result = new(mem_ctx) ir_return(value);
+		break;
+	}
+	case ir_type_precision:
+	{
+		const char* statement = read_string();
+		if (statement && !failed)
+			result = new(mem_ctx) ir_precision_statement(statement);
+		break;
+	}
+	case ir_type_typedecl:
+	{
+		const glsl_type* type = read_type();
+		if (type && !failed)
+			result = new(mem_ctx) ir_typedecl_statement(type);
+		break;
+	}
+	case ir_type_discard:
+	{
+		ir_rvalue* condition = read_rvalue();
+		if (!failed)
+			result = new(mem_ctx) ir_discard(condition);
+		break;
+	}
+	case ir_type_emit_vertex:
+	case ir_type_end_primitive:
+	{
+		ir_rvalue* stream = read_rvalue();
+		if (failed || !stream)
+			break;
+		if (irType == ir_type_emit_vertex)
+			result = new(mem_ctx) ir_emit_vertex(stream);
+		else
+			result = new(mem_ctx) ir_end_primitive(stream);
+		break;
+	}
+	}
+
+	if (failed || !result)
+	{
+		failed = true;
+		return NULL;
+	}
+	if (ir_rvalue* rv = result->as_rvalue())
+		rv->set_precision(precision);
+	return result;
+}
+
+
+// Checks the header; leaves the reader on the parse state.
+static bool read_header(ir_deserializer& r)
+{
+	unsigned char magic[sizeof(kIrMagic)];
+	if (!r.read_bytes(magic, sizeof(magic)) || memcmp(magic, kIrMagic, sizeof(magic)))
+		return false;
+	if (r.read_uint() != kIrFormatVersion)
+		return false;
+	return !r.failed;
+}
+
+
+bool get_serialized_ir_stage(const void* data, size_t size, unsigned* outStage)
+{
+	ir_deserializer r(NULL, data, size);
+	if (!read_header(r))
+		return false;
+	*outStage = r.read_uint(MESA_SHADER_FRAGMENT);
+	return !r.failed;
+}
+
+
+bool deserialize_ir(void* mem_ctx, const void* data, size_t size, _mesa_glsl_parse_state* state, exec_list* outInstructions)
+{
+	ir_deserializer r(mem_ctx, data, size);
+	if (!read_header(r))
+		return false;
+
+	if (r.read_uint() != (unsigned)state->stage)
+		return false;
+	const unsigned languageVersion = r.read_uint();
+	const bool esShader = r.read_uint() != 0;
+	const bool hadVersionString = r.read_uint() != 0;
+	const bool hadFloatPrecision = r.read_uint() != 0;
+	// only the saved extensions are enabled, not the defaults of a new state
+	const char* name;
+	bool enabled, warn;
+	for (unsigned i = 0; (name = _mesa_glsl_get_extension_state(state, i, &enabled, &warn)) != NULL; ++i)
+		_mesa_glsl_set_extension_state(state, name, false, false);
+	const unsigned extensionCount = r.read_uint((unsigned)(r.end - r.cur));
+	for (unsigned i = 0; i < extensionCount && !r.failed; ++i)
+	{
+		name = r.read_string();
+		warn = r.read_uint() != 0;
+		if (!name || !_mesa_glsl_set_extension_state(state, name, true, warn))
+			return false;
+	}
+	if (r.failed)
+		return false;
+	state->language_version = languageVersion;
+	state->es_shader = esShader;
+	state->had_version_string = hadVersionString;
+	state->had_float_precision = hadFloatPrecision;
+
+	exec_list instructions;
+	r.read_list(&instructions, false);
+	if (r.failed || r.cur != r.end)
+		return false;
+	instructions.move_nodes_to(outInstructions);
+	return true;
+}
@@ -0,0 +1,20 @@
+#pragma once
+
+#include "ir.h"
+
+struct _mesa_glsl_parse_state;
+
+// Compact binary form of (linked) IR, to cache shaders past the front end.
+// Types are stored by structure, variables and function signatures by order of
+// first appearance. The parse state that gives the IR its meaning (stage,
+// language version, enabled extensions) is stored along with it.
+
+// Returns the serialized IR, allocated in mem_ctx.
+unsigned char* serialize_ir(void* mem_ctx, exec_list* instructions, const _mesa_glsl_parse_state* state, size_t* outSize);
+
+// Shader stage of serialized IR; false if the data doesn't look like serialized IR.
+bool get_serialized_ir_stage(const void* data, size_t size, unsigned* outStage);
+
+// Recreates serialized IR in mem_ctx, and applies the saved parse state to state
+// (which has to be for the same stage). Returns false on malformed data.
+bool deserialize_ir(void* mem_ctx, const void* data, size_t size, _mesa_glsl_parse_state* state, exec_list* outInstructions);
@@ -2,6 +2,10 @@
 #include "ir_visitor.h"
 #include "ir_unused_structs.h"
 #include "glsl_types.h"
+#include "loop_analysis.h"
+#include "ir_stats.h"
+#include "ir_liveness.h"
+#include "program/hash_table.h"
 
 struct ir_stats_counter_visitor : public ir_hierarchical_visitor {
 	ir_stats_counter_visitor()
@@ -62,3 +66,301 @@ void calculate_shader_stats(exec_list* instructions, int* outMath, int* outTex,
 	*outTex = v.tex;
 	*outFlow = v.flow;
 }
+
+
+// Loops whose iteration count isn't known at compile time count as this many
+// iterations.
+static const int kUnknownLoopIterations = 8;
+
+static int loop_iterations (loop_state* loops, ir_loop* ir)
+{
+	loop_variable_state* ls = loops->get(ir);
+	if (ls && ls->limiting_terminator && ls->limiting_terminator->iterations >= 0)
+		return ls->limiting_terminator->iterations;
+	return -1;
+}
+
+// Estimates the cost of one run of the shader. Everything inside loops counts
+// once per iteration, and both sides of a branch count, since GPUs run both
+// when invocations diverge.
+struct ir_cost_visitor : public ir_hierarchical_visitor {
+	ir_cost_visitor(const shader_cost_model& model, loop_state* loops)
+		: model(model), loops(loops), scale(1.0f)
+	{
+		memset (&cost, 0, sizeof(cost));
+	}
+
+	float math_cost (ir_expression* ir);
+	float texture_cost (ir_texture* ir);
+
+	virtual ir_visitor_status visit_enter(ir_loop* ir)
+	{
+		int iterations = loop_iterations (loops, ir);
+		if (iterations < 0)
+		{
+			iterations = kUnknownLoopIterations;
+			cost.unknownLoops = true;
+		}
+		const float outer = scale;
+		scale *= iterations;
+		cost.flow += scale * model.branch;
+		visit_list_elements (this, &ir->body_instructions);
+		scale = outer;
+		return visit_continue_with_parent;
+	}
+	virtual ir_visitor_status visit_leave(ir_expression* ir)
+	{
+		cost.alu += scale * math_cost (ir);
+		if (ir->operation == ir_triop_fma)
+			++cost.fma;
+		return visit_continue;
+	}
+	virtual ir_visitor_status visit_leave(ir_texture* ir)
+	{
+		cost.tex += scale * texture_cost (ir);
+		cost.textureLookups += scale;
+		return visit_continue;
+	}
+	virtual ir_visitor_status visit_leave(ir_if*)
+	{
+		cost.flow += scale * model.branch;
+		return visit_continue;
+	}
+	virtual ir_visitor_status visit_leave(ir_loop_jump*)
+	{
+		cost.flow += scale * model.branch;
+		return visit_continue;
+	}
+	virtual ir_visitor_status visit_leave(ir_discard*)
+	{
+		cost.flow += scale * model.branch;
+		return visit_continue;
+	}
+
+	const shader_cost_model& model;
+	loop_state* loops;
+	float scale; // how often the current code runs
+	shader_cost cost;
+};
+
+
+float ir_cost_visitor::math_cost (ir_expression* ir)
+{
+	const glsl_type* type = ir->type;
+	const glsl_type* type0 = ir->operands[0]->type;
+	const glsl_type* type1 = ir->operands[1] ? ir->operands[1]->type : NULL;
+
+	// Work scales with the widest vector involved; dot(a,b) is as much
+	// work as a*b
+	float width = type->components();
+	for (unsigned i = 0; i < ir->get_num_operands(); ++i)
+		width = MAX2 (width, (float)ir->operands[i]->type->components());
+
+	float cost;
+	switch (ir->operation)
+	{
+	// source and destination modifiers
+	case ir_unop_neg:
+	case ir_unop_abs:
+	case ir_unop_saturate:
+	// register reads
+	case ir_binop_vector_extract:
+	case ir_triop_vector_insert:
+	case ir_quadop_vector:
+		return 0.0f;
+
+	case ir_unop_rcp:
+	case ir_unop_rsq:
+	case ir_unop_sqrt:
+	case ir_unop_exp:
+	case ir_unop_log:
+	case ir_unop_exp2:
+	case ir_unop_log2:
+	case ir_unop_sin:
+	case ir_unop_cos:
+	case ir_unop_sin_reduced:
+	case ir_unop_cos_reduced:
+		cost = width * model.transcendental;
+		break;
+	case ir_binop_pow:
+		// exp2(log2(x) * y)
+		cost = width * (2.0f * model.transcendental + 1.0f);
+		break;
+	case ir_unop_normalize:
+		// dot, rsq and multiply
+		cost = 2.0f * width + model.transcendental;
+		break;
+	case ir_binop_div:
+		cost = width * model.division;
+		break;
+	case ir_binop_mod:
+		// x - y * floor(x / y)
+		cost = width * (model.division + 2.0f);
+		break;
+	case ir_unop_noise:
+		cost = width * 20.0f;
+		break;
+	case ir_triop_lrp:
+	case ir_triop_clamp:
+		cost = 2.0f * width;
+		break;
+	case ir_binop_mul:
+		// matrix products do a dot product per result component
+		if ((type0->is_matrix() && type1 && !type1->is_scalar()) ||
+			(type1 && type1->is_matrix() && !type0->is_scalar()))
+		{
+			const unsigned inner = type0->is_matrix() ? type0->matrix_columns : type0->vector_elements;
+			cost = (float)(type->components() * inner);
+			break;
+		}
+		cost = width;
+		break;
+	default:
+		cost = width;
+		break;
+	}
+
+	const glsl_precision prec = ir->get_precision();
+	if (prec == glsl_precision_medium || prec == glsl_precision_low)
+		cost *= model.reducedPrecision;
+	return cost;
+}
+
+
+float ir_cost_visitor::texture_cost (ir_texture* ir)
+{
+	float cost = model.texture;
+	switch (ir->op)
+	{
+	case ir_txs:
+	case ir_query_levels:
+	case ir_lod:
+		return cost * 0.5f;
+	case ir_txd:
+		cost *= model.textureGradient;
+		break;
+	default:
+		break;
+	}
+
+	const glsl_type* sampler = ir->sampler->type;
+	if (sampler->sampler_dimensionality == GLSL_SAMPLER_DIM_3D ||
+		sampler->sampler_dimensionality == GLSL_SAMPLER_DIM_CUBE)
+		cost *= model.textureVolume;
+	if (sampler->sampler_shadow)
+		cost *= model.textureShadow;
+	return cost;
+}
+
+
+// Whether an rvalue uses the result of a texture lookup, directly or through
+// variables that hold one.
+struct texture_result_visitor : public ir_hierarchical_visitor {
+	texture_result_visitor(hash_table* vars)
+		: vars(vars), found(false)
+	{
+	}
+
+	virtual ir_visitor_status visit_enter(ir_texture*)
+	{
+		found = true;
+		return visit_stop;
+	}
+	virtual ir_visitor_status visit(ir_dereference_variable* ir)
+	{
+		if (!glslopt_hash_table_find (vars, ir->var))
+			return visit_continue;
+		found = true;
+		return visit_stop;
+	}
+
+	hash_table* vars;
+	bool found;
+};
+
+static bool uses_texture_result (ir_rvalue* ir, hash_table* vars)
+{
+	if (!ir)
+		return false;
+	texture_result_visitor v (vars);
+	ir->accept (&v);
+	return v.found;
+}
+
+// Collects the variables that hold something computed from a texture lookup.
+struct texture_variable_visitor : public ir_hierarchical_visitor {
+	texture_variable_visitor(hash_table* vars)
+		: vars(vars), changed(false)
+	{
+	}
+
+	virtual ir_visitor_status visit_leave(ir_assignment* ir)
+	{
+		ir_variable* var = ir->lhs->variable_referenced();
+		if (!var || glslopt_hash_table_find (vars, var))
+			return visit_continue;
+		if (uses_texture_result (ir->rhs, vars) || uses_texture_result (ir->condition, vars))
+		{
+			glslopt_hash_table_insert (vars, var, var);
+			changed = true;
+		}
+		return visit_continue;
+	}
+
+	hash_table* vars;
+	bool changed;
+};
+
+// Counts the lookups that can only start once another lookup is done, since
+// their coordinates (or lod, offset, derivatives) come from its result.
+struct dependent_read_visitor : public ir_hierarchical_visitor {
+	dependent_read_visitor(hash_table* vars)
+		: vars(vars), count(0)
+	{
+	}
+
+	virtual ir_visitor_status visit_enter(ir_texture* ir)
+	{
+		bool dependent = uses_texture_result (ir->coordinate, vars) ||
+			uses_texture_result (ir->offset, vars) ||
+			uses_texture_result (ir->lod_info.lod, vars);
+		if (ir->op == ir_txd)
+			dependent |= uses_texture_result (ir->lod_info.grad.dPdy, vars);
+		if (dependent)
+			++count;
+		return visit_continue;
+	}
+
+	hash_table* vars;
+	int count;
+};
+
+static int count_dependent_texture_reads (exec_list* instructions)
+{
+	hash_table* vars = glslopt_hash_table_ctor (0, glslopt_hash_table_pointer_hash, glslopt_hash_table_pointer_compare);
+
+	// values flow backwards through loops, so go until nothing changes
+	texture_variable_visitor tv (vars);
+	do {
+		tv.changed = false;
+		tv.run (instructions);
+	} while (tv.changed);
+
+	dependent_read_visitor dv (vars);
+	dv.run (instructions);
+	glslopt_hash_table_dtor (vars);
+	return dv.count;
+}
+
+
+void calculate_shader_cost(exec_list* instructions, const shader_cost_model& model, shader_cost* outCost)
+{
+	loop_state* loops = analyze_loop_variables (instructions);
+	ir_cost_visitor v (model, loops);
+	v.run (instructions);
+	delete loops;
+	v.cost.dependentTextureReads = count_dependent_texture_reads (instructions);
+	liveness_analysis liveness (instructions);
+	v.cost.liveRegisters = v.cost.liveRegistersUnscheduled = liveness.max_registers;
+	*outCost = v.cost;
+}
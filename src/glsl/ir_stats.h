@@ -1,3 +1,34 @@
 #include "ir.h"
 
 void calculate_shader_stats(exec_list* instructions, int* outMath, int* outTex, int* outFlow);
+
+/**
+ * Relative costs of operations on one kind of GPU.  Math costs are per
+ * vector component, in units of a full precision add or multiply.
+ */
+struct shader_cost_model
+{
+	float reducedPrecision; // factor for mediump/lowp math
+	float transcendental;   // exp, log, sin, cos, rcp, rsq, sqrt, pow
+	float division;
+	float texture;          // one 2D lookup
+	float textureVolume;    // factor for 3D and cube lookups
+	float textureShadow;    // factor for depth comparison
+	float textureGradient;  // factor for explicit derivatives
+	float branch;           // per if, jump or loop iteration
+};
+
+struct shader_cost
+{
+	float alu;
+	float tex;
+	float flow;
+	float textureLookups;
+	bool unknownLoops; // some loop iteration counts had to be guessed
+	int fma;
+	int dependentTextureReads;
+	int liveRegisters;            // most vec4 registers live at once
+	int liveRegistersUnscheduled; // same, before do_schedule_for_pressure
+};
+
+void calculate_shader_cost(exec_list* instructions, const shader_cost_model& model, shader_cost* outCost);
@@ -0,0 +1,420 @@
+/**
+ * \file ir_value_range.cpp
+ *
+ * Value range analysis for float expressions.
+ *
+ * Ranges of variables are computed on demand and cached.  A variable that
+ * is (indirectly) assigned from itself, like a loop accumulator, is part of
+ * a cycle the analysis doesn't try to solve; it gets no bounds.
+ */
+
+#include <math.h>
+#include "ir_value_range.h"
+#include "ir_hierarchical_visitor.h"
+#include "glsl_types.h"
+#include "program/hash_table.h"
+#include "main/macros.h"
+
+value_range::value_range()
+   : low(-INFINITY), high(INFINITY), exact(true)
+{
+}
+
+value_range::value_range(float low, float high)
+   : low(low), high(high), exact(true)
+{
+}
+
+bool
+value_range::is_bounded() const
+{
+   return low != -INFINITY || high != INFINITY;
+}
+
+namespace {
+
+enum range_state {
+   RANGE_UNVISITED,
+   RANGE_VISITING,
+   RANGE_DONE
+};
+
+/** Every write to a variable, for computing its range. */
+struct variable_writes {
+   ir_assignment **assignments;
+   unsigned num_assignments;
+   bool unknown;      /**< Written in a way that has no rvalue */
+   range_state state;
+   value_range range;
+};
+
+class write_collector : public ir_hierarchical_visitor {
+public:
+   write_collector(hash_table *variables, void *mem_ctx)
+      : variables(variables), mem_ctx(mem_ctx)
+   {
+   }
+
+   variable_writes *get_writes(ir_variable *var);
+
+   virtual ir_visitor_status visit_enter(ir_assignment *ir);
+   virtual ir_visitor_status visit_enter(ir_call *ir);
+
+   hash_table *variables;
+   void *mem_ctx;
+};
+
+
+variable_writes *
+write_collector::get_writes(ir_variable *var)
+{
+   variable_writes *writes =
+      (variable_writes *) glslopt_hash_table_find(this->variables, var);
+   if (writes == NULL) {
+      writes = rzalloc(this->mem_ctx, variable_writes);
+      writes->range = value_range();
+      glslopt_hash_table_insert(this->variables, writes, var);
+   }
+   return writes;
+}
+
+
+ir_visitor_status
+write_collector::visit_enter(ir_assignment *ir)
+{
+   ir_variable *const var = ir->lhs->variable_referenced();
+   if (var == NULL)
+      return visit_continue;
+
+   variable_writes *const writes = get_writes(var);
+   if (ir->lhs->as_dereference_variable() == NULL) {
+      writes->unknown = true;
+      return visit_continue;
+   }
+
+   writes->assignments = reralloc(this->mem_ctx, writes->assignments,
+                                  ir_assignment *,
+                                  writes->num_assignments + 1);
+   writes->assignments[writes->num_assignments++] = ir;
+   return visit_continue;
+}
+
+
+ir_visitor_status
+write_collector::visit_enter(ir_call *ir)
+{
+   if (ir->return_deref != NULL)
+      get_writes(ir->return_deref->var)->unknown = true;
+
+   foreach_two_lists(formal_node, &ir->callee->parameters,
+                     actual_node, &ir->actual_parameters) {
+      ir_variable *const formal = (ir_variable *) formal_node;
+      ir_rvalue *const actual = (ir_rvalue *) actual_node;
+      if (formal->data.mode != ir_var_function_out &&
+          formal->data.mode != ir_var_function_inout)
+         continue;
+      ir_variable *const var = actual->variable_referenced();
+      if (var != NULL)
+         get_writes(var)->unknown = true;
+   }
+   return visit_continue;
+}
+
+
+value_range
+inexact(value_range a)
+{
+   a.exact = false;
+   return a;
+}
+
+
+value_range
+range_union(value_range a, value_range b)
+{
+   value_range r(MIN2(a.low, b.low), MAX2(a.high, b.high));
+   r.exact = a.exact && b.exact;
+   return r;
+}
+
+
+value_range
+range_min(value_range a, value_range b)
+{
+   value_range r(MIN2(a.low, b.low), MIN2(a.high, b.high));
+   r.exact = a.exact && b.exact;
+   return r;
+}
+
+
+value_range
+range_max(value_range a, value_range b)
+{
+   value_range r(MAX2(a.low, b.low), MAX2(a.high, b.high));
+   r.exact = a.exact && b.exact;
+   return r;
+}
+
+
+value_range
+range_neg(value_range a)
+{
+   value_range r(-a.high, -a.low);
+   r.exact = a.exact;
+   return r;
+}
+
+
+value_range
+range_mul(value_range a, value_range b)
+{
+   const float products[4] = {
+      a.low * b.low, a.low * b.high, a.high * b.low, a.high * b.high
+   };
+
+   value_range r(INFINITY, -INFINITY);
+   for (unsigned i = 0; i < 4; i++) {
+      /* 0 * inf */
+      if (products[i] != products[i])
+         return value_range();
+      r.low = MIN2(r.low, products[i]);
+      r.high = MAX2(r.high, products[i]);
+   }
+   r.exact = a.exact && b.exact;
+   return r;
+}
+
+
+/**
+ * Range of a function that doesn't decrease, like exp2 or sqrt.  GPUs only
+ * approximate these, so the result is not exact.
+ */
+template<typename F> value_range
+range_monotonic(value_range a, F f)
+{
+   return inexact(value_range(f(a.low), f(a.high)));
+}
+
+
+/**
+ * Range of an expression from the ranges of its operands.  The caller
+ * combines the exactness of the operands into the result.
+ */
+value_range
+expression_range(ir_expression *expr, const value_range *r)
+{
+   switch (expr->operation) {
+   case ir_unop_neg:
+      return range_neg(r[0]);
+   case ir_unop_abs:
+      if (r[0].low >= 0.0f)
+         return r[0];
+      if (r[0].high <= 0.0f)
+         return range_neg(r[0]);
+      return value_range(0.0f, MAX2(-r[0].low, r[0].high));
+   case ir_unop_sign:
+      return value_range(-1.0f, 1.0f);
+   case ir_unop_sqrt:
+      return range_monotonic(range_max(r[0], value_range(0.0f, 0.0f)), sqrtf);
+   case ir_unop_exp:
+      return range_monotonic(r[0], expf);
+   case ir_unop_exp2:
+      return range_monotonic(r[0], exp2f);
+   case ir_unop_b2f:
+      return value_range(0.0f, 1.0f);
+   case ir_unop_floor:
+      return value_range(floorf(r[0].low), floorf(r[0].high));
+   case ir_unop_ceil:
+      return value_range(ceilf(r[0].low), ceilf(r[0].high));
+   case ir_unop_trunc:
+   case ir_unop_round_even:
+      return value_range(floorf(r[0].low), ceilf(r[0].high));
+   case ir_unop_fract:
+      return value_range(0.0f, 1.0f);
+   case ir_unop_saturate:
+      return range_min(range_max(r[0], value_range(0.0f, 0.0f)),
+                       value_range(1.0f, 1.0f));
+   case ir_unop_sin:
+   case ir_unop_cos:
+   case ir_unop_sin_reduced:
+   case ir_unop_cos_reduced:
+   case ir_unop_normalize:
+      return inexact(value_range(-1.0f, 1.0f));
+
+   case ir_binop_add:
+      return value_range(r[0].low + r[1].low, r[0].high + r[1].high);
+   case ir_binop_sub:
+      return value_range(r[0].low - r[1].high, r[0].high - r[1].low);
+   case ir_binop_mul:
+      if (expr->operands[0]->type->is_matrix() ||
+          expr->operands[1]->type->is_matrix())
+         return value_range();
+      return range_mul(r[0], r[1]);
+   case ir_binop_min:
+      return range_min(r[0], r[1]);
+   case ir_binop_max:
+      return range_max(r[0], r[1]);
+   case ir_binop_dot: {
+      ir_expression *const a = expr->operands[0]->as_expression();
+      ir_expression *const b = expr->operands[1]->as_expression();
+      if (a && a->operation == ir_unop_normalize &&
+          b && b->operation == ir_unop_normalize)
+         return inexact(value_range(-1.0f, 1.0f));
+      value_range sum = range_mul(r[0], r[1]);
+      const float n = expr->operands[0]->type->vector_elements;
+      return range_mul(sum, value_range(n, n));
+   }
+
+   case ir_triop_clamp:
+      return range_min(range_max(r[0], r[1]), r[2]);
+   case ir_triop_lrp:
+      /* Only an interpolation while a is in [0, 1]. */
+      if (r[2].low >= 0.0f && r[2].high <= 1.0f)
+         return inexact(range_union(r[0], r[1]));
+      return value_range();
+   case ir_triop_csel:
+      return range_union(r[1], r[2]);
+
+   default:
+      return value_range();
+   }
+}
+
+} /* unnamed namespace */
+
+
+value_range_analysis::value_range_analysis(exec_list *instructions,
+                                           bool normalized_textures)
+   : normalized_textures(normalized_textures)
+{
+   this->mem_ctx = glslopt_ralloc_context(NULL);
+   this->variables = glslopt_hash_table_ctor(0, glslopt_hash_table_pointer_hash,
+                                             glslopt_hash_table_pointer_compare);
+
+   write_collector collector(this->variables, this->mem_ctx);
+   collector.run(instructions);
+}
+
+
+value_range_analysis::~value_range_analysis()
+{
+   glslopt_hash_table_dtor(this->variables);
+   glslopt_ralloc_free(this->mem_ctx);
+}
+
+
+value_range
+value_range_analysis::variable_range(ir_variable *var)
+{
+   if (var->data.mode != ir_var_auto && var->data.mode != ir_var_temporary)
+      return value_range();
+
+   variable_writes *const writes =
+      (variable_writes *) glslopt_hash_table_find(this->variables, var);
+   if (writes == NULL || writes->unknown || writes->num_assignments == 0)
+      return value_range();
+
+   switch (writes->state) {
+   case RANGE_DONE:
+      return writes->range;
+   case RANGE_VISITING:
+      return value_range();
+   default:
+      break;
+   }
+
+   writes->state = RANGE_VISITING;
+   value_range r(INFINITY, -INFINITY);
+   for (unsigned i = 0; i < writes->num_assignments && r.is_bounded(); i++)
+      r = range_union(r, range(writes->assignments[i]->rhs));
+   if (r.low > r.high)
+      r = value_range();
+
+   writes->range = r;
+   writes->state = RANGE_DONE;
+   return r;
+}
+
+
+value_range
+value_range_analysis::texture_range(ir_texture *ir)
+{
+   switch (ir->op) {
+   case ir_tex:
+   case ir_txb:
+   case ir_txl:
+   case ir_txd:
+   case ir_txf:
+   case ir_txf_ms:
+   case ir_tg4:
+      break;
+   default:
+      return value_range();
+   }
+
+   /* Depth comparisons always give results in [0, 1]. */
+   const glsl_type *const sampler = ir->sampler->type;
+   if (!sampler->is_sampler())
+      return value_range();
+   if (sampler->sampler_shadow ||
+       (this->normalized_textures && sampler->sampler_type == GLSL_TYPE_FLOAT))
+      return value_range(0.0f, 1.0f);
+
+   return value_range();
+}
+
+
+value_range
+value_range_analysis::range(ir_rvalue *ir)
+{
+   if (ir->type->base_type != GLSL_TYPE_FLOAT)
+      return value_range();
+
+   switch (ir->ir_type) {
+   case ir_type_constant: {
+      ir_constant *const c = (ir_constant *) ir;
+      if (!c->type->is_scalar() && !c->type->is_vector())
+         return value_range();
+      value_range r(c->value.f[0], c->value.f[0]);
+      for (unsigned i = 1; i < c->type->vector_elements; i++)
+         r = range_union(r, value_range(c->value.f[i], c->value.f[i]));
+      return r;
+   }
+
+   case ir_type_swizzle:
+      return range(((ir_swizzle *) ir)->val);
+
+   case ir_type_dereference_variable:
+      return variable_range(((ir_dereference_variable *) ir)->var);
+
+   case ir_type_texture:
+      return texture_range((ir_texture *) ir);
+
+   case ir_type_expression:
+      break;
+
+   default:
+      return value_range();
+   }
+
+   ir_expression *const expr = (ir_expression *) ir;
+   value_range r[3];
+   for (unsigned i = 0; i < expr->get_num_operands() && i < 3; i++) {
+      if (expr->operands[i]->type->base_type == GLSL_TYPE_FLOAT)
+         r[i] = range(expr->operands[i]);
+   }
+
+   value_range result = expression_range(expr, r);
+   switch (expr->operation) {
+   case ir_unop_sign:
+   case ir_unop_b2f:
+   case ir_unop_fract:
+      /* Bounded whatever the operand is. */
+      break;
+   default:
+      for (unsigned i = 0; i < 3; i++)
+         result.exact = result.exact && r[i].exact;
+      break;
+   }
+   return result;
+}
@@ -0,0 +1,56 @@
+/**
+ * \file ir_value_range.h
+ *
+ * Bounds of the values float expressions can take, across a whole shader.
+ */
+
+#pragma once
+
+#include "ir.h"
+
+struct hash_table;
+
+/** Bounds that hold for every component; infinite where unknown. */
+struct value_range {
+   value_range();
+   value_range(float low, float high);
+
+   bool is_bounded() const;
+
+   float low;
+   float high;
+
+   /**
+    * Whether the bounds hold for computed values, and not only for the math
+    * that GPUs approximate.  normalize() can give a vector slightly longer
+    * than 1, so the dot product of two of them can end up past 1.0.
+    */
+   bool exact;
+};
+
+/**
+ * Ranges come from constants, builtins with a known range (saturate, clamp,
+ * fract, abs, sin, cos, normalize, shadow lookups...) and interval
+ * arithmetic.  Ranges that need a builtin to be computed exactly, like those
+ * of sin, cos, normalize, sqrt, exp and mix, are not exact.  A local variable has the union of the ranges of everything
+ * assigned to it, as long as all of its writes are whole assignments.
+ */
+class value_range_analysis {
+public:
+   /**
+    * \param normalized_textures  Whether all textures hold normalized
+    *                             values, so that samples lie in [0, 1].
+    */
+   value_range_analysis(exec_list *instructions, bool normalized_textures);
+   ~value_range_analysis();
+
+   value_range range(ir_rvalue *ir);
+
+private:
+   value_range variable_range(ir_variable *var);
+   value_range texture_range(ir_texture *ir);
+
+   struct hash_table *variables;
+   void *mem_ctx;
+   bool normalized_textures;
+};
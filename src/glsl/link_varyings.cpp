@@ -1503,6 +1503,364 @@ assign_varying_locations(struct gl_context *ctx,
    return true;
 }
 
+/**
+ * Demote producer outputs that the consumer never reads to ordinary globals.
+ *
+ * Dead code elimination then removes them along with the computations that
+ * only feed them.  Built-in varyings and interface block members are left
+ * alone.  Returns true if any output was demoted.
+ */
+bool
+remove_unused_varyings(void *mem_ctx, gl_shader *producer, gl_shader *consumer)
+{
+   hash_table *consumer_inputs
+      = glslopt_hash_table_ctor(0, glslopt_hash_table_string_hash, hash_table_string_compare);
+   hash_table *consumer_interface_inputs
+      = glslopt_hash_table_ctor(0, glslopt_hash_table_string_hash, hash_table_string_compare);
+   ir_variable *consumer_inputs_with_locations[VARYING_SLOT_MAX];
+   bool progress = false;
+
+   if (linker::populate_consumer_input_sets(mem_ctx,
+                                            consumer->ir,
+                                            consumer_inputs,
+                                            consumer_interface_inputs,
+                                            consumer_inputs_with_locations)) {
+      foreach_in_list(ir_instruction, node, producer->ir) {
+         ir_variable *const output_var = node->as_variable();
+
+         if ((output_var == NULL) ||
+             (output_var->data.mode != ir_var_shader_out) ||
+             is_gl_identifier(output_var->name) ||
+             output_var->get_interface_type() != NULL)
+            continue;
+
+         if (linker::get_matching_input(mem_ctx, output_var, consumer_inputs,
+                                        consumer_interface_inputs,
+                                        consumer_inputs_with_locations) == NULL) {
+            output_var->data.mode = ir_var_auto;
+            output_var->data.invariant = 0;
+            output_var->data.centroid = 0;
+            output_var->data.sample = 0;
+            output_var->data.interpolation = INTERP_QUALIFIER_NONE;
+            progress = true;
+         }
+      }
+   }
+
+   glslopt_hash_table_dtor(consumer_inputs);
+   glslopt_hash_table_dtor(consumer_interface_inputs);
+   return progress;
+}
+
+namespace {
+
+/**
+ * Finds the producer outputs that are written by a single assignment, and
+ * spots anything that makes the position of that assignment meaningless.
+ */
+class output_write_visitor : public ir_hierarchical_visitor {
+public:
+   output_write_visitor()
+      : has_return(false)
+   {
+      this->writes = glslopt_hash_table_ctor(0, glslopt_hash_table_pointer_hash,
+                                             glslopt_hash_table_pointer_compare);
+   }
+
+   ~output_write_visitor()
+   {
+      glslopt_hash_table_dtor(this->writes);
+   }
+
+   virtual ir_visitor_status visit_enter(ir_assignment *ir)
+   {
+      count_write(ir->lhs, ir->condition ? 2 : 1);
+      return visit_continue;
+   }
+
+   virtual ir_visitor_status visit_enter(ir_call *ir)
+   {
+      /* Outputs passed as out parameters can't be tracked. */
+      foreach_two_lists(formal_node, &ir->callee->parameters,
+                        actual_node, &ir->actual_parameters) {
+         ir_variable *const formal = (ir_variable *) formal_node;
+         if (formal->data.mode == ir_var_function_out ||
+             formal->data.mode == ir_var_function_inout)
+            count_write((ir_rvalue *) actual_node, 2);
+      }
+      if (ir->return_deref)
+         count_write(ir->return_deref, 2);
+      return visit_continue;
+   }
+
+   virtual ir_visitor_status visit_enter(ir_return *)
+   {
+      this->has_return = true;
+      return visit_continue;
+   }
+
+   unsigned get_write_count(ir_variable *var)
+   {
+      return (unsigned) (uintptr_t) glslopt_hash_table_find(this->writes, var);
+   }
+
+   bool has_return;
+
+private:
+   void count_write(ir_rvalue *lhs, unsigned count)
+   {
+      ir_variable *const var = lhs->variable_referenced();
+      if (var == NULL || var->data.mode != ir_var_shader_out)
+         return;
+      count += get_write_count(var);
+      glslopt_hash_table_remove(this->writes, var);
+      glslopt_hash_table_insert(this->writes, (void *) (uintptr_t) count, var);
+   }
+
+   hash_table *writes;
+};
+
+
+/**
+ * Checks whether an rvalue only depends on constants and uniforms, and
+ * collects the uniforms it reads.
+ */
+class uniform_value_visitor : public ir_hierarchical_visitor {
+public:
+   uniform_value_visitor()
+      : is_uniform(true), num_uniforms(0)
+   {
+   }
+
+   virtual ir_visitor_status visit(ir_dereference_variable *ir)
+   {
+      ir_variable *const var = ir->var;
+      if (var->data.mode != ir_var_uniform || var->type->contains_sampler() ||
+          var->is_in_uniform_block() || var->type->without_array()->is_record() ||
+          this->num_uniforms == ARRAY_SIZE(this->uniforms)) {
+         this->is_uniform = false;
+         return visit_stop;
+      }
+      for (unsigned i = 0; i < this->num_uniforms; ++i) {
+         if (this->uniforms[i] == var)
+            return visit_continue;
+      }
+      this->uniforms[this->num_uniforms++] = var;
+      return visit_continue;
+   }
+
+   virtual ir_visitor_status visit(ir_variable *)
+   {
+      this->is_uniform = false;
+      return visit_stop;
+   }
+
+   virtual ir_visitor_status visit_enter(ir_texture *)
+   {
+      this->is_uniform = false;
+      return visit_stop;
+   }
+
+   virtual ir_visitor_status visit_enter(ir_call *)
+   {
+      this->is_uniform = false;
+      return visit_stop;
+   }
+
+   bool is_uniform;
+   ir_variable *uniforms[16];
+   unsigned num_uniforms;
+};
+
+
+ir_function_signature *
+find_main_signature(exec_list *ir)
+{
+   foreach_in_list(ir_instruction, node, ir) {
+      ir_function *const f = node->as_function();
+      if (f == NULL || strcmp(f->name, "main") != 0)
+         continue;
+      foreach_in_list(ir_function_signature, sig, &f->signatures) {
+         if (sig->is_defined)
+            return sig;
+      }
+   }
+   return NULL;
+}
+
+
+ir_variable *
+find_uniform(exec_list *ir, const char *name)
+{
+   foreach_in_list(ir_instruction, node, ir) {
+      ir_variable *const var = node->as_variable();
+      if (var != NULL && var->data.mode == ir_var_uniform &&
+          strcmp(var->name, name) == 0)
+         return var;
+   }
+   return NULL;
+}
+
+} /* anonymous namespace */
+
+
+/**
+ * Replace consumer inputs that the producer sets to a constant, or to an
+ * expression of constants and uniforms only, with that value.
+ *
+ * Such outputs are the same for every vertex, so interpolation leaves them
+ * as they are.  The consumer computes the expression at the start of main(),
+ * declaring the uniforms it doesn't have yet with the producer's precision.
+ * The matching outputs are then unread, for remove_unused_varyings() to
+ * remove.  Returns true if any input was replaced.
+ */
+bool
+propagate_uniform_varyings(void *mem_ctx, gl_shader *producer,
+                           gl_shader *consumer,
+                           const _mesa_glsl_parse_state *consumer_state)
+{
+   /* GLSL ES 1.00 fragment shaders can't count on highp support. */
+   const bool highp_uniforms = !consumer_state->es_shader ||
+                               consumer_state->language_version >= 300;
+
+   ir_function_signature *const producer_main =
+      find_main_signature(producer->ir);
+   ir_function_signature *const consumer_main =
+      find_main_signature(consumer->ir);
+   if (producer_main == NULL || consumer_main == NULL)
+      return false;
+
+   output_write_visitor writes;
+   writes.run(producer->ir);
+   if (writes.has_return)
+      return false;
+
+   hash_table *consumer_inputs
+      = glslopt_hash_table_ctor(0, glslopt_hash_table_string_hash, hash_table_string_compare);
+   hash_table *consumer_interface_inputs
+      = glslopt_hash_table_ctor(0, glslopt_hash_table_string_hash, hash_table_string_compare);
+   ir_variable *consumer_inputs_with_locations[VARYING_SLOT_MAX];
+   bool progress = false;
+
+   if (!linker::populate_consumer_input_sets(mem_ctx,
+                                             consumer->ir,
+                                             consumer_inputs,
+                                             consumer_interface_inputs,
+                                             consumer_inputs_with_locations)) {
+      glslopt_hash_table_dtor(consumer_inputs);
+      glslopt_hash_table_dtor(consumer_interface_inputs);
+      return false;
+   }
+
+   void *const consumer_ctx = consumer->ir;
+
+   /* Only writes at the top level of main() happen for every vertex. */
+   foreach_in_list(ir_instruction, node, &producer_main->body) {
+      ir_assignment *const assign = node->as_assignment();
+      if (assign == NULL || assign->condition != NULL)
+         continue;
+
+      ir_dereference_variable *const lhs = assign->lhs->as_dereference_variable();
+      if (lhs == NULL)
+         continue;
+
+      ir_variable *const output_var = lhs->var;
+      if (output_var->data.mode != ir_var_shader_out ||
+          is_gl_identifier(output_var->name) ||
+          output_var->get_interface_type() != NULL ||
+          writes.get_write_count(output_var) != 1)
+         continue;
+
+      if ((lhs->type->is_scalar() || lhs->type->is_vector()) &&
+          assign->write_mask != (1u << lhs->type->vector_elements) - 1)
+         continue;
+
+      ir_variable *const input_var =
+         linker::get_matching_input(mem_ctx, output_var, consumer_inputs,
+                                    consumer_interface_inputs,
+                                    consumer_inputs_with_locations);
+      if (input_var == NULL || input_var->type != output_var->type)
+         continue;
+
+      const glsl_precision precision = (glsl_precision) input_var->data.precision;
+      ir_constant *const constant = assign->rhs->as_constant();
+      if (constant != NULL) {
+         ir_constant *const value = constant->clone(input_var, NULL);
+         value->set_precision(precision);
+         input_var->data.mode = ir_var_auto;
+         input_var->data.read_only = 1;
+         input_var->data.has_initializer = 1;
+         input_var->constant_value = value;
+         input_var->constant_initializer = value->clone(input_var, NULL);
+      } else {
+         uniform_value_visitor value;
+         assign->rhs->accept(&value);
+         if (!value.is_uniform)
+            continue;
+
+         /* Map the uniforms to the consumer's, adding the ones it lacks. */
+         hash_table *uniform_map =
+            glslopt_hash_table_ctor(0, glslopt_hash_table_pointer_hash,
+                                    glslopt_hash_table_pointer_compare);
+         ir_variable *new_uniforms[ARRAY_SIZE(value.uniforms)];
+         unsigned num_new_uniforms = 0;
+         bool mappable = true;
+         for (unsigned i = 0; i < value.num_uniforms && mappable; ++i) {
+            ir_variable *const uniform = value.uniforms[i];
+            ir_variable *mapped = find_uniform(consumer->ir, uniform->name);
+            if (mapped == NULL) {
+               if (!highp_uniforms &&
+                   uniform->type->base_type == GLSL_TYPE_FLOAT &&
+                   (uniform->data.precision == glsl_precision_high ||
+                    uniform->data.precision == glsl_precision_undefined)) {
+                  mappable = false;
+                  break;
+               }
+               mapped = uniform->clone(consumer_ctx, NULL);
+               /* The producer's default precision doesn't carry over. */
+               if (consumer_state->es_shader &&
+                   mapped->data.precision == glsl_precision_undefined &&
+                   mapped->type->base_type != GLSL_TYPE_BOOL)
+                  mapped->data.precision = glsl_precision_high;
+               new_uniforms[num_new_uniforms++] = mapped;
+            } else if (mapped->type != uniform->type) {
+               mappable = false;
+               break;
+            }
+            glslopt_hash_table_insert(uniform_map, mapped, uniform);
+         }
+
+         if (mappable) {
+            for (unsigned i = num_new_uniforms; i > 0; --i)
+               consumer->ir->push_head(new_uniforms[i - 1]);
+
+            /* The input becomes a local of main(). */
+            ir_rvalue *const rhs = assign->rhs->clone(consumer_ctx, uniform_map);
+            input_var->remove();
+            input_var->data.mode = ir_var_auto;
+            consumer_main->body.push_head(
+               new(consumer_ctx) ir_assignment(
+                  new(consumer_ctx) ir_dereference_variable(input_var), rhs));
+            consumer_main->body.push_head(input_var);
+         }
+         glslopt_hash_table_dtor(uniform_map);
+         if (!mappable)
+            continue;
+      }
+
+      input_var->data.invariant = 0;
+      input_var->data.centroid = 0;
+      input_var->data.sample = 0;
+      input_var->data.interpolation = INTERP_QUALIFIER_NONE;
+      input_var->data.explicit_location = 0;
+      progress = true;
+   }
+
+   glslopt_hash_table_dtor(consumer_inputs);
+   glslopt_hash_table_dtor(consumer_interface_inputs);
+   return progress;
+}
+
 bool
 check_against_output_limit(struct gl_context *ctx,
                            struct gl_shader_program *prog,
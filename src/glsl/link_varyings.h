@@ -253,6 +253,14 @@ assign_varying_locations(struct gl_context *ctx,
                          tfeedback_decl *tfeedback_decls,
                          unsigned gs_input_vertices);
 
+bool
+remove_unused_varyings(void *mem_ctx, gl_shader *producer, gl_shader *consumer);
+
+bool
+propagate_uniform_varyings(void *mem_ctx, gl_shader *producer,
+                           gl_shader *consumer,
+                           const struct _mesa_glsl_parse_state *consumer_state);
+
 bool
 check_against_output_limit(struct gl_context *ctx,
                            struct gl_shader_program *prog,
@@ -86,6 +86,7 @@ loop_state::loop_state()
    this->ht_variables = glslopt_hash_table_ctor(0, glslopt_hash_table_pointer_hash,
 										 glslopt_hash_table_pointer_compare);
    this->mem_ctx = glslopt_ralloc_context(NULL);
+   this->refs = NULL;
    this->loop_found = false;
 }
 
@@ -166,45 +167,21 @@ loop_state::insert_inductor(loop_variable* loopvar, loop_variable_state* state,
 	if (glslopt_hash_table_find(this->ht_non_inductors, var))
 		return false;
 
-	// Check if this variable is used after the loop anywhere. If it is, it can't be a
-	// variable that's private to the loop.
-	ir_variable_refcount_visitor refs;
-	for (exec_node* node = loop->next;
-		 !node->is_tail_sentinel();
-		 node = node->next)
+	// Check if this variable is used outside of the loop anywhere. If it is, it
+	// can't be a variable that's private to the loop. Only the IR that assigned the
+	// initial value right in front of the loop may use it.
+	ir_variable_refcount_visitor loop_refs;
+	loop->accept (&loop_refs);
+	ir_variable_refcount_entry* const total = this->refs->find_variable_entry(var);
+	ir_variable_refcount_entry* const inside = loop_refs.find_variable_entry(var);
+	const unsigned allowed = loopvar->initial_value_ir ? 1 : 0;
+	if (total == NULL || inside == NULL ||
+		total->referenced_count != inside->referenced_count + allowed)
 	{
-		ir_instruction *ir = (ir_instruction *) node;
-		ir->accept (&refs);
-		if (refs.find_variable_entry(var))
-		{
-			// add to list of "non inductors", so that next loop does not try
-			// to add it as inductor again
-			glslopt_hash_table_insert(this->ht_non_inductors, state, var);
-			return false;
-		}
-	}
-
-	// Check if this variable is used before the loop anywhere. If it is, it can't be a
-	// variable that's private to the loop.
-	// Skip over the IR that declared the variable or assigned the initial value though.
-	for (exec_node* node = loop->prev;
-		 !node->is_head_sentinel();
-		 node = node->prev)
-	{
-		ir_instruction *ir = (ir_instruction *) node;
-		if (ir == loopvar->initial_value_ir)
-			continue;
-		if (ir->ir_type == ir_type_variable)
-			continue;
-
-		ir->accept (&refs);
-		if (refs.find_variable_entry(var))
-		{
-			// add to list of "non inductors", so that next loop does not try
-			// to add it as inductor again
-			glslopt_hash_table_insert(this->ht_non_inductors, state, var);
-			return false;
-		}
+		// add to list of "non inductors", so that next loop does not try
+		// to add it as inductor again
+		glslopt_hash_table_insert(this->ht_non_inductors, state, var);
+		return false;
 	}
 	
 	state->private_induction_variable_count++;
@@ -797,6 +774,10 @@ analyze_loop_variables(exec_list *instructions)
    loop_state *loops = new loop_state;
    loop_analysis v(loops);
 
+   ir_variable_refcount_visitor refs;
+   visit_list_elements(&refs, instructions);
+   loops->refs = &refs;
+
    /* Do two passes over the instructions. The first pass builds a view
     * of the variables declared and whether or not they're used outside
     * of loops (if so, they cannot be inductors).
@@ -809,5 +790,6 @@ analyze_loop_variables(exec_list *instructions)
    v.first_pass = false;
    v.run(instructions);
 
+   loops->refs = NULL;
    return v.loops;
 }
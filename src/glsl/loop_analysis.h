@@ -53,10 +53,26 @@ extern bool
 set_loop_controls(exec_list *instructions, loop_state *ls);
 
 
+/**
+ * Move if-statements whose condition is the same in every iteration out of
+ * loops, with a copy of the loop for each branch
+ */
+extern bool
+unswitch_loops(exec_list *instructions, loop_state *ls,
+               const struct gl_shader_compiler_options *options);
+
+
 extern bool
 unroll_loops(exec_list *instructions, loop_state *ls,
              const struct gl_shader_compiler_options *options);
 
+/**
+ * Move computation that gives the same result in every iteration in front
+ * of the loop
+ */
+extern bool
+hoist_loop_invariants(exec_list *instructions, loop_state *ls);
+
 ir_rvalue *
 find_initial_value(ir_loop *loop, ir_variable *var, ir_instruction **out_containing_ir);
 
@@ -270,6 +286,11 @@ private:
    hash_table *ht_inductors;
    hash_table *ht_non_inductors;
    hash_table *ht_variables;
+
+   /**
+    * References to all variables, while the analysis runs.
+    */
+   class ir_variable_refcount_visitor *refs;
  
 
    void *mem_ctx;
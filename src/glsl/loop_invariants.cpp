@@ -0,0 +1,642 @@
+/**
+ * \file loop_invariants.cpp
+ *
+ * Loop-invariant code motion and loop unswitching.
+ *
+ * Uses the variable classification of loop_analysis.cpp to move work that
+ * gives the same result in every iteration in front of the loop:
+ *
+ *    - assignments to variables only used inside the loop, where the
+ *      variable is written once, unconditionally, before being read, and the
+ *      right-hand side is invariant;
+ *
+ *    - invariant expressions and texture lookups anywhere else in the body,
+ *      which get computed into a new temporary.  Lookups in conditional code
+ *      are left alone, as moving them would fetch texels that might not be
+ *      needed.
+ *
+ * Loop unswitching runs before unrolling instead: an if-statement with an
+ * invariant condition gets moved out of the loop, with a copy of the loop
+ * in each branch, so that each copy can be unrolled on its own.
+ *
+ * A loop is only looked at once the loops nested in it are done, so that
+ * the analysis still describes it.
+ */
+
+#include "loop_analysis.h"
+#include "ir_rvalue_visitor.h"
+#include "ir_variable_refcount.h"
+#include "main/mtypes.h"
+
+namespace {
+
+void
+collect_declaration(ir_instruction *ir, void *data)
+{
+   if (ir->ir_type == ir_type_variable)
+      glslopt_hash_table_insert((hash_table *) data, ir, ir);
+}
+
+
+class loop_invariant_state {
+public:
+   loop_invariant_state(ir_loop *loop, loop_variable_state *lvs)
+      : loop(loop), lvs(lvs)
+   {
+      this->hoisted = glslopt_hash_table_ctor(0, glslopt_hash_table_pointer_hash,
+                                              glslopt_hash_table_pointer_compare);
+      this->declared = glslopt_hash_table_ctor(0, glslopt_hash_table_pointer_hash,
+                                               glslopt_hash_table_pointer_compare);
+      foreach_in_list(ir_instruction, ir, &loop->body_instructions)
+         visit_tree(ir, collect_declaration, this->declared);
+   }
+
+   ~loop_invariant_state()
+   {
+      glslopt_hash_table_dtor(this->hoisted);
+      glslopt_hash_table_dtor(this->declared);
+   }
+
+   bool is_invariant(ir_variable *var)
+   {
+      if (glslopt_hash_table_find(this->hoisted, var) != NULL)
+         return true;
+      if (glslopt_hash_table_find(this->declared, var) != NULL)
+         return false;
+      loop_variable *const lv = this->lvs->get(var);
+      return lv == NULL || lv->num_assignments == 0;
+   }
+
+   bool is_invariant(ir_rvalue *ir, bool allow_texture, unsigned *ops);
+
+   void mark_hoisted(ir_variable *var)
+   {
+      glslopt_hash_table_insert(this->hoisted, var, var);
+   }
+
+   ir_loop *loop;
+   loop_variable_state *lvs;
+
+private:
+   /** Variables now written in front of the loop. */
+   hash_table *hoisted;
+   /** Variables declared in the loop, which can't be read in front of it. */
+   hash_table *declared;
+};
+
+
+/**
+ * Whether the value is the same in every iteration.  Anything that does
+ * actual work is counted in *ops.
+ */
+bool
+loop_invariant_state::is_invariant(ir_rvalue *ir, bool allow_texture,
+                                   unsigned *ops)
+{
+   if (ir == NULL)
+      return true;
+
+   switch (ir->ir_type) {
+   case ir_type_constant:
+      return true;
+
+   case ir_type_dereference_variable:
+      return is_invariant(((ir_dereference_variable *) ir)->var);
+
+   case ir_type_dereference_array: {
+      ir_dereference_array *const deref = (ir_dereference_array *) ir;
+      return is_invariant(deref->array, allow_texture, ops) &&
+             is_invariant(deref->array_index, allow_texture, ops);
+   }
+
+   case ir_type_dereference_record:
+      return is_invariant(((ir_dereference_record *) ir)->record,
+                          allow_texture, ops);
+
+   case ir_type_swizzle:
+      return is_invariant(((ir_swizzle *) ir)->val, allow_texture, ops);
+
+   case ir_type_expression: {
+      ir_expression *const expr = (ir_expression *) ir;
+      if (expr->operation != ir_unop_neg)
+         (*ops)++;
+      for (unsigned i = 0; i < expr->get_num_operands(); i++) {
+         if (!is_invariant(expr->operands[i], allow_texture, ops))
+            return false;
+      }
+      return true;
+   }
+
+   case ir_type_texture: {
+      ir_texture *const tex = (ir_texture *) ir;
+      if (!allow_texture)
+         return false;
+      (*ops)++;
+      if (!is_invariant(tex->sampler, allow_texture, ops) ||
+          !is_invariant(tex->coordinate, allow_texture, ops) ||
+          !is_invariant(tex->offset, allow_texture, ops))
+         return false;
+      switch (tex->op) {
+      case ir_tex:
+      case ir_lod:
+      case ir_query_levels:
+         return true;
+      case ir_txb:
+         return is_invariant(tex->lod_info.bias, allow_texture, ops);
+      case ir_txl:
+      case ir_txf:
+      case ir_txs:
+         return is_invariant(tex->lod_info.lod, allow_texture, ops);
+      case ir_txf_ms:
+         return is_invariant(tex->lod_info.sample_index, allow_texture, ops);
+      case ir_tg4:
+         return is_invariant(tex->lod_info.component, allow_texture, ops);
+      case ir_txd:
+         return is_invariant(tex->lod_info.grad.dPdx, allow_texture, ops) &&
+                is_invariant(tex->lod_info.grad.dPdy, allow_texture, ops);
+      }
+      return false;
+   }
+
+   default:
+      return false;
+   }
+}
+
+
+/**
+ * Replaces invariant expressions in a loop body with temporaries computed in
+ * front of the loop.
+ */
+class invariant_expression_visitor : public ir_rvalue_enter_visitor {
+public:
+   invariant_expression_visitor(loop_invariant_state *state)
+      : state(state), if_depth(0), progress(false), hoisted(NULL),
+        num_hoisted(0)
+   {
+   }
+
+   ~invariant_expression_visitor()
+   {
+      glslopt_ralloc_free(this->hoisted);
+   }
+
+   virtual ir_visitor_status visit_enter(ir_if *ir)
+   {
+      ir_visitor_status s = ir_rvalue_enter_visitor::visit_enter(ir);
+      this->if_depth++;
+      return s;
+   }
+
+   virtual ir_visitor_status visit_leave(ir_if *)
+   {
+      this->if_depth--;
+      return visit_continue;
+   }
+
+   virtual ir_visitor_status visit_enter(ir_loop *)
+   {
+      this->if_depth++;
+      return visit_continue;
+   }
+
+   virtual ir_visitor_status visit_leave(ir_loop *)
+   {
+      this->if_depth--;
+      return visit_continue;
+   }
+
+   virtual void handle_rvalue(ir_rvalue **rvalue);
+
+   loop_invariant_state *state;
+   /** Depth of conditional code (and nested loops, which may not run). */
+   int if_depth;
+   bool progress;
+
+private:
+   /** Assignments made in front of the loop so far. */
+   ir_assignment **hoisted;
+   unsigned num_hoisted;
+};
+
+
+void
+invariant_expression_visitor::handle_rvalue(ir_rvalue **rvalue)
+{
+   ir_rvalue *const ir = *rvalue;
+   if (ir == NULL ||
+       (ir->ir_type != ir_type_expression && ir->ir_type != ir_type_texture))
+      return;
+   if (!ir->type->is_scalar() && !ir->type->is_vector() &&
+       !ir->type->is_matrix())
+      return;
+
+   unsigned ops = 0;
+   if (!this->state->is_invariant(ir, this->if_depth == 0, &ops) || ops == 0)
+      return;
+
+   ir_variable *var = NULL;
+   for (unsigned i = 0; i < this->num_hoisted; i++) {
+      if (this->hoisted[i]->rhs->equals(ir)) {
+         var = this->hoisted[i]->lhs->variable_referenced();
+         break;
+      }
+   }
+
+   void *const mem_ctx = glslopt_ralloc_parent(ir);
+   if (var == NULL) {
+      var = new(mem_ctx) ir_variable(ir->type, "licm", ir_var_temporary,
+                                     ir->get_precision());
+      ir_assignment *const assign =
+         new(mem_ctx) ir_assignment(new(mem_ctx) ir_dereference_variable(var),
+                                    ir);
+      this->state->loop->insert_before(var);
+      this->state->loop->insert_before(assign);
+      this->hoisted = reralloc(NULL, this->hoisted, ir_assignment *,
+                               this->num_hoisted + 1);
+      this->hoisted[this->num_hoisted++] = assign;
+      this->state->mark_hoisted(var);
+   }
+
+   *rvalue = new(mem_ctx) ir_dereference_variable(var);
+   this->progress = true;
+}
+
+
+/**
+ * Walks the loops of a shader, innermost first.
+ */
+class loop_walker {
+public:
+   loop_walker(loop_state *loops)
+      : loops(loops)
+   {
+   }
+
+   virtual ~loop_walker()
+   {
+   }
+
+   bool walk_list(exec_list *instructions);
+
+   /** Transforms one loop whose nested loops didn't change. */
+   virtual bool process_loop(ir_loop *loop) = 0;
+
+   loop_state *loops;
+};
+
+
+/**
+ * Processes the loops in the list, innermost first.  Returns whether
+ * anything changed.
+ */
+bool
+loop_walker::walk_list(exec_list *instructions)
+{
+   bool progress = false;
+
+   foreach_in_list_safe(ir_instruction, ir, instructions) {
+      switch (ir->ir_type) {
+      case ir_type_function:
+         foreach_in_list(ir_function_signature, sig,
+                         &((ir_function *) ir)->signatures)
+            progress |= walk_list(&sig->body);
+         break;
+      case ir_type_if:
+         progress |= walk_list(&((ir_if *) ir)->then_instructions);
+         progress |= walk_list(&((ir_if *) ir)->else_instructions);
+         break;
+      case ir_type_loop: {
+         ir_loop *const loop = (ir_loop *) ir;
+         /* The analysis doesn't know about changes in nested loops; leave
+          * this one for the next round.
+          */
+         if (walk_list(&loop->body_instructions))
+            progress = true;
+         else
+            progress |= process_loop(loop);
+         break;
+      }
+      default:
+         break;
+      }
+   }
+
+   return progress;
+}
+
+
+class loop_invariant_motion : public loop_walker {
+public:
+   loop_invariant_motion(loop_state *loops, ir_variable_refcount_visitor *refs)
+      : loop_walker(loops), refs(refs)
+   {
+   }
+
+   virtual bool process_loop(ir_loop *loop);
+   bool hoist_assignments(loop_invariant_state *state);
+
+   /** References in the whole program; moving code doesn't change them. */
+   ir_variable_refcount_visitor *refs;
+};
+
+
+/**
+ * Moves invariant assignments at the top level of the loop body in front of
+ * the loop, in order.
+ */
+bool
+loop_invariant_motion::hoist_assignments(loop_invariant_state *state)
+{
+   bool progress = false;
+   ir_variable_refcount_visitor local;
+   state->loop->accept(&local);
+
+   foreach_in_list_safe(ir_instruction, node, &state->loop->body_instructions) {
+      ir_assignment *const assign = node->as_assignment();
+      if (assign == NULL || assign->condition != NULL)
+         continue;
+
+      ir_dereference_variable *const lhs = assign->lhs->as_dereference_variable();
+      if (lhs == NULL)
+         continue;
+      ir_variable *const var = lhs->var;
+      if (var->data.mode != ir_var_auto && var->data.mode != ir_var_temporary)
+         continue;
+      if ((var->type->is_scalar() || var->type->is_vector()) &&
+          assign->write_mask != (1u << var->type->vector_elements) - 1)
+         continue;
+
+      loop_variable *const lv = state->lvs->get(var);
+      if (lv == NULL || lv->num_assignments != 1 ||
+          lv->conditional_or_nested_assignment || lv->read_before_write)
+         continue;
+
+      unsigned ops = 0;
+      if (!state->is_invariant(assign->rhs, true, &ops))
+         continue;
+
+      /* The value after the loop would differ when the loop body never
+       * runs, so the variable can't be used outside of it.
+       */
+      ir_variable_refcount_entry *const total = this->refs->find_variable_entry(var);
+      ir_variable_refcount_entry *const inside = local.find_variable_entry(var);
+      if (total == NULL || inside == NULL ||
+          total->referenced_count != inside->referenced_count)
+         continue;
+
+      /* Declarations in the loop body go along. */
+      foreach_in_list(ir_instruction, decl, &state->loop->body_instructions) {
+         if (decl == var) {
+            var->remove();
+            state->loop->insert_before(var);
+            break;
+         }
+      }
+
+      assign->remove();
+      state->loop->insert_before(assign);
+      state->mark_hoisted(var);
+      progress = true;
+   }
+
+   return progress;
+}
+
+
+bool
+loop_invariant_motion::process_loop(ir_loop *loop)
+{
+   loop_variable_state *const lvs = this->loops->get(loop);
+
+   /* Calls may write to anything, and the analysis skips their arguments. */
+   if (lvs == NULL || lvs->contains_calls)
+      return false;
+
+   loop_invariant_state state(loop, lvs);
+   bool progress = hoist_assignments(&state);
+
+   invariant_expression_visitor v(&state);
+   visit_list_elements(&v, &loop->body_instructions);
+
+   return progress || v.progress;
+}
+
+/**
+ * Finds the first if-statement with an invariant condition in a loop body,
+ * outside of nested loops, and measures the loop.
+ */
+class unswitch_candidate_visitor : public ir_hierarchical_visitor {
+public:
+   unswitch_candidate_visitor(loop_invariant_state *state)
+      : state(state), loop_depth(0), nodes(0), num_invariant_ifs(0),
+        candidate(NULL)
+   {
+   }
+
+   virtual ir_visitor_status visit_enter(ir_assignment *)
+   {
+      this->nodes++;
+      return visit_continue;
+   }
+
+   virtual ir_visitor_status visit_enter(ir_expression *)
+   {
+      this->nodes++;
+      return visit_continue;
+   }
+
+   virtual ir_visitor_status visit_enter(ir_loop *)
+   {
+      this->loop_depth++;
+      return visit_continue;
+   }
+
+   virtual ir_visitor_status visit_leave(ir_loop *)
+   {
+      this->loop_depth--;
+      return visit_continue;
+   }
+
+   virtual ir_visitor_status visit_enter(ir_if *ir)
+   {
+      unsigned ops = 0;
+      if (this->loop_depth == 0 &&
+          this->state->is_invariant(ir->condition, false, &ops)) {
+         if (this->candidate == NULL)
+            this->candidate = ir;
+         this->num_invariant_ifs++;
+      }
+      return visit_continue;
+   }
+
+   loop_invariant_state *state;
+   int loop_depth;
+   int nodes;
+   unsigned num_invariant_ifs;
+   ir_if *candidate;
+};
+
+
+/** The if-statements of a tree, in the order visit_tree() finds them. */
+struct if_array {
+   ir_if **ifs;
+   unsigned count;
+};
+
+
+void
+collect_if(ir_instruction *ir, void *data)
+{
+   ir_if *const iff = ir->as_if();
+   if (iff == NULL)
+      return;
+   if_array *const array = (if_array *) data;
+   array->ifs = reralloc(NULL, array->ifs, ir_if *, array->count + 1);
+   array->ifs[array->count++] = iff;
+}
+
+
+/** Replaces an if-statement with the instructions of one of its branches. */
+void
+replace_with_branch(ir_if *ir, exec_list *branch)
+{
+   foreach_in_list_safe(ir_instruction, node, branch) {
+      node->remove();
+      ir->insert_before(node);
+   }
+   ir->remove();
+}
+
+
+class loop_unswitching : public loop_walker {
+public:
+   loop_unswitching(loop_state *loops, int max_nodes)
+      : loop_walker(loops), max_nodes(max_nodes)
+   {
+   }
+
+   virtual bool process_loop(ir_loop *loop);
+
+   /** Size all the copies of one loop may add up to. */
+   int max_nodes;
+};
+
+
+/**
+ * Turns
+ *
+ *     (loop (...a... (if (cond) (...then...) (...else...)) ...b...))
+ *
+ * with an invariant cond into
+ *
+ *     (if (cond)
+ *         ((loop (...a... ...then... ...b...)))
+ *       ((loop (...a... ...else... ...b...))))
+ */
+bool
+loop_unswitching::process_loop(ir_loop *loop)
+{
+   loop_variable_state *const lvs = this->loops->get(loop);
+
+   /* Calls may write to anything, and the analysis skips their arguments. */
+   if (lvs == NULL || lvs->contains_calls)
+      return false;
+
+   loop_invariant_state state(loop, lvs);
+   unswitch_candidate_visitor v(&state);
+   v.run(&loop->body_instructions);
+
+   /* Each copy gets unswitched again on the remaining conditions, so the
+    * loop ends up in 2^n copies, each at most as large as the loop.
+    */
+   if (v.candidate == NULL || v.num_invariant_ifs >= 16 ||
+       v.nodes << v.num_invariant_ifs > this->max_nodes)
+      return false;
+
+   void *const mem_ctx = glslopt_ralloc_parent(loop);
+
+   /* Initial values of induction variables move into both branches, so that
+    * each copy still has a known iteration count.  That needs nothing between
+    * the assignment and the loop to use the variable.
+    */
+   ir_instruction **inits = NULL;
+   unsigned num_inits = 0;
+   foreach_in_list(loop_variable, lv, &lvs->induction_variables) {
+      if (lv->initial_value == NULL)
+         continue;
+
+      ir_variable_refcount_visitor refs;
+      for (exec_node *node = lv->initial_value_ir->next; node != loop;
+           node = node->next)
+         ((ir_instruction *) node)->accept(&refs);
+      if (refs.find_variable_entry(lv->var) != NULL)
+         continue;
+
+      inits = reralloc(NULL, inits, ir_instruction *, num_inits + 1);
+      inits[num_inits++] = lv->initial_value_ir;
+   }
+
+   hash_table *const ht = glslopt_hash_table_ctor(0, glslopt_hash_table_pointer_hash,
+                                                  glslopt_hash_table_pointer_compare);
+   ir_loop *const copy = loop->clone(mem_ctx, ht);
+   glslopt_hash_table_dtor(ht);
+
+   /* Find the same if-statement in the copy by its position. */
+   if_array ifs = { NULL, 0 }, copy_ifs = { NULL, 0 };
+   visit_tree(loop, collect_if, &ifs);
+   visit_tree(copy, collect_if, &copy_ifs);
+   assert(ifs.count == copy_ifs.count);
+
+   ir_if *copy_if = NULL;
+   for (unsigned i = 0; i < ifs.count; i++) {
+      if (ifs.ifs[i] == v.candidate) {
+         copy_if = copy_ifs.ifs[i];
+         break;
+      }
+   }
+   glslopt_ralloc_free(ifs.ifs);
+   glslopt_ralloc_free(copy_ifs.ifs);
+   assert(copy_if != NULL);
+
+   ir_if *const unswitched =
+      new(mem_ctx) ir_if(v.candidate->condition->clone(mem_ctx, NULL));
+   loop->insert_before(unswitched);
+   loop->remove();
+   unswitched->then_instructions.push_tail(copy);
+   unswitched->else_instructions.push_tail(loop);
+
+   for (unsigned i = 0; i < num_inits; i++) {
+      inits[i]->remove();
+      copy->insert_before(inits[i]->clone(mem_ctx, NULL));
+      loop->insert_before(inits[i]);
+   }
+   glslopt_ralloc_free(inits);
+
+   replace_with_branch(copy_if, &copy_if->then_instructions);
+   replace_with_branch(v.candidate, &v.candidate->else_instructions);
+
+   return true;
+}
+
+} /* anonymous namespace */
+
+
+bool
+hoist_loop_invariants(exec_list *instructions, loop_state *ls)
+{
+   ir_variable_refcount_visitor refs;
+   visit_list_elements(&refs, instructions);
+
+   loop_invariant_motion motion(ls, &refs);
+   return motion.walk_list(instructions);
+}
+
+
+bool
+unswitch_loops(exec_list *instructions, loop_state *ls,
+               const struct gl_shader_compiler_options *options)
+{
+   loop_unswitching unswitching(ls, options->MaxUnrollIterations * 25);
+   return unswitching.walk_list(instructions);
+}
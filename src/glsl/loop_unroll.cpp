@@ -41,6 +41,8 @@ public:
 
    virtual ir_visitor_status visit_leave(ir_loop *ir);
    void simple_unroll(ir_loop *ir, int iterations);
+   void partial_unroll(ir_loop *ir, ir_if *terminator, int iterations,
+                       int factor);
    void complex_unroll(ir_loop *ir, int iterations,
                        bool continue_from_then_branch);
    void splice_post_if_instructions(ir_if *ir_if, exec_list *splice_dest);
@@ -96,6 +98,15 @@ public:
       return visit_continue;
    }
 
+   virtual ir_visitor_status visit_enter(ir_call *ir)
+   {
+      /* A function that wasn't inlined still runs its whole body. */
+      loop_unroll_count callee(&ir->callee->body, ls, options);
+      nodes += callee.nodes + 1;
+      nested_loop |= callee.nested_loop;
+      return visit_continue;
+   }
+
    virtual ir_visitor_status visit_enter(ir_dereference_array *ir)
    {
       /* Check for arrays variably-indexed by a loop induction variable.
@@ -179,6 +190,77 @@ loop_unroll_visitor::simple_unroll(ir_loop *ir, int iterations)
 }
 
 
+/**
+ * Repeat the body of a loop \c factor times in each iteration, checking the
+ * terminator only in the first copy.  For example, if the input is:
+ *
+ *     (loop (...) ...pre... (if (cond) (break)) ...post...)
+ *
+ * And the iteration count is 7 and the factor is 3, the output will be:
+ *
+ *     ...pre... ...post...
+ *     (loop (...)
+ *      ...pre... (if (cond) (break)) ...post...
+ *      ...pre... ...post...
+ *      ...pre... ...post...)
+ *
+ * The iterations that don't fill a whole unrolled iteration run first, so
+ * that the terminator still ends the loop after the last copy.
+ */
+void
+loop_unroll_visitor::partial_unroll(ir_loop *ir, ir_if *terminator,
+                                    int iterations, int factor)
+{
+   void *const mem_ctx = glslopt_ralloc_parent(ir);
+
+   exec_node *const terminator_prev = terminator->prev;
+   terminator->remove();
+
+   for (int i = 0; i < iterations % factor; i++) {
+      exec_list copy_list;
+
+      copy_list.make_empty();
+      clone_ir_list(mem_ctx, &copy_list, &ir->body_instructions);
+
+      ir->insert_before(&copy_list);
+   }
+
+   exec_list copies;
+   copies.make_empty();
+   for (int i = 1; i < factor; i++)
+      clone_ir_list(mem_ctx, &copies, &ir->body_instructions);
+
+   ir->body_instructions.append_list(&copies);
+
+   if (terminator_prev->is_head_sentinel())
+      ir->body_instructions.push_head(terminator);
+   else
+      terminator_prev->insert_after(terminator);
+
+   this->progress = true;
+}
+
+
+/**
+ * Pick how many copies of the loop body to put in each iteration of a loop
+ * that is too large to unroll fully, or 1 to leave it alone.  All the copies,
+ * including the left over iterations, have to stay within the code size that
+ * full unrolling would be allowed.
+ */
+static int
+partial_unroll_factor(int iterations, int nodes, int max_nodes,
+                      const struct gl_shader_compiler_options *options)
+{
+   int factor = MIN2((int) options->MaxUnrollFactor, iterations / 2);
+
+   for (; factor > 1; factor--) {
+      if (nodes * (factor + iterations % factor) <= max_nodes)
+         break;
+   }
+   return factor;
+}
+
+
 /**
  * Unroll a loop whose last statement is an ir_if.  If \c
  * continue_from_then_branch is true, the loop is repeated only when the
@@ -301,28 +383,34 @@ loop_unroll_visitor::visit_leave(ir_loop *ir)
    iterations = ls->limiting_terminator->iterations;
 
    const int max_iterations = options->MaxUnrollIterations;
+   const int max_nodes = max_iterations * 25;
 
-   /* Don't try to unroll loops that have zillions of iterations either.
-    */
-   if (iterations > max_iterations)
-      return visit_continue;
-
-   /* Don't try to unroll nested loops and loops with a huge body.
-    */
    loop_unroll_count count(&ir->body_instructions, ls, options);
 
-   bool loop_too_large =
-      count.nested_loop || count.nodes * iterations > (int)max_iterations * 25;
-
-   if (loop_too_large && !count.unsupported_variable_indexing)
-      return visit_continue;
-
    /* Note: the limiting terminator contributes 1 to ls->num_loop_jumps.
     * We'll be removing the limiting terminator before we unroll.
     */
    assert(ls->num_loop_jumps > 0);
    unsigned predicted_num_loop_jumps = ls->num_loop_jumps - 1;
 
+   /* Don't try to unroll loops that have zillions of iterations, nested
+    * loops, or loops with a huge body.  Loops without other jumps can
+    * still be unrolled partially.
+    */
+   bool loop_too_large =
+      count.nested_loop || count.nodes * iterations > max_nodes;
+
+   if (iterations > max_iterations ||
+       (loop_too_large && !count.unsupported_variable_indexing)) {
+      if (predicted_num_loop_jumps == 0 && !count.nested_loop) {
+         const int factor =
+            partial_unroll_factor(iterations, count.nodes, max_nodes, options);
+         if (factor > 1)
+            partial_unroll(ir, ls->limiting_terminator->ir, iterations, factor);
+      }
+      return visit_continue;
+   }
+
    if (predicted_num_loop_jumps > 1)
       return visit_continue;
 
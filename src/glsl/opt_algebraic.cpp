@@ -34,9 +34,13 @@
 #include "ir_optimization.h"
 #include "ir_builder.h"
 #include "glsl_types.h"
+#include "s_expression.h"
+#include <mutex>
 
 using namespace ir_builder;
 
+struct rule_pattern;
+
 namespace {
 
 /**
@@ -59,6 +63,10 @@ public:
    }
 
    ir_rvalue *handle_expression(ir_expression *ir);
+   ir_rvalue *apply_rules(ir_expression *ir);
+   ir_rvalue *build_replacement(const rule_pattern *p,
+                                const glsl_type *type,
+                                ir_rvalue **variables, unsigned reused);
    void handle_rvalue(ir_rvalue **rvalue);
    bool reassociate_constant(ir_expression *ir1,
 			     int const_index,
@@ -80,36 +88,6 @@ public:
 
 } /* unnamed namespace */
 
-static inline bool
-is_vec_zero(ir_constant *ir)
-{
-   return (ir == NULL) ? false : ir->is_zero();
-}
-
-static inline bool
-is_vec_one(ir_constant *ir)
-{
-   return (ir == NULL) ? false : ir->is_one();
-}
-
-static inline bool
-is_vec_two(ir_constant *ir)
-{
-   return (ir == NULL) ? false : ir->is_value(2.0, 2);
-}
-
-static inline bool
-is_vec_negative_one(ir_constant *ir)
-{
-   return (ir == NULL) ? false : ir->is_negative_one();
-}
-
-static inline bool
-is_vec_basis(ir_constant *ir)
-{
-   return (ir == NULL) ? false : ir->is_basis();
-}
-
 static inline bool
 is_valid_vec_const(ir_constant *ir)
 {
@@ -167,6 +145,452 @@ update_type(ir_expression *ir)
    }
 }
 
+/**
+ * \name Rewrite rules
+ *
+ * Each rule is a pair of s-expressions, using the operator names of the IR
+ * printer:
+ *
+ * - A symbol is a variable.  In the search pattern it matches any operand,
+ *   and repeated uses have to match equal operands.  "a@pred" only matches
+ *   constants with the property pred: basis, lt1 (every component below
+ *   one), gt0 (above zero) or unit (both).
+ * - A number matches a constant with that value in every component.  In the
+ *   replacement it becomes a constant of the type of its sibling operands,
+ *   or of the expression being replaced.
+ * - (op ...) matches an expression.  Operands of commutative operations are
+ *   tried in both orders.
+ * - (extract v b) in a replacement is the component of v selected by the
+ *   basis vector b.
+ *
+ * The rules are compiled once and indexed by their top-level operation.
+ * For a given operation they are tried in order, so the cheaper rewrites
+ * go first.
+ */
+/*@{*/
+enum {
+   RULE_FLOAT = 1 << 0,        /**< The result has to be float. */
+   RULE_POW = 1 << 1,          /**< The backend has to support pow. */
+   RULE_SAME_TYPES = 1 << 2    /**< All variables have the same type. */
+};
+
+struct algebraic_rule {
+   const char *search;
+   const char *replace;
+   unsigned flags;
+};
+
+static const algebraic_rule algebraic_rules[] = {
+   { "(~ (~ a))", "a", 0 },
+
+   { "(abs (abs a))", "(abs a)", 0 },
+   { "(abs (neg a))", "(abs a)", 0 },
+
+   { "(neg (neg a))", "a", 0 },
+   { "(neg (- a b))", "(- b a)", 0 },
+
+   { "(exp (log a))", "a", 0 },
+   { "(log (exp a))", "a", 0 },
+   { "(exp2 (log2 a))", "a", 0 },
+   { "(exp2 (* (log2 a) b))", "(pow a b)", RULE_POW },
+   { "(log2 (exp2 a))", "a", 0 },
+
+   { "(! (< a b))", "(>= a b)", 0 },
+   { "(! (> a b))", "(<= a b)", 0 },
+   { "(! (<= a b))", "(> a b)", 0 },
+   { "(! (>= a b))", "(< a b)", 0 },
+   { "(! (== a b))", "(!= a b)", 0 },
+   { "(! (!= a b))", "(== a b)", 0 },
+   { "(! (all_equal a b))", "(any_nequal a b)", 0 },
+   { "(! (any_nequal a b))", "(all_equal a b)", 0 },
+
+   { "(+ a 0)", "a", 0 },
+   { "(+ a (neg b))", "(- a b)", 0 },
+   /* (-x + y) * a + x == x * (1 - a) + y * a */
+   { "(+ (* (+ (neg a) b) c) a)", "(lrp a b c)", RULE_SAME_TYPES },
+
+   { "(- 0 a)", "(neg a)", 0 },
+   { "(- a 0)", "a", 0 },
+
+   { "(* a 1)", "a", 0 },
+   { "(* a 0)", "0", 0 },
+   { "(* a -1)", "(neg a)", 0 },
+
+   { "(/ 1 a)", "(rcp a)", RULE_FLOAT },
+   { "(/ a 1)", "a", 0 },
+
+   { "(dot a 0)", "0", 0 },
+   { "(dot a@basis b)", "(extract b a)", 0 },
+
+   { "(< (+ a b) 0)", "(< a (neg b))", 0 },
+   { "(< 0 (+ a b))", "(< (neg b) a)", 0 },
+   { "(> (+ a b) 0)", "(> a (neg b))", 0 },
+   { "(> 0 (+ a b))", "(> (neg b) a)", 0 },
+   { "(<= (+ a b) 0)", "(<= a (neg b))", 0 },
+   { "(<= 0 (+ a b))", "(<= (neg b) a)", 0 },
+   { "(>= (+ a b) 0)", "(>= a (neg b))", 0 },
+   { "(>= 0 (+ a b))", "(>= (neg b) a)", 0 },
+   { "(== (+ a b) 0)", "(== a (neg b))", 0 },
+   { "(!= (+ a b) 0)", "(!= a (neg b))", 0 },
+
+   { "(<< 0 a)", "0", 0 },
+   { "(<< a 0)", "a", 0 },
+   { "(>> 0 a)", "0", 0 },
+   { "(>> a 0)", "a", 0 },
+
+   { "(&& a 1)", "a", 0 },
+   { "(&& a 0)", "0", 0 },
+   { "(&& (! a) (! b))", "(! (|| a b))", 0 },
+   { "(&& a a)", "a", 0 },
+
+   { "(^^ a 0)", "a", 0 },
+   { "(^^ a 1)", "(! a)", 0 },
+   { "(^^ a a)", "0", 0 },
+
+   { "(|| a 0)", "a", 0 },
+   { "(|| a 1)", "1", 0 },
+   { "(|| (! a) (! b))", "(! (&& a b))", 0 },
+   { "(|| a a)", "a", 0 },
+
+   { "(pow 1 a)", "1", 0 },
+   { "(pow a 1)", "a", 0 },
+   { "(pow 2 a)", "(exp2 a)", 0 },
+   { "(pow a 2)", "(* a a)", 0 },
+
+   /* saturate in disguise */
+   { "(min (max a 0) 1)", "(sat a)", RULE_FLOAT },
+   { "(max (min a 1) 0)", "(sat a)", RULE_FLOAT },
+   { "(min (max a 0) b@lt1)", "(min (sat a) b)", RULE_FLOAT },
+   { "(max (min a b@unit) 0)", "(min (sat a) b)", RULE_FLOAT },
+   { "(min (max a b@unit) 1)", "(max (sat a) b)", RULE_FLOAT },
+   { "(max (min a 1) b@gt0)", "(max (sat a) b)", RULE_FLOAT },
+
+   { "(rcp (rcp a))", "a", 0 },
+   /* While ir_to_mesa.cpp will lower sqrt(x) to rcp(rsq(x)), it does so at
+    * its IR level, so we can always apply this transformation.
+    */
+   { "(rcp (rsq a))", "(sqrt a)", 0 },
+   /* As far as we know, all backends are OK with rsq. */
+   { "(rcp (sqrt a))", "(rsq a)", 0 },
+
+   /* Operands are op0 * op1 + op2. */
+   { "(fma 0 a b)", "b", 0 },
+   { "(fma a 0 b)", "b", 0 },
+   { "(fma a b 0)", "(* a b)", 0 },
+   { "(fma 1 a b)", "(+ a b)", 0 },
+   { "(fma a 1 b)", "(+ a b)", 0 },
+
+   /* Operands are (x, y, a). */
+   { "(lrp a b 0)", "a", 0 },
+   { "(lrp a b 1)", "b", 0 },
+   { "(lrp a a b)", "a", 0 },
+   { "(lrp 0 a b)", "(* a b)", 0 },
+   { "(lrp a 0 b)", "(* a (+ 1 (neg b)))", 0 },
+
+   { "(csel 1 a b)", "a", 0 },
+   { "(csel 0 a b)", "b", 0 },
+};
+
+#define MAX_RULE_VARIABLES 4
+
+enum pattern_kind {
+   PATTERN_EXPRESSION,
+   PATTERN_VARIABLE,
+   PATTERN_CONSTANT,
+   PATTERN_EXTRACT
+};
+
+enum constant_predicate {
+   PREDICATE_NONE,
+   PREDICATE_BASIS,
+   PREDICATE_LESS_THAN_ONE,
+   PREDICATE_GREATER_THAN_ZERO,
+   PREDICATE_UNIT
+};
+
+struct rule_pattern {
+   pattern_kind kind;
+   ir_expression_operation op;
+   unsigned num_operands;
+   rule_pattern *operands[4];
+   unsigned variable;
+   constant_predicate predicate;
+   float value;
+};
+
+struct compiled_rule {
+   rule_pattern *search;
+   rule_pattern *replace;
+   unsigned flags;
+   unsigned reused;      /**< Variables used more than once by replace */
+   int operand_ops[4];   /**< Operation of each top-level operand, or -1 */
+};
+
+/**
+ * The compiled rules, sorted by top-level operation.  Those for operation
+ * op are rules[first[op]] up to rules[first[op + 1]].
+ */
+struct rule_table {
+   compiled_rule rules[Elements(algebraic_rules)];
+   unsigned first[ir_quadop_vector + 2];
+};
+
+static rule_table *compiled_rules = NULL;
+static std::once_flag compiled_rules_flag;
+
+static bool
+is_commutative(ir_expression_operation op)
+{
+   switch (op) {
+   case ir_binop_add:
+   case ir_binop_mul:
+   case ir_binop_equal:
+   case ir_binop_nequal:
+   case ir_binop_all_equal:
+   case ir_binop_any_nequal:
+   case ir_binop_bit_and:
+   case ir_binop_bit_xor:
+   case ir_binop_bit_or:
+   case ir_binop_logic_and:
+   case ir_binop_logic_xor:
+   case ir_binop_logic_or:
+   case ir_binop_dot:
+   case ir_binop_min:
+   case ir_binop_max:
+      return true;
+   default:
+      return false;
+   }
+}
+
+static rule_pattern *
+compile_pattern(void *mem_ctx, s_expression *expr, const char **names,
+                unsigned *num_names, unsigned *uses)
+{
+   rule_pattern *const p = rzalloc(mem_ctx, rule_pattern);
+
+   if (expr->is_number()) {
+      p->kind = PATTERN_CONSTANT;
+      p->value = ((s_number *) expr)->fvalue();
+      return p;
+   }
+
+   if (expr->is_symbol()) {
+      const char *name = ((s_symbol *) expr)->value();
+      const char *at = strchr(name, '@');
+      const size_t length = at ? size_t(at - name) : strlen(name);
+
+      p->kind = PATTERN_VARIABLE;
+      for (p->variable = 0; p->variable < *num_names; p->variable++) {
+         if (strlen(names[p->variable]) == length &&
+             strncmp(names[p->variable], name, length) == 0)
+            break;
+      }
+      if (p->variable == *num_names) {
+         assert(*num_names < MAX_RULE_VARIABLES);
+         names[(*num_names)++] = glslopt_ralloc_strndup(mem_ctx, name, length);
+      }
+      uses[p->variable]++;
+
+      if (at == NULL)
+         p->predicate = PREDICATE_NONE;
+      else if (strcmp(at, "@basis") == 0)
+         p->predicate = PREDICATE_BASIS;
+      else if (strcmp(at, "@lt1") == 0)
+         p->predicate = PREDICATE_LESS_THAN_ONE;
+      else if (strcmp(at, "@gt0") == 0)
+         p->predicate = PREDICATE_GREATER_THAN_ZERO;
+      else if (strcmp(at, "@unit") == 0)
+         p->predicate = PREDICATE_UNIT;
+      else
+         assert(!"Unknown constant predicate");
+      return p;
+   }
+
+   s_list *const list = SX_AS_LIST(expr);
+   assert(list != NULL && !list->subexpressions.is_empty());
+   s_symbol *const head = SX_AS_SYMBOL(list->subexpressions.get_head());
+   assert(head != NULL);
+
+   if (strcmp(head->value(), "extract") == 0) {
+      p->kind = PATTERN_EXTRACT;
+   } else {
+      p->kind = PATTERN_EXPRESSION;
+      p->op = ir_expression::get_operator(head->value());
+      assert(p->op != (ir_expression_operation) -1);
+   }
+
+   foreach_in_list(s_expression, sub, &list->subexpressions) {
+      if (sub == head)
+         continue;
+      assert(p->num_operands < 4);
+      p->operands[p->num_operands++] =
+         compile_pattern(mem_ctx, sub, names, num_names, uses);
+   }
+   assert(p->kind != PATTERN_EXPRESSION ||
+          p->num_operands == ir_expression::get_num_operands(p->op));
+   return p;
+}
+
+static void
+compile_rules()
+{
+   void *const mem_ctx = glslopt_ralloc_autofree_context();
+   rule_table *const table = rzalloc(mem_ctx, rule_table);
+
+   compiled_rule unsorted[Elements(algebraic_rules)];
+   unsigned count[ir_quadop_vector + 1] = { 0 };
+   for (unsigned i = 0; i < Elements(algebraic_rules); i++) {
+      compiled_rule *const rule = &unsorted[i];
+      const char *names[MAX_RULE_VARIABLES];
+      unsigned num_names = 0;
+      unsigned uses[MAX_RULE_VARIABLES] = { 0 };
+
+      const char *src = algebraic_rules[i].search;
+      rule->search = compile_pattern(mem_ctx,
+                                     s_expression::read_expression(mem_ctx, src),
+                                     names, &num_names, uses);
+      assert(rule->search->kind == PATTERN_EXPRESSION);
+
+      memset(uses, 0, sizeof(uses));
+      src = algebraic_rules[i].replace;
+      rule->replace = compile_pattern(mem_ctx,
+                                      s_expression::read_expression(mem_ctx, src),
+                                      names, &num_names, uses);
+      rule->reused = 0;
+      for (unsigned v = 0; v < num_names; v++) {
+         if (uses[v] > 1)
+            rule->reused |= 1 << v;
+      }
+      rule->flags = algebraic_rules[i].flags;
+
+      for (unsigned o = 0; o < 4; o++) {
+         const rule_pattern *const operand =
+            o < rule->search->num_operands ? rule->search->operands[o] : NULL;
+         rule->operand_ops[o] =
+            operand && operand->kind == PATTERN_EXPRESSION ? operand->op : -1;
+      }
+      count[rule->search->op]++;
+   }
+
+   /* Counting sort by top-level operation, keeping the order of the rules
+    * for each.
+    */
+   for (unsigned op = 0; op <= ir_quadop_vector; op++)
+      table->first[op + 1] = table->first[op] + count[op];
+   unsigned next[ir_quadop_vector + 1];
+   memcpy(next, table->first, sizeof(next));
+   for (unsigned i = 0; i < Elements(algebraic_rules); i++)
+      table->rules[next[unsorted[i].search->op]++] = unsorted[i];
+
+   compiled_rules = table;
+}
+
+static ir_constant *
+constant_value(ir_rvalue *ir)
+{
+   ir_constant *const constant = ir->as_constant();
+   return constant ? constant : ir->constant_expression_value();
+}
+
+static bool
+matches_predicate(ir_constant *c, constant_predicate predicate)
+{
+   switch (predicate) {
+   case PREDICATE_BASIS:
+      return c->is_basis();
+   case PREDICATE_LESS_THAN_ONE:
+      return is_less_than_one(c);
+   case PREDICATE_GREATER_THAN_ZERO:
+      return is_greater_than_zero(c);
+   case PREDICATE_UNIT:
+      return is_greater_than_zero(c) && is_less_than_one(c);
+   default:
+      return true;
+   }
+}
+
+static bool match_pattern(const rule_pattern *p, ir_rvalue *ir,
+                          ir_rvalue **variables);
+
+/**
+ * Matches the operands of an expression, also trying the other order if the
+ * operation is commutative.  Variables are only bound on success.
+ */
+static bool
+match_operands(const rule_pattern *p, ir_expression *ir, ir_rvalue **variables)
+{
+   ir_rvalue *bound[MAX_RULE_VARIABLES];
+   memcpy(bound, variables, sizeof(bound));
+
+   bool matched = true;
+   for (unsigned i = 0; matched && i < p->num_operands; i++)
+      matched = match_pattern(p->operands[i], ir->operands[i], bound);
+
+   if (!matched && is_commutative(p->op)) {
+      memcpy(bound, variables, sizeof(bound));
+      matched = match_pattern(p->operands[0], ir->operands[1], bound) &&
+                match_pattern(p->operands[1], ir->operands[0], bound);
+   }
+
+   if (matched)
+      memcpy(variables, bound, sizeof(bound));
+   return matched;
+}
+
+static bool
+match_pattern(const rule_pattern *p, ir_rvalue *ir, ir_rvalue **variables)
+{
+   switch (p->kind) {
+   case PATTERN_VARIABLE:
+      if (p->predicate != PREDICATE_NONE) {
+         ir_constant *const c = constant_value(ir);
+         if (c == NULL || !matches_predicate(c, p->predicate))
+            return false;
+      }
+      if (variables[p->variable] != NULL)
+         return variables[p->variable]->equals(ir);
+      variables[p->variable] = ir;
+      return true;
+
+   case PATTERN_CONSTANT: {
+      ir_constant *const c = constant_value(ir);
+      if (c == NULL)
+         return false;
+      if (c->type->base_type != GLSL_TYPE_FLOAT && p->value != int(p->value))
+         return false;
+      return c->is_value(p->value, int(p->value));
+   }
+
+   case PATTERN_EXPRESSION: {
+      ir_expression *const expr = ir->as_expression();
+      return expr != NULL && expr->operation == p->op &&
+             match_operands(p, expr, variables);
+   }
+
+   default:
+      return false;
+   }
+}
+
+/** A constant of the given type with value in every component. */
+static ir_constant *
+constant_of_type(void *mem_ctx, const glsl_type *type, float value)
+{
+   ir_constant_data data;
+   memset(&data, 0, sizeof(data));
+   for (unsigned c = 0; c < type->components(); c++) {
+      switch (type->base_type) {
+      case GLSL_TYPE_FLOAT: data.f[c] = value; break;
+      case GLSL_TYPE_INT: data.i[c] = int(value); break;
+      case GLSL_TYPE_UINT: data.u[c] = unsigned(value); break;
+      default: data.b[c] = value != 0.0f; break;
+      }
+   }
+   return new(mem_ctx) ir_constant(type, &data);
+}
+/*@}*/
+
 /* Recognize (v.x + v.y) + (v.z + v.w) as dot(v, 1.0) */
 static ir_expression *
 try_replace_with_dot(ir_expression *expr0, ir_expression *expr1, void *mem_ctx)
@@ -291,513 +715,201 @@ ir_algebraic_visitor::swizzle_if_required(ir_expression *expr,
       return operand;
 }
 
+/**
+ * Whether the top-level operands can possibly match the rule, before trying
+ * the whole pattern.
+ */
+static bool
+may_match(const compiled_rule *rule, const int *operand_ops)
+{
+   const rule_pattern *const search = rule->search;
+   bool matched = true;
+   for (unsigned i = 0; matched && i < search->num_operands; i++) {
+      matched = rule->operand_ops[i] < 0 ||
+                rule->operand_ops[i] == operand_ops[i];
+   }
+   if (!matched && is_commutative(search->op)) {
+      matched = (rule->operand_ops[0] < 0 ||
+                 rule->operand_ops[0] == operand_ops[1]) &&
+                (rule->operand_ops[1] < 0 ||
+                 rule->operand_ops[1] == operand_ops[0]);
+   }
+   return matched;
+}
+
 ir_rvalue *
-ir_algebraic_visitor::handle_expression(ir_expression *ir)
+ir_algebraic_visitor::build_replacement(const rule_pattern *p,
+                                        const glsl_type *type,
+                                        ir_rvalue **variables,
+                                        unsigned reused)
 {
-   ir_constant *op_const[4] = {NULL, NULL, NULL, NULL};
-   ir_expression *op_expr[4] = {NULL, NULL, NULL, NULL};
-   unsigned int i;
+   switch (p->kind) {
+   case PATTERN_VARIABLE: {
+      ir_rvalue *const value = variables[p->variable];
+      if (reused & (1 << p->variable))
+         return value->clone(mem_ctx, NULL);
+      return value;
+   }
 
-   assert(ir->get_num_operands() <= 4);
-   for (i = 0; i < ir->get_num_operands(); i++) {
-      if (ir->operands[i]->type->is_matrix())
-	 return ir;
+   case PATTERN_CONSTANT:
+      return constant_of_type(mem_ctx, type, p->value);
 
-      op_const[i] = ir->operands[i]->constant_expression_value();
-      op_expr[i] = ir->operands[i]->as_expression();
+   case PATTERN_EXTRACT: {
+      ir_constant *const basis = constant_value(variables[p->operands[1]->variable]);
+      unsigned component = 0;
+      for (unsigned c = 0; c < basis->type->vector_elements; c++) {
+         if (basis->get_float_component(c) == 1.0f)
+            component = c;
+      }
+      ir_rvalue *const vec = build_replacement(p->operands[0], type,
+                                               variables, reused);
+      return new(mem_ctx) ir_swizzle(vec, component, 0, 0, 0, 1);
    }
 
-   if (this->mem_ctx == NULL)
-      this->mem_ctx = glslopt_ralloc_parent(ir);
-
-   switch (ir->operation) {
-   case ir_unop_bit_not:
-      if (op_expr[0] && op_expr[0]->operation == ir_unop_bit_not)
-         return op_expr[0]->operands[0];
+   default:
       break;
+   }
 
-   case ir_unop_abs:
-      if (op_expr[0] == NULL)
-	 break;
-
-      switch (op_expr[0]->operation) {
-      case ir_unop_abs:
-      case ir_unop_neg:
-         return abs(op_expr[0]->operands[0]);
-      default:
-         break;
+   /* Constants get the type of their siblings, so build those first. */
+   ir_rvalue *operands[4] = { NULL, NULL, NULL, NULL };
+   const glsl_type *operand_type = type;
+   for (unsigned i = 0; i < p->num_operands; i++) {
+      if (p->operands[i]->kind != PATTERN_CONSTANT) {
+         operands[i] = build_replacement(p->operands[i], type, variables,
+                                         reused);
+         operand_type = operands[i]->type;
       }
-      break;
-
-   case ir_unop_neg:
-      if (op_expr[0] == NULL)
-	 break;
+   }
+   for (unsigned i = 0; i < p->num_operands; i++) {
+      if (operands[i] == NULL)
+         operands[i] = constant_of_type(mem_ctx, operand_type,
+                                        p->operands[i]->value);
+   }
 
-      if (op_expr[0]->operation == ir_unop_neg) {
-         return op_expr[0]->operands[0];
-      }
-	   if (op_expr[0] && op_expr[0]->operation == ir_binop_sub) {
-		   // -(A-B) => (B-A)
-		   this->progress = true;
-		   return new(mem_ctx) ir_expression(ir_binop_sub,
-											 ir->type,
-											 op_expr[0]->operands[1],
-											 op_expr[0]->operands[0]);
-	   }
-      break;
+   switch (p->num_operands) {
+   case 1:
+      return new(mem_ctx) ir_expression(p->op, operands[0]);
+   case 2:
+      return new(mem_ctx) ir_expression(p->op, operands[0], operands[1]);
+   default:
+      return new(mem_ctx) ir_expression(p->op, operands[0], operands[1],
+                                        operands[2]);
+   }
+}
 
-   case ir_unop_exp:
-      if (op_expr[0] == NULL)
-	 break;
+/**
+ * Rewrites the expression with the first rule that matches, or returns
+ * NULL.
+ */
+ir_rvalue *
+ir_algebraic_visitor::apply_rules(ir_expression *ir)
+{
+   std::call_once(compiled_rules_flag, compile_rules);
+
+   const unsigned first = compiled_rules->first[ir->operation];
+   const unsigned last = compiled_rules->first[ir->operation + 1];
+   if (first == last)
+      return NULL;
+
+   int operand_ops[4];
+   for (unsigned i = 0; i < 4; i++) {
+      ir_expression *const operand =
+         i < ir->get_num_operands() ? ir->operands[i]->as_expression() : NULL;
+      operand_ops[i] = operand ? operand->operation : -1;
+   }
 
-      if (op_expr[0]->operation == ir_unop_log) {
-         return op_expr[0]->operands[0];
+   for (unsigned r = first; r < last; r++) {
+      const compiled_rule *const rule = &compiled_rules->rules[r];
+
+      if ((rule->flags & RULE_FLOAT) &&
+          ir->type->base_type != GLSL_TYPE_FLOAT)
+         continue;
+      if ((rule->flags & RULE_POW) && options->EmitNoPow)
+         continue;
+      if (!may_match(rule, operand_ops))
+         continue;
+
+      ir_rvalue *variables[MAX_RULE_VARIABLES] = { NULL, NULL, NULL, NULL };
+      if (!match_operands(rule->search, ir, variables))
+         continue;
+
+      if (rule->flags & RULE_SAME_TYPES) {
+         bool same = true;
+         for (unsigned v = 1; v < MAX_RULE_VARIABLES && variables[v]; v++)
+            same = same && variables[v]->type == variables[0]->type;
+         if (!same)
+            continue;
       }
-      break;
 
-   case ir_unop_log:
-      if (op_expr[0] == NULL)
-	 break;
-
-      if (op_expr[0]->operation == ir_unop_exp) {
-         return op_expr[0]->operands[0];
+      /* Anything the replacement uses more than once gets computed once,
+       * into a temporary.
+       */
+      for (unsigned v = 0; v < MAX_RULE_VARIABLES; v++) {
+         if (!(rule->reused & (1 << v)) ||
+             variables[v]->as_dereference_variable() != NULL ||
+             variables[v]->as_constant() != NULL)
+            continue;
+         ir_variable *const tmp =
+            new(ir) ir_variable(variables[v]->type, "x", ir_var_temporary,
+                                variables[v]->get_precision());
+         base_ir->insert_before(tmp);
+         base_ir->insert_before(assign(tmp, variables[v]));
+         variables[v] = new(mem_ctx) ir_dereference_variable(tmp);
       }
-      break;
-
-   case ir_unop_exp2:
-      if (op_expr[0] == NULL)
-	 break;
 
-      if (op_expr[0]->operation == ir_unop_log2) {
-         return op_expr[0]->operands[0];
-      }
+      return build_replacement(rule->replace, ir->type, variables,
+                               rule->reused);
+   }
 
-      if (!options->EmitNoPow && op_expr[0]->operation == ir_binop_mul) {
-         for (int log2_pos = 0; log2_pos < 2; log2_pos++) {
-            ir_expression *log2_expr =
-               op_expr[0]->operands[log2_pos]->as_expression();
-
-            if (log2_expr && log2_expr->operation == ir_unop_log2) {
-               return new(mem_ctx) ir_expression(ir_binop_pow,
-                                                 ir->type,
-                                                 log2_expr->operands[0],
-                                                 op_expr[0]->operands[1 - log2_pos]);
-            }
-         }
-      }
-      break;
+   return NULL;
+}
 
-   case ir_unop_log2:
-      if (op_expr[0] == NULL)
-	 break;
+ir_rvalue *
+ir_algebraic_visitor::handle_expression(ir_expression *ir)
+{
+   ir_constant *op_const[4] = {NULL, NULL, NULL, NULL};
+   ir_expression *op_expr[4] = {NULL, NULL, NULL, NULL};
+   unsigned int i;
 
-      if (op_expr[0]->operation == ir_unop_exp2) {
-         return op_expr[0]->operands[0];
-      }
-      break;
+   assert(ir->get_num_operands() <= 4);
+   for (i = 0; i < ir->get_num_operands(); i++) {
+      if (ir->operands[i]->type->is_matrix())
+	 return ir;
+   }
 
-   case ir_unop_logic_not: {
-      enum ir_expression_operation new_op = ir_unop_logic_not;
-
-      if (op_expr[0] == NULL)
-	 break;
-
-      switch (op_expr[0]->operation) {
-      case ir_binop_less:    new_op = ir_binop_gequal;  break;
-      case ir_binop_greater: new_op = ir_binop_lequal;  break;
-      case ir_binop_lequal:  new_op = ir_binop_greater; break;
-      case ir_binop_gequal:  new_op = ir_binop_less;    break;
-      case ir_binop_equal:   new_op = ir_binop_nequal;  break;
-      case ir_binop_nequal:  new_op = ir_binop_equal;   break;
-      case ir_binop_all_equal:   new_op = ir_binop_any_nequal;  break;
-      case ir_binop_any_nequal:  new_op = ir_binop_all_equal;   break;
-
-      default:
-	 /* The default case handler is here to silence a warning from GCC.
-	  */
-	 break;
-      }
+   if (this->mem_ctx == NULL)
+      this->mem_ctx = glslopt_ralloc_parent(ir);
 
-      if (new_op != ir_unop_logic_not) {
-	 return new(mem_ctx) ir_expression(new_op,
-					   ir->type,
-					   op_expr[0]->operands[0],
-					   op_expr[0]->operands[1]);
-      }
+   ir_rvalue *const rewritten = apply_rules(ir);
+   if (rewritten != NULL)
+      return rewritten;
 
-      break;
+   /* What's left doesn't fit a pattern: moving constants down trees of the
+    * same operation, and the AOS dot product.
+    */
+   for (i = 0; i < ir->get_num_operands(); i++) {
+      op_const[i] = ir->operands[i]->constant_expression_value();
+      op_expr[i] = ir->operands[i]->as_expression();
    }
 
+   switch (ir->operation) {
    case ir_binop_add:
-      if (is_vec_zero(op_const[0]))
-	 return ir->operands[1];
-      if (is_vec_zero(op_const[1]))
-	 return ir->operands[0];
-
-      /* Reassociate addition of constants so that we can do constant
-       * folding.
+   case ir_binop_mul:
+      /* Reassociate addition and multiplication of constants so that we can
+       * do constant folding.
        */
       if (op_const[0] && !op_const[1])
 	 reassociate_constant(ir, 0, op_const[0], op_expr[1]);
       if (op_const[1] && !op_const[0])
 	 reassociate_constant(ir, 1, op_const[1], op_expr[0]);
-		   
-		// A + (-B) => A-B
-	   if (op_expr[1] && op_expr[1]->operation == ir_unop_neg) {
-		   this->progress = true;
-		   return sub(ir->operands[0], op_expr[1]->operands[0]);
-	   }
 
       /* Recognize (v.x + v.y) + (v.z + v.w) as dot(v, 1.0) */
-      if (options->OptimizeForAOS) {
+      if (ir->operation == ir_binop_add && options->OptimizeForAOS) {
          ir_expression *expr = try_replace_with_dot(op_expr[0], op_expr[1],
                                                     mem_ctx);
          if (expr)
             return expr;
       }
-
-      /* Replace (-x + y) * a + x and commutative variations with lrp(x, y, a).
-       *
-       * (-x + y) * a + x
-       * (x * -a) + (y * a) + x
-       * x + (x * -a) + (y * a)
-       * x * (1 - a) + y * a
-       * lrp(x, y, a)
-       */
-      for (int mul_pos = 0; mul_pos < 2; mul_pos++) {
-         ir_expression *mul = op_expr[mul_pos];
-
-         if (!mul || mul->operation != ir_binop_mul)
-            continue;
-
-         /* Multiply found on one of the operands. Now check for an
-          * inner addition operation.
-          */
-         for (int inner_add_pos = 0; inner_add_pos < 2; inner_add_pos++) {
-            ir_expression *inner_add =
-               mul->operands[inner_add_pos]->as_expression();
-
-            if (!inner_add || inner_add->operation != ir_binop_add)
-               continue;
-
-            /* Inner addition found on one of the operands. Now check for
-             * one of the operands of the inner addition to be the negative
-             * of x_operand.
-             */
-            for (int neg_pos = 0; neg_pos < 2; neg_pos++) {
-               ir_expression *neg =
-                  inner_add->operands[neg_pos]->as_expression();
-
-               if (!neg || neg->operation != ir_unop_neg)
-                  continue;
-
-               ir_rvalue *x_operand = ir->operands[1 - mul_pos];
-
-               if (!neg->operands[0]->equals(x_operand))
-                  continue;
-
-               ir_rvalue *y_operand = inner_add->operands[1 - neg_pos];
-               ir_rvalue *a_operand = mul->operands[1 - inner_add_pos];
-
-               if (x_operand->type != y_operand->type ||
-                   x_operand->type != a_operand->type)
-                  continue;
-
-               return lrp(x_operand, y_operand, a_operand);
-            }
-         }
-      }
-
-      break;
-
-   case ir_binop_sub:
-      if (is_vec_zero(op_const[0]))
-	 return neg(ir->operands[1]);
-      if (is_vec_zero(op_const[1]))
-	 return ir->operands[0];
-      break;
-
-   case ir_binop_mul:
-      if (is_vec_one(op_const[0]))
-	 return ir->operands[1];
-      if (is_vec_one(op_const[1]))
-	 return ir->operands[0];
-
-      if (is_vec_zero(op_const[0]) || is_vec_zero(op_const[1]))
-	 return ir_constant::zero(ir, ir->type);
-
-      if (is_vec_negative_one(op_const[0]))
-         return neg(ir->operands[1]);
-      if (is_vec_negative_one(op_const[1]))
-         return neg(ir->operands[0]);
-
-
-      /* Reassociate multiplication of constants so that we can do
-       * constant folding.
-       */
-      if (op_const[0] && !op_const[1])
-	 reassociate_constant(ir, 0, op_const[0], op_expr[1]);
-      if (op_const[1] && !op_const[0])
-	 reassociate_constant(ir, 1, op_const[1], op_expr[0]);
-
-      break;
-
-   case ir_binop_div:
-      if (is_vec_one(op_const[0]) && ir->type->base_type == GLSL_TYPE_FLOAT) {
-	 return new(mem_ctx) ir_expression(ir_unop_rcp,
-					   ir->operands[1]->type,
-					   ir->operands[1],
-					   NULL);
-      }
-      if (is_vec_one(op_const[1]))
-	 return ir->operands[0];
-      break;
-
-   case ir_binop_dot:
-      if (is_vec_zero(op_const[0]) || is_vec_zero(op_const[1]))
-	 return ir_constant::zero(mem_ctx, ir->type);
-
-      if (is_vec_basis(op_const[0])) {
-	 unsigned component = 0;
-	 for (unsigned c = 0; c < op_const[0]->type->vector_elements; c++) {
-	    if (op_const[0]->value.f[c] == 1.0)
-	       component = c;
-	 }
-	 return new(mem_ctx) ir_swizzle(ir->operands[1], component, 0, 0, 0, 1);
-      }
-      if (is_vec_basis(op_const[1])) {
-	 unsigned component = 0;
-	 for (unsigned c = 0; c < op_const[1]->type->vector_elements; c++) {
-	    if (op_const[1]->value.f[c] == 1.0)
-	       component = c;
-	 }
-	 return new(mem_ctx) ir_swizzle(ir->operands[0], component, 0, 0, 0, 1);
-      }
-      break;
-
-   case ir_binop_less:
-   case ir_binop_lequal:
-   case ir_binop_greater:
-   case ir_binop_gequal:
-   case ir_binop_equal:
-   case ir_binop_nequal:
-      for (int add_pos = 0; add_pos < 2; add_pos++) {
-         ir_expression *add = op_expr[add_pos];
-
-         if (!add || add->operation != ir_binop_add)
-            continue;
-
-         ir_constant *zero = op_const[1 - add_pos];
-         if (!is_vec_zero(zero))
-            continue;
-
-         return new(mem_ctx) ir_expression(ir->operation,
-                                           add->operands[0],
-                                           neg(add->operands[1]));
-      }
-      break;
-
-   case ir_binop_rshift:
-   case ir_binop_lshift:
-      /* 0 >> x == 0 */
-      if (is_vec_zero(op_const[0]))
-         return ir->operands[0];
-      /* x >> 0 == x */
-      if (is_vec_zero(op_const[1]))
-         return ir->operands[0];
-      break;
-
-   case ir_binop_logic_and:
-      if (is_vec_one(op_const[0])) {
-	 return ir->operands[1];
-      } else if (is_vec_one(op_const[1])) {
-	 return ir->operands[0];
-      } else if (is_vec_zero(op_const[0]) || is_vec_zero(op_const[1])) {
-	 return ir_constant::zero(mem_ctx, ir->type);
-      } else if (op_expr[0] && op_expr[0]->operation == ir_unop_logic_not &&
-                 op_expr[1] && op_expr[1]->operation == ir_unop_logic_not) {
-         /* De Morgan's Law:
-          *    (not A) and (not B) === not (A or B)
-          */
-         return logic_not(logic_or(op_expr[0]->operands[0],
-                                   op_expr[1]->operands[0]));
-      } else if (ir->operands[0]->equals(ir->operands[1])) {
-         /* (a && a) == a */
-         return ir->operands[0];
-      }
-      break;
-
-   case ir_binop_logic_xor:
-      if (is_vec_zero(op_const[0])) {
-	 return ir->operands[1];
-      } else if (is_vec_zero(op_const[1])) {
-	 return ir->operands[0];
-      } else if (is_vec_one(op_const[0])) {
-	 return logic_not(ir->operands[1]);
-      } else if (is_vec_one(op_const[1])) {
-	 return logic_not(ir->operands[0]);
-      } else if (ir->operands[0]->equals(ir->operands[1])) {
-         /* (a ^^ a) == false */
-	 return ir_constant::zero(mem_ctx, ir->type);
-      }
-      break;
-
-   case ir_binop_logic_or:
-      if (is_vec_zero(op_const[0])) {
-	 return ir->operands[1];
-      } else if (is_vec_zero(op_const[1])) {
-	 return ir->operands[0];
-      } else if (is_vec_one(op_const[0]) || is_vec_one(op_const[1])) {
-	 ir_constant_data data;
-
-	 for (unsigned i = 0; i < 16; i++)
-	    data.b[i] = true;
-
-	 return new(mem_ctx) ir_constant(ir->type, &data);
-      } else if (op_expr[0] && op_expr[0]->operation == ir_unop_logic_not &&
-                 op_expr[1] && op_expr[1]->operation == ir_unop_logic_not) {
-         /* De Morgan's Law:
-          *    (not A) or (not B) === not (A and B)
-          */
-         return logic_not(logic_and(op_expr[0]->operands[0],
-                                    op_expr[1]->operands[0]));
-      } else if (ir->operands[0]->equals(ir->operands[1])) {
-         /* (a || a) == a */
-         return ir->operands[0];
-      }
-      break;
-
-   case ir_binop_pow:
-      /* 1^x == 1 */
-      if (is_vec_one(op_const[0]))
-         return op_const[0];
-
-      /* x^1 == x */
-      if (is_vec_one(op_const[1]))
-         return ir->operands[0];
-
-      /* pow(2,x) == exp2(x) */
-      if (is_vec_two(op_const[0]))
-         return expr(ir_unop_exp2, ir->operands[1]);
-
-      if (is_vec_two(op_const[1])) {
-         ir_variable *x = new(ir) ir_variable(ir->operands[1]->type, "x",
-                                              ir_var_temporary, ir->operands[1]->get_precision());
-         base_ir->insert_before(x);
-         base_ir->insert_before(assign(x, ir->operands[0]));
-         return mul(x, x);
-      }
-
-      break;
-
-   case ir_binop_min:
-   case ir_binop_max:
-      if (ir->type->base_type != GLSL_TYPE_FLOAT)
-         break;
-
-      /* Replace min(max) operations and its commutative combinations with
-       * a saturate operation
-       */
-      for (int op = 0; op < 2; op++) {
-         ir_expression *minmax = op_expr[op];
-         ir_constant *outer_const = op_const[1 - op];
-         ir_expression_operation op_cond = (ir->operation == ir_binop_max) ?
-            ir_binop_min : ir_binop_max;
-
-         if (!minmax || !outer_const || (minmax->operation != op_cond))
-            continue;
-
-         /* Found a min(max) combination. Now try to see if its operands
-          * meet our conditions that we can do just a single saturate operation
-          */
-         for (int minmax_op = 0; minmax_op < 2; minmax_op++) {
-            ir_rvalue *inner_val_a = minmax->operands[minmax_op];
-            ir_rvalue *inner_val_b = minmax->operands[1 - minmax_op];
-
-            if (!inner_val_a || !inner_val_b)
-               continue;
-
-            /* Found a {min|max} ({max|min} (x, 0.0), 1.0) operation and its variations */
-            if ((outer_const->is_one() && inner_val_a->is_zero()) ||
-                (inner_val_a->is_one() && outer_const->is_zero()))
-               return saturate(inner_val_b);
-
-            /* Found a {min|max} ({max|min} (x, 0.0), b) where b < 1.0
-             * and its variations
-             */
-            if (is_less_than_one(outer_const) && inner_val_b->is_zero())
-               return expr(ir_binop_min, saturate(inner_val_a), outer_const);
-
-            if (!inner_val_b->as_constant())
-               continue;
-
-            if (is_less_than_one(inner_val_b->as_constant()) && outer_const->is_zero())
-               return expr(ir_binop_min, saturate(inner_val_a), inner_val_b);
-
-            /* Found a {min|max} ({max|min} (x, b), 1.0), where b > 0.0
-             * and its variations
-             */
-            if (outer_const->is_one() && is_greater_than_zero(inner_val_b->as_constant()))
-               return expr(ir_binop_max, saturate(inner_val_a), inner_val_b);
-            if (inner_val_b->as_constant()->is_one() && is_greater_than_zero(outer_const))
-               return expr(ir_binop_max, saturate(inner_val_a), outer_const);
-         }
-      }
-
-      break;
-
-   case ir_unop_rcp:
-      if (op_expr[0] && op_expr[0]->operation == ir_unop_rcp)
-	 return op_expr[0]->operands[0];
-
-      /* While ir_to_mesa.cpp will lower sqrt(x) to rcp(rsq(x)), it does so at
-       * its IR level, so we can always apply this transformation.
-       */
-      if (op_expr[0] && op_expr[0]->operation == ir_unop_rsq)
-         return sqrt(op_expr[0]->operands[0]);
-
-      /* As far as we know, all backends are OK with rsq. */
-      if (op_expr[0] && op_expr[0]->operation == ir_unop_sqrt) {
-	 return rsq(op_expr[0]->operands[0]);
-      }
-
-      break;
-
-   case ir_triop_fma:
-      /* Operands are op0 * op1 + op2. */
-      if (is_vec_zero(op_const[0]) || is_vec_zero(op_const[1])) {
-         return ir->operands[2];
-      } else if (is_vec_zero(op_const[2])) {
-         return mul(ir->operands[0], ir->operands[1]);
-      } else if (is_vec_one(op_const[0])) {
-         return add(ir->operands[1], ir->operands[2]);
-      } else if (is_vec_one(op_const[1])) {
-         return add(ir->operands[0], ir->operands[2]);
-      }
-      break;
-
-   case ir_triop_lrp:
-      /* Operands are (x, y, a). */
-      if (is_vec_zero(op_const[2])) {
-         return ir->operands[0];
-      } else if (is_vec_one(op_const[2])) {
-         return ir->operands[1];
-      } else if (ir->operands[0]->equals(ir->operands[1])) {
-         return ir->operands[0];
-      } else if (is_vec_zero(op_const[0])) {
-         return mul(ir->operands[1], ir->operands[2]);
-      } else if (is_vec_zero(op_const[1])) {
-         unsigned op2_components = ir->operands[2]->type->vector_elements;
-         ir_constant *one = new(mem_ctx) ir_constant(1.0f, op2_components);
-         return mul(ir->operands[0], add(one, neg(ir->operands[2])));
-      }
-      break;
-
-   case ir_triop_csel:
-      if (is_vec_one(op_const[0]))
-	 return ir->operands[1];
-      if (is_vec_zero(op_const[0]))
-	 return ir->operands[2];
       break;
 
    default:
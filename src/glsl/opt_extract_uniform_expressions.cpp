@@ -0,0 +1,207 @@
+/**
+ * \file opt_extract_uniform_expressions.cpp
+ *
+ * Replace expressions that only depend on uniforms with new uniforms.
+ *
+ * Something like normalize(lightDir) or 1.0 / scale has the same value for
+ * every vertex or fragment of a draw call, yet gets computed for each of
+ * them.  This pass finds the largest such subtrees and replaces each with a
+ * new uniform, so that the application can compute the value once per draw
+ * instead.  The removed expressions are returned as assignments to the new
+ * uniforms, for the caller to report.
+ */
+
+#include "ir.h"
+#include "ir_rvalue_visitor.h"
+#include "ir_optimization.h"
+#include "glsl_types.h"
+
+namespace {
+
+class uniform_expression_visitor : public ir_rvalue_enter_visitor {
+public:
+   uniform_expression_visitor(exec_list *instructions, const char *prefix,
+                              unsigned max_count, exec_list *extracted)
+      : instructions(instructions), prefix(prefix), index(0),
+        max_count(max_count), count(0), extracted(extracted)
+   {
+   }
+
+   virtual void handle_rvalue(ir_rvalue **rvalue);
+
+   exec_list *instructions;
+   const char *prefix;
+   unsigned index;      /**< Next number to try for a name. */
+   unsigned max_count;
+   unsigned count;
+   exec_list *extracted;
+};
+
+
+/**
+ * Whether the value only depends on uniforms and constants.  Anything that
+ * does actual work is counted in *ops.
+ */
+bool
+is_uniform_only(ir_rvalue *ir, unsigned *ops)
+{
+   switch (ir->ir_type) {
+   case ir_type_constant:
+      return true;
+
+   case ir_type_dereference_variable: {
+      ir_variable *const var = ((ir_dereference_variable *) ir)->var;
+      return var->data.mode == ir_var_uniform &&
+             !var->type->contains_sampler() && !var->is_in_uniform_block();
+   }
+
+   case ir_type_dereference_array: {
+      ir_dereference_array *const deref = (ir_dereference_array *) ir;
+      return is_uniform_only(deref->array, ops) &&
+             is_uniform_only(deref->array_index, ops);
+   }
+
+   case ir_type_dereference_record:
+      return is_uniform_only(((ir_dereference_record *) ir)->record, ops);
+
+   case ir_type_swizzle:
+      return is_uniform_only(((ir_swizzle *) ir)->val, ops);
+
+   case ir_type_expression: {
+      ir_expression *const expr = (ir_expression *) ir;
+      switch (expr->operation) {
+      case ir_unop_dFdx:
+      case ir_unop_dFdx_coarse:
+      case ir_unop_dFdx_fine:
+      case ir_unop_dFdy:
+      case ir_unop_dFdy_coarse:
+      case ir_unop_dFdy_fine:
+      case ir_unop_noise:
+      case ir_unop_interpolate_at_centroid:
+      case ir_binop_interpolate_at_offset:
+      case ir_binop_interpolate_at_sample:
+         return false;
+      case ir_unop_neg:
+         /* usually free as a source modifier */
+         break;
+      default:
+         (*ops)++;
+         break;
+      }
+      for (unsigned i = 0; i < expr->get_num_operands(); i++) {
+         if (!is_uniform_only(expr->operands[i], ops))
+            return false;
+      }
+      return true;
+   }
+
+   default:
+      return false;
+   }
+}
+
+
+bool
+is_global_name(exec_list *ir, const char *name)
+{
+   foreach_in_list(ir_instruction, node, ir) {
+      ir_variable *const var = node->as_variable();
+      if (var != NULL && strcmp(var->name, name) == 0)
+         return true;
+   }
+   return false;
+}
+
+
+/** Adds a declaration after the existing ones, ahead of any functions. */
+void
+add_declaration(exec_list *ir, ir_variable *var)
+{
+   foreach_in_list(ir_instruction, node, ir) {
+      if (node->as_function() != NULL) {
+         node->insert_before(var);
+         return;
+      }
+   }
+   ir->push_tail(var);
+}
+
+
+void
+uniform_expression_visitor::handle_rvalue(ir_rvalue **rvalue)
+{
+   ir_rvalue *const ir = *rvalue;
+   if (ir == NULL || ir->as_expression() == NULL)
+      return;
+   if (!ir->type->is_scalar() && !ir->type->is_vector() &&
+       !ir->type->is_matrix())
+      return;
+
+   unsigned ops = 0;
+   if (!is_uniform_only(ir, &ops) || ops == 0)
+      return;
+
+   ir_variable *var = NULL;
+   foreach_in_list(ir_assignment, assign, this->extracted) {
+      if (assign->rhs->equals(ir)) {
+         var = assign->lhs->variable_referenced();
+         break;
+      }
+   }
+
+   void *const mem_ctx = this->instructions;
+   if (var == NULL) {
+      if (this->count >= this->max_count)
+         return;
+
+      /* Names from an earlier run on the same shader are taken already. */
+      char *name;
+      do {
+         name = glslopt_ralloc_asprintf(mem_ctx, "%s%u", this->prefix,
+                                        this->index++);
+      } while (is_global_name(this->instructions, name));
+
+      var = new(mem_ctx) ir_variable(ir->type, name, ir_var_uniform,
+                                     ir->get_precision());
+      add_declaration(this->instructions, var);
+
+      /* The expression moves over as is; the shader gets a reference to the
+       * new uniform in its place.
+       */
+      this->extracted->push_tail(
+         new(mem_ctx) ir_assignment(new(mem_ctx) ir_dereference_variable(var),
+                                    ir));
+      this->count++;
+   }
+
+   *rvalue = new(mem_ctx) ir_dereference_variable(var);
+}
+
+} /* unnamed namespace */
+
+
+/**
+ * Extracts at most max_count uniform-only expressions into new uniforms named
+ * prefix followed by the lowest free number.  For each, an assignment of the
+ * expression to the new uniform is added to extracted.
+ *
+ * Returns the number of uniforms added.
+ */
+unsigned
+do_extract_uniform_expressions(exec_list *instructions, const char *prefix,
+                               unsigned max_count, exec_list *extracted)
+{
+   uniform_expression_visitor v(instructions, prefix, max_count, extracted);
+
+   foreach_in_list(ir_instruction, node, instructions) {
+      ir_function *const func = node->as_function();
+      if (func == NULL)
+         continue;
+      foreach_in_list(ir_function_signature, sig, &func->signatures) {
+         if (sig->is_defined)
+            visit_list_elements(&v, &sig->body);
+      }
+   }
+
+   return v.count;
+}
@@ -0,0 +1,220 @@
+/**
+ * \file opt_fuse_multiply_add.cpp
+ *
+ * Turns multiplies that feed additions into fused multiply-adds.
+ *
+ * Some drivers don't fuse a * b + c by themselves, so the printed code asks
+ * for fma explicitly.  A fused multiply-add only rounds once, which is why
+ * this only runs when the application allows fast math, and never for
+ * assignments to precise variables.
+ *
+ * A sum with several products gets reassociated so that each product
+ * accumulates into the rest of the sum, instead of being added pairwise:
+ *
+ *    a * b + c * d + e * f + g
+ *
+ * becomes
+ *
+ *    fma(e, f, fma(c, d, fma(a, b, g)))
+ *
+ * where a balanced tree from opt_rebalance_tree.cpp would only have fused
+ * two of the three products.  The remaining terms keep their order.
+ */
+
+#include "ir.h"
+#include "ir_rvalue_visitor.h"
+#include "ir_optimization.h"
+#include "glsl_types.h"
+
+namespace {
+
+/** One term of a sum. */
+struct sum_term {
+   ir_rvalue *value;
+   bool negate;
+};
+
+class fma_visitor : public ir_rvalue_enter_visitor {
+public:
+   fma_visitor()
+   {
+      this->progress = false;
+   }
+
+   virtual ir_visitor_status visit_enter(ir_assignment *ir);
+   virtual void handle_rvalue(ir_rvalue **rvalue);
+
+   bool progress;
+
+private:
+   void collect_terms(ir_rvalue *ir, const glsl_type *type, bool negate);
+   ir_rvalue *splat(ir_rvalue *ir, const glsl_type *type);
+
+   sum_term *terms;
+   unsigned num_terms;
+};
+
+
+bool
+is_float_vector(const glsl_type *type)
+{
+   return type->base_type == GLSL_TYPE_FLOAT && !type->is_matrix();
+}
+
+
+bool
+is_sum(ir_expression *ir)
+{
+   return (ir->operation == ir_binop_add || ir->operation == ir_binop_sub) &&
+          is_float_vector(ir->type);
+}
+
+
+/** A component-wise product, as opposed to a matrix product. */
+ir_expression *
+as_product(ir_rvalue *ir)
+{
+   ir_expression *const expr = ir->as_expression();
+   if (expr == NULL || expr->operation != ir_binop_mul ||
+       !is_float_vector(expr->operands[0]->type) ||
+       !is_float_vector(expr->operands[1]->type))
+      return NULL;
+   return expr;
+}
+
+} /* unnamed namespace */
+
+
+ir_visitor_status
+fma_visitor::visit_enter(ir_assignment *ir)
+{
+   ir_variable *const var = ir->lhs->variable_referenced();
+   if (var != NULL && var->data.precise)
+      return visit_continue_with_parent;
+   return ir_rvalue_enter_visitor::visit_enter(ir);
+}
+
+
+/**
+ * Flattens the additions, subtractions and negations of one type at the top
+ * of a sum.
+ */
+void
+fma_visitor::collect_terms(ir_rvalue *ir, const glsl_type *type, bool negate)
+{
+   ir_expression *const expr = ir->as_expression();
+   if (expr != NULL && expr->type == type) {
+      switch (expr->operation) {
+      case ir_binop_add:
+         collect_terms(expr->operands[0], type, negate);
+         collect_terms(expr->operands[1], type, negate);
+         return;
+      case ir_binop_sub:
+         collect_terms(expr->operands[0], type, negate);
+         collect_terms(expr->operands[1], type, !negate);
+         return;
+      case ir_unop_neg:
+         collect_terms(expr->operands[0], type, !negate);
+         return;
+      default:
+         break;
+      }
+   }
+
+   this->terms = reralloc(NULL, this->terms, sum_term, this->num_terms + 1);
+   this->terms[this->num_terms].value = ir;
+   this->terms[this->num_terms].negate = negate;
+   this->num_terms++;
+}
+
+
+/** fma takes operands of one type; scalars get replicated. */
+ir_rvalue *
+fma_visitor::splat(ir_rvalue *ir, const glsl_type *type)
+{
+   if (ir->type == type)
+      return ir;
+   return new(glslopt_ralloc_parent(ir)) ir_swizzle(ir, 0, 0, 0, 0,
+                                                    type->vector_elements);
+}
+
+
+void
+fma_visitor::handle_rvalue(ir_rvalue **rvalue)
+{
+   if (*rvalue == NULL)
+      return;
+
+   ir_expression *const expr = (*rvalue)->as_expression();
+   if (expr == NULL || !is_sum(expr))
+      return;
+
+   this->terms = NULL;
+   this->num_terms = 0;
+   collect_terms(expr, expr->type, false);
+
+   unsigned num_products = 0;
+   for (unsigned i = 0; i < this->num_terms; i++) {
+      if (as_product(this->terms[i].value))
+         num_products++;
+   }
+
+   if (num_products == 0) {
+      glslopt_ralloc_free(this->terms);
+      return;
+   }
+
+   /* The other terms add up to the addend; with nothing else to add, the
+    * first product is it.
+    */
+   const bool only_products = num_products == this->num_terms;
+   void *const mem_ctx = glslopt_ralloc_parent(expr);
+   ir_rvalue *sum = NULL;
+   for (unsigned i = 0; i < this->num_terms; i++) {
+      ir_rvalue *const value = this->terms[i].value;
+      if (as_product(value) && !(only_products && sum == NULL))
+         continue;
+      this->terms[i].value = NULL;
+
+      if (sum == NULL)
+         sum = this->terms[i].negate ?
+            new(mem_ctx) ir_expression(ir_unop_neg, value) : value;
+      else
+         sum = new(mem_ctx) ir_expression(this->terms[i].negate ?
+                                          ir_binop_sub : ir_binop_add,
+                                          sum, value);
+   }
+
+   for (unsigned i = 0; i < this->num_terms; i++) {
+      ir_expression *const product = this->terms[i].value ?
+         as_product(this->terms[i].value) : NULL;
+      if (product == NULL)
+         continue;
+
+      ir_rvalue *a = product->operands[0];
+      ir_rvalue *b = product->operands[1];
+      if (this->terms[i].negate)
+         a = new(mem_ctx) ir_expression(ir_unop_neg, a);
+
+      const glsl_type *const type =
+         sum->type->vector_elements > product->type->vector_elements ?
+         sum->type : product->type;
+      sum = new(mem_ctx) ir_expression(ir_triop_fma, splat(a, type),
+                                       splat(b, type), splat(sum, type));
+   }
+   glslopt_ralloc_free(this->terms);
+
+   *rvalue = splat(sum, expr->type);
+   this->progress = true;
+}
+
+
+bool
+do_fuse_multiply_add(exec_list *instructions)
+{
+   fma_visitor v;
+
+   v.run(instructions);
+
+   return v.progress;
+}
@@ -0,0 +1,539 @@
+/**
+ * \file opt_hoist_varyings.cpp
+ *
+ * Move affine functions of varyings from the fragment shader to the vertex
+ * shader.
+ *
+ * Interpolation is linear, so for an expression like uv * scale + offset with
+ * uniform scale and offset, computing it per vertex and interpolating the
+ * result gives the same value as computing it per fragment from the
+ * interpolated uv.  Each such expression becomes a new varying, written at
+ * the end of the vertex shader's main() and read by the fragment shader in
+ * place of the expression.  Varyings that are no longer read after that are
+ * left for remove_unused_varyings() to clean up.
+ */
+
+#include "ir.h"
+#include "ir_rvalue_visitor.h"
+#include "ir_optimization.h"
+#include "glsl_types.h"
+#include "main/macros.h"
+#include "main/mtypes.h"
+#include "program/hash_table.h"
+
+namespace {
+
+enum value_kind {
+   value_other,    /**< Neither of the below. */
+   value_uniform,  /**< The same for every vertex and fragment. */
+   value_affine,   /**< Affine function of interpolated varyings. */
+};
+
+struct hoist_candidate {
+   ir_rvalue *value;
+   ir_rvalue ***slots;  /**< Where the value (or an equal one) is used. */
+   unsigned num_slots;
+   unsigned cost;       /**< Fragment shader operations per use. */
+};
+
+
+/**
+ * Counts the writes to each variable, to find the ones written by a single
+ * plain assignment.
+ */
+class variable_write_visitor : public ir_hierarchical_visitor {
+public:
+   variable_write_visitor()
+   {
+      this->counts = glslopt_hash_table_ctor(0, glslopt_hash_table_pointer_hash,
+                                             glslopt_hash_table_pointer_compare);
+      this->assignments = glslopt_hash_table_ctor(0, glslopt_hash_table_pointer_hash,
+                                                  glslopt_hash_table_pointer_compare);
+   }
+
+   ~variable_write_visitor()
+   {
+      glslopt_hash_table_dtor(this->counts);
+      glslopt_hash_table_dtor(this->assignments);
+   }
+
+   virtual ir_visitor_status visit_enter(ir_assignment *ir)
+   {
+      ir_dereference_variable *const lhs = ir->lhs->as_dereference_variable();
+      const bool whole = lhs != NULL && ir->condition == NULL &&
+         (!(lhs->type->is_scalar() || lhs->type->is_vector()) ||
+          ir->write_mask == (1u << lhs->type->vector_elements) - 1);
+      if (count_write(ir->lhs, whole ? 1 : 2) == 1)
+         glslopt_hash_table_insert(this->assignments, ir, lhs->var);
+      return visit_continue;
+   }
+
+   virtual ir_visitor_status visit_enter(ir_call *ir)
+   {
+      foreach_two_lists(formal_node, &ir->callee->parameters,
+                        actual_node, &ir->actual_parameters) {
+         ir_variable *const formal = (ir_variable *) formal_node;
+         if (formal->data.mode == ir_var_function_out ||
+             formal->data.mode == ir_var_function_inout)
+            count_write((ir_rvalue *) actual_node, 2);
+      }
+      if (ir->return_deref)
+         count_write(ir->return_deref, 2);
+      return visit_continue;
+   }
+
+   /** The only assignment to a variable that is never written otherwise. */
+   ir_assignment *get_single_assignment(ir_variable *var)
+   {
+      if ((uintptr_t) glslopt_hash_table_find(this->counts, var) != 1)
+         return NULL;
+      return (ir_assignment *) glslopt_hash_table_find(this->assignments, var);
+   }
+
+private:
+   unsigned count_write(ir_rvalue *lhs, unsigned count)
+   {
+      ir_variable *const var = lhs->variable_referenced();
+      if (var == NULL)
+         return 0;
+      count += (unsigned) (uintptr_t) glslopt_hash_table_find(this->counts, var);
+      glslopt_hash_table_remove(this->counts, var);
+      glslopt_hash_table_insert(this->counts, (void *) (uintptr_t) count, var);
+      return count;
+   }
+
+   hash_table *counts;
+   hash_table *assignments;
+};
+
+
+class hoist_candidate_visitor : public ir_rvalue_enter_visitor {
+public:
+   hoist_candidate_visitor(void *mem_ctx, exec_list *producer_ir,
+                           bool es_precision)
+      : mem_ctx(mem_ctx), producer_ir(producer_ir),
+        es_precision(es_precision), candidates(NULL), num_candidates(0),
+        current_assignment(NULL)
+   {
+      this->claimed = glslopt_hash_table_ctor(0, glslopt_hash_table_pointer_hash,
+                                              glslopt_hash_table_pointer_compare);
+      this->visiting = glslopt_hash_table_ctor(0, glslopt_hash_table_pointer_hash,
+                                               glslopt_hash_table_pointer_compare);
+   }
+
+   ~hoist_candidate_visitor()
+   {
+      glslopt_hash_table_dtor(this->claimed);
+      glslopt_hash_table_dtor(this->visiting);
+   }
+
+   virtual ir_visitor_status visit_enter(ir_assignment *ir)
+   {
+      this->current_assignment = ir;
+      return ir_rvalue_enter_visitor::visit_enter(ir);
+   }
+
+   virtual void handle_rvalue(ir_rvalue **rvalue);
+
+   value_kind classify(ir_rvalue *ir, unsigned *cost);
+   bool is_hoistable_uniform(ir_variable *var);
+   ir_variable *find_output(ir_variable *input);
+   ir_assignment *get_local_value(ir_variable *var);
+
+   void *mem_ctx;
+   exec_list *producer_ir;
+   bool es_precision;
+   variable_write_visitor writes;
+   hoist_candidate *candidates;
+   unsigned num_candidates;
+
+private:
+   static void claim(ir_instruction *ir, void *data)
+   {
+      hash_table *claimed = (hash_table *) data;
+      glslopt_hash_table_insert(claimed, ir, ir);
+   }
+
+   /** Nodes inside candidates found so far. */
+   hash_table *claimed;
+   /** Locals whose value classify() is looking into. */
+   hash_table *visiting;
+   ir_assignment *current_assignment;
+};
+
+
+ir_variable *
+find_variable(exec_list *ir, const char *name, ir_variable_mode mode)
+{
+   foreach_in_list(ir_instruction, node, ir) {
+      ir_variable *const var = node->as_variable();
+      if (var != NULL && var->data.mode == mode && strcmp(var->name, name) == 0)
+         return var;
+   }
+   return NULL;
+}
+
+
+/**
+ * Uniforms the vertex shader can read as well: either it declares them
+ * already, or they can be declared there with the same meaning.  With GLSL ES
+ * that needs an explicit precision, since default precisions differ between
+ * the stages.
+ */
+bool
+hoist_candidate_visitor::is_hoistable_uniform(ir_variable *var)
+{
+   if (var->data.mode != ir_var_uniform || var->type->contains_sampler() ||
+       var->is_in_uniform_block() || var->type->without_array()->is_record())
+      return false;
+
+   ir_variable *const existing =
+      find_variable(this->producer_ir, var->name, ir_var_uniform);
+   if (existing != NULL)
+      return existing->type == var->type;
+
+   return !this->es_precision ||
+          var->data.precision != glsl_precision_undefined ||
+          var->type->base_type == GLSL_TYPE_BOOL;
+}
+
+
+/**
+ * Vertex shader output for a fragment shader input that is interpolated the
+ * plain way, or NULL.
+ */
+ir_variable *
+hoist_candidate_visitor::find_output(ir_variable *input)
+{
+   if (input->data.mode != ir_var_shader_in ||
+       is_gl_identifier(input->name) ||
+       input->get_interface_type() != NULL ||
+       input->data.explicit_location ||
+       input->data.centroid || input->data.sample ||
+       (input->data.interpolation != INTERP_QUALIFIER_NONE &&
+        input->data.interpolation != INTERP_QUALIFIER_SMOOTH) ||
+       !input->type->is_float())
+      return NULL;
+
+   ir_variable *const output =
+      find_variable(this->producer_ir, input->name, ir_var_shader_out);
+   return (output != NULL && output->type == input->type) ? output : NULL;
+}
+
+
+/**
+ * Assignment giving a local variable its only value.  Reads of such a
+ * variable are as good as its value, when that only depends on varyings and
+ * uniforms.
+ */
+ir_assignment *
+hoist_candidate_visitor::get_local_value(ir_variable *var)
+{
+   if (var->data.mode != ir_var_temporary && var->data.mode != ir_var_auto)
+      return NULL;
+   return this->writes.get_single_assignment(var);
+}
+
+
+value_kind
+hoist_candidate_visitor::classify(ir_rvalue *ir, unsigned *cost)
+{
+   switch (ir->ir_type) {
+   case ir_type_constant:
+      return value_uniform;
+
+   case ir_type_dereference_variable: {
+      ir_variable *const var = ((ir_dereference_variable *) ir)->var;
+      if (is_hoistable_uniform(var))
+         return value_uniform;
+      if (find_output(var))
+         return value_affine;
+
+      ir_assignment *const assign = get_local_value(var);
+      if (assign == NULL || glslopt_hash_table_find(this->visiting, var) != NULL)
+         return value_other;
+      glslopt_hash_table_insert(this->visiting, var, var);
+      const value_kind kind = classify(assign->rhs, cost);
+      glslopt_hash_table_remove(this->visiting, var);
+      return kind;
+   }
+
+   case ir_type_dereference_array: {
+      ir_dereference_array *const deref = (ir_dereference_array *) ir;
+      ir_dereference_variable *const array = deref->array->as_dereference_variable();
+      if (array == NULL || !is_hoistable_uniform(array->var))
+         return value_other;
+      return classify(deref->array_index, cost) == value_uniform
+         ? value_uniform : value_other;
+   }
+
+   case ir_type_swizzle:
+      return classify(((ir_swizzle *) ir)->val, cost);
+
+   case ir_type_expression: {
+      ir_expression *const expr = (ir_expression *) ir;
+      unsigned num_affine = 0;
+      value_kind kinds[4];
+      for (unsigned i = 0; i < expr->get_num_operands(); ++i) {
+         kinds[i] = classify(expr->operands[i], cost);
+         if (kinds[i] == value_other)
+            return value_other;
+         if (kinds[i] == value_affine)
+            ++num_affine;
+      }
+      ++*cost;
+
+      if (num_affine == 0)
+         return value_uniform;
+      if (!expr->type->is_float())
+         return value_other;
+
+      switch (expr->operation) {
+      case ir_unop_neg:
+      case ir_binop_add:
+      case ir_binop_sub:
+         return value_affine;
+      case ir_binop_mul:
+      case ir_binop_dot:
+         return num_affine == 1 ? value_affine : value_other;
+      case ir_binop_div:
+         return kinds[1] == value_uniform ? value_affine : value_other;
+      default:
+         return value_other;
+      }
+   }
+
+   default:
+      return value_other;
+   }
+}
+
+
+void
+hoist_candidate_visitor::handle_rvalue(ir_rvalue **rvalue)
+{
+   ir_rvalue *const ir = *rvalue;
+   if (ir == NULL || glslopt_hash_table_find(this->claimed, ir) != NULL)
+      return;
+   if (!ir->type->is_float() || !(ir->type->is_scalar() || ir->type->is_vector()))
+      return;
+
+   /* Values of locals are hoisted where the locals are read. */
+   if (this->current_assignment != NULL && rvalue == &this->current_assignment->rhs) {
+      ir_variable *const var = this->current_assignment->lhs->variable_referenced();
+      if (var != NULL && get_local_value(var) == this->current_assignment)
+         return;
+   }
+
+   unsigned cost = 0;
+   if (classify(ir, &cost) != value_affine || cost == 0)
+      return;
+
+   visit_tree(ir, claim, this->claimed);
+
+   hoist_candidate *c = NULL;
+   for (unsigned i = 0; i < this->num_candidates; ++i) {
+      if (this->candidates[i].value->equals(ir)) {
+         c = &this->candidates[i];
+         break;
+      }
+   }
+   if (c == NULL) {
+      this->candidates = reralloc(this->mem_ctx, this->candidates,
+                                  hoist_candidate, this->num_candidates + 1);
+      c = &this->candidates[this->num_candidates++];
+      c->value = ir;
+      c->slots = NULL;
+      c->num_slots = 0;
+      c->cost = cost;
+   }
+   c->slots = reralloc(this->mem_ctx, c->slots, ir_rvalue **, c->num_slots + 1);
+   c->slots[c->num_slots++] = rvalue;
+}
+
+
+int
+compare_candidates(const void *a, const void *b)
+{
+   const hoist_candidate *const ca = (const hoist_candidate *) a;
+   const hoist_candidate *const cb = (const hoist_candidate *) b;
+   const unsigned sa = ca->cost * ca->num_slots;
+   const unsigned sb = cb->cost * cb->num_slots;
+   return sa > sb ? -1 : sa < sb ? 1 : 0;
+}
+
+
+ir_function_signature *
+find_main(exec_list *ir)
+{
+   foreach_in_list(ir_instruction, node, ir) {
+      ir_function *const f = node->as_function();
+      if (f == NULL || strcmp(f->name, "main") != 0)
+         continue;
+      foreach_in_list(ir_function_signature, sig, &f->signatures) {
+         if (sig->is_defined)
+            return sig;
+      }
+   }
+   return NULL;
+}
+
+
+void
+find_return(ir_instruction *ir, void *data)
+{
+   if (ir->ir_type == ir_type_return)
+      *(bool *) data = true;
+}
+
+
+/** Adds a declaration after the existing ones, ahead of any functions. */
+void
+add_declaration(exec_list *ir, ir_variable *var)
+{
+   foreach_in_list(ir_instruction, node, ir) {
+      if (node->as_function() != NULL) {
+         node->insert_before(var);
+         return;
+      }
+   }
+   ir->push_tail(var);
+}
+
+
+/**
+ * Copies a candidate into the vertex shader: inputs become the matching
+ * outputs, locals their values, and uniforms the vertex shader doesn't
+ * declare yet get declared.
+ */
+ir_rvalue *
+clone_into_producer(hoist_candidate_visitor *v, ir_rvalue *ir, exec_list *producer_ir)
+{
+   void *const mem_ctx = producer_ir;
+
+   switch (ir->ir_type) {
+   case ir_type_dereference_variable: {
+      ir_variable *const var = ((ir_dereference_variable *) ir)->var;
+      if (var->data.mode == ir_var_shader_in)
+         return new(mem_ctx) ir_dereference_variable(v->find_output(var));
+      if (var->data.mode == ir_var_uniform) {
+         ir_variable *uniform = find_variable(producer_ir, var->name, ir_var_uniform);
+         if (uniform == NULL) {
+            uniform = var->clone(mem_ctx, NULL);
+            add_declaration(producer_ir, uniform);
+         }
+         return new(mem_ctx) ir_dereference_variable(uniform);
+      }
+      return clone_into_producer(v, v->get_local_value(var)->rhs, producer_ir);
+   }
+
+   case ir_type_dereference_array: {
+      ir_dereference_array *const deref = (ir_dereference_array *) ir;
+      ir_dereference_array *const rv = new(mem_ctx) ir_dereference_array(
+         clone_into_producer(v, deref->array, producer_ir),
+         clone_into_producer(v, deref->array_index, producer_ir));
+      rv->set_precision(deref->get_precision());
+      return rv;
+   }
+
+   case ir_type_swizzle: {
+      ir_swizzle *const swz = (ir_swizzle *) ir;
+      ir_swizzle *const rv = new(mem_ctx) ir_swizzle(
+         clone_into_producer(v, swz->val, producer_ir), swz->mask);
+      rv->set_precision(swz->get_precision());
+      return rv;
+   }
+
+   case ir_type_expression: {
+      ir_expression *const expr = (ir_expression *) ir;
+      ir_rvalue *op[4] = { NULL, NULL, NULL, NULL };
+      for (unsigned i = 0; i < expr->get_num_operands(); ++i)
+         op[i] = clone_into_producer(v, expr->operands[i], producer_ir);
+      ir_expression *const rv = new(mem_ctx) ir_expression(
+         expr->operation, expr->type, op[0], op[1], op[2], op[3]);
+      rv->set_precision(expr->get_precision());
+      return rv;
+   }
+
+   default:
+      return ir->clone(mem_ctx, NULL);
+   }
+}
+
+
+bool
+is_variable_name_used(exec_list *ir, const char *name)
+{
+   foreach_in_list(ir_instruction, node, ir) {
+      ir_variable *const var = node->as_variable();
+      if (var != NULL && strcmp(var->name, name) == 0)
+         return true;
+   }
+   return false;
+}
+
+} /* anonymous namespace */
+
+
+/**
+ * Hoist the costliest affine fragment shader expressions into the vertex
+ * shader, adding at most max_varyings new varyings.  es_precision is set for
+ * GLSL ES, where uniforms can only be moved along with an explicit precision.
+ * Returns the number of varyings added.
+ */
+unsigned
+do_hoist_affine_varyings(gl_shader *producer, gl_shader *consumer,
+                         bool es_precision, unsigned max_varyings)
+{
+   if (max_varyings == 0)
+      return 0;
+
+   ir_function_signature *const producer_main = find_main(producer->ir);
+   if (producer_main == NULL)
+      return 0;
+
+   /* Values are only final at the end of main() if nothing returns early. */
+   bool has_return = false;
+   visit_tree(producer_main, find_return, &has_return);
+   if (has_return)
+      return 0;
+
+   void *const mem_ctx = glslopt_ralloc_context(NULL);
+   hoist_candidate_visitor v(mem_ctx, producer->ir, es_precision);
+   v.writes.run(consumer->ir);
+   v.run(consumer->ir);
+
+   qsort(v.candidates, v.num_candidates, sizeof(hoist_candidate),
+         compare_candidates);
+
+   const unsigned count = MIN2(v.num_candidates, max_varyings);
+   unsigned index = 0;
+   for (unsigned i = 0; i < count; ++i) {
+      hoist_candidate *const c = &v.candidates[i];
+
+      char name[32];
+      do {
+         snprintf(name, sizeof(name), "xlat_hoisted%u", index++);
+      } while (is_variable_name_used(producer->ir, name) ||
+               is_variable_name_used(consumer->ir, name));
+
+      ir_variable *const output =
+         new(producer->ir) ir_variable(c->value->type, name, ir_var_shader_out,
+                                       glsl_precision_undefined);
+      add_declaration(producer->ir, output);
+      producer_main->body.push_tail(
+         new(producer->ir) ir_assignment(
+            new(producer->ir) ir_dereference_variable(output),
+            clone_into_producer(&v, c->value, producer->ir)));
+
+      ir_variable *const input =
+         new(consumer->ir) ir_variable(c->value->type, name, ir_var_shader_in,
+                                       c->value->get_precision());
+      add_declaration(consumer->ir, input);
+      for (unsigned j = 0; j < c->num_slots; ++j)
+         *c->slots[j] = new(consumer->ir) ir_dereference_variable(input);
+   }
+
+   glslopt_ralloc_free(mem_ctx);
+   return count;
+}
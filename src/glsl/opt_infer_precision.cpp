@@ -0,0 +1,505 @@
+/**
+ * \file opt_infer_precision.cpp
+ *
+ * Lowers the precision of local variables where that loses nothing.
+ *
+ * propagate_precision only fills in precision that is missing, so locals
+ * declared highp (or defaulting to it) stay highp, even when they only ever
+ * hold lowp texture samples.  Mobile GPUs run mediump math at about twice
+ * the rate, and the printers declare such variables mediump/lowp, or half
+ * in Metal.
+ *
+ * A variable gets the lowest precision that holds
+ *
+ *  - everything assigned to it: an operation is only as precise as its most
+ *    precise operand, textures as their samplers, and constants need a
+ *    precision with their range;
+ *  - or, when it is only ever copied into other variables, the precision of
+ *    those.
+ *
+ * That only bounds the precision of the inputs, not the rounding error of
+ * the math, which grows with every operation.  Variables whose value feeds
+ * back into them, like sums in loops, would build up that error without
+ * bound, so they keep their declared precision.  Normalized vectors are
+ * assumed to be fine at mediump, as is usual for normals and directions.
+ */
+
+#include <math.h>
+#include "ir.h"
+#include "ir_visitor.h"
+#include "ir_hierarchical_visitor.h"
+#include "ir_optimization.h"
+#include "glsl_types.h"
+#include "program/hash_table.h"
+
+namespace {
+
+struct variable_info {
+   ir_variable *var;
+   ir_assignment **writes;
+   unsigned num_writes;
+   ir_variable **copied_to;  /**< Variables that get copies of this one */
+   unsigned num_copies;
+   variable_info **sources;  /**< Variables read by the writes */
+   unsigned num_sources;
+   bool read;                /**< Used other than by copying */
+   bool unknown;             /**< Written by calls */
+   unsigned visited;         /**< Last reads_itself() search to get here */
+   glsl_precision precision;
+};
+
+class precision_collector : public ir_hierarchical_visitor {
+public:
+   precision_collector(hash_table *variables, void *mem_ctx)
+      : variables(variables), mem_ctx(mem_ctx), infos(NULL), num_infos(0),
+        writing(NULL)
+   {
+   }
+
+   variable_info *get_info(ir_variable *var);
+   void add_source(variable_info *source);
+
+   virtual ir_visitor_status visit(ir_dereference_variable *ir);
+   virtual ir_visitor_status visit_enter(ir_assignment *ir);
+   virtual ir_visitor_status visit_enter(ir_call *ir);
+
+   hash_table *variables;
+   void *mem_ctx;
+   variable_info **infos;
+   unsigned num_infos;
+   variable_info *writing;   /**< Left side of the assignment being visited */
+};
+
+
+bool
+is_candidate(ir_variable *var)
+{
+   return (var->data.mode == ir_var_auto ||
+           var->data.mode == ir_var_temporary) &&
+          var->type->without_array()->base_type == GLSL_TYPE_FLOAT;
+}
+
+
+/** Precision of a variable that isn't inferred; the default is highp. */
+glsl_precision
+declared_precision(ir_variable *var)
+{
+   if (var->data.precision == glsl_precision_undefined)
+      return glsl_precision_high;
+   return (glsl_precision) var->data.precision;
+}
+
+
+variable_info *
+precision_collector::get_info(ir_variable *var)
+{
+   variable_info *info =
+      (variable_info *) glslopt_hash_table_find(this->variables, var);
+   if (info == NULL) {
+      info = rzalloc(this->mem_ctx, variable_info);
+      info->var = var;
+      info->precision = declared_precision(var);
+      glslopt_hash_table_insert(this->variables, info, var);
+      this->infos = reralloc(this->mem_ctx, this->infos, variable_info *,
+                             this->num_infos + 1);
+      this->infos[this->num_infos++] = info;
+   }
+   return info;
+}
+
+
+void
+precision_collector::add_source(variable_info *source)
+{
+   if (this->writing == NULL)
+      return;
+   this->writing->sources = reralloc(this->mem_ctx, this->writing->sources,
+                                     variable_info *,
+                                     this->writing->num_sources + 1);
+   this->writing->sources[this->writing->num_sources++] = source;
+}
+
+
+ir_visitor_status
+precision_collector::visit(ir_dereference_variable *ir)
+{
+   variable_info *const info = get_info(ir->var);
+   info->read = true;
+   add_source(info);
+   return visit_continue;
+}
+
+
+ir_visitor_status
+precision_collector::visit_enter(ir_assignment *ir)
+{
+   ir_variable *const lhs = ir->lhs->variable_referenced();
+   variable_info *const info = get_info(lhs);
+   info->writes = reralloc(this->mem_ctx, info->writes, ir_assignment *,
+                           info->num_writes + 1);
+   info->writes[info->num_writes++] = ir;
+
+   /* Only array indices on the left are reads. */
+   if (ir->lhs->as_dereference_variable() == NULL)
+      ir->lhs->accept(this);
+   if (ir->condition)
+      ir->condition->accept(this);
+
+   ir_rvalue *rhs = ir->rhs;
+   if (rhs->as_swizzle())
+      rhs = rhs->as_swizzle()->val;
+   ir_dereference_variable *const copy = rhs->as_dereference_variable();
+   this->writing = info;
+   if (copy == NULL) {
+      ir->rhs->accept(this);
+      this->writing = NULL;
+      return visit_continue_with_parent;
+   }
+
+   variable_info *const source = get_info(copy->var);
+   source->copied_to = reralloc(this->mem_ctx, source->copied_to,
+                                ir_variable *, source->num_copies + 1);
+   source->copied_to[source->num_copies++] = lhs;
+   add_source(source);
+   this->writing = NULL;
+   return visit_continue_with_parent;
+}
+
+
+ir_visitor_status
+precision_collector::visit_enter(ir_call *ir)
+{
+   if (ir->return_deref != NULL)
+      get_info(ir->return_deref->var)->unknown = true;
+
+   foreach_two_lists(formal_node, &ir->callee->parameters,
+                     actual_node, &ir->actual_parameters) {
+      ir_variable *const formal = (ir_variable *) formal_node;
+      ir_rvalue *const actual = (ir_rvalue *) actual_node;
+      ir_variable *const var = actual->variable_referenced();
+      if (var != NULL && (formal->data.mode == ir_var_function_out ||
+                          formal->data.mode == ir_var_function_inout))
+         get_info(var)->unknown = true;
+      actual->accept(this);
+   }
+   return visit_continue_with_parent;
+}
+
+
+/** Precision a constant needs for its range. */
+glsl_precision
+constant_precision(ir_constant *ir)
+{
+   float largest = 0.0f;
+   for (unsigned i = 0; i < ir->type->components(); i++) {
+      switch (ir->type->base_type) {
+      case GLSL_TYPE_FLOAT:
+         largest = MAX2(largest, fabsf(ir->value.f[i]));
+         break;
+      case GLSL_TYPE_INT:
+         largest = MAX2(largest, fabsf((float) ir->value.i[i]));
+         break;
+      case GLSL_TYPE_UINT:
+         largest = MAX2(largest, (float) ir->value.u[i]);
+         break;
+      case GLSL_TYPE_BOOL:
+         break;
+      default:
+         return glsl_precision_high;
+      }
+   }
+
+   /* The ranges GLSL ES guarantees for lowp and mediump. */
+   if (largest <= 1.0f)
+      return glsl_precision_low;
+   if (largest <= 16384.0f)
+      return glsl_precision_medium;
+   return glsl_precision_high;
+}
+
+
+/**
+ * Whether the value of the variable feeds back into it, directly or through
+ * other variables, like a sum in a loop.  stack has room for every variable.
+ */
+bool
+reads_itself(variable_info *info, unsigned search, variable_info **stack)
+{
+   unsigned size = 0;
+   for (unsigned i = 0; i < info->num_sources; i++) {
+      variable_info *const source = info->sources[i];
+      if (source->visited != search) {
+         source->visited = search;
+         stack[size++] = source;
+      }
+   }
+
+   while (size > 0) {
+      variable_info *const current = stack[--size];
+      if (current == info)
+         return true;
+      for (unsigned i = 0; i < current->num_sources; i++) {
+         variable_info *const source = current->sources[i];
+         if (source->visited != search) {
+            source->visited = search;
+            stack[size++] = source;
+         }
+      }
+   }
+   return false;
+}
+
+
+class precision_inference {
+public:
+   precision_inference(hash_table *variables)
+      : variables(variables)
+   {
+   }
+
+   glsl_precision value_precision(ir_rvalue *ir);
+   glsl_precision variable_precision(ir_variable *var);
+
+   hash_table *variables;
+};
+
+
+glsl_precision
+precision_inference::variable_precision(ir_variable *var)
+{
+   variable_info *const info =
+      (variable_info *) glslopt_hash_table_find(this->variables, var);
+   return info ? info->precision : declared_precision(var);
+}
+
+
+/** The precision a value has, from its sources. */
+glsl_precision
+precision_inference::value_precision(ir_rvalue *ir)
+{
+   switch (ir->ir_type) {
+   case ir_type_constant:
+      return constant_precision((ir_constant *) ir);
+
+   case ir_type_dereference_variable:
+      return variable_precision(((ir_dereference_variable *) ir)->var);
+
+   case ir_type_dereference_array:
+      return value_precision(((ir_dereference_array *) ir)->array);
+
+   case ir_type_swizzle:
+      return value_precision(((ir_swizzle *) ir)->val);
+
+   case ir_type_texture: {
+      ir_variable *const sampler =
+         ((ir_texture *) ir)->sampler->variable_referenced();
+      return sampler ? declared_precision(sampler) : glsl_precision_high;
+   }
+
+   case ir_type_expression:
+      break;
+
+   default:
+      return glsl_precision_high;
+   }
+
+   ir_expression *const expr = (ir_expression *) ir;
+   glsl_precision prec = glsl_precision_undefined;
+   for (unsigned i = 0; i < expr->get_num_operands(); i++)
+      prec = higher_precision(prec, value_precision(expr->operands[i]));
+
+   switch (expr->operation) {
+   case ir_unop_normalize:
+      return (glsl_precision) MAX2(prec, glsl_precision_medium);
+   case ir_unop_b2f:
+   case ir_unop_b2i:
+      return glsl_precision_low;
+   default:
+      return prec;
+   }
+}
+
+
+/** Derefs of the variables that got demoted, and what is computed from them. */
+struct update_state {
+   hash_table *demoted;
+   hash_table *changed;
+};
+
+
+bool
+is_changed(update_state *state, ir_rvalue *ir)
+{
+   return ir != NULL && glslopt_hash_table_find(state->changed, ir) != NULL;
+}
+
+
+/**
+ * Leaf dereferences only get the enter callback, everything else is updated
+ * once its children are done.
+ */
+void
+update_precision(ir_instruction *ir, void *data)
+{
+   update_state *const state = (update_state *) data;
+
+   glsl_precision prec = glsl_precision_undefined;
+   switch (ir->ir_type) {
+   case ir_type_dereference_variable: {
+      ir_variable *const var = ((ir_dereference_variable *) ir)->var;
+      if (glslopt_hash_table_find(state->demoted, var) == NULL)
+         return;
+      prec = (glsl_precision) var->data.precision;
+      break;
+   }
+   case ir_type_dereference_array: {
+      ir_rvalue *const array = ((ir_dereference_array *) ir)->array;
+      if (!is_changed(state, array))
+         return;
+      prec = array->get_precision();
+      break;
+   }
+   case ir_type_swizzle: {
+      ir_rvalue *const val = ((ir_swizzle *) ir)->val;
+      if (!is_changed(state, val))
+         return;
+      prec = val->get_precision();
+      break;
+   }
+   case ir_type_expression: {
+      ir_expression *const expr = (ir_expression *) ir;
+      bool any_changed = false;
+      for (unsigned i = 0; i < expr->get_num_operands(); i++) {
+         any_changed |= is_changed(state, expr->operands[i]);
+         prec = higher_precision(prec, expr->operands[i]->get_precision());
+      }
+      if (!any_changed)
+         return;
+      break;
+   }
+   default:
+      return;
+   }
+
+   ir_rvalue *const rvalue = (ir_rvalue *) ir;
+   if (prec == glsl_precision_undefined || prec == rvalue->get_precision())
+      return;
+   rvalue->set_precision(prec);
+   glslopt_hash_table_insert(state->changed, ir, ir);
+}
+
+} /* unnamed namespace */
+
+
+bool
+do_infer_precision(exec_list *instructions)
+{
+   void *const mem_ctx = glslopt_ralloc_context(NULL);
+   hash_table *const variables =
+      glslopt_hash_table_ctor(0, glslopt_hash_table_pointer_hash,
+                              glslopt_hash_table_pointer_compare);
+
+   precision_collector collector(variables, mem_ctx);
+   collector.run(instructions);
+
+   variable_info **const infos = collector.infos;
+   const unsigned num_infos = collector.num_infos;
+   precision_inference inference(variables);
+
+   /* From the sources: start out as low as can be, and raise variables
+    * until everything assigned to them fits.  Starting variables that read
+    * themselves low would settle them at the precision of what gets added
+    * to them, so they start (and stay) at their declared precision.
+    */
+   variable_info **const stack =
+      ralloc_array(mem_ctx, variable_info *, num_infos);
+   for (unsigned i = 0; i < num_infos; i++) {
+      variable_info *const info = infos[i];
+      if (is_candidate(info->var) && !info->unknown && info->num_writes > 0 &&
+          !reads_itself(info, i + 1, stack))
+         info->precision = glsl_precision_undefined;
+   }
+
+   bool changed;
+   do {
+      changed = false;
+      for (unsigned i = 0; i < num_infos; i++) {
+         variable_info *const info = infos[i];
+         if (!is_candidate(info->var) || info->unknown || info->num_writes == 0)
+            continue;
+
+         glsl_precision prec = glsl_precision_undefined;
+         for (unsigned j = 0; j < info->num_writes; j++) {
+            ir_rvalue *const rhs = info->writes[j]->rhs;
+            prec = higher_precision(prec, inference.value_precision(rhs));
+         }
+         prec = (glsl_precision) MAX2(prec, declared_precision(info->var));
+
+         /* Only ever raise precision, so that cycles settle down. */
+         prec = higher_precision(prec, info->precision);
+         if (prec != info->precision) {
+            info->precision = prec;
+            changed = true;
+         }
+      }
+   } while (changed);
+
+   /* Assigned from nothing but themselves. */
+   for (unsigned i = 0; i < num_infos; i++) {
+      variable_info *const info = infos[i];
+      if (info->precision == glsl_precision_undefined)
+         info->precision = declared_precision(info->var);
+   }
+
+   /* From the uses: values only copied somewhere need no more precision
+    * than that has.
+    */
+   do {
+      changed = false;
+      for (unsigned i = 0; i < num_infos; i++) {
+         variable_info *const info = infos[i];
+         if (!is_candidate(info->var) || info->unknown || info->read ||
+             info->num_copies == 0)
+            continue;
+
+         glsl_precision needed = glsl_precision_undefined;
+         for (unsigned j = 0; j < info->num_copies; j++) {
+            ir_variable *const target = info->copied_to[j];
+            needed = higher_precision(needed,
+                                      inference.variable_precision(target));
+         }
+         const glsl_precision prec =
+            (glsl_precision) MAX2(info->precision, needed);
+         if (prec != info->precision) {
+            info->precision = prec;
+            changed = true;
+         }
+      }
+   } while (changed);
+
+   update_state state;
+   state.demoted = glslopt_hash_table_ctor(0, glslopt_hash_table_pointer_hash,
+                                           glslopt_hash_table_pointer_compare);
+   state.changed = glslopt_hash_table_ctor(0, glslopt_hash_table_pointer_hash,
+                                           glslopt_hash_table_pointer_compare);
+   bool progress = false;
+   for (unsigned i = 0; i < num_infos; i++) {
+      variable_info *const info = infos[i];
+      if (info->precision <= declared_precision(info->var))
+         continue;
+      info->var->data.precision = info->precision;
+      glslopt_hash_table_insert(state.demoted, info, info->var);
+      progress = true;
+   }
+
+   if (progress) {
+      foreach_in_list(ir_instruction, ir, instructions)
+         visit_tree(ir, update_precision, &state, update_precision, &state);
+   }
+
+   glslopt_hash_table_dtor(state.demoted);
+   glslopt_hash_table_dtor(state.changed);
+   glslopt_hash_table_dtor(variables);
+   glslopt_ralloc_free(mem_ctx);
+   return progress;
+}
@@ -28,13 +28,20 @@
  * can be proven to not contribute to the final result.
  *
  * The algorithm is similar to alpha-beta pruning on a minmax search.
+ *
+ * Operands other than constants and nested min/max get their range from
+ * value_range_analysis, which also drives removing clamps and saturates
+ * that can't change their operand, and folding comparisons whose result
+ * the ranges decide.
  */
 
+#include <math.h>
 #include "ir.h"
 #include "ir_visitor.h"
 #include "ir_rvalue_visitor.h"
 #include "ir_optimization.h"
 #include "ir_builder.h"
+#include "ir_value_range.h"
 #include "program/prog_instruction.h"
 #include "glsl_types.h"
 #include "main/macros.h"
@@ -71,16 +78,28 @@ public:
 
 class ir_minmax_visitor : public ir_rvalue_enter_visitor {
 public:
-   ir_minmax_visitor()
-      : progress(false)
+   ir_minmax_visitor(value_range_analysis *ranges)
+      : progress(false), ranges(ranges)
+   {
+      this->mem_ctx = glslopt_ralloc_context(NULL);
+   }
+
+   ~ir_minmax_visitor()
    {
+      glslopt_ralloc_free(this->mem_ctx);
    }
 
+   value_range exact_range(ir_rvalue *rval);
+   minmax_range get_range(ir_rvalue *rval);
    ir_rvalue *prune_expression(ir_expression *expr, minmax_range baserange);
+   ir_rvalue *prune_clamp(ir_expression *expr);
+   ir_rvalue *fold_comparison(ir_expression *expr);
 
    void handle_rvalue(ir_rvalue **rvalue);
 
    bool progress;
+   value_range_analysis *ranges;
+   void *mem_ctx;   /**< For limits that don't come from the IR */
 };
 
 /*
@@ -269,8 +288,20 @@ range_intersection(minmax_range r0, minmax_range r1)
    return ret;
 }
 
-static minmax_range
-get_range(ir_rvalue *rval)
+/**
+ * Range of rval if it holds exactly.  Bounds that rounding can break are
+ * the ones shaders guard with a clamp, e.g. a dot product of normalized
+ * vectors before acos(), so they don't count.
+ */
+value_range
+ir_minmax_visitor::exact_range(ir_rvalue *rval)
+{
+   const value_range r = ranges->range(rval);
+   return r.exact ? r : value_range();
+}
+
+minmax_range
+ir_minmax_visitor::get_range(ir_rvalue *rval)
 {
    ir_expression *expr = rval->as_expression();
    if (expr && (expr->operation == ir_binop_min ||
@@ -285,7 +316,88 @@ get_range(ir_rvalue *rval)
       return minmax_range(c, c);
    }
 
-   return minmax_range();
+   const value_range r = exact_range(rval);
+   minmax_range ret;
+   if (r.low != -INFINITY)
+      ret.low = new(mem_ctx) ir_constant(r.low);
+   if (r.high != INFINITY)
+      ret.high = new(mem_ctx) ir_constant(r.high);
+   return ret;
+}
+
+/**
+ * Drops the limits of a clamp or saturate that the operand's range already
+ * respects.
+ */
+ir_rvalue *
+ir_minmax_visitor::prune_clamp(ir_expression *expr)
+{
+   const value_range r = exact_range(expr->operands[0]);
+
+   if (expr->operation == ir_unop_saturate)
+      return (r.low >= 0.0f && r.high <= 1.0f) ? expr->operands[0] : expr;
+
+   const bool above_low = r.low >= exact_range(expr->operands[1]).high;
+   const bool below_high = r.high <= exact_range(expr->operands[2]).low;
+   if (above_low && below_high)
+      return expr->operands[0];
+
+   /* Clamping to [0, 1] is a free saturate on most GPUs. */
+   ir_constant *const low = expr->operands[1]->as_constant();
+   ir_constant *const high = expr->operands[2]->as_constant();
+   if (low && low->is_zero() && high && high->is_one())
+      return expr;
+
+   if (above_low)
+      return min2(expr->operands[0], expr->operands[2]);
+   if (below_high)
+      return max2(expr->operands[0], expr->operands[1]);
+   return expr;
+}
+
+/** Replaces a comparison the operand ranges decide with a constant. */
+ir_rvalue *
+ir_minmax_visitor::fold_comparison(ir_expression *expr)
+{
+   if (expr->operands[0]->type->base_type != GLSL_TYPE_FLOAT)
+      return expr;
+
+   const value_range a = exact_range(expr->operands[0]);
+   const value_range b = exact_range(expr->operands[1]);
+   bool result;
+
+   switch (expr->operation) {
+   case ir_binop_less:
+   case ir_binop_gequal:
+      if (a.high < b.low)
+         result = true;
+      else if (a.low >= b.high)
+         result = false;
+      else
+         return expr;
+      if (expr->operation == ir_binop_gequal)
+         result = !result;
+      break;
+   case ir_binop_greater:
+   case ir_binop_lequal:
+      if (a.low > b.high)
+         result = true;
+      else if (a.high <= b.low)
+         result = false;
+      else
+         return expr;
+      if (expr->operation == ir_binop_lequal)
+         result = !result;
+      break;
+   default:
+      return expr;
+   }
+
+   ir_constant_data data;
+   memset(&data, 0, sizeof(data));
+   for (unsigned i = 0; i < expr->type->components(); i++)
+      data.b[i] = result;
+   return new(glslopt_ralloc_parent(expr)) ir_constant(expr->type, &data);
 }
 
 /**
@@ -446,11 +558,28 @@ ir_minmax_visitor::handle_rvalue(ir_rvalue **rvalue)
       return;
 
    ir_expression *expr = (*rvalue)->as_expression();
-   if (!expr || (expr->operation != ir_binop_min &&
-                 expr->operation != ir_binop_max))
+   if (!expr)
       return;
 
-   ir_rvalue *new_rvalue = prune_expression(expr, minmax_range());
+   ir_rvalue *new_rvalue;
+   switch (expr->operation) {
+   case ir_binop_min:
+   case ir_binop_max:
+      new_rvalue = prune_expression(expr, minmax_range());
+      break;
+   case ir_unop_saturate:
+   case ir_triop_clamp:
+      new_rvalue = prune_clamp(expr);
+      break;
+   case ir_binop_less:
+   case ir_binop_greater:
+   case ir_binop_lequal:
+   case ir_binop_gequal:
+      new_rvalue = fold_comparison(expr);
+      break;
+   default:
+      return;
+   }
    if (new_rvalue == *rvalue)
       return;
 
@@ -465,9 +594,10 @@ ir_minmax_visitor::handle_rvalue(ir_rvalue **rvalue)
 }
 
 bool
-do_minmax_prune(exec_list *instructions)
+do_minmax_prune(exec_list *instructions, bool normalized_textures)
 {
-   ir_minmax_visitor v;
+   value_range_analysis ranges(instructions, normalized_textures);
+   ir_minmax_visitor v(&ranges);
 
    visit_list_elements(&v, instructions);
 
@@ -54,6 +54,20 @@
  * Also see http://penguin.ewu.edu/~trolfe/DSWpaper/ for a very readable
  * explanation of the of the tree_to_vine() (rightward rotation) and
  * vine_to_tree() (leftward rotation) algorithms.
+ *
+ * With fast math, floating point reductions may be reassociated too, and
+ * trees with any kind of operands get rebuilt.  The operands are sorted by
+ * rank (constants, then values of uniforms only, then of shader inputs, then
+ * everything else) and each rank gets its own balanced subtree:
+ *
+ *    ((x * 2.0) * u) * 0.5
+ *
+ * becomes
+ *
+ *    (2.0 * 0.5) * (u * x)
+ *
+ * so constants fold, uniform parts can be extracted or hoisted, and sums
+ * written in different orders look the same to CSE.
  */
 
 #include "ir.h"
@@ -126,16 +140,41 @@ namespace {
 
 class ir_rebalance_visitor : public ir_rvalue_enter_visitor {
 public:
-   ir_rebalance_visitor()
+   ir_rebalance_visitor(bool reassociate)
+      : reassociate(reassociate)
    {
       progress = false;
    }
 
+   virtual ir_visitor_status visit_enter(ir_assignment *ir);
    void handle_rvalue(ir_rvalue **rvalue);
 
+   bool reassociate;
    bool progress;
 };
 
+/** Operands of a reduction, from the first to compute to the last. */
+enum operand_rank {
+   RANK_CONSTANT,
+   RANK_UNIFORM,
+   RANK_INPUT,
+   RANK_VARIABLE,
+   RANK_COUNT
+};
+
+struct reduction_operand {
+   ir_rvalue *value;
+   operand_rank rank;
+};
+
+struct reduction_operands {
+   ir_expression_operation operation;
+   const glsl_type *type;
+   reduction_operand *operands;
+   unsigned count;
+   bool valid;
+};
+
 struct is_reduction_data {
    ir_expression_operation operation;
    const glsl_type *type;
@@ -280,6 +319,177 @@ update_types(ir_instruction *ir, void *)
    expr->type = new_type;
 }
 
+static void
+operand_rank_of(ir_instruction *ir, void *data)
+{
+   operand_rank *const rank = (operand_rank *) data;
+
+   operand_rank r = RANK_CONSTANT;
+   if (ir->ir_type == ir_type_texture) {
+      r = RANK_VARIABLE;
+   } else if (ir->ir_type == ir_type_dereference_variable) {
+      switch (((ir_dereference_variable *) ir)->var->data.mode) {
+      case ir_var_uniform:
+         r = RANK_UNIFORM;
+         break;
+      case ir_var_shader_in:
+      case ir_var_system_value:
+         r = RANK_INPUT;
+         break;
+      default:
+         r = RANK_VARIABLE;
+         break;
+      }
+   }
+   *rank = MAX2(*rank, r);
+}
+
+static void
+collect_operands(ir_rvalue *ir, reduction_operands *ops)
+{
+   ir_expression *const expr = ir->as_expression();
+   if (expr && expr->operation == ops->operation && expr->type == ops->type) {
+      if (expr->operands[0]->type->is_matrix() ||
+          expr->operands[1]->type->is_matrix()) {
+         ops->valid = false;
+         return;
+      }
+      collect_operands(expr->operands[0], ops);
+      collect_operands(expr->operands[1], ops);
+      return;
+   }
+
+   operand_rank rank = RANK_CONSTANT;
+   visit_tree(ir, operand_rank_of, &rank);
+
+   ops->operands = reralloc(NULL, ops->operands, reduction_operand,
+                            ops->count + 1);
+   ops->operands[ops->count].value = ir;
+   ops->operands[ops->count].rank = rank;
+   ops->count++;
+}
+
+/* Whether ir is the tree build_balanced() would make of the operands. */
+static bool
+is_balanced(ir_rvalue *ir, ir_expression_operation operation,
+            ir_rvalue **operands, unsigned count)
+{
+   if (count == 1)
+      return ir == operands[0];
+
+   ir_expression *const expr = ir->as_expression();
+   const unsigned half = count / 2;
+   return expr && expr->operation == operation &&
+          is_balanced(expr->operands[0], operation, operands, half) &&
+          is_balanced(expr->operands[1], operation, operands + half,
+                      count - half);
+}
+
+static ir_rvalue *
+build_balanced(void *mem_ctx, ir_expression_operation operation,
+               ir_rvalue **operands, unsigned count)
+{
+   if (count == 1)
+      return operands[0];
+
+   const unsigned half = count / 2;
+   ir_rvalue *const a = build_balanced(mem_ctx, operation, operands, half);
+   ir_rvalue *const b = build_balanced(mem_ctx, operation, operands + half,
+                                       count - half);
+   return new(mem_ctx) ir_expression(operation, a, b);
+}
+
+/* Group i has the operands from group_start[i] up to group_start[i + 1]. */
+static bool
+is_grouped(ir_rvalue *ir, ir_expression_operation operation,
+           ir_rvalue **operands, const unsigned *group_start,
+           unsigned num_groups)
+{
+   if (num_groups == 1)
+      return is_balanced(ir, operation, operands + group_start[0],
+                         group_start[1] - group_start[0]);
+
+   ir_expression *const expr = ir->as_expression();
+   const unsigned half = num_groups / 2;
+   return expr && expr->operation == operation &&
+          is_grouped(expr->operands[0], operation, operands, group_start,
+                     half) &&
+          is_grouped(expr->operands[1], operation, operands,
+                     group_start + half, num_groups - half);
+}
+
+static ir_rvalue *
+build_grouped(void *mem_ctx, ir_expression_operation operation,
+              ir_rvalue **operands, const unsigned *group_start,
+              unsigned num_groups)
+{
+   if (num_groups == 1)
+      return build_balanced(mem_ctx, operation, operands + group_start[0],
+                            group_start[1] - group_start[0]);
+
+   const unsigned half = num_groups / 2;
+   ir_rvalue *const a = build_grouped(mem_ctx, operation, operands,
+                                      group_start, half);
+   ir_rvalue *const b = build_grouped(mem_ctx, operation, operands,
+                                      group_start + half, num_groups - half);
+   return new(mem_ctx) ir_expression(operation, a, b);
+}
+
+/**
+ * Sorts the operands of a reduction by rank, and makes a balanced tree of
+ * balanced subtrees for each rank.
+ */
+static ir_rvalue *
+reassociate_expression(ir_expression *expr)
+{
+   reduction_operands ops;
+   ops.operation = expr->operation;
+   ops.type = expr->type;
+   ops.operands = NULL;
+   ops.count = 0;
+   ops.valid = true;
+   collect_operands(expr, &ops);
+
+   if (!ops.valid || ops.count < 3) {
+      glslopt_ralloc_free(ops.operands);
+      return expr;
+   }
+
+   /* Operands of the same rank keep their order. */
+   ir_rvalue **const sorted = ralloc_array(ops.operands, ir_rvalue *,
+                                           ops.count);
+   unsigned group_start[RANK_COUNT + 1];
+   unsigned num_groups = 0;
+   unsigned n = 0;
+   for (unsigned rank = 0; rank < RANK_COUNT; rank++) {
+      const unsigned start = n;
+      for (unsigned i = 0; i < ops.count; i++) {
+         if (ops.operands[i].rank == rank)
+            sorted[n++] = ops.operands[i].value;
+      }
+      if (n > start)
+         group_start[num_groups++] = start;
+   }
+   group_start[num_groups] = n;
+
+   ir_rvalue *result = expr;
+   if (!is_grouped(expr, expr->operation, sorted, group_start, num_groups))
+      result = build_grouped(glslopt_ralloc_parent(expr), expr->operation,
+                             sorted, group_start, num_groups);
+
+   glslopt_ralloc_free(ops.operands);
+   return result;
+}
+
+ir_visitor_status
+ir_rebalance_visitor::visit_enter(ir_assignment *ir)
+{
+   ir_variable *const var = ir->lhs->variable_referenced();
+   if (this->reassociate && var != NULL && var->data.precise)
+      return visit_continue_with_parent;
+   return ir_rvalue_enter_visitor::visit_enter(ir);
+}
+
 void
 ir_rebalance_visitor::handle_rvalue(ir_rvalue **rvalue)
 {
@@ -290,7 +500,8 @@ ir_rebalance_visitor::handle_rvalue(ir_rvalue **rvalue)
    if (!expr || !is_reduction_operation(expr->operation))
       return;
 
-   ir_rvalue *new_rvalue = handle_expression(expr);
+   ir_rvalue *new_rvalue = this->reassociate ?
+      reassociate_expression(expr) : handle_expression(expr);
 
    /* If we failed to rebalance the tree (e.g., because it wasn't a reduction,
     * or some other set of cases) new_rvalue will point to the same root as
@@ -304,16 +515,17 @@ ir_rebalance_visitor::handle_rvalue(ir_rvalue **rvalue)
    if (new_rvalue == *rvalue)
       return;
 
-   visit_tree(new_rvalue, NULL, NULL, update_types);
+   if (!this->reassociate)
+      visit_tree(new_rvalue, NULL, NULL, update_types);
 
    *rvalue = new_rvalue;
    this->progress = true;
 }
 
 bool
-do_rebalance_tree(exec_list *instructions)
+do_rebalance_tree(exec_list *instructions, bool reassociate)
 {
-   ir_rebalance_visitor v;
+   ir_rebalance_visitor v(reassociate);
 
    v.run(instructions);
 
@@ -0,0 +1,404 @@
+/**
+ * \file opt_schedule_pressure.cpp
+ *
+ * Reorders assignments so that fewer variables are live at once.
+ *
+ * Tree grafting and copy propagation leave computations wherever they
+ * happened to be, which can be long before their results are read.  Mobile
+ * GPUs run fewer invocations at once the more registers a shader needs at
+ * its peak, and drivers that run out have to spill.
+ *
+ * This is a list scheduler for each run of assignments between control
+ * flow.  Of the assignments whose inputs are ready, it picks the one that
+ * adds the fewest live registers, preferring the ones that end live ranges,
+ * and otherwise keeps the original order.  The new order is only used when
+ * it needs fewer registers at its peak than the old one.
+ */
+
+#include "ir.h"
+#include "ir_hierarchical_visitor.h"
+#include "ir_liveness.h"
+#include "ir_optimization.h"
+#include "glsl_types.h"
+
+namespace {
+
+struct schedule_node {
+   ir_assignment *ir;
+   /** Index into the run's variables of what it writes, or -1. */
+   int write;
+   /** Indices of what it reads, each once. */
+   unsigned *reads;
+   unsigned num_reads;
+   schedule_node **successors;
+   unsigned num_successors;
+   unsigned num_predecessors;
+   bool scheduled;
+};
+
+/** A variable that a run of assignments touches. */
+struct run_variable {
+   ir_variable *var;
+   unsigned registers;
+   bool live_in;
+   bool live_out;
+   unsigned num_reads;
+   /* While scheduling. */
+   unsigned remaining_reads;
+   bool live;
+};
+
+
+class read_collector : public ir_hierarchical_visitor {
+public:
+   read_collector(void *mem_ctx)
+      : mem_ctx(mem_ctx), vars(NULL), num_vars(0)
+   {
+   }
+
+   virtual ir_visitor_status visit(ir_dereference_variable *ir)
+   {
+      for (unsigned i = 0; i < this->num_vars; i++) {
+         if (this->vars[i] == ir->var)
+            return visit_continue;
+      }
+      this->vars = reralloc(this->mem_ctx, this->vars, ir_variable *,
+                            this->num_vars + 1);
+      this->vars[this->num_vars++] = ir->var;
+      return visit_continue;
+   }
+
+   void *mem_ctx;
+   ir_variable **vars;
+   unsigned num_vars;
+};
+
+
+class run_scheduler {
+public:
+   run_scheduler(void *mem_ctx, liveness_analysis *liveness)
+      : mem_ctx(mem_ctx), liveness(liveness)
+   {
+   }
+
+   bool schedule(ir_instruction *first, exec_node *next);
+
+private:
+   unsigned variable_index(ir_variable *var);
+   void add_node(ir_assignment *ir);
+   void add_dependencies();
+   void start();
+   int pressure_change(const schedule_node *node);
+   void run(const schedule_node *node);
+   unsigned peak(schedule_node **order);
+
+   void *mem_ctx;
+   liveness_analysis *liveness;
+
+   schedule_node *nodes;
+   unsigned num_nodes;
+   run_variable *vars;
+   unsigned num_vars;
+
+   /* What the live variables take while scheduling, and the most so far. */
+   unsigned registers;
+   unsigned max_registers;
+};
+
+
+unsigned
+run_scheduler::variable_index(ir_variable *var)
+{
+   for (unsigned i = 0; i < this->num_vars; i++) {
+      if (this->vars[i].var == var)
+         return i;
+   }
+
+   this->vars = reralloc(this->mem_ctx, this->vars, run_variable,
+                         this->num_vars + 1);
+   run_variable *const v = &this->vars[this->num_vars];
+   memset(v, 0, sizeof(*v));
+   v->var = var;
+   v->registers = variable_registers(var);
+   return this->num_vars++;
+}
+
+
+void
+run_scheduler::add_node(ir_assignment *ir)
+{
+   /* Writing part of an array or structure also depends on what it wrote
+    * before.
+    */
+   read_collector reads(this->mem_ctx);
+   ir->rhs->accept(&reads);
+   if (ir->condition != NULL)
+      ir->condition->accept(&reads);
+   if (ir->lhs->as_dereference_variable() == NULL)
+      ir->lhs->accept(&reads);
+
+   this->nodes = reralloc(this->mem_ctx, this->nodes, schedule_node,
+                          this->num_nodes + 1);
+   schedule_node *const node = &this->nodes[this->num_nodes++];
+   memset(node, 0, sizeof(*node));
+   node->ir = ir;
+
+   ir_variable *const written = ir->lhs->variable_referenced();
+   node->write = written != NULL ? (int) variable_index(written) : -1;
+   node->reads = ralloc_array(this->mem_ctx, unsigned, reads.num_vars + 1);
+   for (unsigned i = 0; i < reads.num_vars; i++) {
+      node->reads[i] = variable_index(reads.vars[i]);
+      this->vars[node->reads[i]].num_reads++;
+   }
+   node->num_reads = reads.num_vars;
+}
+
+
+/** Reads stay after the writes before them, and writes after the reads. */
+void
+run_scheduler::add_dependencies()
+{
+   for (unsigned j = 0; j < this->num_nodes; j++) {
+      schedule_node *const later = &this->nodes[j];
+      for (unsigned i = 0; i < j; i++) {
+         schedule_node *const earlier = &this->nodes[i];
+
+         bool depends = earlier->write >= 0 && earlier->write == later->write;
+         for (unsigned k = 0; k < later->num_reads && !depends; k++)
+            depends = (int) later->reads[k] == earlier->write;
+         for (unsigned k = 0; k < earlier->num_reads && !depends; k++)
+            depends = (int) earlier->reads[k] == later->write;
+         if (!depends)
+            continue;
+
+         earlier->successors = reralloc(this->mem_ctx, earlier->successors,
+                                        schedule_node *,
+                                        earlier->num_successors + 1);
+         earlier->successors[earlier->num_successors++] = later;
+         later->num_predecessors++;
+      }
+   }
+}
+
+
+void
+run_scheduler::start()
+{
+   this->registers = 0;
+   for (unsigned i = 0; i < this->num_vars; i++) {
+      this->vars[i].remaining_reads = this->vars[i].num_reads;
+      this->vars[i].live = this->vars[i].live_in;
+      if (this->vars[i].live)
+         this->registers += this->vars[i].registers;
+   }
+   this->max_registers = this->registers;
+}
+
+
+/** Registers that become live, minus those that stop being live. */
+int
+run_scheduler::pressure_change(const schedule_node *node)
+{
+   int change = 0;
+   for (unsigned i = 0; i < node->num_reads; i++) {
+      const run_variable *const v = &this->vars[node->reads[i]];
+      if ((int) node->reads[i] != node->write && v->live &&
+          v->remaining_reads == 1 && !v->live_out)
+         change -= v->registers;
+   }
+   if (node->write >= 0) {
+      const run_variable *const v = &this->vars[node->write];
+      bool reads_itself = false;
+      for (unsigned i = 0; i < node->num_reads; i++)
+         reads_itself |= (int) node->reads[i] == node->write;
+      const unsigned later_reads = v->remaining_reads - (reads_itself ? 1 : 0);
+      if (!v->live && (later_reads > 0 || v->live_out))
+         change += v->registers;
+   }
+   return change;
+}
+
+
+/** Updates what is live for an assignment having run. */
+void
+run_scheduler::run(const schedule_node *node)
+{
+   if (node->write >= 0 && !this->vars[node->write].live) {
+      this->vars[node->write].live = true;
+      this->registers += this->vars[node->write].registers;
+   }
+   this->max_registers = MAX2(this->max_registers, this->registers);
+
+   for (unsigned i = 0; i < node->num_reads; i++)
+      this->vars[node->reads[i]].remaining_reads--;
+
+   /* A variable that is read again later after being written again counts
+    * as live in between, which is good enough to compare orders with.
+    */
+   for (unsigned i = 0; i <= node->num_reads; i++) {
+      const int index = i < node->num_reads ? (int) node->reads[i] : node->write;
+      if (index < 0)
+         continue;
+      run_variable *const v = &this->vars[index];
+      if (v->live && v->remaining_reads == 0 && !v->live_out) {
+         v->live = false;
+         this->registers -= v->registers;
+      }
+   }
+}
+
+
+/** Most registers the run's variables take at once in some order. */
+unsigned
+run_scheduler::peak(schedule_node **order)
+{
+   start();
+   for (unsigned i = 0; i < this->num_nodes; i++)
+      run(order[i]);
+   return this->max_registers;
+}
+
+
+/**
+ * Schedules the assignments from first up to next, which may be the end of
+ * the list; declarations among them move to the front.
+ */
+bool
+run_scheduler::schedule(ir_instruction *first, exec_node *next)
+{
+   this->nodes = NULL;
+   this->num_nodes = 0;
+   this->vars = NULL;
+   this->num_vars = 0;
+
+   ir_instruction *last = NULL;
+   for (exec_node *node = first; node != next; node = node->next) {
+      ir_instruction *const ir = (ir_instruction *) node;
+      if (ir->as_assignment() != NULL)
+         add_node(ir->as_assignment());
+      last = ir;
+   }
+   if (this->num_nodes < 2)
+      return false;
+
+   /* What is live before the run follows from what is live after it. */
+   for (unsigned i = 0; i < this->num_vars; i++) {
+      run_variable *const v = &this->vars[i];
+      v->live_out = this->liveness->is_live_after(last, v->var);
+      v->live_in = v->live_out;
+   }
+   for (unsigned i = this->num_nodes; i-- > 0; ) {
+      const schedule_node *const node = &this->nodes[i];
+      if (node->ir->condition == NULL && node->ir->whole_variable_written())
+         this->vars[node->write].live_in = false;
+      for (unsigned j = 0; j < node->num_reads; j++)
+         this->vars[node->reads[j]].live_in = true;
+   }
+
+   add_dependencies();
+
+   schedule_node **const original = ralloc_array(this->mem_ctx,
+                                                 schedule_node *,
+                                                 this->num_nodes);
+   schedule_node **const order = ralloc_array(this->mem_ctx,
+                                              schedule_node *,
+                                              this->num_nodes);
+   for (unsigned i = 0; i < this->num_nodes; i++)
+      original[i] = &this->nodes[i];
+
+   start();
+   for (unsigned n = 0; n < this->num_nodes; n++) {
+      schedule_node *best = NULL;
+      int best_change = 0;
+      for (unsigned i = 0; i < this->num_nodes; i++) {
+         schedule_node *const node = &this->nodes[i];
+         if (node->scheduled || node->num_predecessors > 0)
+            continue;
+         const int change = pressure_change(node);
+         if (best == NULL || change < best_change) {
+            best = node;
+            best_change = change;
+         }
+      }
+
+      best->scheduled = true;
+      order[n] = best;
+      run(best);
+      for (unsigned i = 0; i < best->num_successors; i++)
+         best->successors[i]->num_predecessors--;
+   }
+
+   bool reordered = false;
+   for (unsigned i = 0; i < this->num_nodes; i++)
+      reordered |= order[i] != original[i];
+   if (!reordered || peak(order) >= peak(original))
+      return false;
+
+   /* Declarations go first, so that they stay in front of their uses. */
+   exec_list declarations;
+   for (exec_node *node = first; node != next; ) {
+      ir_instruction *const ir = (ir_instruction *) node;
+      node = node->next;
+      ir->remove();
+      if (ir->as_variable() != NULL)
+         declarations.push_tail(ir);
+   }
+
+   foreach_in_list_safe(ir_instruction, ir, &declarations) {
+      ir->remove();
+      next->insert_before(ir);
+   }
+   for (unsigned i = 0; i < this->num_nodes; i++)
+      next->insert_before(order[i]->ir);
+   return true;
+}
+
+
+bool
+schedule_list(exec_list *list, run_scheduler *scheduler)
+{
+   bool progress = false;
+   ir_instruction *first = NULL;
+
+   foreach_in_list_safe(ir_instruction, ir, list) {
+      if (ir->as_assignment() != NULL || ir->as_variable() != NULL) {
+         if (first == NULL)
+            first = ir;
+         continue;
+      }
+
+      if (first != NULL)
+         progress |= scheduler->schedule(first, ir);
+      first = NULL;
+
+      if (ir_if *const branch = ir->as_if()) {
+         progress |= schedule_list(&branch->then_instructions, scheduler);
+         progress |= schedule_list(&branch->else_instructions, scheduler);
+      } else if (ir_loop *const loop = ir->as_loop()) {
+         progress |= schedule_list(&loop->body_instructions, scheduler);
+      } else if (ir_function *const func = ir->as_function()) {
+         foreach_in_list(ir_function_signature, sig, &func->signatures)
+            progress |= schedule_list(&sig->body, scheduler);
+      }
+   }
+   if (first != NULL)
+      progress |= scheduler->schedule(first, list->get_tail()->next);
+
+   return progress;
+}
+
+} /* unnamed namespace */
+
+
+bool
+do_schedule_for_pressure(exec_list *instructions)
+{
+   void *const mem_ctx = glslopt_ralloc_context(NULL);
+   liveness_analysis liveness(instructions);
+   run_scheduler scheduler(mem_ctx, &liveness);
+
+   const bool progress = schedule_list(instructions, &scheduler);
+
+   glslopt_ralloc_free(mem_ctx);
+   return progress;
+}
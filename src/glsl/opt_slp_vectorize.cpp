@@ -0,0 +1,460 @@
+/**
+ * \file opt_slp_vectorize.cpp
+ *
+ * Packs isomorphic scalar computations of a basic block into vector
+ * operations (superword-level parallelism).
+ *
+ * opt_vectorize.cpp combines consecutive assignments of the same expression
+ * to the channels of a variable.  Generated code often interleaves the
+ * channels with other work, and uses different constants for each channel:
+ *
+ *    r.x = a.x * 2.0 + s;
+ *    t = ...;
+ *    r.y = a.y * 3.0 + s;
+ *
+ * This pass groups single-channel assignments to the same variable whose
+ * right-hand sides have the same shape: the same operations, with channels
+ * of one vector, one scalar, or constants at the leaves.  Each group becomes
+ * a single vector assignment in place of its last member:
+ *
+ *    t = ...;
+ *    r.xy = a.xy * vec2(2.0, 3.0) + vec2(s);
+ *
+ * The uses and definitions of the assignments in the block tell whether the
+ * earlier members can move down that far.
+ */
+
+#include "ir.h"
+#include "ir_visitor.h"
+#include "ir_optimization.h"
+#include "glsl_types.h"
+
+namespace {
+
+/** Variables an assignment reads and writes. */
+struct def_use {
+   ir_assignment *ir;
+   ir_variable *def;       /**< NULL once the assignment is gone */
+   unsigned def_mask;
+   ir_variable **uses;
+   unsigned num_uses;
+   bool candidate;         /**< Single channel, vectorizable right-hand side */
+   unsigned channel;
+};
+
+
+void
+collect_use(ir_instruction *ir, void *data)
+{
+   ir_dereference_variable *const deref = ir->as_dereference_variable();
+   if (deref == NULL)
+      return;
+   def_use *const du = (def_use *) data;
+   du->uses = reralloc(NULL, du->uses, ir_variable *, du->num_uses + 1);
+   du->uses[du->num_uses++] = deref->var;
+}
+
+
+bool
+uses_variable(const def_use *du, const ir_variable *var)
+{
+   for (unsigned i = 0; i < du->num_uses; i++) {
+      if (du->uses[i] == var)
+         return true;
+   }
+   return false;
+}
+
+
+bool
+is_vectorizable_type(const glsl_type *type)
+{
+   return type->base_type == GLSL_TYPE_FLOAT ||
+          type->base_type == GLSL_TYPE_INT ||
+          type->base_type == GLSL_TYPE_UINT;
+}
+
+
+/**
+ * Whether the operation works on each component on its own, and prints the
+ * same for vectors as for scalars.
+ */
+bool
+is_componentwise(ir_expression_operation op)
+{
+   switch (op) {
+   case ir_unop_bit_not:
+   case ir_unop_neg:
+   case ir_unop_abs:
+   case ir_unop_sign:
+   case ir_unop_rcp:
+   case ir_unop_rsq:
+   case ir_unop_sqrt:
+   case ir_unop_exp:
+   case ir_unop_log:
+   case ir_unop_exp2:
+   case ir_unop_log2:
+   case ir_unop_f2i:
+   case ir_unop_f2u:
+   case ir_unop_i2f:
+   case ir_unop_u2f:
+   case ir_unop_i2u:
+   case ir_unop_u2i:
+   case ir_unop_trunc:
+   case ir_unop_ceil:
+   case ir_unop_floor:
+   case ir_unop_fract:
+   case ir_unop_round_even:
+   case ir_unop_sin:
+   case ir_unop_cos:
+   case ir_unop_saturate:
+   case ir_unop_dFdx:
+   case ir_unop_dFdy:
+   case ir_binop_add:
+   case ir_binop_sub:
+   case ir_binop_mul:
+   case ir_binop_div:
+   case ir_binop_mod:
+   case ir_binop_min:
+   case ir_binop_max:
+   case ir_binop_pow:
+   case ir_triop_fma:
+   case ir_triop_clamp:
+   case ir_triop_lrp:
+      return true;
+   default:
+      return false;
+   }
+}
+
+
+/**
+ * Whether two scalar trees can become the components of one vector tree.
+ * Counts the operations in *ops.
+ */
+bool
+isomorphic(ir_rvalue *a, ir_rvalue *b, unsigned *ops)
+{
+   if (!a->type->is_scalar() || a->type != b->type ||
+       !is_vectorizable_type(a->type))
+      return false;
+
+   if (a->ir_type == ir_type_constant && b->ir_type == ir_type_constant)
+      return true;
+
+   ir_swizzle *const swz_a = a->as_swizzle();
+   ir_swizzle *const swz_b = b->as_swizzle();
+   if (swz_a != NULL && swz_b != NULL)
+      return swz_a->val->type->is_vector() && swz_a->val->equals(swz_b->val);
+
+   ir_expression *const expr_a = a->as_expression();
+   ir_expression *const expr_b = b->as_expression();
+   if (expr_a != NULL && expr_b != NULL) {
+      if (expr_a->operation != expr_b->operation ||
+          !is_componentwise(expr_a->operation))
+         return false;
+      (*ops)++;
+      for (unsigned i = 0; i < expr_a->get_num_operands(); i++) {
+         if (!isomorphic(expr_a->operands[i], expr_b->operands[i], ops))
+            return false;
+      }
+      return true;
+   }
+
+   /* The same scalar gets replicated. */
+   return a->ir_type != ir_type_texture && a->equals(b);
+}
+
+
+/**
+ * Builds the vector tree whose components are the given isomorphic scalar
+ * trees.
+ */
+ir_rvalue *
+build_vector(void *mem_ctx, ir_rvalue **trees, unsigned count)
+{
+   ir_rvalue *const first = trees[0];
+   const glsl_type *const type =
+      glsl_type::get_instance(first->type->base_type, count, 1);
+
+   if (first->ir_type == ir_type_constant) {
+      ir_constant_data data;
+      memset(&data, 0, sizeof(data));
+      for (unsigned i = 0; i < count; i++) {
+         ir_constant *const c = (ir_constant *) trees[i];
+         switch (type->base_type) {
+         case GLSL_TYPE_FLOAT: data.f[i] = c->value.f[0]; break;
+         case GLSL_TYPE_INT: data.i[i] = c->value.i[0]; break;
+         default: data.u[i] = c->value.u[0]; break;
+         }
+      }
+      return new(mem_ctx) ir_constant(type, &data, first->get_precision());
+   }
+
+   if (ir_swizzle *const swz = first->as_swizzle()) {
+      unsigned components[4];
+      for (unsigned i = 0; i < count; i++)
+         components[i] = ((ir_swizzle *) trees[i])->mask.x;
+      return new(mem_ctx) ir_swizzle(swz->val->clone(mem_ctx, NULL),
+                                     components, count);
+   }
+
+   if (ir_expression *const expr = first->as_expression()) {
+      ir_rvalue *operands[4] = { NULL, NULL, NULL, NULL };
+      for (unsigned op = 0; op < expr->get_num_operands(); op++) {
+         ir_rvalue *sources[4];
+         for (unsigned i = 0; i < count; i++)
+            sources[i] = ((ir_expression *) trees[i])->operands[op];
+         operands[op] = build_vector(mem_ctx, sources, count);
+      }
+      return new(mem_ctx) ir_expression(expr->operation, type, operands[0],
+                                        operands[1], operands[2], operands[3]);
+   }
+
+   return new(mem_ctx) ir_swizzle(first->clone(mem_ctx, NULL), 0, 0, 0, 0,
+                                  count);
+}
+
+
+class slp_vectorizer {
+public:
+   slp_vectorizer()
+      : progress(false)
+   {
+   }
+
+   void vectorize_list(exec_list *instructions);
+   void vectorize_block(def_use *block, unsigned count);
+   bool can_move(def_use *block, const bool *in_pack, unsigned from,
+                 unsigned to);
+   void emit_pack(def_use *block, const unsigned *members, unsigned count);
+
+   bool progress;
+};
+
+
+/**
+ * Splits the list into basic blocks of assignments, and vectorizes each.
+ * Nested lists are blocks of their own.
+ */
+void
+slp_vectorizer::vectorize_list(exec_list *instructions)
+{
+   def_use *block = NULL;
+   unsigned count = 0;
+
+   foreach_in_list(ir_instruction, ir, instructions) {
+      ir_assignment *const assign = ir->as_assignment();
+      if (assign != NULL) {
+         block = reralloc(NULL, block, def_use, count + 1);
+         def_use *const du = &block[count++];
+         memset(du, 0, sizeof(*du));
+         du->ir = assign;
+         du->def = assign->lhs->variable_referenced();
+         du->def_mask = assign->write_mask;
+         visit_tree(assign->rhs, collect_use, du);
+         if (assign->condition)
+            visit_tree(assign->condition, collect_use, du);
+         if (assign->lhs->as_dereference_variable() == NULL) {
+            du->def_mask = ~0u;
+            visit_tree(assign->lhs, collect_use, du);
+         }
+
+         const glsl_type *const type = du->def ? du->def->type : NULL;
+         unsigned ops = 0;
+         du->candidate = assign->condition == NULL &&
+                         assign->lhs->as_dereference_variable() != NULL &&
+                         type->is_vector() && is_vectorizable_type(type) &&
+                         du->def_mask != 0 &&
+                         (du->def_mask & (du->def_mask - 1)) == 0 &&
+                         !uses_variable(du, du->def) &&
+                         isomorphic(assign->rhs, assign->rhs, &ops) &&
+                         ops > 0;
+         while (du->candidate && (du->def_mask & (1u << du->channel)) == 0)
+            du->channel++;
+         continue;
+      }
+      if (ir->as_variable() != NULL)
+         continue;
+
+      vectorize_block(block, count);
+      count = 0;
+
+      switch (ir->ir_type) {
+      case ir_type_function:
+         foreach_in_list(ir_function_signature, sig,
+                         &((ir_function *) ir)->signatures)
+            vectorize_list(&sig->body);
+         break;
+      case ir_type_if:
+         vectorize_list(&((ir_if *) ir)->then_instructions);
+         vectorize_list(&((ir_if *) ir)->else_instructions);
+         break;
+      case ir_type_loop:
+         vectorize_list(&((ir_loop *) ir)->body_instructions);
+         break;
+      default:
+         break;
+      }
+   }
+
+   vectorize_block(block, count);
+   glslopt_ralloc_free(block);
+}
+
+
+/**
+ * Whether the assignment at \c from can move down to \c to, past everything
+ * in between that isn't part of the same pack.
+ */
+bool
+slp_vectorizer::can_move(def_use *block, const bool *in_pack, unsigned from,
+                         unsigned to)
+{
+   const def_use *const moved = &block[from];
+
+   for (unsigned i = from + 1; i < to; i++) {
+      const def_use *const du = &block[i];
+      if (in_pack[i] || du->def == NULL)
+         continue;
+      if (uses_variable(du, moved->def))
+         return false;
+      if (du->def == moved->def && (du->def_mask & moved->def_mask) != 0)
+         return false;
+      if (uses_variable(moved, du->def))
+         return false;
+   }
+   return true;
+}
+
+
+void
+slp_vectorizer::vectorize_block(def_use *block, unsigned count)
+{
+   bool *const in_pack = rzalloc_array(NULL, bool, count);
+
+   for (unsigned first = 0; first < count; first++) {
+      if (!block[first].candidate)
+         continue;
+
+      /* Members in order, and by channel. */
+      unsigned members[4];
+      unsigned num_members = 1;
+      unsigned channels = 1u << block[first].channel;
+      members[0] = first;
+
+      for (unsigned i = first + 1; i < count && num_members < 4; i++) {
+         unsigned ops = 0;
+         if (block[i].candidate && block[i].def == block[first].def &&
+             (channels & (1u << block[i].channel)) == 0 &&
+             isomorphic(block[first].ir->rhs, block[i].ir->rhs, &ops)) {
+            members[num_members++] = i;
+            channels |= 1u << block[i].channel;
+         }
+      }
+      if (num_members < 2)
+         continue;
+
+      const unsigned last = members[num_members - 1];
+      for (unsigned i = 0; i < num_members; i++)
+         in_pack[members[i]] = true;
+
+      /* Members that can't move stay where they are; they don't read the
+       * variable, so the rest can still move past them.
+       */
+      unsigned kept = 0;
+      for (unsigned i = 0; i < num_members; i++) {
+         if (members[i] == last ||
+             can_move(block, in_pack, members[i], last))
+            members[kept++] = members[i];
+         else
+            in_pack[members[i]] = false;
+      }
+
+      if (kept >= 2)
+         emit_pack(block, members, kept);
+
+      for (unsigned i = 0; i < num_members; i++)
+         in_pack[members[i]] = false;
+   }
+
+   glslopt_ralloc_free(in_pack);
+   for (unsigned i = 0; i < count; i++)
+      glslopt_ralloc_free(block[i].uses);
+}
+
+
+/**
+ * Replaces the members of a pack with one vector assignment in place of the
+ * last one.
+ */
+void
+slp_vectorizer::emit_pack(def_use *block, const unsigned *members,
+                          unsigned count)
+{
+   def_use *const last = &block[members[count - 1]];
+   void *const mem_ctx = glslopt_ralloc_parent(last->ir);
+
+   /* Components of the right-hand side go to the written channels in
+    * order.
+    */
+   unsigned by_channel[4];
+   memcpy(by_channel, members, count * sizeof(members[0]));
+   for (unsigned i = 1; i < count; i++) {
+      for (unsigned j = i; j > 0 &&
+           block[by_channel[j]].channel < block[by_channel[j - 1]].channel;
+           j--) {
+         const unsigned tmp = by_channel[j];
+         by_channel[j] = by_channel[j - 1];
+         by_channel[j - 1] = tmp;
+      }
+   }
+
+   ir_rvalue *trees[4];
+   unsigned write_mask = 0;
+   for (unsigned i = 0; i < count; i++) {
+      trees[i] = block[by_channel[i]].ir->rhs;
+      write_mask |= block[by_channel[i]].def_mask;
+   }
+
+   ir_assignment *const assign =
+      new(mem_ctx) ir_assignment(new(mem_ctx) ir_dereference_variable(last->def),
+                                 build_vector(mem_ctx, trees, count), NULL,
+                                 write_mask);
+   last->ir->insert_before(assign);
+
+   /* The block's information follows the instructions. */
+   for (unsigned i = 0; i < count; i++) {
+      def_use *const du = &block[members[i]];
+      du->ir->remove();
+      du->candidate = false;
+      if (du == last)
+         continue;
+      for (unsigned u = 0; u < du->num_uses; u++) {
+         last->uses = reralloc(NULL, last->uses, ir_variable *,
+                               last->num_uses + 1);
+         last->uses[last->num_uses++] = du->uses[u];
+      }
+      du->def = NULL;
+      du->num_uses = 0;
+   }
+   last->ir = assign;
+   last->def_mask = write_mask;
+
+   this->progress = true;
+}
+
+} /* unnamed namespace */
+
+
+/**
+ * Packs isomorphic single-channel assignments to the same variable within
+ * basic blocks into vector assignments.
+ */
+bool
+do_slp_vectorize(exec_list *instructions)
+{
+   slp_vectorizer v;
+   v.vectorize_list(instructions);
+   return v.progress;
+}
@@ -0,0 +1,499 @@
+/**
+ * \file opt_texture_fetches.cpp
+ *
+ * Merges identical texture fetches.
+ *
+ * do_cse forgets everything at the end of a basic block, and only merges
+ * fetches whose coordinates are uniforms or shader inputs.  This pass walks
+ * whole functions instead, and remembers each fetch until something it
+ * reads (the coordinate, lod, offset or sampler index) gets assigned.  A
+ * fetch that is the same as a remembered one reads the result of that one
+ * instead.
+ *
+ * When both branches of an if do the same fetch, and nothing in the if
+ * assigns to what it reads, the fetch moves in front of the if.  The lookup
+ * is then only done once, and it starts before the branch so its latency
+ * can overlap with the condition.  A fetch in just one of the branches
+ * stays where it is, as moving it would also do it whenever the other
+ * branch runs.
+ */
+
+#include "ir.h"
+#include "ir_rvalue_visitor.h"
+#include "ir_optimization.h"
+#include "ir_builder.h"
+#include "glsl_types.h"
+
+using namespace ir_builder;
+
+namespace {
+
+/** A fetch whose result is still valid. */
+struct fetch_entry {
+   /** The fetch; the rhs of var's assignment once it has a variable. */
+   ir_rvalue **val;
+   /** Statement to put the variable in front of. */
+   ir_instruction *base_ir;
+   ir_variable *var;
+   /** Every variable the fetch reads. */
+   ir_variable **reads;
+   unsigned num_reads;
+};
+
+
+class texture_fetch_visitor : public ir_rvalue_visitor {
+public:
+   texture_fetch_visitor()
+   {
+      this->mem_ctx = glslopt_ralloc_context(NULL);
+      this->available = NULL;
+      this->num_available = 0;
+      this->progress = false;
+   }
+
+   ~texture_fetch_visitor()
+   {
+      glslopt_ralloc_free(this->mem_ctx);
+   }
+
+   virtual ir_visitor_status visit_enter(ir_function_signature *ir);
+   virtual ir_visitor_status visit_enter(ir_if *ir);
+   virtual ir_visitor_status visit_enter(ir_loop *ir);
+   virtual ir_visitor_status visit_leave(ir_assignment *ir);
+   virtual ir_visitor_status visit_leave(ir_call *ir);
+   virtual void handle_rvalue(ir_rvalue **rvalue);
+
+   void kill(ir_variable *var);
+   void kill_all();
+
+   bool progress;
+
+private:
+   fetch_entry *find(ir_texture *ir);
+   fetch_entry *add(ir_rvalue **rvalue, ir_instruction *base_ir);
+   void move_to_variable(fetch_entry *entry);
+   fetch_entry **save();
+   void restore(fetch_entry **saved, unsigned num_saved);
+   void kill_assigned(exec_list *instructions);
+   void hoist(ir_if *ir);
+
+   void *mem_ctx;
+   fetch_entry **available;
+   unsigned num_available;
+};
+
+
+/** Collects the variables an rvalue reads. */
+class read_collector : public ir_hierarchical_visitor {
+public:
+   read_collector(void *mem_ctx)
+      : mem_ctx(mem_ctx), reads(NULL), num_reads(0)
+   {
+   }
+
+   virtual ir_visitor_status visit(ir_dereference_variable *ir)
+   {
+      for (unsigned i = 0; i < this->num_reads; i++) {
+         if (this->reads[i] == ir->var)
+            return visit_continue;
+      }
+      this->reads = reralloc(this->mem_ctx, this->reads, ir_variable *,
+                             this->num_reads + 1);
+      this->reads[this->num_reads++] = ir->var;
+      return visit_continue;
+   }
+
+   void *mem_ctx;
+   ir_variable **reads;
+   unsigned num_reads;
+};
+
+
+/** Collects the variables that some code assigns. */
+class assignment_collector : public ir_hierarchical_visitor {
+public:
+   assignment_collector(void *mem_ctx)
+      : mem_ctx(mem_ctx), vars(NULL), num_vars(0), has_calls(false)
+   {
+   }
+
+   virtual ir_visitor_status visit_leave(ir_assignment *ir)
+   {
+      ir_variable *const var = ir->lhs->variable_referenced();
+      if (var == NULL)
+         return visit_continue;
+      this->vars = reralloc(this->mem_ctx, this->vars, ir_variable *,
+                            this->num_vars + 1);
+      this->vars[this->num_vars++] = var;
+      return visit_continue;
+   }
+
+   /* Functions that are left after inlining can write to anything. */
+   virtual ir_visitor_status visit_leave(ir_call *)
+   {
+      this->has_calls = true;
+      return visit_continue;
+   }
+
+   void *mem_ctx;
+   ir_variable **vars;
+   unsigned num_vars;
+   bool has_calls;
+};
+
+
+/**
+ * Collects the outermost fetches that a list of instructions always does,
+ * that is outside of nested ifs and loops.
+ */
+class unconditional_fetch_collector : public ir_hierarchical_visitor {
+public:
+   unconditional_fetch_collector(void *mem_ctx)
+      : mem_ctx(mem_ctx), fetches(NULL), num_fetches(0)
+   {
+   }
+
+   virtual ir_visitor_status visit_enter(ir_if *)
+   {
+      return visit_continue_with_parent;
+   }
+
+   virtual ir_visitor_status visit_enter(ir_loop *)
+   {
+      return visit_continue_with_parent;
+   }
+
+   virtual ir_visitor_status visit_enter(ir_texture *ir)
+   {
+      this->fetches = reralloc(this->mem_ctx, this->fetches, ir_texture *,
+                               this->num_fetches + 1);
+      this->fetches[this->num_fetches++] = ir;
+      return visit_continue_with_parent;
+   }
+
+   void *mem_ctx;
+   ir_texture **fetches;
+   unsigned num_fetches;
+};
+
+
+class contains_fetch_visitor : public ir_hierarchical_visitor {
+public:
+   contains_fetch_visitor(ir_rvalue *fetch)
+      : fetch(fetch), found(false)
+   {
+   }
+
+   virtual ir_visitor_status visit_enter(ir_texture *ir)
+   {
+      if (ir != this->fetch)
+         return visit_continue;
+      this->found = true;
+      return visit_stop;
+   }
+
+   ir_rvalue *fetch;
+   bool found;
+};
+
+
+bool
+contains_fetch(ir_rvalue *haystack, ir_rvalue *fetch)
+{
+   contains_fetch_visitor v(fetch);
+   haystack->accept(&v);
+   return v.found;
+}
+
+
+bool
+any_shared(ir_variable *const *a, unsigned num_a,
+           ir_variable *const *b, unsigned num_b)
+{
+   for (unsigned i = 0; i < num_a; i++) {
+      for (unsigned j = 0; j < num_b; j++) {
+         if (a[i] == b[j])
+            return true;
+      }
+   }
+   return false;
+}
+
+} /* unnamed namespace */
+
+
+fetch_entry *
+texture_fetch_visitor::find(ir_texture *ir)
+{
+   for (unsigned i = 0; i < this->num_available; i++) {
+      if (ir->equals(*this->available[i]->val))
+         return this->available[i];
+   }
+   return NULL;
+}
+
+
+fetch_entry *
+texture_fetch_visitor::add(ir_rvalue **rvalue, ir_instruction *base_ir)
+{
+   read_collector reads(this->mem_ctx);
+   (*rvalue)->accept(&reads);
+
+   fetch_entry *const entry = rzalloc(this->mem_ctx, fetch_entry);
+   entry->val = rvalue;
+   entry->base_ir = base_ir;
+   entry->reads = reads.reads;
+   entry->num_reads = reads.num_reads;
+
+   this->available = reralloc(this->mem_ctx, this->available, fetch_entry *,
+                              this->num_available + 1);
+   this->available[this->num_available++] = entry;
+   return entry;
+}
+
+
+/**
+ * Moves the first fetch of a value into a new variable, for the later ones
+ * to read.
+ */
+void
+texture_fetch_visitor::move_to_variable(fetch_entry *entry)
+{
+   ir_rvalue *const fetch = *entry->val;
+   void *const ctx = glslopt_ralloc_parent(fetch);
+
+   ir_variable *const var = new(ctx) ir_variable(fetch->type, "tex",
+                                                 ir_var_temporary,
+                                                 fetch->get_precision());
+   entry->base_ir->insert_before(var);
+   ir_assignment *const assignment = assign(var, fetch);
+   entry->base_ir->insert_before(assignment);
+
+   *entry->val = new(ctx) ir_dereference_variable(var);
+   entry->val = &assignment->rhs;
+   entry->var = var;
+
+   /* Fetches inside this one now have to get their variables in front of
+    * its assignment.
+    */
+   for (unsigned i = 0; i < this->num_available; i++) {
+      fetch_entry *const other = this->available[i];
+      if (other != entry && contains_fetch(fetch, *other->val))
+         other->base_ir = assignment;
+   }
+}
+
+
+void
+texture_fetch_visitor::kill(ir_variable *var)
+{
+   if (var == NULL)
+      return;
+
+   unsigned n = 0;
+   for (unsigned i = 0; i < this->num_available; i++) {
+      if (!any_shared(this->available[i]->reads,
+                      this->available[i]->num_reads, &var, 1))
+         this->available[n++] = this->available[i];
+   }
+   this->num_available = n;
+}
+
+
+void
+texture_fetch_visitor::kill_all()
+{
+   this->num_available = 0;
+}
+
+
+fetch_entry **
+texture_fetch_visitor::save()
+{
+   fetch_entry **const saved = ralloc_array(this->mem_ctx, fetch_entry *,
+                                            this->num_available + 1);
+   memcpy(saved, this->available, this->num_available * sizeof(*saved));
+   return saved;
+}
+
+
+void
+texture_fetch_visitor::restore(fetch_entry **saved, unsigned num_saved)
+{
+   this->available = reralloc(this->mem_ctx, this->available, fetch_entry *,
+                              num_saved + 1);
+   memcpy(this->available, saved, num_saved * sizeof(*saved));
+   this->num_available = num_saved;
+}
+
+
+void
+texture_fetch_visitor::kill_assigned(exec_list *instructions)
+{
+   assignment_collector assigned(this->mem_ctx);
+   assigned.run(instructions);
+
+   if (assigned.has_calls) {
+      kill_all();
+      return;
+   }
+   for (unsigned i = 0; i < assigned.num_vars; i++)
+      kill(assigned.vars[i]);
+}
+
+
+/**
+ * Starts the fetches that both branches do in front of the if, where the
+ * branches then find them.
+ */
+void
+texture_fetch_visitor::hoist(ir_if *ir)
+{
+   unconditional_fetch_collector then_fetches(this->mem_ctx);
+   then_fetches.run(&ir->then_instructions);
+   if (then_fetches.num_fetches == 0)
+      return;
+
+   unconditional_fetch_collector else_fetches(this->mem_ctx);
+   else_fetches.run(&ir->else_instructions);
+   if (else_fetches.num_fetches == 0)
+      return;
+
+   /* What a fetch reads might have changed by the time the branch does it. */
+   assignment_collector assigned(this->mem_ctx);
+   assigned.run(&ir->then_instructions);
+   assigned.run(&ir->else_instructions);
+   if (assigned.has_calls)
+      return;
+
+   void *const ctx = glslopt_ralloc_parent(ir);
+   for (unsigned i = 0; i < then_fetches.num_fetches; i++) {
+      ir_texture *const fetch = then_fetches.fetches[i];
+      if (find(fetch) != NULL)
+         continue;
+
+      bool in_else = false;
+      for (unsigned j = 0; j < else_fetches.num_fetches && !in_else; j++)
+         in_else = fetch->equals(else_fetches.fetches[j]);
+      if (!in_else)
+         continue;
+
+      read_collector reads(this->mem_ctx);
+      fetch->accept(&reads);
+      if (any_shared(reads.reads, reads.num_reads,
+                     assigned.vars, assigned.num_vars))
+         continue;
+
+      ir_variable *const var = new(ctx) ir_variable(fetch->type, "tex",
+                                                    ir_var_temporary,
+                                                    fetch->get_precision());
+      ir->insert_before(var);
+      ir_assignment *const assignment = assign(var, fetch->clone(ctx, NULL));
+      ir->insert_before(assignment);
+
+      fetch_entry *const entry = add(&assignment->rhs, assignment);
+      entry->var = var;
+      this->progress = true;
+   }
+}
+
+
+ir_visitor_status
+texture_fetch_visitor::visit_enter(ir_function_signature *)
+{
+   kill_all();
+   return visit_continue;
+}
+
+
+ir_visitor_status
+texture_fetch_visitor::visit_enter(ir_if *ir)
+{
+   ir->condition->accept(this);
+   handle_rvalue(&ir->condition);
+   hoist(ir);
+
+   /* Fetches in one branch aren't done in the other one, nor after the if
+    * when it took the other branch.
+    */
+   const unsigned num_saved = this->num_available;
+   fetch_entry **const saved = save();
+
+   visit_list_elements(this, &ir->then_instructions);
+   restore(saved, num_saved);
+
+   visit_list_elements(this, &ir->else_instructions);
+   restore(saved, num_saved);
+
+   kill_assigned(&ir->then_instructions);
+   kill_assigned(&ir->else_instructions);
+   return visit_continue_with_parent;
+}
+
+
+ir_visitor_status
+texture_fetch_visitor::visit_enter(ir_loop *ir)
+{
+   /* The next iteration starts with what the last one assigned. */
+   kill_assigned(&ir->body_instructions);
+
+   /* The body might not run to the end. */
+   const unsigned num_saved = this->num_available;
+   fetch_entry **const saved = save();
+
+   visit_list_elements(this, &ir->body_instructions);
+   restore(saved, num_saved);
+   return visit_continue_with_parent;
+}
+
+
+ir_visitor_status
+texture_fetch_visitor::visit_leave(ir_assignment *ir)
+{
+   ir_visitor_status s = ir_rvalue_visitor::visit_leave(ir);
+   kill(ir->lhs->variable_referenced());
+   return s;
+}
+
+
+ir_visitor_status
+texture_fetch_visitor::visit_leave(ir_call *ir)
+{
+   ir_visitor_status s = ir_rvalue_visitor::visit_leave(ir);
+   kill_all();
+   return s;
+}
+
+
+void
+texture_fetch_visitor::handle_rvalue(ir_rvalue **rvalue)
+{
+   if (*rvalue == NULL)
+      return;
+
+   ir_texture *const tex = (*rvalue)->as_texture();
+   if (tex == NULL)
+      return;
+
+   fetch_entry *const entry = find(tex);
+   if (entry == NULL) {
+      add(rvalue, this->base_ir);
+      return;
+   }
+
+   if (entry->var == NULL)
+      move_to_variable(entry);
+   *rvalue = new(glslopt_ralloc_parent(tex)) ir_dereference_variable(entry->var);
+   this->progress = true;
+}
+
+
+bool
+do_merge_texture_fetches(exec_list *instructions)
+{
+   texture_fetch_visitor v;
+
+   v.run(instructions);
+
+   return v.progress;
+}
@@ -49,6 +49,10 @@
         'glsl/ir.h',
         'glsl/ir_stats.h',
         'glsl/ir_stats.cpp',
+        'glsl/ir_fingerprint.h',
+        'glsl/ir_fingerprint.cpp',
+        'glsl/ir_serialize.h',
+        'glsl/ir_serialize.cpp',
         'glsl/ir_basic_block.cpp',
         'glsl/ir_basic_block.h',
         'glsl/ir_builder.cpp',
@@ -66,6 +70,8 @@
         'glsl/ir_hierarchical_visitor.h',
         'glsl/ir_hv_accept.cpp',
         'glsl/ir_import_prototypes.cpp',
+        'glsl/ir_liveness.cpp',
+        'glsl/ir_liveness.h',
         'glsl/ir_optimization.h',
         'glsl/ir_print_glsl_visitor.cpp',
         'glsl/ir_print_glsl_visitor.h',
@@ -79,6 +85,8 @@
         'glsl/ir_unused_structs.cpp',
         'glsl/ir_unused_structs.h',
         'glsl/ir_validate.cpp',
+        'glsl/ir_value_range.cpp',
+        'glsl/ir_value_range.h',
         'glsl/ir_variable_refcount.cpp',
         'glsl/ir_variable_refcount.h',
         'glsl/ir_visitor.h',
@@ -98,6 +106,7 @@
         'glsl/loop_analysis.cpp',
         'glsl/loop_analysis.h',
         'glsl/loop_controls.cpp',
+        'glsl/loop_invariants.cpp',
         'glsl/loop_unroll.cpp',
         'glsl/lower_clip_distance.cpp',
         'glsl/lower_discard.cpp',
@@ -126,13 +135,20 @@
         'glsl/opt_dead_code.cpp',
         'glsl/opt_dead_code_local.cpp',
         'glsl/opt_dead_functions.cpp',
+        'glsl/opt_extract_uniform_expressions.cpp',
         'glsl/opt_flatten_nested_if_blocks.cpp',
         'glsl/opt_function_inlining.cpp',
+        'glsl/opt_fuse_multiply_add.cpp',
+        'glsl/opt_hoist_varyings.cpp',
         'glsl/opt_if_simplification.cpp',
+        'glsl/opt_infer_precision.cpp',
         'glsl/opt_noop_swizzle.cpp',
         'glsl/opt_redundant_jumps.cpp',
+        'glsl/opt_slp_vectorize.cpp',
+        'glsl/opt_schedule_pressure.cpp',
         'glsl/opt_structure_splitting.cpp',
         'glsl/opt_swizzle_swizzle.cpp',
+        'glsl/opt_texture_fetches.cpp',
         'glsl/opt_tree_grafting.cpp',
         'glsl/opt_vectorize.cpp',
         'glsl/opt_flip_matrices.cpp',
@@ -1019,6 +1019,7 @@ struct gl_shader_compiler_options
 
    GLuint MaxIfDepth;               /**< Maximum nested IF blocks */
    GLuint MaxUnrollIterations;
+   GLuint MaxUnrollFactor;          /**< Partial unrolling; 0 or 1 for none */
 
    /**
     * Optimize code for array of structures backends.
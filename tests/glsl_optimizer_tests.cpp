@@ -620,6 +620,89 @@ static bool TestFile (glslopt_ctx* ctx, bool vertex,
 }
 
 
+// Compiles one source under all keyword combinations, once through
+// glslopt_optimize_variants and once as independent compiles; results have to
+// match, and both timings are printed.
+static bool BenchmarkVariants (glslopt_ctx* ctx)
+{
+	static const char* kSource =
+		"uniform sampler2D _MainTex;\n"
+		"uniform sampler2D _DetailTex;\n"
+		"uniform vec4 _FogColor;\n"
+		"varying vec4 uv;\n"
+		"varying float fog;\n"
+		"void main() {\n"
+		"  vec4 c = texture2D (_MainTex, uv.xy);\n"
+		"#ifdef DETAIL\n"
+		"  c.rgb *= texture2D (_DetailTex, uv.zw).rgb * 2.0;\n"
+		"#endif\n"
+		"#ifdef ALPHA_TEST\n"
+		"  if (c.a < 0.5) discard;\n"
+		"#endif\n"
+		"#if defined(FOG_LINEAR) || defined(FOG_EXP)\n"
+		"  c.rgb = mix (_FogColor.rgb, c.rgb, clamp (fog, 0.0, 1.0));\n"
+		"#endif\n"
+		"  gl_FragColor = c;\n"
+		"}\n";
+	// The last two keywords don't apply to this shader, like most keywords of an engine.
+	static const char* kKeywords[] = { "DETAIL", "ALPHA_TEST", "FOG_LINEAR", "FOG_EXP", "SHADOWS_SCREEN", "LIGHTMAP_ON" };
+	const int kKeywordCount = sizeof(kKeywords) / sizeof(kKeywords[0]);
+	const int kVariantCount = 1 << kKeywordCount;
+
+	std::vector<std::string> defineSets (kVariantCount);
+	std::vector<std::string> sources (kVariantCount);
+	for (int v = 0; v < kVariantCount; ++v)
+	{
+		for (int k = 0; k < kKeywordCount; ++k)
+		{
+			if (!(v & (1 << k)))
+				continue;
+			defineSets[v] += std::string(kKeywords[k]) + " ";
+			sources[v] += std::string("#define ") + kKeywords[k] + " 1\n";
+		}
+		sources[v] += kSource;
+	}
+
+	clock_t time0 = clock();
+	std::vector<glslopt_shader*> independent (kVariantCount);
+	for (int v = 0; v < kVariantCount; ++v)
+		independent[v] = glslopt_optimize (ctx, kGlslOptShaderFragment, sources[v].c_str(), 0);
+
+	clock_t time1 = clock();
+	std::vector<const char*> defines (kVariantCount);
+	for (int v = 0; v < kVariantCount; ++v)
+		defines[v] = defineSets[v].c_str();
+	std::vector<glslopt_shader*> variants (kVariantCount);
+	glslopt_optimize_variants (ctx, kGlslOptShaderFragment, kSource, &defines[0], kVariantCount, 0, &variants[0]);
+	clock_t time2 = clock();
+
+	bool res = true;
+	int unique = 0;
+	for (int v = 0; v < kVariantCount; ++v)
+	{
+		bool shared = false;
+		for (int i = 0; i < v && !shared; ++i)
+			shared = variants[i] == variants[v];
+		if (!shared)
+			++unique;
+
+		if (!glslopt_get_status (independent[v]) || !glslopt_get_status (variants[v]) ||
+			strcmp (glslopt_get_output (independent[v]), glslopt_get_output (variants[v])) != 0)
+		{
+			printf ("\n  variant '%s': does not match independent compile\n", defines[v]);
+			res = false;
+		}
+		glslopt_shader_delete (independent[v]);
+		glslopt_shader_delete (variants[v]);
+	}
+
+	printf ("\n** variants: %i define sets (%i unique), independent %.3fsec, variants %.3fsec\n",
+		kVariantCount, unique,
+		float(time1-time0)/CLOCKS_PER_SEC, float(time2-time1)/CLOCKS_PER_SEC);
+	return res;
+}
+
+
 int main (int argc, const char** argv)
 {
 	if (argc < 2)
@@ -689,6 +772,9 @@ int main (int argc, const char** argv)
 	clock_t time1 = clock();
 	float timeDelta = float(time1-time0)/CLOCKS_PER_SEC;
 
+	if (!BenchmarkVariants (ctx[2]))
+		++errors;
+
 	if (errors != 0)
 		printf ("\n**** %i tests (%.2fsec), %i !!!FAILED!!!\n", (int)tests, timeDelta, (int)errors);
 	else
@@ -169,6 +169,1327 @@ void main ()
 })GLSL");
 }
 
+// NOLINTNEXTLINE
+TEST(OptimizerSinkTest, StreamedOutputMatchesStringOutput)
+{
+    const char* src = R"GLSL(
+precision mediump float;
+uniform sampler2D mainTex;
+varying vec4 color;
+varying vec2 uv;
+void main()
+{
+    gl_FragColor = texture2D(mainTex, uv) * color;
+}
+    )GLSL";
+
+    auto* ctx = glslopt_initialize(kGlslTargetOpenGLES20);
+    auto* expected = glslopt_optimize(ctx, kGlslOptShaderFragment, src, 0);
+    ASSERT_TRUE(glslopt_get_status(expected));
+
+    std::string streamed;
+    glslopt_sink sink {};
+    sink.type = kGlslSinkCallback;
+    sink.userData = &streamed;
+    sink.callback = [](const char* data, size_t size, void* userData) {
+        static_cast<std::string*>(userData)->append(data, size);
+        return true;
+    };
+    auto* shader = glslopt_optimize_to_sink(ctx, kGlslOptShaderFragment, src, 0, &sink);
+    EXPECT_TRUE(glslopt_get_status(shader));
+    EXPECT_EQ(nullptr, glslopt_get_output(shader));
+    EXPECT_EQ(std::string(glslopt_get_output(expected)), streamed);
+    EXPECT_EQ(streamed.size(), glslopt_get_output_size(shader));
+    glslopt_shader_delete(shader);
+
+    sink.type = kGlslSinkSizeOnly;
+    shader = glslopt_optimize_to_sink(ctx, kGlslOptShaderFragment, src, 0, &sink);
+    EXPECT_TRUE(glslopt_get_status(shader));
+    EXPECT_EQ(glslopt_get_output_size(expected), glslopt_get_output_size(shader));
+    glslopt_shader_delete(shader);
+
+    sink.type = kGlslSinkCallback;
+    sink.callback = [](const char*, size_t, void*) { return false; };
+    shader = glslopt_optimize_to_sink(ctx, kGlslOptShaderFragment, src, 0, &sink);
+    EXPECT_FALSE(glslopt_get_status(shader));
+    glslopt_shader_delete(shader);
+
+    glslopt_shader_delete(expected);
+    glslopt_cleanup(ctx);
+}
+
+// NOLINTNEXTLINE
+TEST(OptimizerBufferTest, LengthDelimitedSource)
+{
+    const std::string src = R"GLSL(
+varying vec4 color;
+#define SCALE \
+    2.0
+void main()
+{
+    gl_FragColor = color * SCALE;
+}
+)GLSL";
+    // not NUL terminated: followed by junk that must not be read
+    const std::string buffer = src + "}}} garbage";
+
+    auto* ctx = glslopt_initialize(kGlslTargetOpenGL);
+    auto* expected = glslopt_optimize(ctx, kGlslOptShaderFragment, src.c_str(), 0);
+    ASSERT_TRUE(glslopt_get_status(expected));
+
+    auto* shader = glslopt_optimize_buffer(ctx, kGlslOptShaderFragment, buffer.data(), src.size(), 0, nullptr);
+    EXPECT_TRUE(glslopt_get_status(shader)) << glslopt_get_log(shader);
+    EXPECT_STREQ(glslopt_get_output(expected), glslopt_get_output(shader));
+    glslopt_shader_delete(shader);
+
+    glslopt_shader_delete(expected);
+    glslopt_cleanup(ctx);
+}
+
+// NOLINTNEXTLINE
+TEST(OptimizerPreprocessorBypassTest, SkipsOnlySourcesWithoutDirectives)
+{
+    auto* ctx = glslopt_initialize(kGlslTargetOpenGLES20);
+    EXPECT_EQ(0u, glslopt_get_preprocessor_bypass_count(ctx));
+
+    const char* plain = "varying lowp vec4 color;\nvoid main() { gl_FragColor = color * 2.0; }\n";
+    const char* needsPreprocessor[] = {
+        "#define X 2.0\nvarying lowp vec4 color;\nvoid main() { gl_FragColor = color * X; }\n",
+        "varying lowp vec4 color; // comment\nvoid main() { gl_FragColor = color; }\n",
+        "varying lowp vec4 color; /* comment */\nvoid main() { gl_FragColor = color; }\n",
+        "varying lowp vec4 color;\nvoid main() { gl_FragColor = color * float(__LINE__); }\n",
+    };
+
+    auto* shader = glslopt_optimize(ctx, kGlslOptShaderFragment, plain, 0);
+    EXPECT_TRUE(glslopt_get_status(shader)) << glslopt_get_log(shader);
+    glslopt_shader_delete(shader);
+    EXPECT_EQ(1u, glslopt_get_preprocessor_bypass_count(ctx));
+
+    for (const char* src : needsPreprocessor) {
+        shader = glslopt_optimize(ctx, kGlslOptShaderFragment, src, 0);
+        EXPECT_TRUE(glslopt_get_status(shader)) << src << glslopt_get_log(shader);
+        glslopt_shader_delete(shader);
+    }
+    EXPECT_EQ(1u, glslopt_get_preprocessor_bypass_count(ctx));
+
+    glslopt_cleanup(ctx);
+}
+
+// NOLINTNEXTLINE
+TEST(OptimizerPreludeTest, PreludeMatchesInlinedSource)
+{
+    const std::string prelude = R"GLSL(
+precision mediump float;
+#define LIGHT_SCALE 0.5
+struct Light { vec3 dir; vec3 color; };
+uniform Light _MainLight;
+uniform vec4 _UnusedColor;
+float lambert(vec3 n) { return max(0.0, dot(n, _MainLight.dir)) * LIGHT_SCALE; }
+vec3 unusedHelper(vec3 c) { return c * _UnusedColor.rgb; }
+)GLSL";
+    const std::string body = R"GLSL(
+varying vec3 normal;
+void main()
+{
+    gl_FragColor = vec4(_MainLight.color * lambert(normalize(normal)), LIGHT_SCALE);
+}
+)GLSL";
+
+    auto* ctx = glslopt_initialize(kGlslTargetOpenGLES20);
+    auto* expected = glslopt_optimize(ctx, kGlslOptShaderFragment, (prelude + body).c_str(), 0);
+    ASSERT_TRUE(glslopt_get_status(expected)) << glslopt_get_log(expected);
+
+    ASSERT_TRUE(glslopt_set_prelude(ctx, kGlslOptShaderFragment, prelude.c_str())) << glslopt_get_prelude_log(ctx, kGlslOptShaderFragment);
+    for (int i = 0; i < 2; ++i) {
+        auto* shader = glslopt_optimize(ctx, kGlslOptShaderFragment, body.c_str(), 0);
+        EXPECT_TRUE(glslopt_get_status(shader)) << glslopt_get_log(shader);
+        EXPECT_EQ(TrimStr(glslopt_get_output(expected)), TrimStr(glslopt_get_output(shader)));
+        glslopt_shader_delete(shader);
+    }
+
+    // versions have to match
+    auto* shader = glslopt_optimize(ctx, kGlslOptShaderFragment, ("#version 300 es\n" + body).c_str(), 0);
+    EXPECT_FALSE(glslopt_get_status(shader));
+    glslopt_shader_delete(shader);
+
+    EXPECT_FALSE(glslopt_set_prelude(ctx, kGlslOptShaderFragment, "float broken("));
+    EXPECT_NE(std::string(), glslopt_get_prelude_log(ctx, kGlslOptShaderFragment));
+    EXPECT_TRUE(glslopt_set_prelude(ctx, kGlslOptShaderFragment, nullptr));
+
+    glslopt_shader_delete(expected);
+    glslopt_cleanup(ctx);
+}
+
+// NOLINTNEXTLINE
+TEST(OptimizerVariantsTest, VariantsMatchIndependentCompiles)
+{
+    const char* source = R"GLSL(
+varying vec4 color;
+uniform sampler2D tex;
+void main()
+{
+    vec4 c = texture2D(tex, color.xy);
+#ifdef FOG
+    c.rgb = mix(c.rgb, vec3(0.5), color.w);
+#endif
+#if QUALITY > 1
+    c *= 2.0;
+#endif
+    gl_FragColor = c;
+}
+)GLSL";
+    const char* defineSets[] = {
+        "",
+        "FOG",
+        "FOG QUALITY=2",
+        "UNUSED_KEYWORD",   // not in source: same as ""
+        "QUALITY=1",        // same preprocessed source as ""
+        "QUALITY=2\nFOG=1", // same as "FOG QUALITY=2"
+        "FOG QUALITY=LEVEL LEVEL=3 UNUSED=LEVEL",
+    };
+    const char* textDefines[] = {
+        "",
+        "#define FOG 1\n",
+        "#define FOG 1\n#define QUALITY 2\n",
+        "#define UNUSED_KEYWORD 1\n",
+        "#define QUALITY 1\n",
+        "#define QUALITY 2\n#define FOG 1\n",
+        "#define FOG\n#define QUALITY LEVEL\n#define LEVEL 3\n",
+    };
+    const unsigned count = sizeof(defineSets) / sizeof(defineSets[0]);
+
+    auto* ctx = glslopt_initialize(kGlslTargetOpenGL);
+    glslopt_shader* shaders[count];
+    glslopt_optimize_variants(ctx, kGlslOptShaderFragment, source, defineSets, count, 0, shaders);
+
+    for (unsigned i = 0; i < count; ++i) {
+        auto* expected = glslopt_optimize(ctx, kGlslOptShaderFragment, (std::string(textDefines[i]) + source).c_str(), 0);
+        ASSERT_TRUE(glslopt_get_status(expected)) << glslopt_get_log(expected);
+        EXPECT_TRUE(glslopt_get_status(shaders[i])) << defineSets[i] << glslopt_get_log(shaders[i]);
+        EXPECT_STREQ(glslopt_get_output(expected), glslopt_get_output(shaders[i])) << defineSets[i];
+        glslopt_shader_delete(expected);
+    }
+    EXPECT_EQ(shaders[0], shaders[3]);
+    EXPECT_EQ(shaders[0], shaders[4]);
+    EXPECT_EQ(shaders[2], shaders[5]);
+    EXPECT_EQ(shaders[2], shaders[6]);
+    EXPECT_NE(shaders[0], shaders[1]);
+    EXPECT_NE(shaders[1], shaders[2]);
+    for (auto* shader : shaders)
+        glslopt_shader_delete(shader);
+
+    const char* badDefines[] = { "FOG=(" , "FOG" };
+    glslopt_optimize_variants(ctx, kGlslOptShaderFragment, "#if FOG\nvoid main() {}\n#endif\n", badDefines, 2, 0, shaders);
+    EXPECT_FALSE(glslopt_get_status(shaders[0]));
+    EXPECT_TRUE(glslopt_get_status(shaders[1])) << glslopt_get_log(shaders[1]);
+    glslopt_shader_delete(shaders[0]);
+    glslopt_shader_delete(shaders[1]);
+
+    glslopt_cleanup(ctx);
+}
+
+// NOLINTNEXTLINE
+TEST(OptimizerFingerprintTest, IdenticalProgramsShareOutput)
+{
+    const char* sources[] = {
+        "varying lowp vec4 color;\nvoid main() { lowp vec4 tmp = color * 2.0; gl_FragColor = tmp; }\n",
+        "varying lowp vec4 color;\n// same program, other names\nvoid main() {\n  lowp vec4 doubled = color * 2.0;\n  gl_FragColor = doubled;\n}\n",
+        "varying lowp vec4 color;\nvoid main() { gl_FragColor = color * 3.0; }\n",
+    };
+
+    auto* ctx = glslopt_initialize(kGlslTargetOpenGLES20);
+    glslopt_shader* shaders[3];
+    for (int i = 0; i < 3; ++i) {
+        shaders[i] = glslopt_optimize(ctx, kGlslOptShaderFragment, sources[i], 0);
+        ASSERT_TRUE(glslopt_get_status(shaders[i])) << glslopt_get_log(shaders[i]);
+        ASSERT_NE(nullptr, glslopt_shader_get_fingerprint(shaders[i]));
+    }
+
+    auto sameFingerprint = [&](int a, int b) {
+        return memcmp(glslopt_shader_get_fingerprint(shaders[a]), glslopt_shader_get_fingerprint(shaders[b]), kGlslOptFingerprintSize) == 0;
+    };
+    EXPECT_TRUE(sameFingerprint(0, 1));
+    EXPECT_FALSE(sameFingerprint(0, 2));
+    EXPECT_EQ(glslopt_get_output(shaders[0]), glslopt_get_output(shaders[1]));
+    EXPECT_NE(glslopt_get_output(shaders[0]), glslopt_get_output(shaders[2]));
+
+    // the shared buffer stays valid until the last shader using it is gone
+    std::string output = glslopt_get_output(shaders[1]);
+    glslopt_shader_delete(shaders[0]);
+    EXPECT_EQ(output, glslopt_get_output(shaders[1]));
+    glslopt_shader_delete(shaders[1]);
+    shaders[1] = glslopt_optimize(ctx, kGlslOptShaderFragment, sources[1], 0);
+    EXPECT_EQ(output, glslopt_get_output(shaders[1]));
+    glslopt_shader_delete(shaders[1]);
+    glslopt_shader_delete(shaders[2]);
+
+    auto* failed = glslopt_optimize(ctx, kGlslOptShaderFragment, "void main() { undefined(); }\n", 0);
+    EXPECT_FALSE(glslopt_get_status(failed));
+    EXPECT_EQ(nullptr, glslopt_shader_get_fingerprint(failed));
+    glslopt_shader_delete(failed);
+
+    glslopt_cleanup(ctx);
+}
+
+// NOLINTNEXTLINE
+TEST(OptimizerSavedIRTest, SavedIRRoundTrips)
+{
+    const char* source =
+        "#version 300 es\n"
+        "precision mediump float;\n"
+        "struct Light { vec3 dir; vec3 color; };\n"
+        "uniform Light lights[2];\n"
+        "uniform sampler2D tex;\n"
+        "in vec2 uv;\n"
+        "in vec3 normal;\n"
+        "out vec4 color;\n"
+        "const float kScale[3] = float[3](0.5, 1.0, 2.0);\n"
+        "vec3 shade(Light l) { return l.color * max(dot(normal, l.dir), 0.0); }\n"
+        "void main() {\n"
+        "  vec3 c = vec3(0.0);\n"
+        "  for (int i = 0; i < 2; ++i) c += shade(lights[i]) * kScale[i];\n"
+        "  color = texture(tex, uv) * vec4(c, 1.0);\n"
+        "}\n";
+
+    auto* ctx = glslopt_initialize(kGlslTargetOpenGLES30);
+    auto* shader = glslopt_optimize(ctx, kGlslOptShaderFragment, source, kGlslOptionSaveIR);
+    ASSERT_TRUE(glslopt_get_status(shader)) << glslopt_get_log(shader);
+    size_t size = 0;
+    const void* ir = glslopt_get_saved_ir(shader, &size);
+    ASSERT_NE(nullptr, ir);
+    std::string blob((const char*)ir, size);
+
+    // optimizing the saved IR gives the same result, and saving it again the same bytes
+    auto* fromIR = glslopt_optimize_ir(ctx, blob.data(), blob.size(), kGlslOptionSaveIR);
+    ASSERT_TRUE(glslopt_get_status(fromIR)) << glslopt_get_log(fromIR);
+    EXPECT_STREQ(glslopt_get_output(shader), glslopt_get_output(fromIR));
+    const void* irAgain = glslopt_get_saved_ir(fromIR, &size);
+    EXPECT_EQ(blob, std::string((const char*)irAgain, size));
+    glslopt_shader_delete(fromIR);
+
+    // another compile of the same source saves the same bytes
+    auto* again = glslopt_optimize(ctx, kGlslOptShaderFragment, source, kGlslOptionSaveIR);
+    irAgain = glslopt_get_saved_ir(again, &size);
+    EXPECT_EQ(blob, std::string((const char*)irAgain, size));
+    glslopt_shader_delete(again);
+
+    // also with another context for the same language
+    auto* metalCtx = glslopt_initialize(kGlslTargetMetal);
+    auto* metalFromSource = glslopt_optimize(metalCtx, kGlslOptShaderFragment, source, 0);
+    auto* metalFromIR = glslopt_optimize_ir(metalCtx, blob.data(), blob.size(), 0);
+    ASSERT_TRUE(glslopt_get_status(metalFromIR)) << glslopt_get_log(metalFromIR);
+    EXPECT_STREQ(glslopt_get_output(metalFromSource), glslopt_get_output(metalFromIR));
+    glslopt_shader_delete(metalFromSource);
+    glslopt_shader_delete(metalFromIR);
+    glslopt_cleanup(metalCtx);
+
+    // malformed data fails cleanly
+    for (size_t i = 0; i < blob.size(); i += 7) {
+        auto* truncated = glslopt_optimize_ir(ctx, blob.data(), i, 0);
+        EXPECT_FALSE(glslopt_get_status(truncated));
+        glslopt_shader_delete(truncated);
+    }
+    std::string corrupt = blob;
+    corrupt[0] = 'X';
+    auto* bad = glslopt_optimize_ir(ctx, corrupt.data(), corrupt.size(), 0);
+    EXPECT_FALSE(glslopt_get_status(bad));
+    glslopt_shader_delete(bad);
+
+    // not saved unless asked for
+    auto* plain = glslopt_optimize(ctx, kGlslOptShaderFragment, source, 0);
+    EXPECT_EQ(nullptr, glslopt_get_saved_ir(plain, &size));
+    glslopt_shader_delete(plain);
+
+    glslopt_shader_delete(shader);
+    glslopt_cleanup(ctx);
+}
+
+// NOLINTNEXTLINE
+TEST(OptimizerTargetsTest, TargetsMatchIndependentCompiles)
+{
+    const char* sources[] = {
+        "#version 100\n"
+        "uniform sampler2D tex;\n"
+        "uniform mediump vec4 tint;\n"
+        "varying mediump vec2 uv;\n"
+        "void main() { gl_FragColor = texture2D(tex, uv) * tint * 2.0; }\n",
+        // derivatives are an extension only the GLES2 target has
+        "#version 100\n"
+        "#extension GL_OES_standard_derivatives : require\n"
+        "varying mediump vec2 uv;\n"
+        "void main() { gl_FragColor = vec4(dFdx(uv), dFdy(uv)); }\n",
+    };
+    const glslopt_target targets[] = { kGlslTargetOpenGLES20, kGlslTargetOpenGLES30, kGlslTargetMetal };
+    glslopt_ctx* contexts[3];
+    glslopt_ctx* separateContexts[3];
+    for (int i = 0; i < 3; ++i) {
+        contexts[i] = glslopt_initialize(targets[i]);
+        separateContexts[i] = glslopt_initialize(targets[i]);
+    }
+
+    for (const char* source : sources) {
+        glslopt_shader* shaders[3];
+        glslopt_optimize_targets(contexts, 3, kGlslOptShaderFragment, source, 0, shaders);
+        for (int i = 0; i < 3; ++i) {
+            auto* separate = glslopt_optimize(separateContexts[i], kGlslOptShaderFragment, source, 0);
+            ASSERT_EQ(glslopt_get_status(separate), glslopt_get_status(shaders[i])) << "target " << i << ": " << glslopt_get_log(shaders[i]);
+            if (glslopt_get_status(separate)) {
+                EXPECT_STREQ(glslopt_get_output(separate), glslopt_get_output(shaders[i]));
+                ASSERT_EQ(glslopt_shader_get_uniform_count(separate), glslopt_shader_get_uniform_count(shaders[i]));
+                ASSERT_EQ(glslopt_shader_get_texture_count(separate), glslopt_shader_get_texture_count(shaders[i]));
+                for (int u = 0; u < glslopt_shader_get_uniform_count(separate); ++u) {
+                    const char* separateName;
+                    const char* name;
+                    glslopt_basic_type type;
+                    glslopt_precision prec;
+                    int vecSize, matSize, arraySize, location;
+                    glslopt_shader_get_uniform_desc(separate, u, &separateName, &type, &prec, &vecSize, &matSize, &arraySize, &location);
+                    glslopt_shader_get_uniform_desc(shaders[i], u, &name, &type, &prec, &vecSize, &matSize, &arraySize, &location);
+                    EXPECT_STREQ(separateName, name);
+                }
+            }
+            glslopt_shader_delete(separate);
+        }
+        // results belong to their own context
+        for (int i = 0; i < 3; ++i)
+            glslopt_shader_delete(shaders[i]);
+    }
+
+    for (int i = 0; i < 3; ++i) {
+        glslopt_cleanup(contexts[i]);
+        glslopt_cleanup(separateContexts[i]);
+    }
+}
+
+// NOLINTNEXTLINE
+TEST(OptimizerSpecializeTest, SpecializedMatchesConstSource)
+{
+    const char* uniformSource =
+        "#version 100\n"
+        "uniform sampler2D tex;\n"
+        "uniform bool useTint;\n"
+        "uniform int taps;\n"
+        "uniform mediump vec4 tint;\n"
+        "uniform mediump vec2 offsets[2];\n"
+        "varying mediump vec2 uv;\n"
+        "void main() {\n"
+        "  mediump vec4 c = vec4(0.0);\n"
+        "  for (int i = 0; i < 4; ++i) { if (i >= taps) break; c += texture2D(tex, uv + offsets[i / 2] * float(i)); }\n"
+        "  if (useTint) c *= tint;\n"
+        "  gl_FragColor = c;\n"
+        "}\n";
+    const char* constSource =
+        "#version 100\n"
+        "uniform sampler2D tex;\n"
+        "const bool useTint = false;\n"
+        "const int taps = 2;\n"
+        "uniform mediump vec4 tint;\n"
+        "uniform mediump vec2 offsets[2];\n"
+        "varying mediump vec2 uv;\n"
+        "void main() {\n"
+        "  mediump vec4 c = vec4(0.0);\n"
+        "  for (int i = 0; i < 4; ++i) { if (i >= taps) break; c += texture2D(tex, uv + offsets[i / 2] * float(i)); }\n"
+        "  if (useTint) c *= tint;\n"
+        "  gl_FragColor = c;\n"
+        "}\n";
+
+    auto* ctx = glslopt_initialize(kGlslTargetOpenGLES20);
+    auto* shader = glslopt_optimize(ctx, kGlslOptShaderFragment, uniformSource, kGlslOptionRetainIR);
+    ASSERT_TRUE(glslopt_get_status(shader)) << glslopt_get_log(shader);
+    EXPECT_EQ(4, glslopt_shader_get_uniform_count(shader));
+
+    const float useTint = 0.0f;
+    const float taps = 2.0f;
+    const glslopt_uniform_binding bindings[] = { { "useTint", &useTint }, { "taps", &taps } };
+    auto* specialized = glslopt_specialize(ctx, shader, bindings, 2);
+    ASSERT_TRUE(glslopt_get_status(specialized)) << glslopt_get_log(specialized);
+    EXPECT_STREQ(glslopt_get_raw_output(shader), glslopt_get_raw_output(specialized));
+    EXPECT_EQ(1, glslopt_shader_get_uniform_count(specialized));
+    EXPECT_EQ(nullptr, strstr(glslopt_get_output(specialized), "for ("));
+
+    auto* reference = glslopt_optimize(ctx, kGlslOptShaderFragment, constSource, 0);
+    ASSERT_TRUE(glslopt_get_status(reference)) << glslopt_get_log(reference);
+    EXPECT_STREQ(glslopt_get_output(reference), glslopt_get_output(specialized));
+
+    // specializing a specialized shader keeps going from its IR
+    const float offsets[] = { 0.0f, 0.0f, 1.0f, 0.0f };
+    const glslopt_uniform_binding more[] = { { "offsets", offsets } };
+    auto* twice = glslopt_specialize(ctx, specialized, more, 1);
+    ASSERT_TRUE(glslopt_get_status(twice)) << glslopt_get_log(twice);
+    EXPECT_EQ(0, glslopt_shader_get_uniform_count(twice));
+
+    const glslopt_uniform_binding unknown[] = { { "nope", &taps } };
+    auto* failed = glslopt_specialize(ctx, shader, unknown, 1);
+    EXPECT_FALSE(glslopt_get_status(failed));
+    EXPECT_NE(nullptr, strstr(glslopt_get_log(failed), "nope"));
+
+    auto* notRetained = glslopt_optimize(ctx, kGlslOptShaderFragment, uniformSource, 0);
+    auto* notSpecialized = glslopt_specialize(ctx, notRetained, bindings, 2);
+    EXPECT_FALSE(glslopt_get_status(notSpecialized));
+
+    glslopt_shader_delete(notSpecialized);
+    glslopt_shader_delete(notRetained);
+    glslopt_shader_delete(failed);
+    glslopt_shader_delete(twice);
+    glslopt_shader_delete(reference);
+    glslopt_shader_delete(specialized);
+    glslopt_shader_delete(shader);
+    glslopt_cleanup(ctx);
+}
+
+// NOLINTNEXTLINE
+TEST(OptimizerProgramTest, RemovesVaryingsFragmentShaderDoesNotRead)
+{
+    const char* vertexSource =
+        "#version 300 es\n"
+        "in vec4 pos;\n"
+        "in vec3 nrm;\n"
+        "uniform mat4 mvp;\n"
+        "uniform mat3 nm;\n"
+        "out vec2 uv;\n"
+        "out vec3 n;\n"
+        "out float fog;\n"
+        "void main() { gl_Position = mvp * pos; uv = pos.xy * 0.5; n = normalize(nm * nrm); fog = exp(-length(gl_Position.xyz)); }\n";
+    // fog is declared and read, but the read is dead
+    const char* fragmentSource =
+        "#version 300 es\n"
+        "in mediump vec2 uv;\n"
+        "in mediump float fog;\n"
+        "uniform sampler2D tex;\n"
+        "out mediump vec4 color;\n"
+        "void main() { mediump float f = fog; color = texture(tex, uv); }\n";
+    const char* mismatchedSource =
+        "#version 300 es\n"
+        "in mediump vec3 uv;\n"
+        "uniform sampler2D tex;\n"
+        "out mediump vec4 color;\n"
+        "void main() { color = texture(tex, uv.xy); }\n";
+
+    const glslopt_target targets[] = { kGlslTargetOpenGLES30, kGlslTargetMetal };
+    for (glslopt_target target : targets) {
+        auto* ctx = glslopt_initialize(target);
+        glslopt_shader* vs;
+        glslopt_shader* fs;
+        glslopt_optimize_program(ctx, vertexSource, fragmentSource, 0, &vs, &fs);
+        ASSERT_TRUE(glslopt_get_status(vs)) << glslopt_get_log(vs);
+        ASSERT_TRUE(glslopt_get_status(fs)) << glslopt_get_log(fs);
+        EXPECT_NE(nullptr, strstr(glslopt_get_output(vs), "uv"));
+        EXPECT_EQ(nullptr, strstr(glslopt_get_output(vs), "fog"));
+        EXPECT_EQ(nullptr, strstr(glslopt_get_output(vs), "normalize"));
+        EXPECT_EQ(1, glslopt_shader_get_input_count(vs));
+        EXPECT_EQ(1, glslopt_shader_get_uniform_count(vs));
+
+        // the fragment shader is optimized as it would be by itself
+        auto* separate = glslopt_optimize(ctx, kGlslOptShaderFragment, fragmentSource, 0);
+        EXPECT_STREQ(glslopt_get_output(separate), glslopt_get_output(fs));
+        glslopt_shader_delete(separate);
+        glslopt_shader_delete(vs);
+        glslopt_shader_delete(fs);
+
+        glslopt_optimize_program(ctx, vertexSource, mismatchedSource, 0, &vs, &fs);
+        EXPECT_FALSE(glslopt_get_status(vs));
+        EXPECT_FALSE(glslopt_get_status(fs));
+        EXPECT_NE(nullptr, strstr(glslopt_get_log(fs), "uv"));
+        glslopt_shader_delete(vs);
+        glslopt_shader_delete(fs);
+        glslopt_cleanup(ctx);
+    }
+}
+
+// NOLINTNEXTLINE
+TEST(OptimizerProgramTest, FoldsUniformVaryingsIntoFragmentShader)
+{
+    const char* vertexSource =
+        "#version 100\n"
+        "attribute vec4 pos;\n"
+        "uniform mat4 mvp;\n"
+        "uniform mediump vec4 tint;\n"
+        "uniform vec4 highTint;\n"
+        "varying vec2 uv;\n"
+        "varying mediump vec4 color;\n"
+        "varying float one;\n"
+        "varying vec4 highColor;\n"
+        "void main() { gl_Position = mvp * pos; uv = pos.xy * 0.5; color = tint * 2.0; one = 1.0; highColor = highTint; }\n";
+    const char* fragmentSource =
+        "#version 100\n"
+        "varying mediump vec2 uv;\n"
+        "varying mediump vec4 color;\n"
+        "varying mediump float one;\n"
+        "varying mediump vec4 highColor;\n"
+        "uniform sampler2D tex;\n"
+        "void main() { gl_FragColor = texture2D(tex, uv) * color * one + highColor; }\n";
+
+    auto* ctx = glslopt_initialize(kGlslTargetOpenGLES20);
+    glslopt_shader* vs;
+    glslopt_shader* fs;
+    glslopt_optimize_program(ctx, vertexSource, fragmentSource, 0, &vs, &fs);
+    ASSERT_TRUE(glslopt_get_status(vs)) << glslopt_get_log(vs);
+    ASSERT_TRUE(glslopt_get_status(fs)) << glslopt_get_log(fs);
+
+    // highp uniforms can't move to a GLSL ES 1.00 fragment shader
+    EXPECT_EQ(2, glslopt_shader_get_input_count(fs));
+    EXPECT_NE(nullptr, strstr(glslopt_get_output(fs), "uniform mediump vec4 tint;"));
+    EXPECT_EQ(nullptr, strstr(glslopt_get_output(fs), "highTint"));
+    EXPECT_EQ(nullptr, strstr(glslopt_get_output(vs), "tint"));
+
+    const char* removed[] = { "color", "one" };
+    for (glslopt_shader* shader : { vs, fs }) {
+        ASSERT_EQ(2, glslopt_shader_get_removed_varying_count(shader));
+        for (int i = 0; i < 2; ++i) {
+            const char* name;
+            glslopt_basic_type type;
+            glslopt_precision prec;
+            int vecSize, matSize, arraySize, location;
+            glslopt_shader_get_removed_varying_desc(shader, i, &name, &type, &prec, &vecSize, &matSize, &arraySize, &location);
+            EXPECT_STREQ(removed[i], name);
+            EXPECT_EQ(kGlslTypeFloat, type);
+            EXPECT_EQ(i == 0 ? 4 : 1, vecSize);
+        }
+    }
+    glslopt_shader_delete(vs);
+    glslopt_shader_delete(fs);
+    glslopt_cleanup(ctx);
+}
+
+// NOLINTNEXTLINE
+TEST(OptimizerProgramTest, HoistsAffineExpressionsIntoVertexShader)
+{
+    const char* vertexSource =
+        "#version 300 es\n"
+        "in vec4 pos;\n"
+        "uniform mat4 mvp;\n"
+        "out vec2 uv;\n"
+        "out vec3 normal;\n"
+        "void main() { gl_Position = mvp * pos; uv = pos.xy; normal = pos.xyz; }\n";
+    const char* fragmentSource =
+        "#version 300 es\n"
+        "precision mediump float;\n"
+        "uniform mediump vec2 scale;\n"
+        "uniform mediump vec2 offset;\n"
+        "uniform vec3 lightDir;\n"
+        "uniform sampler2D tex;\n"
+        "in vec2 uv;\n"
+        "in vec3 normal;\n"
+        "out vec4 color;\n"
+        "void main() {\n"
+        "  vec2 tc = uv * scale + offset;\n"
+        "  color = texture(tex, tc) * max(dot(normalize(normal), lightDir), 0.0) + texture(tex, tc * 0.5);\n"
+        "}\n";
+
+    auto* ctx = glslopt_initialize(kGlslTargetOpenGLES30);
+    glslopt_shader* vs;
+    glslopt_shader* fs;
+
+    // off by default
+    glslopt_optimize_program(ctx, vertexSource, fragmentSource, 0, &vs, &fs);
+    ASSERT_TRUE(glslopt_get_status(fs)) << glslopt_get_log(fs);
+    auto* separate = glslopt_optimize(ctx, kGlslOptShaderFragment, fragmentSource, 0);
+    EXPECT_STREQ(glslopt_get_output(separate), glslopt_get_output(fs));
+    glslopt_shader_delete(separate);
+    glslopt_shader_delete(vs);
+    glslopt_shader_delete(fs);
+
+    // uv only feeds the two texture coordinates, so it goes away; normal gets
+    // normalized, which is not affine
+    glslopt_set_max_hoisted_varyings(ctx, 2);
+    glslopt_optimize_program(ctx, vertexSource, fragmentSource, 0, &vs, &fs);
+    ASSERT_TRUE(glslopt_get_status(vs)) << glslopt_get_log(vs);
+    ASSERT_TRUE(glslopt_get_status(fs)) << glslopt_get_log(fs);
+    EXPECT_EQ(nullptr, strstr(glslopt_get_output(fs), "scale"));
+    EXPECT_EQ(nullptr, strstr(glslopt_get_output(fs), "offset"));
+    EXPECT_NE(nullptr, strstr(glslopt_get_output(fs), "normalize"));
+    EXPECT_NE(nullptr, strstr(glslopt_get_output(vs), "uniform mediump vec2 scale;"));
+    EXPECT_EQ(3, glslopt_shader_get_input_count(fs));
+    EXPECT_NE(nullptr, strstr(glslopt_get_output(vs), "xlat_hoisted1 = (xlat_hoisted0 * 0.5);"));
+    ASSERT_EQ(1, glslopt_shader_get_removed_varying_count(fs));
+    const char* name;
+    glslopt_basic_type type;
+    glslopt_precision prec;
+    int vecSize, matSize, arraySize, location;
+    glslopt_shader_get_removed_varying_desc(fs, 0, &name, &type, &prec, &vecSize, &matSize, &arraySize, &location);
+    EXPECT_STREQ("uv", name);
+    glslopt_shader_delete(vs);
+    glslopt_shader_delete(fs);
+
+    // with a budget of one, the scaled coordinate is derived from the first
+    // hoisted one in the fragment shader again
+    glslopt_set_max_hoisted_varyings(ctx, 1);
+    glslopt_optimize_program(ctx, vertexSource, fragmentSource, 0, &vs, &fs);
+    ASSERT_TRUE(glslopt_get_status(fs)) << glslopt_get_log(fs);
+    EXPECT_EQ(2, glslopt_shader_get_input_count(fs));
+    EXPECT_NE(nullptr, strstr(glslopt_get_output(fs), "(xlat_hoisted0 * 0.5)"));
+    EXPECT_EQ(1, glslopt_shader_get_removed_varying_count(fs));
+    glslopt_shader_delete(vs);
+    glslopt_shader_delete(fs);
+    glslopt_cleanup(ctx);
+}
+
+// NOLINTNEXTLINE
+TEST(OptimizerUniformExpressionTest, ExtractsUniformOnlyExpressions)
+{
+    const char* source =
+        "#version 100\n"
+        "uniform mediump vec3 lightDir;\n"
+        "uniform mediump float scale;\n"
+        "uniform sampler2D tex;\n"
+        "varying mediump vec3 normal;\n"
+        "varying mediump vec2 uv;\n"
+        "void main() {\n"
+        "  mediump float d = max(dot(normal, normalize(lightDir)), 0.0);\n"
+        "  gl_FragColor = texture2D(tex, uv * scale) * d / (scale * 2.0);\n"
+        "}\n";
+
+    auto* ctx = glslopt_initialize(kGlslTargetOpenGLES20);
+    auto* plain = glslopt_optimize(ctx, kGlslOptShaderFragment, source, 0);
+    ASSERT_TRUE(glslopt_get_status(plain)) << glslopt_get_log(plain);
+    EXPECT_EQ(0, glslopt_shader_get_uniform_expression_count(plain));
+
+    auto* shader = glslopt_optimize(ctx, kGlslOptShaderFragment, source, kGlslOptionExtractUniformExpressions);
+    ASSERT_TRUE(glslopt_get_status(shader)) << glslopt_get_log(shader);
+    const char* output = glslopt_get_output(shader);
+    EXPECT_EQ(nullptr, strstr(output, "normalize"));
+    EXPECT_EQ(nullptr, strstr(output, "lightDir"));
+    // scale itself is still read for the texture coordinate
+    EXPECT_NE(nullptr, strstr(output, "(uv * scale)"));
+
+    ASSERT_EQ(2, glslopt_shader_get_uniform_expression_count(shader));
+    const char* name;
+    const char* expression;
+    glslopt_basic_type type;
+    glslopt_precision prec;
+    int vecSize, matSize;
+    glslopt_shader_get_uniform_expression_desc(shader, 0, &name, &type, &prec, &vecSize, &matSize, &expression);
+    EXPECT_STREQ("xlat_fs_uniform0", name);
+    EXPECT_EQ(1, vecSize);
+    EXPECT_STREQ("(scale * 2.0)", expression);
+    glslopt_shader_get_uniform_expression_desc(shader, 1, &name, &type, &prec, &vecSize, &matSize, &expression);
+    EXPECT_STREQ("xlat_fs_uniform1", name);
+    EXPECT_EQ(kGlslTypeFloat, type);
+    EXPECT_EQ(kGlslPrecMedium, prec);
+    EXPECT_EQ(3, vecSize);
+    EXPECT_EQ(1, matSize);
+    EXPECT_STREQ("normalize(lightDir)", expression);
+    EXPECT_NE(nullptr, strstr(output, "uniform mediump vec3 xlat_fs_uniform1;"));
+
+    // the new uniforms are regular uniforms of the shader
+    EXPECT_EQ(3, glslopt_shader_get_uniform_count(shader));
+
+    glslopt_shader_delete(plain);
+    glslopt_shader_delete(shader);
+    glslopt_cleanup(ctx);
+}
+
+// NOLINTNEXTLINE
+TEST(OptimizerLoopTest, HoistsLoopInvariantCode)
+{
+    const char* source =
+        "#version 300 es\n"
+        "precision mediump float;\n"
+        "uniform vec4 u;\n"
+        "uniform int count;\n"
+        "in vec2 uv;\n"
+        "out vec4 color;\n"
+        "void main() {\n"
+        "  vec4 c = vec4(0.0);\n"
+        "  float last = 0.0;\n"
+        "  for (int i = 0; i < count; ++i) {\n"
+        "    float scale = u.x * u.y + 1.0;\n"
+        "    if (uv.x > float(i))\n"
+        "      last = u.z * 2.0;\n"
+        "    c += vec4(scale * float(i), last, uv * u.w);\n"
+        "  }\n"
+        "  color = c;\n"
+        "}\n";
+
+    auto* ctx = glslopt_initialize(kGlslTargetOpenGLES30);
+    auto* shader = glslopt_optimize(ctx, kGlslOptShaderFragment, source, 0);
+    ASSERT_TRUE(glslopt_get_status(shader)) << glslopt_get_log(shader);
+    std::string_view output = glslopt_get_output(shader);
+    const size_t loop = output.find("for (");
+    ASSERT_NE(std::string_view::npos, loop) << output;
+
+    // invariant expressions are computed once, in front of the loop
+    EXPECT_LT(output.find("((u.x * u.y) + 1.0)"), loop) << output;
+    EXPECT_LT(output.find("(u.z * 2.0)"), loop) << output;
+    EXPECT_LT(output.find("(uv * u.w)"), loop) << output;
+
+    // but the conditional write and what depends on i stay in the loop
+    const size_t branch = output.find("if ((uv.x > float(i_1)))");
+    const size_t product = output.find("(tmpvar_4 * float(i_1))");
+    ASSERT_NE(std::string_view::npos, branch) << output;
+    ASSERT_NE(std::string_view::npos, product) << output;
+    EXPECT_GT(branch, loop);
+    EXPECT_NE(std::string_view::npos, output.find("last_2 = tmpvar_5;", branch)) << output;
+    EXPECT_GT(product, loop);
+
+    glslopt_shader_delete(shader);
+    glslopt_cleanup(ctx);
+}
+
+// NOLINTNEXTLINE
+TEST(OptimizerLoopTest, PartiallyUnrollsLongLoops)
+{
+    const char* source =
+        "#version 100\n"
+        "uniform sampler2D tex;\n"
+        "uniform mediump vec2 offsets[23];\n"
+        "varying mediump vec2 uv;\n"
+        "void main() {\n"
+        "  mediump vec4 sum = vec4(0.0);\n"
+        "  for (int i = 0; i < 23; i++)\n"
+        "    sum += texture2D(tex, uv + offsets[i]);\n"
+        "  gl_FragColor = sum;\n"
+        "}\n";
+
+    auto* ctx = glslopt_initialize(kGlslTargetOpenGLES20);
+    int math, tex, flow;
+
+    auto* plain = glslopt_optimize(ctx, kGlslOptShaderFragment, source, 0);
+    ASSERT_TRUE(glslopt_get_status(plain)) << glslopt_get_log(plain);
+    EXPECT_NE(nullptr, strstr(glslopt_get_output(plain), "for ("));
+    glslopt_shader_get_stats(plain, &math, &tex, &flow);
+    EXPECT_EQ(1, tex);
+
+    // 3 iterations in front of the loop, then 5 iterations of 4 copies each
+    glslopt_set_unroll_factor(ctx, 4);
+    auto* unrolled = glslopt_optimize(ctx, kGlslOptShaderFragment, source, 0);
+    ASSERT_TRUE(glslopt_get_status(unrolled)) << glslopt_get_log(unrolled);
+    const char* output = glslopt_get_output(unrolled);
+    EXPECT_NE(nullptr, strstr(output, "offsets[2]"));
+    EXPECT_NE(nullptr, strstr(output, "i_1 = 3;"));
+    EXPECT_NE(nullptr, strstr(output, "while (true)"));
+    glslopt_shader_get_stats(unrolled, &math, &tex, &flow);
+    EXPECT_EQ(7, tex);
+
+    // a factor too large for the size limit gets lowered
+    glslopt_set_unroll_factor(ctx, 64);
+    auto* limited = glslopt_optimize(ctx, kGlslOptShaderFragment, source, 0);
+    ASSERT_TRUE(glslopt_get_status(limited)) << glslopt_get_log(limited);
+    glslopt_shader_get_stats(limited, &math, &tex, &flow);
+    EXPECT_GT(tex, 7);
+    EXPECT_LT(tex, 23);
+
+    glslopt_shader_delete(plain);
+    glslopt_shader_delete(unrolled);
+    glslopt_shader_delete(limited);
+    glslopt_cleanup(ctx);
+}
+
+// NOLINTNEXTLINE
+TEST(OptimizerLoopTest, UnswitchesUniformConditionsBeforeUnrolling)
+{
+    const char* source =
+        "#version 100\n"
+        "uniform sampler2D tex;\n"
+        "uniform bool flip;\n"
+        "uniform mediump vec2 offsets[4];\n"
+        "varying mediump vec2 uv;\n"
+        "void main() {\n"
+        "  mediump vec4 sum = vec4(0.0);\n"
+        "  for (int i = 0; i < 4; i++) {\n"
+        "    mediump vec2 p = uv + offsets[i];\n"
+        "    if (flip)\n"
+        "      p.y = 1.0 - p.y;\n"
+        "    sum += texture2D(tex, p);\n"
+        "  }\n"
+        "  gl_FragColor = sum;\n"
+        "}\n";
+
+    auto* ctx = glslopt_initialize(kGlslTargetOpenGLES20);
+    auto* shader = glslopt_optimize(ctx, kGlslOptShaderFragment, source, 0);
+    ASSERT_TRUE(glslopt_get_status(shader)) << glslopt_get_log(shader);
+    std::string_view output = glslopt_get_output(shader);
+
+    // one branch around two unrolled copies, instead of one per iteration
+    const auto first = output.find("if (flip)");
+    ASSERT_NE(std::string_view::npos, first);
+    EXPECT_EQ(std::string_view::npos, output.find("if (", first + 1));
+    EXPECT_EQ(std::string_view::npos, output.find("for ("));
+    EXPECT_EQ(std::string_view::npos, output.find("while ("));
+    int math, tex, flow;
+    glslopt_shader_get_stats(shader, &math, &tex, &flow);
+    EXPECT_EQ(8, tex);
+
+    glslopt_shader_delete(shader);
+    glslopt_cleanup(ctx);
+}
+
+// NOLINTNEXTLINE
+TEST(OptimizerStatsTest, ExtendedStatsWeighCosts)
+{
+    const char* source =
+        "#version 300 es\n"
+        "uniform sampler2D tex;\n"
+        "uniform samplerCube cube;\n"
+        "uniform int count;\n"
+        "uniform PREC vec4 scale;\n"
+        "in PREC vec3 dir;\n"
+        "out PREC vec4 color;\n"
+        "void main() {\n"
+        "  PREC vec4 sum = texture(cube, dir);\n"
+        "  for (int i = 0; i < count; i++)\n"
+        "    sum += texture(tex, vec2(float(i) * 0.1));\n"
+        "  color = sqrt(sum) * scale;\n"
+        "}\n";
+    auto withPrecision = [source](const char* prec) {
+        std::string src = source;
+        for (size_t pos; (pos = src.find("PREC")) != std::string::npos; )
+            src.replace(pos, 4, prec);
+        return src;
+    };
+
+    glslopt_shader_stats high[2], medium[2];
+    const glslopt_target targets[] = { kGlslTargetOpenGL, kGlslTargetOpenGLES30 };
+    for (int t = 0; t < 2; ++t) {
+        auto* ctx = glslopt_initialize(targets[t]);
+        auto* shader = glslopt_optimize(ctx, kGlslOptShaderFragment, withPrecision("highp").c_str(), 0);
+        ASSERT_TRUE(glslopt_get_status(shader)) << glslopt_get_log(shader);
+        glslopt_shader_get_extended_stats(shader, &high[t]);
+        glslopt_shader_delete(shader);
+        shader = glslopt_optimize(ctx, kGlslOptShaderFragment, withPrecision("mediump").c_str(), 0);
+        ASSERT_TRUE(glslopt_get_status(shader)) << glslopt_get_log(shader);
+        glslopt_shader_get_extended_stats(shader, &medium[t]);
+        glslopt_shader_delete(shader);
+        glslopt_cleanup(ctx);
+    }
+
+    // the old counters see one lookup per call site
+    EXPECT_EQ(2, high[0].approxTex);
+    // the loop runs an unknown number of times, counted as 8
+    EXPECT_TRUE(high[0].unknownLoops);
+    EXPECT_FLOAT_EQ(9.0f, high[0].textureLookups);
+    // 8 2D lookups at 4 and a cube map lookup at 1.5 times that
+    EXPECT_FLOAT_EQ(38.0f, high[0].textureCost);
+    EXPECT_GT(high[0].flowCost, 8.0f);
+    // precision only matters on mobile targets
+    EXPECT_FLOAT_EQ(high[0].aluCost, medium[0].aluCost);
+    EXPECT_LT(medium[1].aluCost, high[1].aluCost);
+    EXPECT_FLOAT_EQ(high[0].textureCost, high[1].textureCost);
+
+    // targets that share optimization work still weigh the result by their own model
+    const char* shared =
+        "#version 100\n"
+        "uniform sampler2D tex;\n"
+        "varying mediump vec2 uv;\n"
+        "void main() { gl_FragColor = uv.x > 0.5 ? texture2D(tex, uv) : vec4(0.0); }\n";
+    glslopt_ctx* contexts[] = { glslopt_initialize(kGlslTargetOpenGLES20), glslopt_initialize(kGlslTargetOpenGLES30) };
+    glslopt_shader* shaders[2];
+    glslopt_optimize_targets(contexts, 2, kGlslOptShaderFragment, shared, 0, shaders);
+    for (int t = 0; t < 2; ++t) {
+        ASSERT_TRUE(glslopt_get_status(shaders[t])) << glslopt_get_log(shaders[t]);
+        auto* separate = glslopt_optimize(contexts[t], kGlslOptShaderFragment, shared, 0);
+        glslopt_shader_stats sharedStats, separateStats;
+        glslopt_shader_get_extended_stats(shaders[t], &sharedStats);
+        glslopt_shader_get_extended_stats(separate, &separateStats);
+        EXPECT_FLOAT_EQ(separateStats.aluCost, sharedStats.aluCost);
+        EXPECT_FLOAT_EQ(separateStats.textureCost, sharedStats.textureCost);
+        EXPECT_FLOAT_EQ(separateStats.flowCost, sharedStats.flowCost);
+        glslopt_shader_delete(separate);
+        glslopt_shader_delete(shaders[t]);
+    }
+    glslopt_cleanup(contexts[0]);
+    glslopt_cleanup(contexts[1]);
+}
+
+// NOLINTNEXTLINE
+TEST(OptimizerVectorizeTest, PacksInterleavedScalarCode)
+{
+    const char* source =
+        "#version 100\n"
+        "uniform mediump vec4 a;\n"
+        "uniform mediump float s;\n"
+        "varying mediump vec2 uv;\n"
+        "void main() {\n"
+        "  mediump vec3 r;\n"
+        "  mediump float k = s * uv.x;\n"
+        "  r.x = a.x * 2.0 + k;\n"
+        "  mediump float t = a.z * uv.y;\n"
+        "  r.y = a.y * 3.0 + k;\n"
+        "  r.z = t;\n"
+        "  mediump vec2 q;\n"
+        "  q.x = sqrt(uv.x);\n"
+        "  mediump float w = uv.y;\n"
+        "  if (uv.x > 0.5) w = q.x;\n"
+        "  q.y = sqrt(w);\n"
+        "  gl_FragColor = vec4(r, q.x + q.y);\n"
+        "}\n";
+
+    auto* ctx = glslopt_initialize(kGlslTargetOpenGLES20);
+    auto* shader = glslopt_optimize(ctx, kGlslOptShaderFragment, source, 0);
+    ASSERT_TRUE(glslopt_get_status(shader)) << glslopt_get_log(shader);
+    std::string_view output = glslopt_get_output(shader);
+
+    // r.x moves past the unrelated t; q.x can't move past the branch
+    EXPECT_NE(std::string_view::npos, output.find(".xy = ((a.xy * vec2(2.0, 3.0))"));
+    EXPECT_EQ(std::string_view::npos, output.find("(a.x * 2.0)"));
+    EXPECT_NE(std::string_view::npos, output.find(".x = sqrt(uv.x);"));
+
+    auto* check = glslopt_optimize(ctx, kGlslOptShaderFragment, output.data(), 0);
+    EXPECT_TRUE(glslopt_get_status(check)) << glslopt_get_log(check);
+    glslopt_shader_delete(check);
+
+    glslopt_shader_delete(shader);
+    glslopt_cleanup(ctx);
+}
+
+// NOLINTNEXTLINE
+TEST(OptimizerAlgebraicTest, RewriteRulesKeepOperandOrder)
+{
+    const char* source =
+        "#version 100\n"
+        "uniform mediump float a;\n"
+        "varying mediump vec2 uv;\n"
+        "void main() {\n"
+        "  mediump float p = pow(uv.x + a, 2.0);\n"
+        "  mediump float q = (0.0 < uv.x + uv.y) ? 1.0 : 0.0;\n"
+        "  gl_FragColor = vec4(p, q, 0.0, 1.0);\n"
+        "}\n";
+
+    auto* ctx = glslopt_initialize(kGlslTargetOpenGLES20);
+    auto* shader = glslopt_optimize(ctx, kGlslOptShaderFragment, source, 0);
+    ASSERT_TRUE(glslopt_get_status(shader)) << glslopt_get_log(shader);
+    std::string_view output = glslopt_get_output(shader);
+
+    // 0 < x + y is -y < x, not x < -y
+    EXPECT_NE(std::string_view::npos, output.find("(-(uv.y) < uv.x)"));
+    // pow(x, 2) computes x once and squares it
+    EXPECT_EQ(std::string_view::npos, output.find("pow"));
+    const auto sum = output.find("(uv.x + a)");
+    ASSERT_NE(std::string_view::npos, sum);
+    EXPECT_EQ(std::string_view::npos, output.find("(uv.x + a)", sum + 1));
+
+    glslopt_shader_delete(shader);
+    glslopt_cleanup(ctx);
+}
+
+// NOLINTNEXTLINE
+TEST(OptimizerRangeTest, RemovesRedundantClampsAndComparisons)
+{
+    const char* source =
+        "#version 100\n"
+        "uniform sampler2D tex;\n"
+        "varying mediump vec2 uv;\n"
+        "void main() {\n"
+        "  mediump float f = fract(uv.x * 7.0);\n"
+        "  mediump float s = clamp(f, 0.0, 1.0);\n"
+        "  mediump float w = fract(uv.y) * 0.5 + 0.5;\n"
+        "  mediump float m = max(w, 0.0);\n"
+        "  mediump vec3 l = clamp(texture2D(tex, uv).rgb, 0.0, 1.0);\n"
+        "  if (w > 2.0) discard;\n"
+        "  gl_FragColor = vec4(l * s, m);\n"
+        "}\n";
+
+    auto* ctx = glslopt_initialize(kGlslTargetOpenGLES20);
+    auto* shader = glslopt_optimize(ctx, kGlslOptShaderFragment, source, 0);
+    ASSERT_TRUE(glslopt_get_status(shader)) << glslopt_get_log(shader);
+    std::string_view output = glslopt_get_output(shader);
+
+    // fract and fract * 0.5 + 0.5 are in range already; w is never above 2
+    EXPECT_EQ(std::string_view::npos, output.find("max"));
+    EXPECT_EQ(std::string_view::npos, output.find("discard"));
+    // texture formats are unknown
+    EXPECT_NE(std::string_view::npos, output.find("clamp ("));
+    glslopt_shader_delete(shader);
+
+    shader = glslopt_optimize(ctx, kGlslOptShaderFragment, source, kGlslOptionNormalizedTextures);
+    ASSERT_TRUE(glslopt_get_status(shader)) << glslopt_get_log(shader);
+    output = glslopt_get_output(shader);
+    EXPECT_EQ(std::string_view::npos, output.find("clamp"));
+
+    glslopt_shader_delete(shader);
+    glslopt_cleanup(ctx);
+}
+
+// NOLINTNEXTLINE
+TEST(OptimizerFmaTest, FusesMultiplyAddsUnderFastMath)
+{
+    const char* source =
+        "#version 300 es\n"
+        "precision highp float;\n"
+        "uniform vec4 a, b, c;\n"
+        "in vec4 uv;\n"
+        "out vec4 o;\n"
+        "void main() {\n"
+        "  o = a * b + c * uv - uv;\n"
+        "}\n";
+
+    auto* ctx = glslopt_initialize(kGlslTargetMetal);
+    auto* shader = glslopt_optimize(ctx, kGlslOptShaderFragment, source, kGlslOptionFastMath);
+    ASSERT_TRUE(glslopt_get_status(shader)) << glslopt_get_log(shader);
+    std::string_view output = glslopt_get_output(shader);
+    EXPECT_NE(std::string_view::npos, output.find("fma (_mtl_u.c, _mtl_i.uv, fma (_mtl_u.a, _mtl_u.b, -(_mtl_i.uv)))")) << output;
+    glslopt_shader_stats stats;
+    glslopt_shader_get_extended_stats(shader, &stats);
+    EXPECT_EQ(2, stats.fusedMultiplyAdds);
+    glslopt_shader_delete(shader);
+
+    // rounding stays as written without fast math
+    shader = glslopt_optimize(ctx, kGlslOptShaderFragment, source, 0);
+    ASSERT_TRUE(glslopt_get_status(shader)) << glslopt_get_log(shader);
+    output = glslopt_get_output(shader);
+    EXPECT_EQ(std::string_view::npos, output.find("fma"));
+    glslopt_shader_delete(shader);
+    glslopt_cleanup(ctx);
+
+    // GLSL ES 3.00 has no fma
+    ctx = glslopt_initialize(kGlslTargetOpenGLES30);
+    shader = glslopt_optimize(ctx, kGlslOptShaderFragment, source, kGlslOptionFastMath);
+    ASSERT_TRUE(glslopt_get_status(shader)) << glslopt_get_log(shader);
+    output = glslopt_get_output(shader);
+    EXPECT_EQ(std::string_view::npos, output.find("fma"));
+    glslopt_shader_delete(shader);
+    glslopt_cleanup(ctx);
+
+    // desktop GLSL keeps GL_ARB_gpu_shader5 enabled for the fma calls
+    const char* glslSource =
+        "#version 150\n"
+        "#extension GL_ARB_gpu_shader5 : enable\n"
+        "uniform vec4 a, b, c;\n"
+        "in vec4 uv;\n"
+        "out vec4 o;\n"
+        "void main() {\n"
+        "  o = a * b + c * uv;\n"
+        "}\n";
+    ctx = glslopt_initialize(kGlslTargetOpenGL);
+    shader = glslopt_optimize(ctx, kGlslOptShaderFragment, glslSource, kGlslOptionFastMath);
+    ASSERT_TRUE(glslopt_get_status(shader)) << glslopt_get_log(shader);
+    output = glslopt_get_output(shader);
+    EXPECT_NE(std::string_view::npos, output.find("#extension GL_ARB_gpu_shader5 : enable")) << output;
+    EXPECT_NE(std::string_view::npos, output.find("fma (")) << output;
+    glslopt_shader_delete(shader);
+    glslopt_cleanup(ctx);
+}
+// NOLINTNEXTLINE
+TEST(OptimizerFingerprintTest, CoversPrintedExtensions)
+{
+    const char* plain =
+        "#version 150\n"
+        "uniform vec4 a, b;\n"
+        "out vec4 o;\n"
+        "void main() { o = a * b; }\n";
+    const char* withExtension =
+        "#version 150\n"
+        "#extension GL_ARB_gpu_shader5 : enable\n"
+        "uniform vec4 a, b;\n"
+        "out vec4 o;\n"
+        "void main() { o = a * b; }\n";
+
+    auto* ctx = glslopt_initialize(kGlslTargetOpenGL);
+    auto* first = glslopt_optimize(ctx, kGlslOptShaderFragment, plain, 0);
+    auto* second = glslopt_optimize(ctx, kGlslOptShaderFragment, withExtension, 0);
+    ASSERT_TRUE(glslopt_get_status(first)) << glslopt_get_log(first);
+    ASSERT_TRUE(glslopt_get_status(second)) << glslopt_get_log(second);
+    EXPECT_NE(0, memcmp(glslopt_shader_get_fingerprint(first), glslopt_shader_get_fingerprint(second), kGlslOptFingerprintSize));
+    glslopt_shader_delete(first);
+    glslopt_shader_delete(second);
+    glslopt_cleanup(ctx);
+}
+
+// NOLINTNEXTLINE
+TEST(OptimizerReassociateTest, GroupsOperandsByRank)
+{
+    const char* source =
+        "#version 300 es\n"
+        "precision highp float;\n"
+        "uniform vec4 a, b;\n"
+        "in vec4 uv;\n"
+        "out float o;\n"
+        "void main() {\n"
+        "  o = uv.x + a.x + 1.0 + uv.y + b.y + 2.0;\n"
+        "}\n";
+
+    auto* ctx = glslopt_initialize(kGlslTargetOpenGLES30);
+    auto* shader = glslopt_optimize(ctx, kGlslOptShaderFragment, source, 0);
+    ASSERT_TRUE(glslopt_get_status(shader)) << glslopt_get_log(shader);
+    std::string_view output = glslopt_get_output(shader);
+    EXPECT_EQ(std::string_view::npos, output.find("3.0 + ((a.x + b.y)")) << output;
+    glslopt_shader_delete(shader);
+
+    // constants fold, and uniforms come before inputs
+    shader = glslopt_optimize(ctx, kGlslOptShaderFragment, source, kGlslOptionFastMath);
+    ASSERT_TRUE(glslopt_get_status(shader)) << glslopt_get_log(shader);
+    output = glslopt_get_output(shader);
+    EXPECT_NE(std::string_view::npos, output.find("o = (3.0 + ((a.x + b.y) + (uv.x + uv.y)));")) << output;
+    glslopt_shader_delete(shader);
+
+    shader = glslopt_optimize(ctx, kGlslOptShaderFragment, source, kGlslOptionFastMath | kGlslOptionExtractUniformExpressions);
+    ASSERT_TRUE(glslopt_get_status(shader)) << glslopt_get_log(shader);
+    EXPECT_EQ(1, glslopt_shader_get_uniform_expression_count(shader));
+    glslopt_shader_delete(shader);
+    glslopt_cleanup(ctx);
+}
+
+// NOLINTNEXTLINE
+TEST(OptimizerPrecisionTest, DemotesTemporariesOnlyUsedAtLowerPrecision)
+{
+    const char* source =
+        "#version 300 es\n"
+        "precision highp float;\n"
+        "uniform vec4 k;\n"
+        "in vec3 n;\n"
+        "out mediump vec4 o;\n"
+        "void main() {\n"
+        "  highp vec4 r = k * n.x;\n"
+        "  o = r;\n"
+        "}\n";
+
+    auto* ctx = glslopt_initialize(kGlslTargetOpenGLES30);
+    auto* shader = glslopt_optimize(ctx, kGlslOptShaderFragment, source, 0);
+    ASSERT_TRUE(glslopt_get_status(shader)) << glslopt_get_log(shader);
+    std::string_view output = glslopt_get_output(shader);
+    EXPECT_EQ(std::string_view::npos, output.find("mediump vec4 tmpvar_")) << output;
+    glslopt_shader_delete(shader);
+
+    // r only ends up in a mediump output
+    shader = glslopt_optimize(ctx, kGlslOptShaderFragment, source, kGlslOptionInferPrecision);
+    ASSERT_TRUE(glslopt_get_status(shader)) << glslopt_get_log(shader);
+    output = glslopt_get_output(shader);
+    EXPECT_NE(std::string_view::npos, output.find("mediump vec4 tmpvar_")) << output;
+    glslopt_shader_delete(shader);
+    glslopt_cleanup(ctx);
+
+    ctx = glslopt_initialize(kGlslTargetMetal);
+    shader = glslopt_optimize(ctx, kGlslOptShaderFragment, source, kGlslOptionInferPrecision);
+    ASSERT_TRUE(glslopt_get_status(shader)) << glslopt_get_log(shader);
+    output = glslopt_get_output(shader);
+    EXPECT_NE(std::string_view::npos, output.find("half4 tmpvar_")) << output;
+    EXPECT_NE(std::string_view::npos, output.find(" = half4((_mtl_u.k")) << output;
+    glslopt_shader_delete(shader);
+    glslopt_cleanup(ctx);
+}
+// NOLINTNEXTLINE
+TEST(OptimizerPrecisionTest, KeepsPrecisionOfAccumulators)
+{
+    const char* source =
+        "#version 300 es\n"
+        "precision mediump float;\n"
+        "uniform lowp sampler2D tex;\n"
+        "uniform int count;\n"
+        "in vec2 uv;\n"
+        "out vec4 o;\n"
+        "void main() {\n"
+        "  highp float sum = 0.0;\n"
+        "  highp float total = 0.0;\n"
+        "  for (int i = 0; i < count; i++) {\n"
+        "    lowp vec4 c = texture(tex, uv * float(i));\n"
+        "    sum = sum + c.r;\n"
+        "    highp float next = total * 0.5 + c.g;\n"
+        "    if (c.b > 0.5)\n"
+        "      total = next;\n"
+        "  }\n"
+        "  o = vec4(sum, total, 0.0, 1.0);\n"
+        "}\n";
+
+    // every sample is lowp, but the sums grow with the loop count
+    auto* ctx = glslopt_initialize(kGlslTargetOpenGLES30);
+    auto* shader = glslopt_optimize(ctx, kGlslOptShaderFragment, source, kGlslOptionInferPrecision);
+    ASSERT_TRUE(glslopt_get_status(shader)) << glslopt_get_log(shader);
+    std::string_view output = glslopt_get_output(shader);
+    EXPECT_NE(std::string_view::npos, output.find("highp float sum_")) << output;
+    EXPECT_NE(std::string_view::npos, output.find("highp float total_")) << output;
+    EXPECT_EQ(std::string_view::npos, output.find("lowp float")) << output;
+    glslopt_shader_delete(shader);
+    glslopt_cleanup(ctx);
+}
+
+// NOLINTNEXTLINE
+TEST(OptimizerTextureTest, MergesFetchesAcrossBlocks)
+{
+    const char* source =
+        "#version 300 es\n"
+        "precision mediump float;\n"
+        "uniform sampler2D tex, lut;\n"
+        "uniform float k;\n"
+        "in vec2 uv;\n"
+        "out vec4 o;\n"
+        "void main() {\n"
+        "  vec4 a = texture(tex, uv);\n"
+        "  vec4 c;\n"
+        "  if (a.x > k) c = texture(tex, uv * 2.0) * a; else c = texture(tex, uv * 2.0) + a;\n"
+        "  if (a.y > 0.5) c += texture(tex, uv).yxzw;\n"
+        "  vec2 p = uv;\n"
+        "  if (k > 1.0) p = uv.yx;\n"
+        "  c += texture(tex, p) + texture(lut, a.xy);\n"
+        "  o = c * texture(tex, p);\n"
+        "}\n";
+
+    auto count = [](std::string_view s, std::string_view what) {
+        int n = 0;
+        for (size_t i = s.find(what); i != std::string_view::npos; i = s.find(what, i + 1))
+            ++n;
+        return n;
+    };
+
+    auto* ctx = glslopt_initialize(kGlslTargetOpenGLES30);
+    auto* shader = glslopt_optimize(ctx, kGlslOptShaderFragment, source, 0);
+    ASSERT_TRUE(glslopt_get_status(shader)) << glslopt_get_log(shader);
+    std::string_view output = glslopt_get_output(shader);
+
+    // the fetch from both branches moves in front of the if; p changes in
+    // between, so texture(tex, p) can't be the one from the start
+    EXPECT_EQ(1, count(output, "texture (tex, uv)")) << output;
+    EXPECT_EQ(1, count(output, "texture (tex, (uv * 2.0))")) << output;
+    EXPECT_LT(output.find("texture (tex, (uv * 2.0))"), output.find("if ")) << output;
+    EXPECT_EQ(1, count(output, "texture (tex, p_")) << output;
+
+    glslopt_shader_stats stats;
+    glslopt_shader_get_extended_stats(shader, &stats);
+    EXPECT_FLOAT_EQ(4.0f, stats.textureLookups);
+    EXPECT_EQ(1, stats.dependentTextureReads);
+
+    glslopt_shader_delete(shader);
+    glslopt_cleanup(ctx);
+}
+
+// NOLINTNEXTLINE
+TEST(OptimizerScheduleTest, ReordersAssignmentsForFewerLiveRegisters)
+{
+    const char* source =
+        "#version 300 es\n"
+        "precision mediump float;\n"
+        "uniform sampler2D t0, t1, t2, t3;\n"
+        "in vec2 uv;\n"
+        "out vec4 o;\n"
+        "void main() {\n"
+        "  vec4 a = texture(t0, uv);\n"
+        "  vec4 b = texture(t1, uv);\n"
+        "  vec4 c = texture(t2, uv);\n"
+        "  vec4 d = texture(t3, uv);\n"
+        "  vec4 s = a * a.x + b * b.y;\n"
+        "  if (s.x > 0.5) discard;\n"
+        "  o = s * c * c.z + d * d.w;\n"
+        "}\n";
+
+    auto* ctx = glslopt_initialize(kGlslTargetOpenGLES30);
+    auto* shader = glslopt_optimize(ctx, kGlslOptShaderFragment, source, 0);
+    ASSERT_TRUE(glslopt_get_status(shader)) << glslopt_get_log(shader);
+    glslopt_shader_stats stats;
+    glslopt_shader_get_extended_stats(shader, &stats);
+    EXPECT_EQ(4, stats.liveRegisters);
+    EXPECT_EQ(4, stats.liveRegistersUnscheduled);
+    glslopt_shader_delete(shader);
+
+    // the sum of a and b happens before c and d get fetched, but not past
+    // the branch
+    shader = glslopt_optimize(ctx, kGlslOptShaderFragment, source, kGlslOptionScheduleForPressure);
+    ASSERT_TRUE(glslopt_get_status(shader)) << glslopt_get_log(shader);
+    std::string_view output = glslopt_get_output(shader);
+    const size_t sum = output.find("(tmpvar_1 * tmpvar_1.x)");
+    EXPECT_NE(std::string_view::npos, sum) << output;
+    EXPECT_LT(sum, output.find("texture (t2, uv)")) << output;
+    EXPECT_LT(output.find("texture (t3, uv)"), output.find("if ")) << output;
+    glslopt_shader_get_extended_stats(shader, &stats);
+    EXPECT_EQ(3, stats.liveRegisters);
+    EXPECT_EQ(4, stats.liveRegistersUnscheduled);
+
+    auto* check = glslopt_optimize(ctx, kGlslOptShaderFragment, output.data(), 0);
+    EXPECT_TRUE(glslopt_get_status(check)) << glslopt_get_log(check);
+    glslopt_shader_delete(check);
+
+    glslopt_shader_delete(shader);
+    glslopt_cleanup(ctx);
+}
+
 using CompilerResult = std::pair<bool, std::string>;
 
 CompilerResult CompileShader(glslopt_target targetLang, glslopt_shader_type type, const char* shaderSrc)